@@ -0,0 +1,83 @@
+#include "libpstack/budget.h"
+#include "libpstack/global.h"
+
+#include <mutex>
+
+namespace Budget {
+
+size_t limit;
+
+namespace {
+std::mutex lock;
+size_t total;
+
+// function-local static, so clients constructed during static
+// initialization find a live registry.
+std::list<Client *> &
+lru()
+{
+    static std::list<Client *> list;
+    return list;
+}
+}
+
+Client::Client(bool concurrent_) : concurrent(concurrent_)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    lruHook = lru().insert(lru().end(), this);
+}
+
+Client::~Client()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    total -= held;
+    lru().erase(lruHook);
+}
+
+void
+Client::charge(size_t count) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    held += count;
+    total += count;
+    auto &list = lru();
+    list.splice(list.begin(), list, lruHook);
+    if (limit == 0 || total <= limit)
+        return;
+    // Over budget: shed from the cold end of the list until we fit. Skip
+    // ourselves, anyone that's busy (shed returns 0), and - when this charge
+    // comes from a concurrent path - the clients confined to the serialized
+    // one. One pass bounds the work; if everything is hot we stay over
+    // budget until the next charge.
+    for (auto it = list.rbegin(); it != list.rend() && total > limit; ++it) {
+        Client *victim = *it;
+        if (victim == this || (concurrent && !victim->concurrent))
+            continue;
+        auto freed = victim->shed();
+        victim->held -= freed;
+        total -= freed;
+        if (freed != 0 && verbose >= 2)
+            *debug << "budget: shed " << freed << " bytes, "
+                << total << "/" << limit << " in use\n";
+    }
+}
+
+void
+Client::release(size_t count) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    held -= count;
+    total -= count;
+}
+
+void
+Client::touch() const
+{
+    if (limit == 0)
+        return;
+    std::lock_guard<std::mutex> guard(lock);
+    auto &list = lru();
+    list.splice(list.begin(), list, lruHook);
+}
+
+} // Budget namespace
@@ -8,6 +8,7 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <cxxabi.h>
 #include <fstream>
 #include <assert.h>
 #include <iostream>
@@ -15,7 +16,11 @@
 #include <algorithm>
 #include <memory>
 #include <sys/types.h>
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "libpstack/proc.h"
 #include "libpstack/elf.h"
@@ -34,35 +39,66 @@
 #endif
 using namespace std;
 
-// does "name" match the glob pattern "pattern"?
-static int
-globmatchR(const char *pattern, const char *name)
-{
-    for (;; name++) {
-        switch (*pattern) {
-        case '*':
-            // if the rest of the name matches the bit of pattern after '*',
-            for (;;) {
-                if (globmatchR(pattern + 1, name))
-                    return 1;
-                if (*name == 0) // exhuasted name without finding a match
-                    return 0;
-                ++name;
+/*
+ * A glob pattern ('*' wildcards only) compiled into its literal segments.
+ * Matching is then an anchored prefix/suffix compare plus an in-order
+ * substring search for the middle segments - linear in the name, where the
+ * recursive character-at-a-time matcher went quadratic on '*' patterns.
+ */
+class CompiledGlob {
+    std::vector<std::string> segments;
+    bool leadingStar = false;
+    bool trailingStar = false;
+    bool anyStar = false;
+public:
+    explicit CompiledGlob(const std::string &pattern) {
+        std::string cur;
+        for (char c : pattern) {
+            if (c == '*') {
+                anyStar = true;
+                trailingStar = true;
+                if (cur.empty() && segments.empty())
+                    leadingStar = true;
+                if (!cur.empty())
+                    segments.push_back(std::move(cur));
+                cur.clear();
+            } else {
+                trailingStar = false;
+                cur += c;
             }
-        default:
-            if (*name != *pattern)
-                return 0;
         }
-        if (*pattern++ == 0)
-            return 1;
+        if (!cur.empty())
+            segments.push_back(std::move(cur));
     }
-}
 
-static int
-globmatch(const string &pattern, const string &name)
-{
-    return globmatchR(pattern.c_str(), name.c_str());
-}
+    bool matches(const std::string &name) const {
+        size_t lo = 0, hi = name.size();
+        size_t first = 0, last = segments.size();
+        if (!leadingStar && first < last) {
+            const auto &seg = segments[first];
+            if (hi - lo < seg.size() || name.compare(lo, seg.size(), seg) != 0)
+                return false;
+            lo += seg.size();
+            ++first;
+        }
+        if (!trailingStar && first < last) {
+            const auto &seg = segments[last - 1];
+            if (hi - lo < seg.size() ||
+                    name.compare(hi - seg.size(), seg.size(), seg) != 0)
+                return false;
+            hi -= seg.size();
+            --last;
+        }
+        for (size_t i = first; i < last; ++i) {
+            size_t at = name.find(segments[i], lo);
+            if (at == std::string::npos || at + segments[i].size() > hi)
+                return false;
+            lo = at + segments[i].size();
+        }
+        // without a wildcard, the anchored segments must consume everything.
+        return anyStar || lo == hi;
+    }
+};
 
 struct ListedSymbol {
     Elf::Sym sym;
@@ -70,30 +106,171 @@ struct ListedSymbol {
     string name;
     size_t count;
     string objname;
-    ListedSymbol(const Elf::Sym &sym_, Elf::Off objbase_, string name_, string object)
+    Elf::Object::sptr obj;
+    ListedSymbol(const Elf::Sym &sym_, Elf::Off objbase_, string name_, string object,
+            Elf::Object::sptr obj_)
         : sym(sym_)
         , objbase(objbase_)
         , name(name_)
         , count(0)
         , objname(object)
+        , obj(std::move(obj_))
     {}
     Elf::Off memaddr() const { return  sym.st_value + objbase; }
 };
 
+/*
+ * For a vtable symbol, estimate the size of the objects that refer to it by
+ * finding the class's DIE and reading DW_AT_byte_size. Best effort: returns
+ * 0 if the name doesn't demangle to a vtable, or the type isn't indexed in
+ * the object's debug info.
+ */
+static size_t
+typeSize(Process &proc, const ListedSymbol &listed)
+{
+    if (listed.name.compare(0, 4, "_ZTV") != 0 || !listed.obj)
+        return 0;
+    int status = 0;
+    char *raw = abi::__cxa_demangle(listed.name.c_str(), nullptr, nullptr, &status);
+    if (status != 0 || raw == nullptr)
+        return 0;
+    std::string full = raw;
+    free(raw);
+    static const std::string prefix = "vtable for ";
+    if (full.compare(0, prefix.size(), prefix) != 0)
+        return 0;
+    std::string typeName = full.substr(prefix.size());
+    // the name indexes hold unqualified names; drop any namespace prefix.
+    auto sep = typeName.rfind("::");
+    if (sep != std::string::npos)
+        typeName = typeName.substr(sep + 2);
+    auto sizeOf = [](const Dwarf::DIE &die) -> size_t {
+        if (die.tag() != Dwarf::DW_TAG_class_type &&
+                die.tag() != Dwarf::DW_TAG_structure_type)
+            return 0;
+        auto sizeAttr = die.attribute(Dwarf::DW_AT_byte_size);
+        return sizeAttr.valid() ? uintmax_t(sizeAttr) : 0;
+    };
+    try {
+        auto dwarf = proc.getDwarf(listed.obj);
+        if (!dwarf)
+            return 0;
+        for (const auto &die : dwarf->namedEntries(typeName)) {
+            auto size = sizeOf(die);
+            if (size != 0)
+                return size;
+        }
+        // No accelerator table; walk the units, looking at CU- and
+        // namespace-level types. Bounded by only being done for the entries
+        // we print.
+        std::function<size_t(const Dwarf::DIE &)> visit =
+            [&](const Dwarf::DIE &die) -> size_t {
+            for (const auto &child : die.children()) {
+                switch (child.tag()) {
+                    case Dwarf::DW_TAG_class_type:
+                    case Dwarf::DW_TAG_structure_type:
+                        if (child.name() == typeName) {
+                            auto size = sizeOf(child);
+                            if (size != 0)
+                                return size;
+                        }
+                        break;
+                    case Dwarf::DW_TAG_namespace: {
+                        auto size = visit(child);
+                        if (size != 0)
+                            return size;
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+            return 0;
+        };
+        for (const auto &unit : dwarf->getUnits()) {
+            auto size = visit(unit->root());
+            if (size != 0)
+                return size;
+        }
+    }
+    catch (const std::exception &) {
+        // no (or unreadable) debug info - just skip the size column.
+    }
+    return 0;
+}
+
+// Candidate symbols in a flat table sorted by end address - the scan probes
+// this for every word that survives the range prefilter, so lookups are a
+// binary search over contiguous memory rather than a pointer chase.
 class SymbolStore {
-    std::map<Elf::Off, ListedSymbol> store_;
+    std::vector<std::pair<Elf::Off, ListedSymbol>> store_; // keyed by end address.
+    // Occupancy bitmap over the candidate range, one bit per granule of
+    // address space. Words that pass the coarse range check are tested here
+    // - one shift, one AND - and only the rare survivors binary-search the
+    // table. Symbols cluster in a few data sections, so the bitmap is
+    // sparse and tiny relative to the range it covers.
+    std::vector<uint64_t> bitmap_;
+    unsigned granule_ = 0; // log2 of bytes covered per bit.
+    Elf::Off bitmapBase_ = 0;
+    bool prepared_ = false;
 public:
 
     void add(ListedSymbol symbol) {
-        store_.emplace(symbol.memaddr() + symbol.sym.st_size, symbol);
+        assert(!prepared_);
+        store_.emplace_back(symbol.memaddr() + symbol.sym.st_size, symbol);
+    }
+
+    // sort the table for lookup; call once after the last add().
+    void prepare() {
+        std::stable_sort(store_.begin(), store_.end(),
+                [](const auto &l, const auto &r) { return l.first < r.first; });
+        // keep the first symbol added at any given end address.
+        store_.erase(std::unique(store_.begin(), store_.end(),
+                [](const auto &l, const auto &r) { return l.first == r.first; }),
+                store_.end());
+        prepared_ = true;
+        if (store_.empty())
+            return;
+        bitmapBase_ = minAddr();
+        Elf::Off span = maxAddr() - bitmapBase_;
+        // cap the bitmap at 1MiB (2^23 bits), widening the granule to suit.
+        for (granule_ = 6; (span >> granule_) >= (1 << 23); ++granule_)
+            ;
+        bitmap_.resize((span >> granule_) / 64 + 1);
+        for (const auto &item : store_) {
+            Elf::Off lo = item.second.memaddr();
+            Elf::Off end = std::max(item.first, lo + 1); // zero-sized symbols get one bit.
+            for (Elf::Off bit = (lo - bitmapBase_) >> granule_;
+                    bit <= (end - 1 - bitmapBase_) >> granule_; ++bit)
+                bitmap_[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    // is anything near this address? caller must range-check first.
+    bool mayMatch(Elf::Off address) const {
+        Elf::Off bit = (address - bitmapBase_) >> granule_;
+        return (bitmap_[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+    }
+
+    // Tight bounds on where any match can possibly lie: a word outside
+    // [minAddr, maxAddr) can't match either matcher, whatever its offset.
+    Elf::Off minAddr() const {
+        Elf::Off lo = std::numeric_limits<Elf::Off>::max();
+        for (const auto &item : store_)
+            lo = std::min(lo, item.second.memaddr());
+        return lo;
+    }
+    Elf::Off maxAddr() const {
+        return store_.empty() ? 0 : store_.back().first;
     }
 
     template <typename Match>
     std::tuple<bool, ListedSymbol*> find(Elf::Off address, const Match match) {
-        auto pos = store_.lower_bound(address);
-        auto sym = &pos->second;
-        if (pos != store_.end() && match(address, sym)) {
-            return std::make_tuple(true, sym);
+        assert(prepared_);
+        auto pos = std::lower_bound(store_.begin(), store_.end(), address,
+                [](const auto &ent, Elf::Off addr) { return ent.first < addr; });
+        if (pos != store_.end() && match(address, &pos->second)) {
+            return std::make_tuple(true, &pos->second);
         }
         return std::make_tuple(false, nullptr);
     }
@@ -179,6 +356,7 @@ mainExcept(int argc, char *argv[])
     std::vector<std::pair<Elf::Off, Elf::Off>> searchaddrs;
     std::string findstr;
     int symOffset = -1;
+    size_t topCount = 0;
 
     Flags flags;
 
@@ -217,6 +395,9 @@ mainExcept(int argc, char *argv[])
           "change previous 'f' option to include all addresses in range ['f' addr, 'e' addr)",
           [&](const char *p) { searchaddrs.back().second = strtoul(p, 0, 0); })
     .add("string", 'S', "text", "search the core for the text string <text>, and print it's address", Flags::set(findstr))
+    .add("top", 't', "count",
+          "only print the <count> most frequently referenced symbols",
+          Flags::set(topCount))
     .parse(argc, argv);
 
     if (argc - optind >= 2) {
@@ -242,15 +423,22 @@ mainExcept(int argc, char *argv[])
     if (patterns.empty())
         patterns.push_back(virtpattern);
 
+    // compile the patterns once, up front - the matchers run over every
+    // symbol of every object's tables.
+    std::vector<CompiledGlob> globs;
+    globs.reserve(patterns.size());
+    for (auto &pattern : patterns)
+        globs.emplace_back(pattern);
+
     for (auto &loaded : process->objects) {
         size_t count = 0;
-        auto findSymbols = [&count, showsyms, &store, &patterns, &loaded]( auto table ) {
+        auto findSymbols = [&count, showsyms, &store, &globs, &loaded]( auto table ) {
            for (const auto &sym : *table) {
-               for (auto &pattern : patterns) {
-                   auto name = table->name(sym);
-                   if (globmatch(pattern, name)) {
+               auto name = table->name(sym);
+               for (auto &glob : globs) {
+                   if (glob.matches(name)) {
                        store.add(ListedSymbol(sym, loaded.first,
-                                name, stringify(*loaded.second->io)));
+                                name, stringify(*loaded.second->io), loaded.second));
                        if (verbose > 1 || showsyms)
                           std::cout << name << "\n";
                        count++;
@@ -265,20 +453,31 @@ mainExcept(int argc, char *argv[])
     }
     if (showsyms)
        exit(0);
+    store.prepare();
+
+    // Almost no word read from the core lands anywhere near a candidate
+    // symbol, so reject with two compares against the candidate range
+    // before doing any table search. For the offset-bound matcher the
+    // viable window shifts by the offset.
+    Elf::Off filterLo = store.minAddr();
+    Elf::Off filterHi = store.maxAddr();
+    if (symOffset > 0) {
+        filterLo += symOffset;
+        filterHi += symOffset;
+    }
 
     // Now run through the corefile, searching for virtual objects.
 #ifdef WITH_PYTHON
     PythonPrinter<2> py(*process, std::cout, PstackOptions());
 #endif
-    std::vector<Elf::Off> data;
     auto as = process->addressSpace();
-    for (auto &segment : as ) {
+    if (findstr != "") {
+        for (auto &segment : as ) {
         if (verbose) {
             IOFlagSave _(*debug);
             *debug << "scan " << hex << segment.start <<  " to " << segment.start + segment.memSize
                 << " (filesiz = " << segment.fileSize  << ", memsiz=" << segment.memSize << ") ";
         }
-        if (findstr != "") {
             std::vector<char> corestr;
             corestr.resize(std::max(size_t(4096UL), findstr.size() * 4));
             for (size_t in, memPos = segment.start, corestrPos = 0; memPos < segment.start + segment.fileSize; memPos += in) {
@@ -302,21 +501,44 @@ mainExcept(int argc, char *argv[])
                 }
                 memPos += in;
             }
-        } else {
-            auto search = [&](auto m) {
+        }
+    } else {
+        // The pointer scan is embarrassingly parallel: segments are
+        // independent, so chop them into chunks a pool of workers pulls
+        // from. Hits are counted per-worker and merged at the end; the
+        // symbol store is only read during the scan.
+        struct Chunk { Elf::Addr start; size_t size; };
+        const size_t chunk_size = 1'048'576;
+        std::vector<Chunk> chunks;
+        for (auto &segment : as) {
+            if (verbose) {
+                IOFlagSave _(*debug);
+                *debug << "scan " << hex << segment.start <<  " to " << segment.start + segment.memSize
+                    << " (filesiz = " << segment.fileSize  << ", memsiz=" << segment.memSize << ")\n";
+            }
+            for (Elf::Addr off = 0; off < segment.fileSize; off += chunk_size)
+                chunks.push_back({segment.start + off,
+                        std::min(chunk_size, size_t(segment.fileSize - off))});
+        }
+        std::mutex outputLock;
+        auto search = [&](auto m) {
+            size_t nworkers = std::max(size_t(1), std::min(chunks.size(),
+                        size_t(std::thread::hardware_concurrency())));
+            std::vector<std::unordered_map<ListedSymbol *, size_t>> hits(nworkers);
+            std::atomic<size_t> nextChunk(0);
+            auto worker = [&](size_t me) {
                 const size_t step = sizeof(Elf::Off);
-                const size_t chunk_size = 1'048'576;
-                Elf::Addr loc=segment.start;
-                const Elf::Addr end_loc = loc + segment.fileSize;
-                while (loc < end_loc) {
-                    size_t read_size = std::min(chunk_size, end_loc - loc);
+                std::vector<Elf::Off> data;
+                for (size_t ci; (ci = nextChunk++) < chunks.size();) {
+                    Elf::Addr loc = chunks[ci].start;
+                    size_t read_size = chunks[ci].size;
                     data.resize(read_size/step);
                     try {
                         read_size = process->io->read(loc, read_size, reinterpret_cast<char*>(data.data()));
                     }
                     catch (const std::exception &ex) {
+                        std::lock_guard<std::mutex> guard(outputLock);
                         std::cerr << "error reading chunk from core: " << ex.what() << std::endl;
-                        loc = end_loc;
                         continue;
                     }
                     data.resize(read_size / step);
@@ -329,47 +551,71 @@ mainExcept(int argc, char *argv[])
                         if (searchaddrs.size()) {
                             for (auto range = searchaddrs.begin(); range != searchaddrs.end(); ++range) {
                                 if (p >= range->first && p < range->second && (p % 4 == 0)) {
+                                    std::lock_guard<std::mutex> guard(outputLock);
                                     IOFlagSave _(cout);
                                     cout << "0x" << hex << loc << dec << "\n";
                                 }
                             }
                         } else {
+                            if (p < filterLo || p >= filterHi)
+                                continue;
+                            if (!store.mayMatch(symOffset > 0 ? p - symOffset : p))
+                                continue;
                             bool found;
                             ListedSymbol * sym;
                             std::tie(found, sym) = store.find(p, m);
                             if (found) {
-                                if (showaddrs)
+                                if (showaddrs) {
+                                    std::lock_guard<std::mutex> guard(outputLock);
                                     cout
                                         << sym->name << " 0x" << std::hex << loc
                                         << std::dec <<  " ... size=" << sym->sym.st_size
                                         << ", diff=" << p - sym->memaddr() << endl;
-#if 0 && WITH_PYTHON
-                                if (doPython) {
-                                    std::cout << "pyo " << Elf::Addr(loc) << " ";
-                                    py.print(Elf::Addr(loc) - sizeof (PyObject) +
-                                        sizeof (struct _typeobject *));
-                                    std::cout << "\n";
                                 }
-#endif
-                                sym->count++;
+                                ++hits[me][sym];
                             }
                         }
                     }
                 }
             };
-            if (symOffset > 0)
-                search(OffsetBoundSymbolMatcher(symOffset));
-            else
-                search(OffsetFreeSymbolMatcher());
-        }
+            if (nworkers > 1) {
+                std::vector<std::thread> workers;
+                workers.reserve(nworkers);
+                for (size_t t = 0; t < nworkers; ++t)
+                    workers.emplace_back(worker, t);
+                for (auto &w : workers)
+                    w.join();
+            } else {
+                worker(0);
+            }
+            for (auto &perWorker : hits)
+                for (auto &hit : perWorker)
+                    hit.first->count += hit.second;
+        };
+        if (symOffset > 0)
+            search(OffsetBoundSymbolMatcher(symOffset));
+        else
+            search(OffsetFreeSymbolMatcher());
     }
     auto histogram = store.flatten();
     sort(histogram.begin(), histogram.end(),
       [](const ListedSymbol &l, const ListedSymbol &r) { return l.count > r.count; });
 
-    for (auto &i : histogram)
-        if (i.count)
-            cout << dec << i.count << " " << i.name << " ( from " << i.objname << ")" << endl;
+    // Aggregate in-tool: count, and where the class's DW_AT_byte_size is
+    // findable, the estimated bytes those instances occupy. The size lookup
+    // only runs for the entries actually printed.
+    size_t printed = 0;
+    for (auto &i : histogram) {
+        if (!i.count)
+            continue;
+        if (topCount != 0 && printed++ >= topCount)
+            break;
+        cout << dec << i.count << " " << i.name << " ( from " << i.objname << ")";
+        size_t size = typeSize(*process, i);
+        if (size != 0)
+            cout << " size=" << size << ", total=" << size * i.count;
+        cout << endl;
+    }
     return 0;
 }
 
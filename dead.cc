@@ -3,7 +3,10 @@
 #include "libpstack/elf.h"
 #include "libpstack/proc.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
 
 CoreProcess::CoreProcess(Elf::Object::sptr exec, Elf::Object::sptr core,
         const PstackOptions &options, Dwarf::ImageCache &imageCache)
@@ -12,16 +15,26 @@ CoreProcess::CoreProcess(Elf::Object::sptr exec, Elf::Object::sptr core,
 {
 }
 
+const std::vector<Elf::NoteDesc> &
+CoreProcess::notesOfType(int type) const
+{
+    if (!notesIndexed) {
+        for (const auto &note : coreImage->notes())
+            if (note.name() == "CORE")
+                noteIndex[note.type()].push_back(note);
+        notesIndexed = true;
+    }
+    static const std::vector<Elf::NoteDesc> empty;
+    auto it = noteIndex.find(type);
+    return it == noteIndex.end() ? empty : it->second;
+}
+
 Reader::csptr
 CoreProcess::getAUXV() const
 {
 #ifdef __linux__
-    for (auto note : coreImage->notes()) {
-       if (note.name() == "CORE" && note.type() == NT_AUXV) {
-           return note.data();
-           break;
-       }
-    }
+    for (const auto &note : notesOfType(NT_AUXV))
+        return note.data();
 #endif
     return {};
 }
@@ -115,13 +128,11 @@ bool
 CoreProcess::getRegs(lwpid_t pid, Elf::CoreRegisters *reg)
 {
 #ifdef NT_PRSTATUS
-   for (auto note : coreImage->notes()) {
-        if (note.name() == "CORE" && note.type() == NT_PRSTATUS) {
-            const auto &prstatus = note.data()->readObj<prstatus_t>(0);
-            if (prstatus.pr_pid == pid) {
-                memcpy(reg, &prstatus.pr_reg, sizeof(*reg));
-                return true;
-            }
+   for (const auto &note : notesOfType(NT_PRSTATUS)) {
+        const auto &prstatus = note.data()->readObj<prstatus_t>(0);
+        if (prstatus.pr_pid == pid) {
+            memcpy(reg, &prstatus.pr_reg, sizeof(*reg));
+            return true;
         }
    }
 #endif
@@ -151,22 +162,19 @@ pid_t
 CoreProcess::getPID() const
 {
     // Return the PID of the first task in the core.
-    for (auto note : coreImage->notes())
-        if (note.name() == "CORE" && note.type() == NT_PRSTATUS)
-            return note.data()->readObj<prstatus_t>(0).pr_pid;
+    for (const auto &note : notesOfType(NT_PRSTATUS))
+        return note.data()->readObj<prstatus_t>(0).pr_pid;
     return -1;
 }
 
 void
 CoreProcess::findLWPs()
 {
-    for (auto note : coreImage->notes()) {
-        if (note.name() == "CORE" && note.type() == NT_PRSTATUS) {
-            auto prstatus = note.data()->readObj<prstatus_t>(0);
-            (void)lwps[prstatus.pr_pid];
-            if (verbose) {
-               *debug << "task " << prstatus.pr_pid << " current sig is " << prstatus.pr_cursig << "\n";
-            }
+    for (const auto &note : notesOfType(NT_PRSTATUS)) {
+        auto prstatus = note.data()->readObj<prstatus_t>(0);
+        (void)lwps[prstatus.pr_pid];
+        if (verbose) {
+           *debug << "task " << prstatus.pr_pid << " current sig is " << prstatus.pr_cursig << "\n";
         }
     }
 }
@@ -196,34 +204,81 @@ CoreProcess::loadSharedObjectsFromFileNote()
     // If the core is truncated, and we have no access to the link map, we make
     // a guess at what shared libraries are mapped by looking in the NT_FILE
     // note if present.
-    for (auto note : coreImage->notes()) {
-        if (note.name() == "CORE" && note.type() == NT_FILE) {
-            auto data = note.data();
-            auto header = data->readObj<FileNoteHeader>(0);
-            Elf::Off stroff = 0;
-            auto entries = data->view("FILE note entries", sizeof header, header.count * sizeof (FileEntry));
-            auto fileNames = data->view("FILE note names", sizeof header + header.count * sizeof (FileEntry));
-            uintptr_t totalSize = 0;
-            for (auto entry : ReaderArray<FileEntry>(*entries)) {
-                auto name = fileNames->readString(stroff);
-                stroff += name.size() + 1;
-                uintptr_t size = entry.end - entry.start;
-                totalSize += size;
-                if (verbose > 2)
-                    *debug << "NT_FILE mapping " << name << " " << (void *)entry.start << " " << size << std::endl;
-                if (entry.fileOff == 0) {
-                    try {
-                        // Just try and load it like an ELF object.
-                        addElfObject(imageCache.getImageForName(name), entry.start);
-                    }
-                    catch (...) {
+    for (const auto &note : notesOfType(NT_FILE)) {
+        auto data = note.data();
+        auto header = data->readObj<FileNoteHeader>(0);
+        Elf::Off stroff = 0;
+        auto entries = data->view("FILE note entries", sizeof header, header.count * sizeof (FileEntry));
+        auto fileNames = data->view("FILE note names", sizeof header + header.count * sizeof (FileEntry));
+        uintptr_t totalSize = 0;
+        struct PendingObject {
+            std::string path;
+            Elf::Addr start;
+            Elf::Addr end;
+        };
+        std::vector<PendingObject> pending;
+        for (auto entry : ReaderArray<FileEntry>(*entries)) {
+            auto name = fileNames->readString(stroff);
+            stroff += name.size() + 1;
+            uintptr_t size = entry.end - entry.start;
+            totalSize += size;
+            if (verbose > 2)
+                *debug << "NT_FILE mapping " << name << " " << (void *)entry.start << " " << size << std::endl;
+            if (entry.fileOff == 0)
+                pending.push_back({name, entry.start, entry.end});
+        }
+
+        // Open and parse the backing objects concurrently, front-loading the
+        // mappings that contain a thread's program counter: those are the
+        // objects the first frames of output will need.
+        std::vector<Elf::Addr> pcs;
+#ifdef NT_PRSTATUS
+        for (const auto &status : notesOfType(NT_PRSTATUS)) {
+            auto prstatus = status.data()->readObj<prstatus_t>(0);
+            Elf::CoreRegisters regs;
+            memcpy(&regs, &prstatus.pr_reg, sizeof regs);
+            pcs.push_back(Elf::getReg(regs, IPREG));
+        }
+#endif
+        std::stable_partition(pending.begin(), pending.end(),
+            [&pcs] (const PendingObject &object) {
+                for (auto pc : pcs)
+                    if (pc >= object.start && pc < object.end)
+                        return true;
+                return false;
+            });
+        size_t nthreads = std::min(pending.size(), size_t(std::thread::hardware_concurrency()));
+        if (nthreads > 1) {
+            std::atomic<size_t> nextJob(0);
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < nthreads; ++i)
+                workers.emplace_back([&] {
+                    for (;;) {
+                        size_t j = nextJob++;
+                        if (j >= pending.size())
+                            return;
+                        try {
+                            imageCache.getImageForName(pending[j].path);
+                        }
+                        catch (const std::exception &e) {
+                            // failures silently ignored when we register below.
+                        }
                     }
-                }
+                });
+            for (auto &w : workers)
+                w.join();
+        }
+        for (const auto &object : pending) {
+            try {
+                // Just try and load it like an ELF object.
+                addElfObject(imageCache.getImageForName(object.path), object.start);
+            }
+            catch (...) {
             }
-            if (verbose)
-                *debug << "total mapped file size: " << totalSize << std::endl;
-            return true; // found an NT_FILE note, so success.
         }
+        if (verbose)
+            *debug << "total mapped file size: " << totalSize << std::endl;
+        return true; // found an NT_FILE note, so success.
     }
     return false;
 }
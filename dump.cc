@@ -4,9 +4,11 @@
 
 #include <sys/procfs.h>
 
+#include <array>
 #include <cassert>
 #include <iomanip>
 #include <set>
+#include <string_view>
 #include <unordered_map>
 
 #if ELF_BITS == 64
@@ -19,6 +21,95 @@
 #error "Non-32, non-64-bit platform?"
 #endif
 
+namespace {
+/*
+ * Compile-time value -> name tables for the DWARF enums, generated from the
+ * same X-macro headers as the enums themselves. A full-info dump prints
+ * tens of millions of tag/attribute/form names, so lookup is a
+ * bounds-checked index into a dense constexpr array, and the names are
+ * stored pre-quoted: each is emitted with a single write rather than a trip
+ * through the string escaper (they are known-clean identifiers). Vendor
+ * extension values sit above the dense range and spill into a small
+ * linear-scanned overflow list.
+ */
+struct EnumNames {
+    struct Entry { unsigned value; std::string_view name; };
+    std::array<std::string_view, 256> dense{};
+    std::array<Entry, 64> sparse{};
+    size_t nsparse = 0;
+    constexpr void add(unsigned value, std::string_view name) {
+        if (value < dense.size())
+            dense[value] = name;
+        else
+            sparse[nsparse++] = {value, name};
+    }
+    std::string_view name(unsigned value) const {
+        if (value < dense.size())
+            return dense[value];
+        for (size_t i = 0; i < nsparse; ++i)
+            if (sparse[i].value == value)
+                return sparse[i].name;
+        return {};
+    }
+};
+
+constexpr EnumNames cfaInsnNames = [] {
+    EnumNames t{};
+#define DWARF_CFA_INSN(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/cfainsns.h"
+#undef DWARF_CFA_INSN
+    return t;
+}();
+
+constexpr EnumNames tagNames = [] {
+    EnumNames t{};
+#define DWARF_TAG(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/tags.h"
+#undef DWARF_TAG
+    return t;
+}();
+
+constexpr EnumNames unitTypeNames = [] {
+    EnumNames t{};
+#define DWARF_UNIT_TYPE(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/unittype.h"
+#undef DWARF_UNIT_TYPE
+    return t;
+}();
+
+constexpr EnumNames lineENames = [] {
+    EnumNames t{};
+#define DWARF_LINE_E(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/line_e.h"
+#undef DWARF_LINE_E
+    return t;
+}();
+
+constexpr EnumNames formNames = [] {
+    EnumNames t{};
+#define DWARF_FORM(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/forms.h"
+#undef DWARF_FORM
+    return t;
+}();
+
+constexpr EnumNames attrNames = [] {
+    EnumNames t{};
+#define DWARF_ATTR(x, y) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/attr.h"
+#undef DWARF_ATTR
+    return t;
+}();
+
+constexpr EnumNames opNames = [] {
+    EnumNames t{};
+#define DWARF_OP(x, y, args) t.add(y, "\"" #x "\"");
+#include "libpstack/dwarf/ops.h"
+#undef DWARF_OP
+    return t;
+}();
+}
+
 struct DumpCFAInsns {
     Elf::Off start;
     Elf::Off end;
@@ -30,14 +121,12 @@ struct DumpCFAInsns {
 
 std::ostream &operator <<(std::ostream &os, const JSON<Dwarf::CFAInstruction> &j)
 {
-    Dwarf::CFAInstruction insn = j.object;
-#define DWARF_CFA_INSN(x,y) case Dwarf::x: return os << json(#x);
-    switch (insn) {
-#include "libpstack/dwarf/cfainsns.h"
-    default: return os << json(int(insn));
+    auto name = cfaInsnNames.name(unsigned(j.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_CFA_INSN
-   return os;
+    return os << json(int(j.object));
 }
 
 void
@@ -229,13 +318,15 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::FileEntry> &jobj)
         .field("lastmod", fe.lastMod);
 }
 
-template <typename C>
-std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineState, C> &jo) {
-    auto &ls = jo.object;
-    return JObject(os)
-        .field("file", *ls.file)
-        .field("line", ls.line)
-        .field("addr", ls.addr);
+std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineInfo::LineRow, const Dwarf::LineInfo *> &jo) {
+    auto &row = jo.object;
+    auto lines = jo.context;
+    JObject o(os);
+    if (row.file < lines->files.size())
+        o.field("file", lines->files[row.file]);
+    return o
+        .field("line", row.line)
+        .field("addr", row.addr);
 }
 
 template <typename C>
@@ -247,11 +338,27 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::LineInfo, C> &jo)
         .field("opcode_lengths", lines.opcode_lengths)
         .field("files", lines.files)
         .field("directories", lines.directories)
-        .field("matrix", lines.matrix);
+        .field("matrix", lines.rows, &lines);
 }
 
-std::ostream & operator << (std::ostream &os, const JSON<Dwarf::DIE> &jo) {
+/*
+ * Context for a streaming DIE-tree dump. The tree is rendered depth-first
+ * straight off the iterators, but each DIE decoded along the way lands in
+ * the unit's cache and arena, which otherwise grow to hold the entire tree
+ * before the per-unit purge - gigabytes for a large LTO'd binary. Count the
+ * DIEs as they are rendered and periodically purge the unit: ancestors on
+ * the recursion path own their storage, so they survive the purge, and
+ * iteration re-decodes from the section data as it advances.
+ */
+struct DIETreeDump {
+    static constexpr size_t purgeInterval = 65536;
+    mutable size_t rendered = 0;
+};
+
+std::ostream & operator << (std::ostream &os, const JSON<Dwarf::DIE, DIETreeDump> &jo) {
     auto &entry = jo.object;
+    if (++jo.context.rendered % DIETreeDump::purgeInterval == 0)
+        entry.getUnit()->purge();
     JObject o(os);
 
     o
@@ -262,10 +369,14 @@ std::ostream & operator << (std::ostream &os, const JSON<Dwarf::DIE> &jo) {
         .field("attributes", entry.attributes());
 
     if (entry.hasChildren())
-        o.field("children", entry.children());
+        o.field("children", entry.children(), jo.context);
     return o;
 }
 
+std::ostream & operator << (std::ostream &os, const JSON<Dwarf::DIE> &jo) {
+    return os << json(jo.object, DIETreeDump());
+}
+
 std::ostream & operator << (std::ostream &os, const Dwarf::DIE &die) {
    return os << json(die);
 }
@@ -300,50 +411,50 @@ std::ostream &operator << (std::ostream &os, const JSON<Dwarf::Unit::sptr> &unit
 }
 
 std::ostream & operator << (std::ostream &os, const JSON<Dwarf::Tag> &tag) {
-#define DWARF_TAG(x,y) case Dwarf::x: return os << json(#x);
-    switch (tag.object) {
-#include "libpstack/dwarf/tags.h"
-    default: return os << json(int(tag.object));
+    auto name = tagNames.name(unsigned(tag.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_TAG
+    return os << json(int(tag.object));
 }
 
 std::ostream & operator << (std::ostream &os, const JSON<Dwarf::UnitType> &ut) {
-#define DWARF_UNIT_TYPE(x,y) case Dwarf::x: return os << json(#x);
-    switch (ut.object) {
-#include "libpstack/dwarf/unittype.h"
-    default: return os << json(int(ut.object));
+    auto name = unitTypeNames.name(unsigned(ut.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_UNIT_TYPE
+    return os << json(int(ut.object));
 }
 
 
 std::ostream &operator << (std::ostream &os, JSON<Dwarf::LineEOpcode> code) {
-#define DWARF_LINE_E(x,y) case Dwarf::x: return os << json(#x);
-    switch (code.object) {
-#include "libpstack/dwarf/line_e.h"
-    default: return os << json(int(code.object));
+    auto name = lineENames.name(unsigned(code.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_LINE_E
+    return os << json(int(code.object));
 }
 
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::Form> &code) {
-#define DWARF_FORM(x,y) case Dwarf::x: return os << json(#x);
-    switch (code.object) {
-#include "libpstack/dwarf/forms.h"
-    default: return os << json("(unknown)");
+    auto name = formNames.name(unsigned(code.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_FORM
+    return os << json("(unknown)");
 }
 
 std::ostream &
 operator << (std::ostream &os, const JSON<Dwarf::AttrName> &code) {
-#define DWARF_ATTR(x,y) case Dwarf::x: return os << json(#x) ;
-    switch (code.object) {
-#include "libpstack/dwarf/attr.h"
-    default: return os << '"' << int(code.object) << '"';
+    auto name = attrNames.name(unsigned(code.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_ATTR
+    return os << '"' << int(code.object) << '"';
 }
 
 std::ostream &
@@ -499,6 +610,7 @@ operator << (std::ostream &os, const JSON<AddrStr> &addr)
 std::ostream &
 operator << (std::ostream &os, const JSON<Dwarf::CFI> &info)
 {
+    info.object.decodeAll(); // lazy instances only decode what lookups need.
     Mapper<AddrStr, decltype(info.object.cies)::mapped_type, decltype(info.object.cies)>
        ciesByString(info.object.cies);
     return JObject(os)
@@ -649,7 +761,7 @@ std::ostream &operator<< (std::ostream &os, const JSON<Elf::Object> &elf)
         .field("type", typeNames[ehdr.e_type])
         .field("entry", ehdr.e_entry)
         .field("abi", brand < sizeof abiNames / sizeof abiNames[0]? abiNames[brand] : nullptr)
-        .field("sections", elf.object.sectionHeaders)
+        .field("sections", elf.object.getSections())
         .field("segments", mappedSegments, &elf.object)
         .field("notes", elf.object.notes())
         .field("versioninfo", *elf.object.symbolVersions())
@@ -926,12 +1038,12 @@ operator<< (std::ostream &os, const JSON<Elf::Dyn, std::pair<const Elf::Object *
 std::ostream &
 operator<< (std::ostream &os, const JSON<Dwarf::ExpressionOp> op)
 {
-#define DWARF_OP(name, value, args) case Dwarf::name: return os << json(#name);
-    switch (op.object) {
-#include "libpstack/dwarf/ops.h"
-        default: return os << json(int(op.object));
+    auto name = opNames.name(unsigned(op.object));
+    if (!name.empty()) {
+        os.write(name.data(), name.size());
+        return os;
     }
-#undef DWARF_OP
+    return os << json(int(op.object));
 }
 
 std::ostream &
@@ -2,6 +2,8 @@
 
 #include "libpstack/dwarf.h"
 #include "libpstack/global.h"
+#include "libpstack/stringify.h"
+#include "libpstack/trace.h"
 
 namespace Dwarf {
 Info::sptr
@@ -13,15 +15,23 @@ ImageCache::getDwarf(const std::string &filename)
 Info::sptr
 ImageCache::getDwarf(Elf::Object::sptr object)
 {
-    auto it = dwarfCache.find(object);
-    dwarfLookups++;
-    if (it != dwarfCache.end()) {
-        dwarfHits++;
-        return it->second;
+    {
+        std::lock_guard<std::mutex> guard(mtx);
+        auto it = dwarfCache.find(object);
+        dwarfLookups++;
+        if (it != dwarfCache.end()) {
+            dwarfHits++;
+            return it->second;
+        }
     }
+    // construct outside the lock; first to insert wins.
+    Trace::Span span("dwarf", [&] { return "info " + stringify(*object->io); });
     auto dwarf = std::make_shared<Info>(object, *this);
-    dwarfCache[object] = dwarf;
-    return dwarf;
+    std::lock_guard<std::mutex> guard(mtx);
+    auto &slot = dwarfCache[object];
+    if (slot == nullptr)
+        slot = dwarf;
+    return slot;
 }
 
 ImageCache::ImageCache() : dwarfHits(0), dwarfLookups(0) { }
@@ -32,10 +42,19 @@ ImageCache::~ImageCache() noexcept {
             << dwarfHits << std::endl;
 }
 
+std::ostream &
+ImageCache::dumpStats(std::ostream &os) const
+{
+    os << "DWARF image cache: lookups: " << dwarfLookups << ", hits="
+        << dwarfHits << std::endl;
+    return Elf::ImageCache::dumpStats(os);
+}
+
 void
 ImageCache::flush(Elf::Object::sptr o)
 {
     Elf::ImageCache::flush(o);
+    std::lock_guard<std::mutex> guard(mtx);
     dwarfCache.erase(o);
 }
 
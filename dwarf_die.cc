@@ -5,6 +5,7 @@
 #include "libpstack/fs.h"
 #include <set>
 #include <algorithm>
+#include <new>
 
 namespace Dwarf {
 
@@ -12,13 +13,20 @@ class DIE::Raw {
     Raw() = delete;
     Raw(const Raw &) = delete;
     const Abbreviation *type;
-    std::vector<DIE::Attribute::Value> values;
+    // One value per form entry, in the unit's arena. For fixed-layout
+    // abbreviations this stays null until an attribute is probed.
+    DIE::Attribute::Value *values;
+    Elf::Off dataOff; // offset of the attribute data, just past the abbreviation code.
     Elf::Off parent; // 0 implies we do not yet know the parent's offset.
     Elf::Off firstChild;
     Elf::Off nextSibling;
+    void decodeValues(Unit *, DWARFReader &);
+    void decodeValues(Unit *);
 public:
+    // Raw DIEs live in their unit's arena: they are placement-constructed
+    // there and never individually destroyed, so everything in here must be
+    // trivially destructible.
     Raw(Unit *, DWARFReader &, size_t, Elf::Off parent);
-    ~Raw();
     // Mostly, Raw DIEs are hidden from everything. DIE needs access though
     friend class DIE;
     static std::shared_ptr<Raw> decode(Unit *unit, const DIE &parent, Elf::Off offset);
@@ -30,19 +38,101 @@ DIE::firstChild() const
     return unit->offsetToDIE(*this, raw->firstChild);
 }
 
+namespace {
+
+// Advance the reader past one attribute without interpreting it. 'size' is
+// the abbreviation's precomputed encoding size, or -1 where it depends on the
+// data.
+void
+skipForm(DWARFReader &r, Form form, int size)
+{
+    if (size >= 0) {
+        r.skip(size);
+        return;
+    }
+    switch (form) {
+    case DW_FORM_sdata:
+        r.getsleb128();
+        break;
+    case DW_FORM_udata:
+    case DW_FORM_strx:
+    case DW_FORM_addrx:
+    case DW_FORM_loclistx:
+    case DW_FORM_rnglistx:
+    case DW_FORM_ref_udata:
+        r.getuleb128();
+        break;
+    case DW_FORM_string:
+        r.getstring();
+        break;
+    case DW_FORM_block1:
+        r.skip(r.getu8());
+        break;
+    case DW_FORM_block2:
+        r.skip(r.getu16());
+        break;
+    case DW_FORM_block4:
+        r.skip(r.getu32());
+        break;
+    case DW_FORM_exprloc:
+    case DW_FORM_block:
+        r.skip(r.getuleb128());
+        break;
+    default:
+        abort();
+        break;
+    }
+}
+
+}
+
+Elf::Off
+DIE::skipTree(Unit *unit, Elf::Off offset)
+{
+    DWARFReader r(unit->dwarf->debugInfo.io(), offset);
+    for (size_t depth = 1; depth != 0;) {
+        size_t code = r.getuleb128();
+        if (code == 0) {
+            --depth;
+            continue;
+        }
+        auto type = unit->findAbbreviation(code);
+        if (type->fixedSize && type->nextSibIdx == -1) {
+            r.skip(type->totalSize);
+            if (type->hasChildren)
+                ++depth;
+            continue;
+        }
+        Elf::Off sibling = 0;
+        for (size_t i = 0; i < type->forms.size(); ++i) {
+            if (int(i) == type->nextSibIdx) {
+                // DW_AT_sibling: its value jumps us past this DIE's subtree,
+                // so read it rather than skipping it.
+                int size = type->formSizes[i];
+                sibling = unit->offset + (size >= 0
+                        ? r.getuint(size)
+                        : r.getuleb128());
+            } else {
+                skipForm(r, type->forms[i].form, type->formSizes[i]);
+            }
+        }
+        if (sibling != 0)
+            r.setOffset(sibling);
+        else if (type->hasChildren)
+            ++depth;
+    }
+    return r.getOffset();
+}
+
 DIE
 DIE::nextSibling(const DIE &parent) const
 {
-
     if (raw->nextSibling == 0) {
-        // Need to work out what the next sibling is, and we don't have DW_AT_sibling
-        // Run through all our children. decodeEntries will update the
-        // parent's (our) nextSibling.
-        std::shared_ptr<Raw> last = nullptr;
-        for (auto &it : children())
-            last = it.raw;
-        if (last)
-            last->nextSibling = 0;
+        // No DW_AT_sibling, and our extent wasn't implied by the
+        // abbreviation: the next sibling starts just past our subtree. Find
+        // it with a raw cursor walk over the section data rather than
+        // decoding and caching every descendant.
+        raw->nextSibling = skipTree(unit.get(), raw->firstChild);
     }
     return unit->offsetToDIE(parent, raw->nextSibling);
 }
@@ -98,13 +188,8 @@ DIE::containsAddress(Elf::Addr addr) const
     auto rangeattr = attribute(DW_AT_ranges);
     if (rangeattr.valid()) {
         auto ranges = unit->getRanges(*this, low.valid() ? uintmax_t(low) : 0);
-        if (ranges) {
-            // Iterate over the ranges, and see if the address lies inside.
-            for (auto &range : *ranges)
-                if (range.first <= addr && addr <= range.second)
-                    return ContainsAddr::YES;
-            return ContainsAddr::NO;
-        }
+        if (ranges)
+            return ranges->contains(addr) ? ContainsAddr::YES : ContainsAddr::NO;
     }
     return ContainsAddr::UNKNOWN;
 }
@@ -153,31 +238,69 @@ DIE::name() const
     return attr.valid() ? std::string(attr) : "";
 }
 
+std::string_view
+DIE::name(std::string &backing) const
+{
+    auto attr = attribute(DW_AT_name);
+    return attr.valid() ? attr.stringView(backing) : std::string_view();
+}
+
 DIE::Raw::Raw(Unit *unit, DWARFReader &r, size_t abbrev, Elf::Off parent_)
     : type(unit->findAbbreviation(abbrev))
+    , values(nullptr)
+    , dataOff(r.getOffset())
     , parent(parent_)
     , firstChild(0)
     , nextSibling(0)
 {
+    if (type->fixedSize && type->nextSibIdx == -1) {
+        // The abbreviation tells us exactly how much data the DIE occupies,
+        // so we can place it in the tree without decoding any attributes;
+        // they're decoded on demand if anything probes them.
+        if (type->hasChildren)
+            firstChild = dataOff + type->totalSize;
+        else
+            nextSibling = dataOff + type->totalSize;
+    } else {
+        decodeValues(unit, r);
+        if (type->hasChildren) {
+            // If the type has children, last offset read is the first child.
+            firstChild = r.getOffset();
+        } else {
+            nextSibling = r.getOffset(); // we have no children, so next DIE is next sib
+            firstChild = 0; // no children.
+        }
+    }
+}
+
+void
+DIE::Raw::decodeValues(Unit *unit, DWARFReader &r)
+{
+    auto &arena = *unit->arena;
+    values = static_cast<DIE::Attribute::Value *>(arena.allocate(
+                sizeof (DIE::Attribute::Value) * type->forms.size(),
+                alignof (DIE::Attribute::Value)));
     size_t i = 0;
-    values.reserve(type->forms.size());
     for (auto &form : type->forms) {
-        values.emplace_back(r, form, unit);
+        new (&values[i]) DIE::Attribute::Value(r, form, unit, arena);
         if (int(i) == type->nextSibIdx)
             nextSibling = values[i].sdata + unit->offset;
         ++i;
     }
-    if (type->hasChildren) {
-        // If the type has children, last offset read is the first child.
-        firstChild = r.getOffset();
-    } else {
-        nextSibling = r.getOffset(); // we have no children, so next DIE is next sib
-        firstChild = 0; // no children.
-    }
 }
 
-DIE::Attribute::Value::Value(DWARFReader &r, const FormEntry &forment, Unit *unit)
+void
+DIE::Raw::decodeValues(Unit *unit)
+{
+    DWARFReader r(unit->dwarf->debugInfo.io(), dataOff);
+    decodeValues(unit, r);
+}
+
+DIE::Attribute::Value::Value(DWARFReader &r, const FormEntry &forment, Unit *unit, Arena &arena)
 {
+    auto newBlock = [&arena] {
+        return new (arena.allocate(sizeof (Block), alignof (Block))) Block();
+    };
     switch (forment.form) {
 
     case DW_FORM_GNU_strp_alt: {
@@ -268,21 +391,21 @@ DIE::Attribute::Value::Value(DWARFReader &r, const FormEntry &forment, Unit *uni
         break;
 
     case DW_FORM_block1:
-        block = new Block();
+        block = newBlock();
         block->length = r.getu8();
         block->offset = r.getOffset();
         r.skip(block->length);
         break;
 
     case DW_FORM_block2:
-        block = new Block();
+        block = newBlock();
         block->length = r.getu16();
         block->offset = r.getOffset();
         r.skip(block->length);
         break;
 
     case DW_FORM_block4:
-        block = new Block();
+        block = newBlock();
         block->length = r.getu32();
         block->offset = r.getOffset();
         r.skip(block->length);
@@ -290,7 +413,7 @@ DIE::Attribute::Value::Value(DWARFReader &r, const FormEntry &forment, Unit *uni
 
     case DW_FORM_exprloc:
     case DW_FORM_block:
-        block = new Block();
+        block = newBlock();
         block->length = r.getuleb128();
         block->offset = r.getOffset();
         r.skip(block->length);
@@ -323,25 +446,6 @@ DIE::Attribute::Value::Value(DWARFReader &r, const FormEntry &forment, Unit *uni
     }
 }
 
-DIE::Raw::~Raw()
-{
-    int i = 0;
-    for (auto &forment : type->forms) {
-        switch (forment.form) {
-            case DW_FORM_exprloc:
-            case DW_FORM_block:
-            case DW_FORM_block1:
-            case DW_FORM_block2:
-            case DW_FORM_block4:
-                delete values[i].block;
-                break;
-            default:
-                break;
-        }
-        ++i;
-    }
-}
-
 static void walk(const DIE & die) { for (auto c : die.children()) { walk(c); } };
 Elf::Off
 DIE::getParentOffset() const
@@ -378,7 +482,12 @@ DIE::decode(Unit *unit, const DIE &parent, Elf::Off offset)
             parent.raw->nextSibling = r.getOffset();
         return nullptr;
     }
-    return std::make_shared<DIE::Raw>(unit, r, abbrev, parent.getOffset());
+    // Allocate the Raw in the unit's arena; the returned shared_ptr shares
+    // ownership of the arena itself, which is all that keeps the storage
+    // alive once the unit is purged.
+    auto &arena = unit->arena;
+    void *raw = arena->allocate(sizeof (DIE::Raw), alignof (DIE::Raw));
+    return { arena, new (raw) DIE::Raw(unit, r, abbrev, parent.getOffset()) };
 }
 
 DIE::Children::const_iterator &DIE::Children::const_iterator::operator++() {
@@ -462,6 +571,25 @@ DIE::Attribute::operator uintmax_t() const
     }
 }
 
+bool
+Ranges::contains(uintmax_t addr) const
+{
+    // The common cases are trivial: most functions have a single range.
+    switch (size()) {
+        case 0:
+            return false;
+        case 1:
+            return front().first <= addr && addr <= front().second;
+        default:
+            break;
+    }
+    // Entries are sorted by start address and don't overlap: only the last
+    // entry starting at or below addr can contain it.
+    auto it = std::upper_bound(begin(), end(), addr,
+            [](uintmax_t a, const value_type &r) { return a < r.first; });
+    return it != begin() && addr <= (--it)->second;
+}
+
 Ranges::Ranges(const DIE &die, uintmax_t base) {
 
     auto ranges = die.attribute(DW_AT_ranges);
@@ -543,9 +671,22 @@ Ranges::Ranges(const DIE &die, uintmax_t base) {
             }
         }
     }
+    // Keep the entries sorted by start address so contains() can binary
+    // search. Producers don't guarantee any particular order.
+    std::sort(begin(), end());
 }
 
 DIE::Attribute::operator std::string() const
+{
+    std::string backing;
+    auto view = stringView(backing);
+    // if the view was materialized into backing, hand that out rather than
+    // copying it again.
+    return view.data() == backing.data() ? std::move(backing) : std::string(view);
+}
+
+std::string_view
+DIE::Attribute::stringView(std::string &backing) const
 {
     if (!valid())
         return "";
@@ -560,23 +701,23 @@ DIE::Attribute::operator std::string() const
             auto &strs = alt->debugStrings;
             if (!strs)
                 return "(alt string table unavailable)";
-            return strs.io()->readString(value().addr);
+            return strs.io()->readStringView(value().addr, backing);
         }
         case DW_FORM_strp:
-            return dwarf->debugStrings.io()->readString(value().addr);
+            return dwarf->debugStrings.io()->readStringView(value().addr, backing);
 
         case DW_FORM_line_strp:
-            return dwarf->debugLineStrings.io()->readString(value().addr);
+            return dwarf->debugLineStrings.io()->readStringView(value().addr, backing);
 
         case DW_FORM_string:
-            return die.unit->dwarf->debugInfo.io()->readString(value().addr);
+            return die.unit->dwarf->debugInfo.io()->readStringView(value().addr, backing);
 
         case DW_FORM_strx1:
         case DW_FORM_strx2:
         case DW_FORM_strx3:
         case DW_FORM_strx4:
         case DW_FORM_strx:
-            return die.unit->strx(value().addr);
+            return die.unit->strx(value().addr, backing);
 
         default:
             abort();
@@ -673,7 +814,10 @@ DIE::Attributes::end() const {
 }
 
 const DIE::Attribute::Value &DIE::Attribute::value() const {
-    return die.raw->values.at(formp - &die.raw->type->forms[0]);
+    auto raw = die.raw.get();
+    if (raw->values == nullptr)
+        raw->decodeValues(die.unit.get());
+    return raw->values[formp - &raw->type->forms[0]];
 }
 
 Tag DIE::tag() const {
@@ -1,13 +1,24 @@
 #include "libpstack/dwarf.h"
 #include "libpstack/dwarf_reader.h"
+#include "libpstack/stringify.h"
+#include "libpstack/fs.h"
 #include "libpstack/global.h"
+#include "libpstack/stats.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 namespace Dwarf {
+namespace {
+
+// Decode the value part of a DW_EH_PE-encoded datum; the caller applies
+// whatever base the top nibble of the encoding calls for.
 intmax_t
-CFI::decodeAddress(DWARFReader &f, int encoding) const
+decodeRawValue(DWARFReader &f, int encoding)
 {
     intmax_t base;
-    Elf::Off offset = f.getOffset();
     switch (encoding & 0xf) {
     case DW_EH_PE_sdata2:
         base = f.getint(2);
@@ -40,7 +51,38 @@ CFI::decodeAddress(DWARFReader &f, int encoding) const
         abort();
         break;
     }
+    return base;
+}
+
+// Size of a DW_EH_PE-encoded datum, or 0 if it's variable-length (LEB128) -
+// fixed sizes are what make .eh_frame_hdr's table binary-searchable.
+size_t
+encodedSize(int encoding)
+{
+    switch (encoding & 0xf) {
+    case DW_EH_PE_sdata2:
+    case DW_EH_PE_udata2:
+        return 2;
+    case DW_EH_PE_sdata4:
+    case DW_EH_PE_udata4:
+        return 4;
+    case DW_EH_PE_sdata8:
+    case DW_EH_PE_udata8:
+        return 8;
+    case DW_EH_PE_absptr:
+        return sizeof (Elf::Word);
+    default:
+        return 0;
+    }
+}
+
+}
 
+intmax_t
+CFI::decodeAddress(DWARFReader &f, int encoding) const
+{
+    Elf::Off offset = f.getOffset();
+    intmax_t base = decodeRawValue(f, encoding);
     switch (encoding & 0xf0) {
     case 0:
         break;
@@ -52,7 +94,7 @@ CFI::decodeAddress(DWARFReader &f, int encoding) const
 }
 
 Elf::Off
-CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
+CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff) const
 {
     size_t addrLen;
     Elf::Off length = r.getlength(&addrLen);
@@ -68,17 +110,81 @@ CFI::decodeCIEFDEHdr(DWARFReader &r, enum FIType type, Elf::Off *cieOff)
 }
 
 bool
-CFI::isCIE(Elf::Addr cieid)
+CFI::isCIE(Elf::Addr cieid) const
 {
     return (type == FI_DEBUG_FRAME && cieid == 0xffffffff) || (type == FI_EH_FRAME && cieid == 0);
 }
 
-CFI::CFI(const Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
+void
+CFI::addCIE(Elf::Off offset) const
+{
+    if (cies.find(offset) != cies.end())
+        return;
+    DWARFReader r(io, offset);
+    Elf::Off cieOff;
+    auto end = decodeCIEFDEHdr(r, type, &cieOff);
+    cies.emplace(std::piecewise_construct,
+            std::forward_as_tuple(offset),
+            std::forward_as_tuple(this, r, end));
+}
+
+CFI::CFI(const Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_,
+        Elf::Addr hdrAddr_, Reader::csptr hdrIo_)
     : dwarf(info)
     , sectionAddr(addr)
     , io(std::move(io_))
     , type(type_)
 {
+    if (type == FI_EH_FRAME && hdrIo_ != nullptr) {
+        // .eh_frame_hdr carries a table of (location, FDE address) pairs,
+        // sorted by location. If we understand its encoding, defer all CIE
+        // and FDE decoding: findFDE will search the table in place.
+        try {
+            DWARFReader r(hdrIo_);
+            auto version = r.getu8();
+            auto framePtrEnc = r.getu8();
+            auto countEnc = r.getu8();
+            auto tableEnc = r.getu8();
+            if (version == 1
+                    && encodedSize(framePtrEnc) != 0
+                    && encodedSize(countEnc) != 0
+                    && encodedSize(tableEnc) != 0
+                    && (tableEnc & 0xf0) == DW_EH_PE_datarel) {
+                decodeRawValue(r, framePtrEnc); // address of .eh_frame; unused.
+                auto count = uintmax_t(decodeRawValue(r, countEnc));
+                if (count != 0) {
+                    hdrIo = hdrIo_;
+                    hdrAddr = hdrAddr_;
+                    searchTable = r.getOffset();
+                    searchEntries = count;
+                    searchEnc = tableEnc;
+                    searchEntrySize = encodedSize(tableEnc) * 2;
+                    return;
+                }
+            }
+        }
+        catch (const Exception &ex) {
+            if (verbose)
+                *debug << "can't use .eh_frame_hdr for " << *io << ": "
+                    << ex.what() << "\n";
+        }
+    }
+    decodeAll();
+}
+
+void
+CFI::decodeAll() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    decodeAllLocked();
+}
+
+void
+CFI::decodeAllLocked() const
+{
+    if (allDecoded)
+        return;
+    allDecoded = true;
     DWARFReader reader(io);
     // decode in 2 passes: first for CIE, then for FDE
     Elf::Off nextoff;
@@ -88,31 +194,83 @@ CFI::CFI(const Info *info, Elf::Addr addr, Reader::csptr io_, enum FIType type_)
         nextoff = decodeCIEFDEHdr(reader, type, &associatedCIE);
         if (nextoff == 0)
             break;
-        auto ensureCIE = [this, &reader, nextoff] (Elf::Off offset) {
-            // This is in fact a CIE - add it in if we have not seen it yet.
-            if (cies.find(offset) != cies.end())
-                return;
-            cies.emplace(std::piecewise_construct,
-                        std::forward_as_tuple(offset),
-                        std::forward_as_tuple(this, reader, nextoff));
-        };
         if (associatedCIE == Elf::Off(-1)) {
-            ensureCIE(startOffset);
+            addCIE(startOffset);
         } else {
             // Make sure we have the associated CIE.
-            ensureCIE(associatedCIE);
+            addCIE(associatedCIE);
             fdeList.emplace_back(this, reader, associatedCIE, nextoff);
         }
     }
+    // Sort by start address: the section's order is link order, but findFDE
+    // wants to binary search. FDE ranges don't overlap.
+    std::sort(fdeList.begin(), fdeList.end(),
+            [](const FDE &l, const FDE &r) { return l.iloc < r.iloc; });
+}
+
+const CIE *
+CFI::getCIE(Elf::Off offset) const
+{
+    // map nodes are stable, so the pointer stays good after we unlock.
+    std::lock_guard<std::mutex> guard(lock);
+    return &cies.at(offset);
 }
 
 const FDE *
 CFI::findFDE(Elf::Addr addr) const
 {
-    for (const auto &fde : fdeList)
-        if (fde.iloc <= addr && fde.iloc + fde.irange > addr)
-            return &fde;
-    return nullptr;
+    std::lock_guard<std::mutex> guard(lock);
+    if (searchEntries != 0 && !allDecoded) {
+        // Binary search .eh_frame_hdr's table for the last entry at or below
+        // addr, then decode just that FDE (and its CIE, if new).
+        auto location = [this](size_t idx, Elf::Addr *fdeAddr) {
+            DWARFReader r(hdrIo, searchTable + idx * searchEntrySize);
+            Elf::Addr loc = decodeRawValue(r, searchEnc) + hdrAddr;
+            if (fdeAddr != nullptr)
+                *fdeAddr = decodeRawValue(r, searchEnc) + hdrAddr;
+            return loc;
+        };
+        size_t lo = 0, hi = searchEntries;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (location(mid, nullptr) <= addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == 0)
+            return nullptr;
+        Elf::Addr fdeAddr;
+        location(lo - 1, &fdeAddr);
+        Elf::Off off = fdeAddr - sectionAddr;
+        auto it = fdesByOffset.find(off);
+        if (it == fdesByOffset.end()) {
+            Stats::callFrames.miss();
+            DWARFReader r(io, off);
+            Elf::Off cieOff;
+            auto end = decodeCIEFDEHdr(r, type, &cieOff);
+            if (end == 0 || cieOff == Elf::Off(-1))
+                return nullptr; // table pointed at something that's not an FDE.
+            addCIE(cieOff);
+            it = fdesByOffset.emplace(std::piecewise_construct,
+                    std::forward_as_tuple(off),
+                    std::forward_as_tuple(this, r, cieOff, end)).first;
+        } else {
+            Stats::callFrames.hit();
+        }
+        const auto &fde = it->second;
+        return fde.iloc <= addr && fde.iloc + fde.irange > addr ? &fde : nullptr;
+    }
+
+    decodeAllLocked();
+    // Find the first FDE starting beyond addr: only its predecessor can
+    // cover it.
+    auto it = std::upper_bound(fdeList.begin(), fdeList.end(), addr,
+            [](Elf::Addr a, const FDE &fde) { return a < fde.iloc; });
+    if (it == fdeList.begin())
+        return nullptr;
+    --it;
+    return it->iloc + it->irange > addr ? &*it : nullptr;
 }
 
 CallFrame::CallFrame()
@@ -130,7 +288,8 @@ CallFrame::CallFrame()
 }
 
 CallFrame
-CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
+CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr,
+        uintmax_t *rowStart, uintmax_t *rowEnd) const
 {
     std::stack<CallFrame> stack;
     CallFrame frame;
@@ -145,7 +304,14 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
         dframe = execInsns(r2, 0, 0);
         frame = dframe;
     }
+    if (rowStart != nullptr)
+        *rowStart = addr;
+    if (rowEnd != nullptr)
+        *rowEnd = std::numeric_limits<uintmax_t>::max();
     while (addr <= wantAddr) {
+        // The rules in force apply from the most recent location advance.
+        if (rowStart != nullptr)
+            *rowStart = addr;
         if (r.empty())
             return frame;
         uint8_t rawOp = r.getu8();
@@ -290,23 +456,63 @@ CIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const
                 break;
             }
 
-            // Can't deal with anything else yet.
+            // Can't deal with anything else yet. Throw rather than abort:
+            // callers either skip the FDE (the compact unwind compiler) or
+            // fall back to other unwind mechanisms (the stack walker).
             case DW_CFA_GNU_window_save:
             case DW_CFA_GNU_negative_offset_extended:
             default:
-                abort();
+                throw (Exception() << "unhandled extended CFA instruction "
+                        << int(op));
             }
             break;
 
         default:
-            abort();
-            break;
+            throw (Exception() << "unhandled CFA instruction " << int(rawOp));
         }
     }
+    // The location advanced past wantAddr: the row is valid until here.
+    if (rowEnd != nullptr)
+        *rowEnd = addr;
     return frame;
 }
 
-FDE::FDE(CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
+std::shared_ptr<const CallFrame>
+CallFrameCache::find(Elf::Addr addr)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = byAddr.upper_bound(addr);
+    if (it == byAddr.begin())
+        return nullptr;
+    --it;
+    auto entry = it->second;
+    if (entry->end <= addr)
+        return nullptr;
+    entries.splice(entries.begin(), entries, entry); // mark recently used.
+    return entry->frame;
+}
+
+std::shared_ptr<const CallFrame>
+CallFrameCache::add(Elf::Addr start, Elf::Addr end, CallFrame frame)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto existing = byAddr.find(start);
+    if (existing != byAddr.end()) {
+        // Replace a stale entry rather than leaving it orphaned.
+        entries.erase(existing->second);
+        byAddr.erase(existing);
+    }
+    if (entries.size() >= maxEntries) {
+        byAddr.erase(entries.back().start);
+        entries.pop_back();
+    }
+    entries.push_front({start, end,
+            std::make_shared<const CallFrame>(std::move(frame))});
+    byAddr[start] = entries.begin();
+    return entries.front().frame;
+}
+
+FDE::FDE(const CFI *fi, DWARFReader &reader, Elf::Off cieOff_, Elf::Off endOff_)
     : end(endOff_)
     , cieOff(cieOff_)
 {
@@ -391,4 +597,193 @@ CIE::CIE(const CFI *fi, DWARFReader &r, Elf::Off end_)
     r.setOffset(end);
 }
 
+const CompactUnwind::Row *
+CompactUnwind::find(Elf::Addr addr) const
+{
+    auto it = std::upper_bound(rows.begin(), rows.end(), addr,
+            [](Elf::Addr a, const Row &row) { return a < row.pc; });
+    if (it == rows.begin())
+        return nullptr;
+    --it;
+    return (it->flags & ROW_FULL_CFI) == 0 ? &*it : nullptr;
+}
+
+CompactUnwind
+CompactUnwind::compile(const CFI &cfi)
+{
+    CompactUnwind table;
+    cfi.decodeAll();
+    for (const auto &fde : cfi.fdeList) {
+        const auto &cie = cfi.cies.at(fde.cieOff);
+        uintmax_t fdeEnd = fde.iloc + fde.irange;
+        uintmax_t pc = fde.iloc;
+        // Enumerate the rows of the FDE by repeatedly executing its
+        // instructions, stepping the target address to the end of the row
+        // found each time.
+        while (pc < fdeEnd) {
+            uintmax_t rowStart = pc, rowEnd = fdeEnd;
+            bool simple = false;
+            int16_t cfaReg = 0;
+            uint16_t flags = 0;
+            int32_t cfaOffset = 0, raOffset = 0, fpOffset = 0;
+            try {
+                DWARFReader r(cfi.io, fde.instructions, fde.end);
+                auto frame = cie.execInsns(r, fde.iloc, pc, &rowStart, &rowEnd);
+                rowEnd = std::min(rowEnd, fdeEnd);
+                auto ra = frame.registers.find(cie.rar);
+                // Signal handler frames need full register recovery, so
+                // never take the compact path through them. The CFA must
+                // come from the stack or frame pointer - those are the only
+                // registers the compact unwinder maintains across frames.
+                if (!cie.isSignalHandler
+                      && frame.cfaValue.type == OFFSET
+#ifdef FPREG
+                      && (frame.cfaReg == CFA_RESTORE_REGNO || frame.cfaReg == FPREG)
+#else
+                      && frame.cfaReg == CFA_RESTORE_REGNO
+#endif
+                      && ra != frame.registers.end()
+                      && ra->second.type == OFFSET) {
+                    simple = true;
+                    cfaReg = int16_t(frame.cfaReg);
+                    cfaOffset = int32_t(frame.cfaValue.u.offset);
+                    raOffset = int32_t(ra->second.u.offset);
+#ifdef FPREG
+                    // Mirror what full CFI would do to the frame pointer:
+                    // UNDEF/SAME keep the current value, OFFSET restores it
+                    // from the frame; anything fancier forces the slow path.
+                    auto fp = frame.registers.find(FPREG);
+                    if (fp != frame.registers.end()) {
+                        switch (fp->second.type) {
+                            case UNDEF:
+                            case SAME:
+                                break;
+                            case OFFSET:
+                                flags |= ROW_FP_AT;
+                                fpOffset = int32_t(fp->second.u.offset);
+                                break;
+                            default:
+                                simple = false;
+                                break;
+                        }
+                    }
+#endif
+                }
+            }
+            catch (const Exception &ex) {
+                if (verbose)
+                    *debug << "can't compile unwind rows for FDE at "
+                        << std::hex << fde.iloc << std::dec << ": "
+                        << ex.what() << "\n";
+            }
+            if (simple)
+                table.rows.push_back({Elf::Addr(rowStart), cfaOffset, raOffset, fpOffset, cfaReg, flags});
+            else
+                table.rows.push_back({Elf::Addr(rowStart), 0, 0, 0, 0, ROW_FULL_CFI});
+            if (rowEnd <= pc)
+                break;
+            pc = rowEnd;
+        }
+        // terminate the FDE, so the last row doesn't bleed into any gap
+        // before the next function.
+        table.rows.push_back({Elf::Addr(fdeEnd), 0, 0, 0, 0, ROW_FULL_CFI});
+    }
+    // Order by address; where a terminator coincides with the next FDE's
+    // first row, the real row must come later so lookups prefer it.
+    std::sort(table.rows.begin(), table.rows.end(),
+            [](const Row &l, const Row &r) {
+                return l.pc != r.pc ? l.pc < r.pc
+                    : (l.flags & ROW_FULL_CFI) > (r.flags & ROW_FULL_CFI); });
+    return table;
+}
+
+namespace {
+
+// On-disk form of a compact unwind table, stored under cacheDirectory() and
+// keyed by build-id: this header, then the rows.
+struct CompactHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t pad;
+    uint64_t imageSize; // size of the image the table was built from.
+    uint64_t count;
+};
+
+constexpr uint32_t CUIDX_MAGIC = 0x50534355; // "PSCU"
+constexpr uint32_t CUIDX_VERSION = 2; // 2: rows grew a frame-pointer restore slot.
+
+}
+
+const CompactUnwind *
+Info::compactUnwind() const
+{
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    if (!orcLoaded) {
+        orcLoaded = true;
+        auto dir = cacheDirectory();
+        auto buildID = elf->getBuildID();
+        if (dir == "" || buildID == "")
+            return nullptr;
+        int fd = ::open(stringify(dir, "/", buildID, ".cuidx").c_str(), O_RDONLY);
+        if (fd == -1)
+            return nullptr;
+        CompactHeader hdr;
+        auto table = std::make_unique<CompactUnwind>();
+        bool ok = pread(fd, &hdr, sizeof hdr, 0) == ssize_t(sizeof hdr)
+            && hdr.magic == CUIDX_MAGIC
+            && hdr.version == CUIDX_VERSION
+            && hdr.recordSize == sizeof (CompactUnwind::Row)
+            && hdr.imageSize == uint64_t(elf->io->size());
+        if (ok) {
+            table->rows.resize(hdr.count);
+            size_t bytes = hdr.count * sizeof (CompactUnwind::Row);
+            ok = pread(fd, table->rows.data(), bytes, sizeof hdr) == ssize_t(bytes);
+        }
+        close(fd);
+        if (ok) {
+            orcTable = std::move(table);
+            if (verbose >= 2)
+                *debug << "loaded compact unwind table for build-id " << buildID
+                    << " (" << orcTable->rows.size() << " rows)\n";
+        }
+    }
+    return orcTable.get();
+}
+
+bool
+Info::compileCompactUnwind() const
+{
+    // --warm workers can hit the same Info for a shared DSO; serialize so
+    // they don't interleave writes into the same temporary file.
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    auto dir = cacheDirectory();
+    auto buildID = elf->getBuildID();
+    if (dir == "" || buildID == "")
+        return false;
+    const CFI *cfi = getCFI();
+    if (cfi == nullptr)
+        return false;
+    auto table = CompactUnwind::compile(*cfi);
+    makedirs(dir);
+    auto path = stringify(dir, "/", buildID, ".cuidx");
+    // write to a temporary and rename, so concurrent readers only ever see a
+    // complete table.
+    auto tmp = stringify(path, ".", getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    CompactHeader hdr { CUIDX_MAGIC, CUIDX_VERSION, sizeof (CompactUnwind::Row), 0,
+        uint64_t(elf->io->size()), table.rows.size() };
+    size_t bytes = table.rows.size() * sizeof (CompactUnwind::Row);
+    bool ok = write(fd, &hdr, sizeof hdr) == ssize_t(sizeof hdr)
+        && write(fd, table.rows.data(), bytes) == ssize_t(bytes);
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
 }
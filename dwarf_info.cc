@@ -3,14 +3,29 @@
 #include "libpstack/stringify.h"
 #include "libpstack/fs.h"
 #include "libpstack/global.h"
-#include <memory>
+#include "libpstack/stats.h"
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 namespace Dwarf {
 
 std::unique_ptr<CFI>
 Info::decodeCFI(const Elf::Section &section, FIType ftype) const {
     try {
+        if (ftype == FI_EH_FRAME) {
+            // Pass .eh_frame_hdr if it's there: its sorted table lets the
+            // CFI decode FDEs on demand instead of scanning the section.
+            auto &hdr = elf->getSection(".eh_frame_hdr", SHT_PROGBITS);
+            if (hdr)
+                return std::make_unique<CFI>(this, section.shdr.sh_addr,
+                        section.io(), ftype, hdr.shdr.sh_addr, hdr.io());
+        }
         return std::make_unique<CFI>(this, section.shdr.sh_addr, section.io(), ftype);
     }
     catch (const Exception &ex) {
@@ -21,6 +36,7 @@ Info::decodeCFI(const Elf::Section &section, FIType ftype) const {
 
 CFI *
 Info::getEhFrame() const {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     if (!ehFrameLoaded) {
         ehFrameLoaded = true;
         auto &sec = elf->getDebugSection(".eh_frame", SHT_PROGBITS);
@@ -32,6 +48,7 @@ Info::getEhFrame() const {
 
 CFI *
 Info::getDebugFrame() const {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     if (!debugFrameLoaded) {
         debugFrameLoaded = true;
         auto &sec = elf->getSection(".debug_frame", SHT_PROGBITS);
@@ -63,17 +80,99 @@ Info::Info(Elf::Object::sptr obj, ImageCache &cache_)
 std::vector<std::pair<std::string, int>>
 Info::sourceFromAddr(uintmax_t addr) const
 {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    // The same PCs recur sample after sample when looping with "-b", so
+    // remember previous resolutions - including misses, which are stored as
+    // (and indistinguishable from) empty results.
+    auto memo = sourceForAddr.find(addr);
+    if (memo != sourceForAddr.end()) {
+        Stats::sourceLines.hit();
+        return memo->second;
+    }
+    Stats::sourceLines.miss();
+
     std::vector<std::pair<std::string, int>> info;
 
     const auto &unit = lookupUnit(addr);
     if (unit)
         unit->sourceFromAddr(Elf::Addr(addr), info);
+    sourceForAddr.emplace(addr, info);
     return info;
 }
 
+/*
+ * Pre-decode a DW_OP stream into (operation, operand) pairs. Anything the
+ * evaluator would otherwise read from the stream - LEB128s, fixed-width
+ * constants, addresses - is decoded here, so evaluation never touches the
+ * Reader. Nested DW_OP_entry_value expressions are compiled in-line, with the
+ * operand holding their instruction count.
+ */
+CompiledExpression::CompiledExpression(DWARFReader &r)
+{
+    while (!r.empty()) {
+        auto op = ExpressionOp(r.getu8());
+        intmax_t operand = 0;
+        switch (op) {
+            case DW_OP_consts:
+            case DW_OP_fbreg:
+            case DW_OP_regx:
+                operand = r.getsleb128();
+                break;
+            case DW_OP_constu:
+                operand = r.getuleb128();
+                break;
+            case DW_OP_const2s:
+                operand = int16_t(r.getu16());
+                break;
+            case DW_OP_const4u:
+                operand = r.getu32();
+                break;
+            case DW_OP_const4s:
+                operand = int32_t(r.getu32());
+                break;
+            case DW_OP_addr:
+                operand = r.getuint(r.addrLen);
+                break;
+            case DW_OP_GNU_parameter_ref:
+                operand = r.getuint(4);
+                break;
+            case DW_OP_entry_value:
+            case DW_OP_GNU_entry_value: {
+                auto len = r.getuleb128();
+                DWARFReader sub(r.io, r.getOffset(), r.getOffset() + len);
+                r.skip(len);
+                CompiledExpression nested(sub);
+                insns.push_back({op, intmax_t(nested.insns.size())});
+                insns.insert(insns.end(), nested.insns.begin(), nested.insns.end());
+                continue;
+            }
+            default:
+                if (op >= DW_OP_breg0 && op <= DW_OP_breg31)
+                    operand = r.getsleb128();
+                // everything else the evaluator handles has no operands.
+                break;
+        }
+        insns.push_back({op, operand});
+    }
+}
+
+const CompiledExpression &
+Info::expressionAt(const Reader::csptr &io, Elf::Off start, Elf::Off end) const
+{
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    auto key = std::make_pair(io.get(), start);
+    auto it = expressions.find(key);
+    if (it == expressions.end()) {
+        DWARFReader r(io, start, end);
+        it = expressions.emplace(key, CompiledExpression(r)).first;
+    }
+    return it->second;
+}
+
 const std::list<PubnameUnit> &
 Info::pubnames() const
 {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     if (pubnameUnits == nullptr) {
         pubnameUnits.reset( new std::list<PubnameUnit> );
         auto &pubnamesh = elf->getDebugSection(".debug_pubnames", SHT_NULL);
@@ -89,13 +188,18 @@ Info::pubnames() const
 Unit::sptr
 Info::getUnit(Elf::Off offset) const
 {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     auto &ent = units[offset];
     if (ent == nullptr) {
+        Stats::dwarfUnits.miss();
         DWARFReader r(debugInfo.io(), offset);
         ent = std::make_shared<Unit>(this, r);
         if (verbose >= 3)
             *debug << "create unit " << ent->name() << "@" << offset
                       << " in " << *debugInfo.io() << "\n";
+    } else {
+        Stats::dwarfUnits.hit();
+        ent->touch(); // keep hot units off the budget's cold end.
     }
     return ent;
 }
@@ -112,6 +216,7 @@ Info::offsetToDIE(Elf::Off offset) const
     // offset <= the required DIE offset, and walk forward until we find the
     // first unit that has an end > the DIE offset (they can be the same unit)
 
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     auto it = units.upper_bound(offset);
     // "it" is the first unit with an offset > our DIE offset. Our required
     // Unit is before this in the sequence.
@@ -157,9 +262,72 @@ Info::offsetToDIE(Elf::Off offset) const
 Info::Units
 Info::getUnits() const
 {
+    // A full unit sweep walks .debug_info front to back - let the backing
+    // store know.
+    if (debugInfo)
+        debugInfo.io()->advise(0, debugInfo.io()->size(), Reader::Advice::Sequential);
+    decodeAllUnits();
     return Units(shared_from_this());
 }
 
+void
+Info::decodeAllUnits() const
+{
+    // The worker threads below touch only their own units, never these
+    // caches, so holding the lock across the fan-out can't deadlock them.
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    if (allUnitsDecoded)
+        return;
+    allUnitsDecoded = true;
+
+    // Unit headers chain together, so finding the boundaries is inherently
+    // serial - but it's cheap, and getUnit caches the (undecoded) units for
+    // the iterator to return. The expensive part - abbreviation parsing and
+    // root DIE decode - is independent per unit, so fan that out. Only
+    // worthwhile (and only safe, given the buffering readers) when the debug
+    // data is memory-backed.
+    if (!debugInfo ||
+            debugInfo.io()->contiguous(0, debugInfo.io()->size()) == nullptr)
+        return;
+    size_t maxthreads = std::thread::hardware_concurrency();
+    if (maxthreads <= 1)
+        return;
+
+    std::vector<Unit::sptr> all;
+    for (Elf::Off off = 0; off < debugInfo.io()->size(); )  {
+        auto u = getUnit(off);
+        all.push_back(u);
+        off = u->end;
+    }
+
+    // Force lazy section readers into existence before the workers share
+    // them.
+    elf->getDebugSection(".debug_abbrev", SHT_NULL).io();
+
+    std::atomic<size_t> nextJob(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0, n = std::min(all.size(), maxthreads); t < n; ++t)
+        workers.emplace_back([&] {
+            for (;;) {
+                size_t i = nextJob++;
+                if (i >= all.size())
+                    return;
+                try {
+                    all[i]->root();
+                }
+                catch (const Exception &ex) {
+                    // Leave the unit for the consumer: touching it again will
+                    // raise the same error in the caller's context.
+                    if (verbose >= 2)
+                        *debug << "decoding unit at " << all[i]->offset
+                            << " failed: " << ex.what() << "\n";
+                }
+            }
+        });
+    for (auto &w : workers)
+        w.join();
+}
+
 void
 Info::decodeARangeSet(DWARFReader &r) const {
     Elf::Off start = r.getOffset();
@@ -193,6 +361,7 @@ Info::decodeARangeSet(DWARFReader &r) const {
 
 Unit::sptr
 Info::lookupUnit(Elf::Addr addr) const {
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
     if (aranges == nullptr) {
         aranges.reset(new ARanges());
         auto &arangesh = elf->getDebugSection(".debug_aranges", SHT_NULL);
@@ -200,6 +369,9 @@ Info::lookupUnit(Elf::Addr addr) const {
             DWARFReader r(arangesh.io());
             while (!r.empty())
                 decodeARangeSet(r);
+        } else if (loadARangesIndex()) {
+            // A previous run synthesized the unit index for this image.
+            unitRangesCached = true;
         }
     }
     auto it = aranges->upper_bound(addr);
@@ -207,27 +379,9 @@ Info::lookupUnit(Elf::Addr addr) const {
         return getUnit(it->second.second);
 
     if (!unitRangesCached) {
-        // Clang does not add debug_aranges.  If we fail to find the unit via
-        // the aranges, walk through all the units, and check out their
-        // DW_AT_range attribute, and fold its content into the aranges data.
         unitRangesCached = true;
-        for (auto u : getUnits()) {
-            auto root = u->root();
-            auto lowpc = root.attribute(DW_AT_low_pc);
-            auto highpc = root.attribute(DW_AT_high_pc);
-            if (lowpc.valid() && highpc.valid()) {
-               uintmax_t low = uintmax_t(lowpc);
-               uintmax_t high = uintmax_t(highpc);
-               if (highpc.form() != DW_FORM_addr)
-                  high += low;
-               (*aranges)[high] = std::make_pair(high - low, u->offset);
-            }
-            // do we have ranges for this DIE?
-            auto ranges = root.getRanges();
-            if (ranges)
-                for (auto r : *ranges)
-                    (*aranges)[r.second] = { r.first, u->offset };
-        }
+        synthesizeARanges();
+        saveARangesIndex();
     }
 
     // Try again now we've added all the unit ranges.
@@ -237,6 +391,166 @@ Info::lookupUnit(Elf::Addr addr) const {
     return nullptr;
 }
 
+/*
+ * Clang does not add debug_aranges. If we fail to find a unit via the
+ * aranges, walk through all the units, check out their root DIE's range
+ * attributes, and fold the content into the aranges data. Only the root DIE
+ * of each unit is examined and units are independent, so the sweep fans out
+ * across threads when the debug data is memory-backed.
+ */
+void
+Info::synthesizeARanges() const
+{
+    std::vector<Unit::sptr> all;
+    for (const auto &u : getUnits())
+        all.push_back(u);
+
+    using UnitRanges = std::vector<std::pair<Elf::Addr, std::pair<Elf::Addr, Elf::Off>>>;
+    std::vector<UnitRanges> perUnit(all.size());
+    auto scan = [&] (size_t i) {
+        const auto &u = all[i];
+        auto root = u->root();
+        auto lowpc = root.attribute(DW_AT_low_pc);
+        auto highpc = root.attribute(DW_AT_high_pc);
+        if (lowpc.valid() && highpc.valid()) {
+           uintmax_t low = uintmax_t(lowpc);
+           uintmax_t high = uintmax_t(highpc);
+           if (highpc.form() != DW_FORM_addr)
+              high += low;
+           perUnit[i].emplace_back(high, std::make_pair(high - low, u->offset));
+        }
+        // do we have ranges for this DIE?
+        auto ranges = root.getRanges();
+        if (ranges)
+            for (auto r : *ranges)
+                perUnit[i].emplace_back(r.second, std::make_pair(r.first, u->offset));
+    };
+
+    bool memBacked = debugInfo &&
+        debugInfo.io()->contiguous(0, debugInfo.io()->size()) != nullptr;
+    size_t nthreads = memBacked
+        ? std::min(all.size(), size_t(std::thread::hardware_concurrency()))
+        : 1;
+    if (nthreads > 1) {
+        std::atomic<size_t> nextJob(0);
+        std::exception_ptr error;
+        std::mutex errorLock;
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < nthreads; ++t)
+            workers.emplace_back([&] {
+                for (;;) {
+                    size_t i = nextJob++;
+                    if (i >= all.size())
+                        return;
+                    try {
+                        scan(i);
+                    }
+                    catch (...) {
+                        std::lock_guard<std::mutex> guard(errorLock);
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                }
+            });
+        for (auto &w : workers)
+            w.join();
+        if (error)
+            std::rethrow_exception(error);
+    } else {
+        for (size_t i = 0; i < all.size(); ++i)
+            scan(i);
+    }
+
+    for (const auto &unitRanges : perUnit)
+        for (const auto &r : unitRanges)
+            (*aranges)[r.first] = r.second;
+}
+
+namespace {
+
+// On-disk form of a synthesized unit address index, stored under
+// cacheDirectory() and keyed by build-id: this header, then one record per
+// range.
+struct ARangeRec {
+    Elf::Addr end;
+    Elf::Addr length;
+    Elf::Off unit;
+};
+
+struct ARangeHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t pad;
+    uint64_t imageSize; // size of the image the index was built from.
+    uint64_t count;
+};
+
+constexpr uint32_t ARINDEX_MAGIC = 0x50534152; // "PSAR"
+constexpr uint32_t ARINDEX_VERSION = 1;
+
+}
+
+bool
+Info::loadARangesIndex() const
+{
+    auto dir = cacheDirectory();
+    auto buildID = elf->getBuildID();
+    if (dir == "" || buildID == "")
+        return false;
+    int fd = ::open(stringify(dir, "/", buildID, ".aridx").c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    ARangeHeader hdr;
+    bool ok = pread(fd, &hdr, sizeof hdr, 0) == ssize_t(sizeof hdr)
+        && hdr.magic == ARINDEX_MAGIC
+        && hdr.version == ARINDEX_VERSION
+        && hdr.recordSize == sizeof (ARangeRec)
+        && hdr.imageSize == uint64_t(elf->io->size());
+    if (ok) {
+        std::vector<ARangeRec> recs(hdr.count);
+        size_t bytes = hdr.count * sizeof (ARangeRec);
+        ok = pread(fd, recs.data(), bytes, sizeof hdr) == ssize_t(bytes);
+        if (ok)
+            for (const auto &rec : recs)
+                (*aranges)[rec.end] = std::make_pair(rec.length, rec.unit);
+    }
+    close(fd);
+    if (ok && verbose >= 2)
+        *debug << "loaded unit address index for build-id " << buildID
+            << " (" << aranges->size() << " ranges)\n";
+    return ok;
+}
+
+void
+Info::saveARangesIndex() const
+{
+    auto dir = cacheDirectory();
+    auto buildID = elf->getBuildID();
+    if (dir == "" || buildID == "")
+        return;
+    makedirs(dir);
+    auto path = stringify(dir, "/", buildID, ".aridx");
+    // write to a temporary and rename, so concurrent readers only ever see a
+    // complete index.
+    auto tmp = stringify(path, ".", getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return;
+    std::vector<ARangeRec> recs;
+    recs.reserve(aranges->size());
+    for (const auto &ent : *aranges)
+        recs.push_back({ent.first, ent.second.first, ent.second.second});
+    ARangeHeader hdr { ARINDEX_MAGIC, ARINDEX_VERSION, sizeof (ARangeRec), 0,
+        uint64_t(elf->io->size()), recs.size() };
+    size_t bytes = recs.size() * sizeof (ARangeRec);
+    bool ok = write(fd, &hdr, sizeof hdr) == ssize_t(sizeof hdr)
+        && write(fd, recs.data(), bytes) == ssize_t(bytes);
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        unlink(tmp.c_str());
+}
+
 Abbreviation::Abbreviation(DWARFReader &r)
     : tag(Tag(r.getuleb128()))
     , hasChildren(HasChildren(r.getu8()) == DW_CHILDREN_yes)
@@ -256,6 +570,79 @@ Abbreviation::Abbreviation(DWARFReader &r)
     }
 }
 
+/*
+ * Work out whether every attribute in this abbreviation has a size knowable
+ * without decoding it, given the unit's version and address/offset widths. If
+ * so, DIEs using the abbreviation can be placed in the tree in constant time,
+ * deferring attribute decode until something actually probes them.
+ */
+void
+Abbreviation::computeLayout(uint16_t version, size_t dwarfLen, size_t addrlen)
+{
+    totalSize = 0;
+    fixedSize = true;
+    formSizes.resize(forms.size());
+    size_t idx = 0;
+    for (const auto &forment : forms) {
+        int size;
+        switch (forment.form) {
+        case DW_FORM_flag_present:
+        case DW_FORM_implicit_const:
+            size = 0;
+            break;
+        case DW_FORM_data1:
+        case DW_FORM_ref1:
+        case DW_FORM_flag:
+        case DW_FORM_strx1:
+        case DW_FORM_addrx1:
+            size = 1;
+            break;
+        case DW_FORM_data2:
+        case DW_FORM_ref2:
+        case DW_FORM_strx2:
+        case DW_FORM_addrx2:
+            size = 2;
+            break;
+        case DW_FORM_strx3:
+        case DW_FORM_addrx3:
+            size = 3;
+            break;
+        case DW_FORM_data4:
+        case DW_FORM_ref4:
+        case DW_FORM_strx4:
+        case DW_FORM_addrx4:
+            size = 4;
+            break;
+        case DW_FORM_data8:
+        case DW_FORM_ref8:
+        case DW_FORM_ref_sig8:
+            size = 8;
+            break;
+        case DW_FORM_addr:
+            size = addrlen;
+            break;
+        case DW_FORM_strp:
+        case DW_FORM_line_strp:
+            size = version <= 2 ? 4 : dwarfLen;
+            break;
+        case DW_FORM_GNU_strp_alt:
+        case DW_FORM_GNU_ref_alt:
+        case DW_FORM_sec_offset:
+        case DW_FORM_ref_addr:
+            size = dwarfLen;
+            break;
+        default:
+            // LEB128s, inline strings, blocks: size depends on the data.
+            size = -1;
+            fixedSize = false;
+            break;
+        }
+        formSizes[idx++] = size;
+        if (size > 0)
+            totalSize += size;
+    }
+}
+
 LineInfo *
 Info::linesAt(intmax_t offset, Unit &unit) const
 {
@@ -268,6 +655,16 @@ Info::linesAt(intmax_t offset, Unit &unit) const
     return lines;
 }
 
+const Macros *
+Info::macrosAt(intmax_t offset, int version) const
+{
+    std::lock_guard<std::recursive_mutex> guard(lazyLock);
+    auto &slot = macroBlocks[std::make_pair(Elf::Off(offset), version)];
+    if (slot == nullptr)
+        slot = std::make_unique<Macros>(*this, offset, version);
+    return slot.get();
+}
+
 std::string
 Info::getAltImageName() const
 {
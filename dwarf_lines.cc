@@ -1,6 +1,8 @@
 #include "libpstack/dwarf.h"
 #include "libpstack/dwarf_reader.h"
 #include "libpstack/global.h"
+
+#include <algorithm>
 namespace Dwarf {
 
 namespace {
@@ -20,7 +22,7 @@ readEntryFormats(DWARFReader &r) {
 }
 
 LineState::LineState(LineInfo *li)
-    : file{ &li->files[1] }
+    : file{ li->files.size() > 1 ? 1U : 0U }
     , addr { 0 }
     , line { 1 }
     , column { 0 }
@@ -36,7 +38,20 @@ LineState::LineState(LineInfo *li)
 static void
 dwarfStateAddRow(LineInfo *li, const LineState &state)
 {
-    li->matrix.push_back(state);
+    li->rows.push_back({state.addr,
+            state.end_sequence ? LineInfo::endSequence : state.file,
+            state.line});
+}
+
+const LineInfo::LineRow *
+LineInfo::rowForAddress(uintmax_t addr) const
+{
+    auto it = std::upper_bound(rows.begin(), rows.end(), addr,
+            [](uintmax_t a, const LineRow &row) { return a < row.addr; });
+    if (it == rows.begin())
+        return nullptr;
+    --it;
+    return it->file == endSequence ? nullptr : &*it;
 }
 
 void
@@ -45,6 +60,8 @@ LineInfo::build(DWARFReader &r, Unit &unit)
     size_t dwarfLen;
     uint32_t total_length = r.getlength(&dwarfLen);
     Elf::Off end = r.getOffset() + total_length;
+    // the line program is decoded start-to-finish in one pass.
+    r.io->advise(r.getOffset(), total_length, Reader::Advice::Sequential);
 
     uint16_t version = r.getu16();
     unsigned char address_size;
@@ -203,7 +220,7 @@ LineInfo::build(DWARFReader &r, Unit &unit)
                 state.line += r.getsleb128();
                 break;
             case DW_LNS_set_file:
-                state.file = &files[r.getuleb128()];
+                state.file = r.getuleb128();
                 break;
             case DW_LNS_copy:
                 dwarfStateAddRow(this, state);
@@ -238,6 +255,17 @@ LineInfo::build(DWARFReader &r, Unit &unit)
             }
         }
     }
+
+    // Sequences can appear in any address order: sort the compiled table so
+    // rowForAddress can binary search. An end-of-sequence marker often shares
+    // its address with the start of the next sequence; place it first so the
+    // live row wins the lookup.
+    std::sort(rows.begin(), rows.end(),
+            [](const LineRow &l, const LineRow &r) {
+                if (l.addr != r.addr)
+                    return l.addr < r.addr;
+                return (l.file == endSequence) > (r.file == endSequence);
+            });
 }
 
 FileEntry::FileEntry(std::string name_, unsigned dirindex_, unsigned lastMod_, unsigned length_)
@@ -138,7 +138,47 @@ Macros::visit4(Unit &u, MacroVisitor *visitor) const
 bool
 Macros::visit5(Unit &u, MacroVisitor *visitor) const
 {
-    auto lineinfo = debug_line_offset != -1 ? u.dwarf->linesAt(debug_line_offset, u) : nullptr;
+    // Decode the opcode stream once; this and later traversals replay the
+    // decoded entries, and imports go through the owning Info's
+    // offset-indexed cache instead of being re-decoded at every import site.
+    if (entries == nullptr)
+        decode5(u);
+    for (const auto &e : *entries) {
+        switch (e.kind) {
+            case Entry::Kind::define:
+                if (!visitor->define(e.line, e.text))
+                    return false;
+                break;
+            case Entry::Kind::undef:
+                if (!visitor->undef(e.line, e.text))
+                    return false;
+                break;
+            case Entry::Kind::startFile:
+                if (!visitor->startFile(e.line, e.directory, e.file))
+                    return false;
+                break;
+            case Entry::Kind::endFile:
+                if (!visitor->endFile())
+                    return false;
+                break;
+            case Entry::Kind::import:
+                // XXX: as with strings below, "u" is likely not right for the
+                // imported block, but only matters for unit-relative string
+                // offsets, which imports can't use reliably.
+                if (!u.dwarf->macrosAt(e.importOffset, 5)->visit(u, visitor))
+                    return false;
+                break;
+        }
+    }
+    return true;
+}
+
+void
+Macros::decode5(Unit &u) const
+{
+    entries = std::make_unique<std::vector<Entry>>();
+    std::unique_ptr<LineInfo> lineinfo(
+            debug_line_offset != -1 ? u.dwarf->linesAt(debug_line_offset, u) : nullptr);
     DWARFReader dr(io);
     for (bool done=false; !done; ) {
         auto code = DWARF_MACRO_CODE(dr.getu8());
@@ -151,8 +191,12 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 if (verbose > 1)
                     *debug << "DW_MACRO_start_file( " << lineinfo->files[file].name << " from line " << line << " )\n";
                 auto &fileinfo = lineinfo->files[file];
-                if (!visitor->startFile(line, lineinfo->directories[fileinfo.dirindex], fileinfo))
-                    return false;
+                Entry e {};
+                e.kind = Entry::Kind::startFile;
+                e.line = int(line);
+                e.directory = lineinfo->directories[fileinfo.dirindex];
+                e.file = fileinfo;
+                entries->push_back(std::move(e));
                 break;
             }
 
@@ -160,14 +204,13 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 auto offset = dr.getuint(dwarflen);
                 if (verbose > 1)
                     *debug << "DW_MACRO_import( " << offset << " )\n";
-
-                // XXX: "u" is likely not right here, but only makes a
-                // difference if the import unit uses unit-relative string
-                // offsets, which it can't, reliably. (see DW_MACRO_define_strp below)
-                Macros nest(*u.dwarf, offset, 5);
-                if (!nest.visit(u, visitor))
-                    return false;
-
+                // just record the target: the replay loop resolves it in the
+                // Info's block cache, where it is decoded at most once however
+                // many sites import it.
+                Entry e {};
+                e.kind = Entry::Kind::import;
+                e.importOffset = offset;
+                entries->push_back(std::move(e));
                 break;
             }
 
@@ -177,8 +220,11 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 auto str = dr.readFormString(*u.dwarf, u, code == DW_MACRO_define_strx ? DW_FORM_strx : DW_FORM_strp);
                 if (verbose > 1)
                     *debug << "DW_MACRO_define_strp( " << line << ", " << str << " )\n";
-                if (!visitor->define(line, str))
-                    return false;
+                Entry e {};
+                e.kind = Entry::Kind::define;
+                e.line = int(line);
+                e.text = std::move(str);
+                entries->push_back(std::move(e));
                 break;
             }
 
@@ -187,8 +233,11 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 auto str = dr.getstring();
                 if (verbose > 1)
                     *debug << "DW_MACRO_define( " << line << ", " << str << " )\n";
-                if (!visitor->define(line, str))
-                    return false;
+                Entry e {};
+                e.kind = Entry::Kind::define;
+                e.line = int(line);
+                e.text = std::move(str);
+                entries->push_back(std::move(e));
                 break;
             }
 
@@ -198,8 +247,11 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 auto str = dr.readFormString(*u.dwarf, u, code == DW_MACRO_undef_strx ? DW_FORM_strx : DW_FORM_strp);
                 if (verbose > 1)
                     *debug << "DW_MACRO_undef_strp( " << line << ", '" << str << "' )\n";
-                if (!visitor->undef(line, str))
-                    return false;
+                Entry e {};
+                e.kind = Entry::Kind::undef;
+                e.line = int(line);
+                e.text = std::move(str);
+                entries->push_back(std::move(e));
                 break;
             }
 
@@ -208,16 +260,22 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 auto str = dr.getstring();
                 if (verbose > 1)
                     *debug << "DW_MACRO_undef( " << line << ", '" << str << "' )\n";
-                if (!visitor->undef(line, str))
-                    return false;
+                Entry e {};
+                e.kind = Entry::Kind::undef;
+                e.line = int(line);
+                e.text = std::move(str);
+                entries->push_back(std::move(e));
                 break;
             }
 
             case DW_MACRO_end_file:
                 if (verbose > 1)
                     *debug << "DW_MACRO_end_file()\n";
-                if (!visitor->endFile())
-                    return false;
+                {
+                    Entry e {};
+                    e.kind = Entry::Kind::endFile;
+                    entries->push_back(std::move(e));
+                }
                 break;
 
             case DW_MACRO_eol:
@@ -231,7 +289,6 @@ Macros::visit5(Unit &u, MacroVisitor *visitor) const
                 break;
         }
     }
-    return true;
 }
 
 }
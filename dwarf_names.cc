@@ -0,0 +1,385 @@
+#include "libpstack/dwarf.h"
+#include "libpstack/dwarf_reader.h"
+#include "libpstack/global.h"
+
+#include <cctype>
+
+namespace Dwarf {
+
+namespace {
+
+// Attribute codes for .debug_names entry pool abbreviations (DWARF5 6.1.1.4.7)
+enum DebugNamesIdx {
+    DW_IDX_compile_unit = 1,
+    DW_IDX_type_unit = 2,
+    DW_IDX_die_offset = 3,
+    DW_IDX_parent = 4,
+    DW_IDX_type_hash = 5,
+};
+
+// The hash function mandated for .debug_names buckets (DJB).
+uint32_t
+debugNamesHash(const std::string &text)
+{
+    uint32_t h = 5381;
+    for (auto c : text)
+        h = h * 33 + (unsigned char)c;
+    return h;
+}
+
+// Decode a single entry-pool attribute value. Name indexes only use a small
+// set of forms; anything else means we don't understand the producer.
+uintmax_t
+readIdxForm(DWARFReader &r, Form form)
+{
+    switch (form) {
+    case DW_FORM_data1:
+    case DW_FORM_ref1:
+        return r.getu8();
+    case DW_FORM_data2:
+    case DW_FORM_ref2:
+        return r.getu16();
+    case DW_FORM_data4:
+    case DW_FORM_ref4:
+        return r.getu32();
+    case DW_FORM_data8:
+    case DW_FORM_ref8:
+        return r.getuint(8);
+    case DW_FORM_udata:
+    case DW_FORM_ref_udata:
+        return r.getuleb128();
+    case DW_FORM_flag_present:
+        return 1;
+    default:
+        throw Exception() << "unhandled form " << int(form) << " in name index";
+    }
+}
+
+/*
+ * DWARF5 .debug_names: a header, per-unit offset tables, a bucketed hash over
+ * the names, and an entry pool described by its own abbreviation table. We
+ * keep only the header geometry and the decoded pool abbreviations; the
+ * bucket, hash, string and entry tables are probed in place through the
+ * section reader, so an unused index costs little more than the header parse.
+ */
+class DebugNamesIndex : public NameIndex {
+    const Info *info;
+    Reader::csptr io;
+    size_t dwarfLen;
+    uint32_t cuCount;
+    uint32_t bucketCount;
+    uint32_t nameCount;
+    Elf::Off cuBase; // table of unit offsets into .debug_info.
+    Elf::Off bucketBase;
+    Elf::Off hashBase;
+    Elf::Off strBase; // offsets into .debug_str, per name.
+    Elf::Off entryBase; // offsets into the entry pool, per name.
+    Elf::Off poolBase;
+    struct IdxAttr {
+        unsigned idx;
+        Form form;
+    };
+    std::unordered_map<uintmax_t, std::vector<IdxAttr>> poolAbbrevs;
+public:
+    DebugNamesIndex(const Info *, Reader::csptr);
+    std::vector<Result> lookup(const std::string &name) const override;
+};
+
+DebugNamesIndex::DebugNamesIndex(const Info *info_, Reader::csptr io_)
+    : info(info_)
+    , io(io_)
+{
+    DWARFReader r(io);
+    r.getlength(&dwarfLen);
+    auto version = r.getu16();
+    if (version != 5)
+        throw Exception() << "unhandled .debug_names version " << version;
+    r.getu16(); // padding.
+    cuCount = r.getu32();
+    auto localTUs = r.getu32();
+    auto foreignTUs = r.getu32();
+    bucketCount = r.getu32();
+    nameCount = r.getu32();
+    auto abbrevSize = r.getu32();
+    auto augLen = r.getu32();
+    r.skip(augLen);
+
+    cuBase = r.getOffset();
+    bucketBase = cuBase + dwarfLen * (cuCount + localTUs) + 8 * foreignTUs;
+    hashBase = bucketBase + 4 * bucketCount;
+    strBase = hashBase + (bucketCount != 0 ? 4 * nameCount : 0);
+    entryBase = strBase + dwarfLen * nameCount;
+    Elf::Off abbrevBase = entryBase + dwarfLen * nameCount;
+    poolBase = abbrevBase + abbrevSize;
+
+    // Decode the entry-pool abbreviation table up front; it's tiny.
+    r.setOffset(abbrevBase);
+    while (r.getOffset() < abbrevBase + abbrevSize) {
+        auto code = r.getuleb128();
+        if (code == 0)
+            break;
+        r.getuleb128(); // tag - we don't filter on it.
+        auto &attrs = poolAbbrevs[code];
+        for (;;) {
+            auto idx = r.getuleb128();
+            auto form = Form(r.getuleb128());
+            if (idx == 0 && form == 0)
+                break;
+            attrs.push_back({unsigned(idx), form});
+        }
+    }
+}
+
+std::vector<NameIndex::Result>
+DebugNamesIndex::lookup(const std::string &name) const
+{
+    std::vector<Result> rv;
+    if (nameCount == 0)
+        return rv;
+
+    DWARFReader r(io);
+    auto nameAt = [&] (uint32_t idx) { // idx is 1-based, per the spec.
+        r.setOffset(strBase + dwarfLen * (idx - 1));
+        return info->debugStrings.io()->readString(r.getuint(dwarfLen));
+    };
+
+    // Find the range of name-table indexes to consider.
+    uint32_t first, last; // inclusive, 1-based.
+    auto h = debugNamesHash(name);
+    if (bucketCount != 0) {
+        r.setOffset(bucketBase + 4 * (h % bucketCount));
+        first = r.getu32();
+        if (first == 0)
+            return rv; // empty bucket.
+        last = nameCount;
+    } else {
+        // No hash table in this index: compare every name.
+        first = 1;
+        last = nameCount;
+    }
+
+    for (auto idx = first; idx <= last; ++idx) {
+        if (bucketCount != 0) {
+            r.setOffset(hashBase + 4 * (idx - 1));
+            auto entryHash = r.getu32();
+            if (idx != first && entryHash % bucketCount != h % bucketCount)
+                break; // ran off the end of our bucket.
+            if (entryHash != h)
+                continue;
+        }
+        if (nameAt(idx) != name)
+            continue;
+        // Found our name: walk its entries in the pool.
+        r.setOffset(entryBase + dwarfLen * (idx - 1));
+        DWARFReader pool(io, poolBase + r.getuint(dwarfLen));
+        for (;;) {
+            auto code = pool.getuleb128();
+            if (code == 0)
+                break;
+            auto abbrev = poolAbbrevs.find(code);
+            if (abbrev == poolAbbrevs.end())
+                throw Exception() << "corrupt .debug_names entry pool";
+            uintmax_t cu = 0;
+            uintmax_t dieOff = 0;
+            bool isTU = false;
+            for (const auto &attr : abbrev->second) {
+                auto value = readIdxForm(pool, attr.form);
+                switch (attr.idx) {
+                case DW_IDX_compile_unit:
+                    cu = value;
+                    break;
+                case DW_IDX_die_offset:
+                    dieOff = value;
+                    break;
+                case DW_IDX_type_unit:
+                case DW_IDX_type_hash:
+                    isTU = true; // type units aren't in our CU table: skip.
+                    break;
+                default:
+                    break;
+                }
+            }
+            if (isTU || cu >= cuCount)
+                continue;
+            r.setOffset(cuBase + dwarfLen * cu);
+            auto unitOffset = r.getuint(dwarfLen);
+            rv.push_back({Elf::Off(unitOffset),
+                    dieOff != 0 ? Elf::Off(unitOffset + dieOff) : 0});
+        }
+        break;
+    }
+    return rv;
+}
+
+/*
+ * .gdb_index: an open-addressed hash of names over a constant pool, each
+ * naming the compilation units that define the symbol. It doesn't identify
+ * individual DIEs, so results point at unit roots.
+ */
+class GdbIndex : public NameIndex {
+    Reader::csptr io;
+    Elf::Off cuListOff;
+    Elf::Off symTabOff;
+    Elf::Off poolOff;
+    size_t slots;
+    size_t cuCount;
+
+    // The symbol hash used by .gdb_index (gdb's dwarf5_djb_hash variant).
+    static uint32_t hash(const std::string &text) {
+        uint32_t h = 0;
+        for (auto c : text)
+            h = h * 67 + tolower((unsigned char)c) - 113;
+        return h;
+    }
+public:
+    GdbIndex(Reader::csptr);
+    std::vector<Result> lookup(const std::string &name) const override;
+};
+
+GdbIndex::GdbIndex(Reader::csptr io_)
+    : io(io_)
+{
+    DWARFReader r(io);
+    auto version = r.getu32();
+    if (version < 4 || version > 8)
+        throw Exception() << "unhandled .gdb_index version " << version;
+    cuListOff = r.getu32();
+    auto typesOff = r.getu32();
+    r.getu32(); // address area.
+    symTabOff = r.getu32();
+    poolOff = r.getu32();
+    cuCount = (typesOff - cuListOff) / 16; // pairs of 64-bit offset + length.
+    slots = (poolOff - symTabOff) / 8; // pairs of 32-bit offsets; power of two.
+}
+
+std::vector<NameIndex::Result>
+GdbIndex::lookup(const std::string &name) const
+{
+    std::vector<Result> rv;
+    if (slots == 0)
+        return rv;
+    DWARFReader r(io);
+    auto h = hash(name);
+    size_t step = ((h * 17) & (slots - 1)) | 1;
+    size_t slot = h & (slots - 1);
+    for (size_t probes = 0; probes < slots; ++probes, slot = (slot + step) & (slots - 1)) {
+        r.setOffset(symTabOff + 8 * slot);
+        auto nameOff = r.getu32();
+        auto vecOff = r.getu32();
+        if (nameOff == 0 && vecOff == 0)
+            return rv; // empty slot: name not present.
+        if (io->readString(poolOff + nameOff) != name)
+            continue;
+        r.setOffset(poolOff + vecOff);
+        auto count = r.getu32();
+        for (uint32_t i = 0; i < count; ++i) {
+            auto cu = r.getu32() & 0xffffff; // high bits hold symbol kind.
+            if (cu >= cuCount)
+                continue; // type units: not in the CU table.
+            DWARFReader cur(io, cuListOff + 16 * cu);
+            rv.push_back({Elf::Off(cur.getuint(8)), 0});
+        }
+        return rv;
+    }
+    return rv;
+}
+
+/*
+ * Fallback index built from .debug_pubnames. The section stores a string per
+ * entry; materializing them all (as Info::pubnames() does for dumping) costs
+ * hundreds of megabytes on large GCC-built images, so we keep just a hash of
+ * each name plus the offsets needed to verify and resolve a hit - a name is
+ * only re-read from the section when its hash matches a query.
+ */
+class PubnamesIndex : public NameIndex {
+    Reader::csptr io;
+    struct Entry {
+        Elf::Off nameOff; // offset of the name string in the section.
+        Elf::Off unitOffset;
+        Elf::Off dieOffset;
+    };
+    std::unordered_multimap<uint32_t, Entry> entries;
+public:
+    PubnamesIndex(Reader::csptr);
+    std::vector<Result> lookup(const std::string &name) const override;
+};
+
+PubnamesIndex::PubnamesIndex(Reader::csptr io_)
+    : io(io_)
+{
+    DWARFReader r(io);
+    while (!r.empty()) {
+        auto length = r.getu32();
+        Elf::Off next = r.getOffset() + length;
+        r.getu16(); // version
+        Elf::Off infoOffset = r.getu32();
+        r.getu32(); // length of the unit's debug_info.
+        while (r.getOffset() < next) {
+            auto dieOff = r.getu32();
+            if (dieOff == 0)
+                break;
+            Elf::Off nameOff = r.getOffset();
+            auto name = r.getstring();
+            entries.emplace(debugNamesHash(name),
+                    Entry{nameOff, infoOffset, infoOffset + dieOff});
+        }
+        r.setOffset(next);
+    }
+}
+
+std::vector<NameIndex::Result>
+PubnamesIndex::lookup(const std::string &name) const
+{
+    std::vector<Result> rv;
+    auto range = entries.equal_range(debugNamesHash(name));
+    for (auto it = range.first; it != range.second; ++it)
+        if (io->readString(it->second.nameOff) == name)
+            rv.push_back({it->second.unitOffset, it->second.dieOffset});
+    return rv;
+}
+
+}
+
+std::vector<DIE>
+Info::namedEntries(const std::string &name) const
+{
+    if (!nameIndexLoaded) {
+        nameIndexLoaded = true;
+        try {
+            auto &names = elf->getDebugSection(".debug_names", SHT_NULL);
+            if (names) {
+                nameIndex = std::make_unique<DebugNamesIndex>(this, names.io());
+            } else {
+                auto &gdb = elf->getDebugSection(".gdb_index", SHT_NULL);
+                if (gdb) {
+                    nameIndex = std::make_unique<GdbIndex>(gdb.io());
+                } else {
+                    auto &pub = elf->getDebugSection(".debug_pubnames", SHT_NULL);
+                    if (pub)
+                        nameIndex = std::make_unique<PubnamesIndex>(pub.io());
+                }
+            }
+        }
+        catch (const Exception &ex) {
+            if (verbose)
+                *debug << "can't decode name index for " << *elf->io
+                    << ": " << ex.what() << "\n";
+            nameIndex.reset();
+        }
+    }
+
+    std::vector<DIE> rv;
+    if (nameIndex == nullptr)
+        return rv;
+    for (const auto &result : nameIndex->lookup(name)) {
+        auto unit = getUnit(result.unitOffset);
+        auto entry = result.dieOffset != 0
+            ? unit->offsetToDIE(DIE(), result.dieOffset)
+            : unit->root();
+        if (entry)
+            rv.push_back(entry);
+    }
+    return rv;
+}
+
+}
@@ -3,6 +3,8 @@
 #include "libpstack/dwarf.h"
 #include "libpstack/dwarf_reader.h"
 
+#include <algorithm>
+
 namespace Dwarf {
 
 void
@@ -15,17 +17,53 @@ Unit::load()
         abbreviations.emplace(std::piecewise_construct,
                 std::forward_as_tuple(code),
                 std::forward_as_tuple(abbR));
+    for (auto &abbrev : abbreviations)
+        abbrev.second.computeLayout(version, dwarfLen, addrlen);
 }
 
 std::string
 Unit::strx(size_t idx) {
+    std::string backing;
+    auto view = strx(idx, backing);
+    return view.data() == backing.data() ? std::move(backing) : std::string(view);
+}
+
+void
+Unit::locateStrx() {
     if (!dwarf->debugStrOffsets)
         throw Exception() << "no string offsets table, but have strx form";
     // Get the root die, and the string offset base.
-    auto base = intmax_t(root().attribute(DW_AT_str_offsets_base));
-    auto len = dwarfLen;
-    DWARFReader r(dwarf->debugStrOffsets.io(), base + len * idx);
-    return dwarf->debugStrings.io()->readString(r.getuint(len));
+    strxBase = uintmax_t(root().attribute(DW_AT_str_offsets_base));
+    auto io = dwarf->debugStrOffsets.io();
+    auto size = io->size();
+    strxCount = strxBase < uintmax_t(size) ? (size - strxBase) / dwarfLen : 0;
+    strxSlice = io->contiguous(strxBase, strxCount * dwarfLen);
+    strxLocated = true;
+}
+
+std::string_view
+Unit::strx(size_t idx, std::string &backing) {
+    if (!strxLocated)
+        locateStrx();
+    if (idx >= strxCount)
+        throw Exception() << "string index " << idx << " out of range";
+    uintmax_t stroff;
+    if (strxSlice != nullptr) {
+        // directly index the mmapped offset table.
+        if (dwarfLen == 4) {
+            uint32_t v;
+            memcpy(&v, strxSlice + idx * 4, sizeof v);
+            stroff = v;
+        } else {
+            uint64_t v;
+            memcpy(&v, strxSlice + idx * 8, sizeof v);
+            stroff = v;
+        }
+    } else {
+        DWARFReader r(dwarf->debugStrOffsets.io(), strxBase + dwarfLen * idx);
+        stroff = r.getuint(dwarfLen);
+    }
+    return dwarf->debugStrings.io()->readStringView(stroff, backing);
 }
 
 uintmax_t
@@ -67,7 +105,8 @@ Unit::rnglistx(size_t slot) {
 
 
 Unit::Unit(const Info *di, DWARFReader &r)
-    : abbrevOffset{ 0 }
+    : Budget::Client(false) // DIEs are only walked on the serialized paths.
+    , abbrevOffset{ 0 }
     , dwarf(di)
     , unitType(DW_UT_compile)
     , offset(r.getOffset())
@@ -123,6 +162,15 @@ Unit::offsetToRawDIE(const DIE &parent, Elf::Off offset) {
         rawptr = DIE::decode(this, parent, offset);
         // this may still be null, and occupy space in the hash table, but
         // it's harmless, and cheaper than removing the entry.
+
+        // Keep the budget abreast of the arena: it only grows in chunks, so
+        // this charges (and can shed colder caches) once per chunk, not per
+        // DIE.
+        auto footprint = arena->size();
+        if (footprint != budgeted) {
+            charge(footprint - budgeted);
+            budgeted = footprint;
+        }
     }
     return rawptr;
 }
@@ -158,12 +206,12 @@ Unit::getMacros()
        for (auto i : { DW_AT_GNU_macros, DW_AT_macros, DW_AT_macro_info }) {
           auto a = root_.attribute(i);
           if (a.valid()) {
-              macros = std::make_unique<Macros>(*dwarf, intmax_t(a), i == DW_AT_macro_info ? 4 : 5);
-              return macros.get();
+              macros = dwarf->macrosAt(intmax_t(a), i == DW_AT_macro_info ? 4 : 5);
+              return macros;
           }
        }
     }
-    return macros.get();
+    return macros;
 }
 
 bool
@@ -173,15 +221,12 @@ Unit::sourceFromAddr(Elf::Addr addr, std::vector<std::pair<std::string, int>> &i
         return false;
     auto lines = getLines();
     if (lines) {
-        for (auto i = lines->matrix.begin(); i != lines->matrix.end(); ++i) {
-            if (i->end_sequence)
-                continue;
-            auto next = i+1;
-            if (i->addr <= addr && next->addr > addr) {
-                auto &dirname = lines->directories[i->file->dirindex];
-                info.emplace_back(verbose ? dirname + "/" + i->file->name : i->file->name, i->line);
-                return true;
-            }
+        auto row = lines->rowForAddress(addr);
+        if (row != nullptr && row->file < lines->files.size()) {
+            auto &file = lines->files[row->file];
+            auto &dirname = lines->directories[file.dirindex];
+            info.emplace_back(verbose ? dirname + "/" + file.name : file.name, row->line);
+            return true;
         }
     }
     return false;
@@ -212,6 +257,81 @@ Unit::findAbbreviation(size_t code) const
     return it != abbreviations.end() ? &it->second : nullptr;
 }
 
+void
+Unit::indexFunctions(const DIE &die)
+{
+    auto tag = die.tag();
+    if (tag == DW_TAG_subprogram || tag == DW_TAG_inlined_subroutine) {
+        auto low = die.attribute(DW_AT_low_pc, true);
+        auto high = die.attribute(DW_AT_high_pc, true);
+        if (low.valid() && high.valid()) {
+            auto start = uintmax_t(low);
+            auto end = uintmax_t(high);
+            switch (high.form()) {
+                case DW_FORM_addr:
+                case DW_FORM_addrx:
+                case DW_FORM_addrx1:
+                case DW_FORM_addrx2:
+                case DW_FORM_addrx3:
+                case DW_FORM_addrx4:
+                    break;
+                default:
+                    end += start; // offset forms give the function's length.
+                    break;
+            }
+            funcRanges->push_back({start, end, 0, die.getOffset()});
+        } else if (die.attribute(DW_AT_ranges).valid()) {
+            auto ranges = getRanges(die, low.valid() ? uintmax_t(low) : 0);
+            if (ranges)
+                for (auto &r : *ranges)
+                    funcRanges->push_back({r.first, r.second, 0, die.getOffset()});
+        }
+    }
+    for (auto child : die.children())
+        indexFunctions(child);
+}
+
+std::vector<DIE>
+Unit::functionsForAddress(Elf::Addr addr)
+{
+    if (funcRanges == nullptr) {
+        funcRanges.reset(new std::vector<FuncRange>());
+        indexFunctions(root());
+        std::sort(funcRanges->begin(), funcRanges->end(),
+                [](const FuncRange &l, const FuncRange &r) { return l.low < r.low; });
+        Elf::Addr maxHigh = 0;
+        for (auto &fr : *funcRanges) {
+            maxHigh = std::max(maxHigh, fr.high);
+            fr.maxHigh = maxHigh;
+        }
+    }
+
+    // Find the first entry starting after addr: only entries before it can
+    // contain addr, and only while the running maximum end address stays
+    // above it. Functions nest, so several entries can match.
+    std::vector<Elf::Off> offsets;
+    auto it = std::upper_bound(funcRanges->begin(), funcRanges->end(), addr,
+            [](Elf::Addr a, const FuncRange &fr) { return a < fr.low; });
+    while (it != funcRanges->begin()) {
+        --it;
+        if (it->maxHigh <= addr)
+            break;
+        if (it->high > addr)
+            offsets.push_back(it->die);
+    }
+
+    // DIE offsets increase in tree (DFS) order, so sorting them yields the
+    // nesting chain, outermost entry first. A DIE with multiple ranges can
+    // appear more than once.
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    std::vector<DIE> dies;
+    dies.reserve(offsets.size());
+    for (auto off : offsets)
+        dies.push_back(offsetToDIE(DIE(), off));
+    return dies;
+}
+
 const Ranges *
 Unit::getRanges(const DIE &die, uintmax_t base) {
     auto &ptr = rangesForOffset[die.offset];
@@ -220,12 +340,46 @@ Unit::getRanges(const DIE &die, uintmax_t base) {
     return ptr.get();
 }
 
-void
-Unit::purge()
+size_t
+Unit::dropDecoded()
 {
     allEntries = AllEntries();
     rangesForOffset = decltype(rangesForOffset)();
-    macros.reset(nullptr);
+    macros = nullptr; // the decoded block itself stays in the Info's cache.
+    // Drop our reference to the DIE storage. It's freed here unless some API
+    // consumer still holds DIEs from this unit, in which case it lingers
+    // until the last of those goes.
+    arena = std::make_shared<Arena>();
+    auto freed = budgeted;
+    budgeted = 0;
+    return freed;
+}
+
+void
+Unit::purge()
+{
+    release(dropDecoded());
+}
+
+size_t
+Unit::shed()
+{
+    // The budget registry settles the accounting from our return value
+    // (calling release() here would deadlock on the registry lock).
+    return dropDecoded();
+}
+
+void *
+Arena::allocate(size_t size, size_t align)
+{
+    used = (used + align - 1) & ~(align - 1);
+    if (chunks.empty() || used + size > chunkSize) {
+        chunks.emplace_back(new char[std::max(chunkSize, size)]);
+        used = 0;
+    }
+    void *rv = chunks.back().get() + used;
+    used += size;
+    return rv;
 }
 
 }
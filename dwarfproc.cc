@@ -13,7 +13,7 @@ namespace Dwarf {
 void
 StackFrame::setCoreRegs(const Elf::CoreRegisters &sys)
 {
-#define REGMAP(number, field) ::Elf::setReg(regs, number, sys.field);
+#define REGMAP(number, field) ::Elf::setReg(*regs, number, sys.field);
 #include "libpstack/archreg.h"
 #undef REGMAP
 }
@@ -21,7 +21,7 @@ StackFrame::setCoreRegs(const Elf::CoreRegisters &sys)
 void
 StackFrame::getCoreRegs(Elf::CoreRegisters &core) const
 {
-#define REGMAP(number, field) core.field = Elf::getReg(regs, number);
+#define REGMAP(number, field) core.field = Elf::getReg(*regs, number);
 #include "libpstack/archreg.h"
 #undef REGMAP
 }
@@ -29,7 +29,7 @@ StackFrame::getCoreRegs(Elf::CoreRegisters &core) const
 Elf::Addr
 StackFrame::rawIP() const
 {
-    return Elf::getReg(regs, IPREG);
+    return Elf::getReg(*regs, IPREG);
 }
 
 Dwarf::ProcessLocation
@@ -194,8 +194,9 @@ ExpressionStack::eval(const Process &proc, const DIE::Attribute &attr,
         case DW_FORM_block:
         case DW_FORM_exprloc: {
             const auto &block = Block(attr);
-            DWARFReader r(dwarf->debugInfo.io(), block.offset, block.offset + block.length);
-            return eval(proc, r, frame, reloc);
+            const auto &expr = dwarf->expressionAt(dwarf->debugInfo.io(),
+                  block.offset, block.offset + block.length);
+            return eval(proc, expr, frame, reloc);
         }
         default:
             abort();
@@ -204,10 +205,28 @@ ExpressionStack::eval(const Process &proc, const DIE::Attribute &attr,
 
 Elf::Addr
 ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *frame, Elf::Addr reloc)
+{
+    // One-shot evaluation (eg, for location-list entries, which vary with the
+    // IP and aren't worth caching): compile, then run the compiled form.
+    CompiledExpression expr(r);
+    return eval(proc, expr, frame, reloc);
+}
+
+Elf::Addr
+ExpressionStack::eval(const Process &proc, const CompiledExpression &expr,
+      const StackFrame *frame, Elf::Addr reloc)
+{
+    return evalInsns(proc, expr, 0, expr.insns.size(), frame, reloc);
+}
+
+Elf::Addr
+ExpressionStack::evalInsns(const Process &proc, const CompiledExpression &expr,
+      size_t begin, size_t end, const StackFrame *frame, Elf::Addr reloc)
 {
     isReg = false;
-    while (!r.empty()) {
-        auto op = ExpressionOp(r.getu8());
+    for (size_t i = begin; i < end; ++i) {
+        auto op = expr.insns[i].op;
+        auto operand = expr.insns[i].operand;
         switch (op) {
             case DW_OP_deref: {
                 intmax_t addr = poptop();
@@ -217,30 +236,15 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
                 break;
             }
 
-            case DW_OP_consts: {
-                push(r.getsleb128());
-                break;
-            }
-
-            case DW_OP_constu: {
-                push(r.getuleb128());
+            case DW_OP_consts:
+            case DW_OP_constu:
+            case DW_OP_const2s:
+            case DW_OP_const4u:
+            case DW_OP_const4s:
+                // constants of all widths are already decoded and
+                // sign-extended as appropriate.
+                push(operand);
                 break;
-            }
-
-            case DW_OP_const2s: {
-                push(int16_t(r.getu16()));
-                break;
-            }
-
-            case DW_OP_const4u: {
-                push(r.getu32());
-                break;
-            }
-
-            case DW_OP_const4s: {
-                push(int32_t(r.getu32()));
-                break;
-            }
 
             case DW_OP_minus: {
                 Elf::Addr tos = poptop();
@@ -263,11 +267,9 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
             case DW_OP_breg16: case DW_OP_breg17: case DW_OP_breg18: case DW_OP_breg19:
             case DW_OP_breg20: case DW_OP_breg21: case DW_OP_breg22: case DW_OP_breg23:
             case DW_OP_breg24: case DW_OP_breg25: case DW_OP_breg26: case DW_OP_breg27:
-            case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31: {
-                Elf::Off offset = r.getsleb128();
-                push(Elf::getReg(frame->regs, op - DW_OP_breg0) + offset);
+            case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31:
+                push(Elf::getReg(*frame->regs, op - DW_OP_breg0) + operand);
                 break;
-            }
 
             case DW_OP_lit0: case DW_OP_lit1: case DW_OP_lit2: case DW_OP_lit3: case DW_OP_lit4:
             case DW_OP_lit5: case DW_OP_lit6: case DW_OP_lit7: case DW_OP_lit8: case DW_OP_lit9:
@@ -348,17 +350,15 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
                 push(lhs >> rhs);
                 break;
             }
-            case DW_OP_addr: {
-                auto value = r.getuint(r.addrLen);
-                push(value + reloc);
+            case DW_OP_addr:
+                push(operand + reloc);
                 break;
-            }
             case DW_OP_call_frame_cfa:
                push(frame->cfa);
                break;
             case DW_OP_fbreg:
                // Yuk - find DW_AT_frame_base, and offset from that.
-               frame->getFrameBase(proc, r.getsleb128(), this);
+               frame->getFrameBase(proc, operand, this);
                break;
 
             case DW_OP_reg0: case DW_OP_reg1: case DW_OP_reg2: case DW_OP_reg3:
@@ -371,17 +371,19 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
             case DW_OP_reg28: case DW_OP_reg29: case DW_OP_reg30: case DW_OP_reg31:
                 isReg = true;
                 inReg = op - DW_OP_reg0;
-                push(Elf::getReg(frame->regs, op - DW_OP_reg0));
+                push(Elf::getReg(*frame->regs, op - DW_OP_reg0));
                 break;
             case DW_OP_regx:
-                push(Elf::getReg(frame->regs, r.getsleb128()));
+                push(Elf::getReg(*frame->regs, operand));
                 break;
 
             case DW_OP_entry_value:
             case DW_OP_GNU_entry_value: {
-                auto len = r.getuleb128();
-                DWARFReader r2(r.io, r.getOffset(), r.getOffset() + len);
-                push(eval(proc, r2, frame, reloc));
+                // the nested expression was compiled in-line; the operand is
+                // its instruction count.
+                auto count = size_t(operand);
+                push(evalInsns(proc, expr, i + 1, i + 1 + count, frame, reloc));
+                i += count;
                 break;
             }
 
@@ -391,7 +393,7 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
                 {
                   auto loc = frame->scopeIP(proc);
                   auto unit = loc.die().getUnit();
-                  auto off = r.getuint(4);
+                  auto off = Elf::Off(operand);
                   auto die = unit->offsetToDIE(DIE(), off + unit->offset);
                   std::clog << die << "\n";
                   auto attr = die.attribute(DW_AT_type);
@@ -412,7 +414,7 @@ ExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *fra
 }
 
 
-StackFrame::StackFrame(UnwindMechanism mechanism, const Elf::CoreRegisters &regs_)
+StackFrame::StackFrame(UnwindMechanism mechanism, Elf::CoreRegisters *regs_)
     : regs(regs_)
     , cfa(0)
     , mechanism(mechanism)
@@ -421,6 +423,44 @@ StackFrame::StackFrame(UnwindMechanism mechanism, const Elf::CoreRegisters &regs
 
 std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
     auto location = scopeIP(p);
+
+    // If a compact unwind table was compiled for this image, and it has a
+    // simple row for this address, we can unwind with two register fetches
+    // and a memory read, and skip CFI processing entirely.
+    if (location.valid()) {
+        const auto *cu = location.dwarf()->compactUnwind();
+        if (cu != nullptr) {
+            const auto *row = cu->find(location.address() - location.elfReloc);
+            if (row != nullptr) {
+                cfa = Elf::getReg(*regs, row->cfaReg) + row->cfaOffset;
+                if (cfa != 0) {
+                    Elf::Addr ra;
+                    if (p.io->read(cfa + row->raOffset, sizeof ra, (char *)&ra) == sizeof ra
+                          && ra != 0) {
+                        Elf::CoreRegisters out = *regs;
+#ifdef CFA_RESTORE_REGNO
+                        Elf::setReg(out, CFA_RESTORE_REGNO, cfa);
+#endif
+#ifdef FPREG
+                        // The next frame's CFA may be frame-pointer based, so
+                        // recover the caller's frame pointer when this frame
+                        // saved it.
+                        if (row->flags & CompactUnwind::ROW_FP_AT) {
+                            Elf::Addr fp;
+                            if (p.io->read(cfa + row->fpOffset, sizeof fp, (char *)&fp) != sizeof fp)
+                                return std::nullopt;
+                            Elf::setReg(out, FPREG, fp);
+                        }
+#endif
+                        Elf::setReg(out, IPREG, ra);
+                        return out;
+                    }
+                }
+                return std::nullopt;
+            }
+        }
+    }
+
     auto cfi = location.cfi();
     auto fde = location.fde();
     auto cie = location.cie();
@@ -434,13 +474,19 @@ std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
     // relocate from process address to object address
     Elf::Off objaddr = location.address() - location.elfReloc;
 
-    DWARFReader r(cfi->io, fde->instructions, fde->end);
-
-    auto iter = location.dwarf()->callFrameForAddr.find(objaddr);
-    if (iter == location.dwarf()->callFrameForAddr.end())
-        location.dwarf()->callFrameForAddr[objaddr] = cie->execInsns(r, fde->iloc, objaddr);
-
-    const CallFrame &dcf = location.dwarf()->callFrameForAddr[objaddr];
+    // The CFA instructions yield a row of rules covering a PC range; any
+    // address within a cached row reuses the computed frame rather than
+    // re-executing the program.
+    auto &cache = location.dwarf()->callFrames;
+    auto cached = cache.find(objaddr);
+    if (cached == nullptr) {
+        DWARFReader r(cfi->io, fde->instructions, fde->end);
+        uintmax_t rowStart, rowEnd;
+        auto frame = cie->execInsns(r, fde->iloc, objaddr, &rowStart, &rowEnd);
+        rowEnd = std::min(rowEnd, uintmax_t(fde->iloc + fde->irange));
+        cached = cache.add(rowStart, rowEnd, std::move(frame));
+    }
+    const CallFrame &dcf = *cached;
 
     // Given the registers available, and the state of the call unwind data,
     // calculate the CFA at this point.
@@ -448,7 +494,7 @@ std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
     switch (dcf.cfaValue.type) {
         case SAME:
         case UNDEF:
-            cfa = Elf::getReg(regs, dcf.cfaReg);
+            cfa = Elf::getReg(*regs, dcf.cfaReg);
             break;
         case VAL_OFFSET:
         case VAL_EXPRESSION:
@@ -458,15 +504,15 @@ std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
             break;
 
         case OFFSET:
-            cfa = Elf::getReg(regs, dcf.cfaReg) + dcf.cfaValue.u.offset;
+            cfa = Elf::getReg(*regs, dcf.cfaReg) + dcf.cfaValue.u.offset;
             break;
 
         case EXPRESSION: {
             ExpressionStack stack;
             auto start = dcf.cfaValue.u.expression.offset;
             auto end = start + dcf.cfaValue.u.expression.length;
-            DWARFReader r(location.cfi()->io, start, end);
-            cfa = stack.eval(p, r, this, location.elfReloc);
+            const auto &expr = location.dwarf()->expressionAt(cfi->io, start, end);
+            cfa = stack.eval(p, expr, this, location.elfReloc);
             break;
         }
         default:
@@ -480,20 +526,39 @@ std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
     // that's the stack pointer, and it's unlikely there will be an encoding for this
     Elf::setReg(out, CFA_RESTORE_REGNO, cfa);
 #endif
+    // Registers saved at an offset from the CFA are plain memory fetches at
+    // addresses we know up front - gather them into a single scatter read,
+    // so a process-backed reader can satisfy them in one batch rather than
+    // one access per register.
+    std::vector<std::pair<int, Elf::Addr>> offsetRegs;
+    for (auto &entry : dcf.registers)
+        if (entry.second.type == OFFSET)
+            offsetRegs.emplace_back(entry.first, cfa + entry.second.u.offset);
+    if (!offsetRegs.empty()) {
+        std::vector<Elf::Addr> values(offsetRegs.size()); // XXX: assume addrLen = sizeof Elf_Addr
+        std::vector<Reader::ReadRange> ranges(offsetRegs.size());
+        for (size_t i = 0; i < offsetRegs.size(); ++i)
+            ranges[i] = { Reader::Off(offsetRegs[i].second), sizeof values[i], (char *)&values[i], 0 };
+        p.io->readScatter(&ranges[0], ranges.size());
+        for (size_t i = 0; i < offsetRegs.size(); ++i) {
+            if (ranges[i].rc != sizeof values[i])
+                throw Exception() << "can't read register " << offsetRegs[i].first
+                    << " saved at address " << std::hex << offsetRegs[i].second << std::dec;
+            Elf::setReg(out, offsetRegs[i].first, values[i]);
+        }
+    }
+
     for (auto &entry : dcf.registers) {
         const auto &unwind = entry.second;
         const int regno = entry.first;
         switch (unwind.type) {
             case UNDEF:
             case SAME:
-                Elf::setReg(out, regno, Elf::getReg(regs, regno));
+                Elf::setReg(out, regno, Elf::getReg(*regs, regno));
                 break;
-            case OFFSET: {
-                Elf::Addr reg; // XXX: assume addrLen = sizeof Elf_Addr
-                p.io->readObj(cfa + unwind.u.offset, &reg);
-                Elf::setReg(out, regno, reg);
+            case OFFSET:
+                // handled in the batch above.
                 break;
-            }
             case REG:
                 Elf::setReg(out, regno, Elf::getReg(out,unwind.u.reg));
                 break;
@@ -501,9 +566,10 @@ std::optional<Elf::CoreRegisters> StackFrame::unwind(Process &p) {
             case EXPRESSION: {
                 ExpressionStack stack;
                 stack.push(cfa);
-                DWARFReader reader(cfi->io, unwind.u.expression.offset,
+                const auto &expr = location.dwarf()->expressionAt(cfi->io,
+                      unwind.u.expression.offset,
                       unwind.u.expression.offset + unwind.u.expression.length);
-                auto val = stack.eval(p, reader, this, location.elfReloc);
+                auto val = stack.eval(p, expr, this, location.elfReloc);
                 // EXPRESSIONs give an address, VAL_EXPRESSION gives a literal.
                 if (unwind.type == EXPRESSION)
                     p.io->readObj(val, &val);
@@ -563,6 +629,8 @@ CodeLocation::fde() const {
 
 const FDE *
 ProcessLocation::fde() const {
+    if (codeloc == nullptr)
+        return nullptr;
     return codeloc->fde();
 }
 
@@ -571,7 +639,12 @@ CodeLocation::die() const {
     if (!die_ && dwarf_) {
         Dwarf::Unit::sptr u = dwarf_->lookupUnit(location_);
         if (u) {
-            die_ = u->root().findEntryForAddr(location_, Dwarf::DW_TAG_subprogram);
+            for (auto &f : u->functionsForAddress(location_)) {
+                if (f.tag() == Dwarf::DW_TAG_subprogram) {
+                    die_ = f;
+                    break;
+                }
+            }
         }
     }
     return die_;
@@ -579,6 +652,9 @@ CodeLocation::die() const {
 
 const DIE &
 ProcessLocation::die() const {
+    static const DIE nullDie;
+    if (codeloc == nullptr)
+        return nullDie;
     return codeloc->die();
 }
 
@@ -591,7 +667,7 @@ ProcessLocation::cie() const {
     auto lfde = fde();
     if (lfde == nullptr)
         return nullptr;
-    return &cfi()->cies.at(lfde->cieOff);
+    return cfi()->getCIE(lfde->cieOff);
 }
 
 std::vector<std::pair<std::string, int>>
@@ -622,7 +698,7 @@ ProcessLocation::set(const Process &proc, Elf::Addr address)
     auto [ elfReloc, elf, phdr ] = proc.findSegment(address);
     auto dwarf = elf ? proc.getDwarf(elf) : nullptr;
     if (dwarf) {
-        codeloc = std::make_shared<CodeLocation>(dwarf, phdr, address - elfReloc);
+        codeloc = proc.getCodeLocation(dwarf, phdr, address - elfReloc);
         this->elfReloc = elfReloc;
     } else {
         this->codeloc = nullptr;
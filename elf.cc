@@ -2,13 +2,18 @@
 #include "libpstack/stringify.h"
 #include "libpstack/ioflag.h"
 #include "libpstack/fs.h"
+#include "libpstack/trace.h"
 #ifdef WITH_ZLIB
 #include "libpstack/inflatereader.h"
 #endif
 #ifdef WITH_LZMA
 #include "libpstack/lzmareader.h"
 #endif
+#ifdef WITH_DEBUGINFOD
+#include <elfutils/debuginfod.h>
+#endif
 
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -69,6 +74,8 @@ Notes::iterator::iterator(const Object *object_, bool begin)
 void Notes::iterator::startSection() {
     offset = 0;
     io = object->io->view("note section", Off(phdrsi->p_offset), size_t(phdrsi->p_filesz));
+    // note scans touch the entire segment in short order.
+    io->advise(0, size_t(phdrsi->p_filesz), Reader::Advice::WillNeed);
 }
 
 Notes::iterator &Notes::iterator::operator++()
@@ -130,7 +137,7 @@ std::string
 Object::symbolVersion(const VersionedSymbol &sym) const {
     auto vi = symbolVersions();
 
-    int idx = sym.versionIdx & 0x7fff;
+    int idx = sym.versionIdx() & 0x7fff;
     if (idx >= 2)
         return vi->versions.at(idx);
     else
@@ -223,6 +230,21 @@ Object::Object(ImageCache &cache, Reader::csptr io_, bool isDebug)
                 [] (const Phdr &lhs, const Phdr &rhs) {
                     return lhs.p_vaddr < rhs.p_vaddr; });
 
+    // Section headers (and everything derived from them - section names, the
+    // dynamic entries, version info) are materialized lazily on the first
+    // request for a section: for live-process unwinding, we mostly just need
+    // the program headers.
+    gnu_version = nullptr;
+}
+
+void
+Object::loadSections() const
+{
+    if (sectionsLoaded)
+        return;
+    // set the flag before we start: getSection below re-enters here.
+    sectionsLoaded = true;
+
     Elf::Off off;
     int i;
 
@@ -231,9 +253,9 @@ Object::Object(ImageCache &cache, Reader::csptr io_, bool isDebug)
     int headerCount = elfHeader.e_shnum == 0 && elfHeader.e_shentsize != 0 ?
        1 : elfHeader.e_shnum;
 
-    // sectionHeaders.reserve(elfHeader.e_shnum);
+    auto self = const_cast<Object *>(this);
     for (off = elfHeader.e_shoff, i = 0; i < headerCount; i++) {
-        sectionHeaders.emplace_back(std::make_unique<Section>(this, off));
+        sectionHeaders.emplace_back(std::make_unique<Section>(self, off));
         if (i == 0 && elfHeader.e_shnum == 0)
             headerCount = sectionHeaders[0]->shdr.sh_size;
         off += elfHeader.e_shentsize;
@@ -384,47 +406,170 @@ Object::getInterpreter() const
     return "";
 }
 
+std::string
+Object::getBuildID() const
+{
+    for (const auto &note : notes()) {
+        if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
+            auto io = note.data();
+            std::vector<unsigned char> data(io->size());
+            io->readObj(0, &data[0], io->size());
+            std::ostringstream os;
+            os << std::hex << std::setfill('0');
+            for (auto byte : data)
+                os << std::setw(2) << int(byte);
+            return os.str();
+        }
+    }
+    return "";
+}
+
+namespace {
+
 /*
- * Find the symbol that represents a particular address.
+ * On-disk layout of a cached symbol address index: this header, followed by
+ * the raw AddrSym records. The records hold string-table offsets rather than
+ * names, which stay valid across runs because the file is keyed by build-id.
  */
-std::optional<std::pair<Sym, string>>
-Object::findSymbolByAddress(Addr addr, int type)
+struct SymIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize; // sizeof(AddrSym) when written; rejects ABI skew.
+    uint32_t pad;
+    uint64_t imageSize; // size of the ELF image the index was built from.
+    uint64_t count;
+};
+
+constexpr uint32_t SYMINDEX_MAGIC = 0x50535849; // "PSXI"
+constexpr uint32_t SYMINDEX_VERSION = 1;
+
+}
+
+bool
+Object::loadAddrIndex()
 {
-    /* Try to find symbols in these sections */
-    bool haveExactZeroSizeMatch = false;
+    auto dir = cacheDirectory();
+    auto buildID = getBuildID();
+    if (dir == "" || buildID == "")
+        return false;
+    int fd = ::open(stringify(dir, "/", buildID, ".symidx").c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    SymIndexHeader hdr;
+    bool ok = pread(fd, &hdr, sizeof hdr, 0) == ssize_t(sizeof hdr)
+        && hdr.magic == SYMINDEX_MAGIC
+        && hdr.version == SYMINDEX_VERSION
+        && hdr.recordSize == sizeof(AddrSym)
+        && hdr.imageSize == uint64_t(io->size());
+    if (ok) {
+        addrIndex.resize(hdr.count);
+        size_t bytes = hdr.count * sizeof(AddrSym);
+        ok = pread(fd, addrIndex.data(), bytes, sizeof hdr) == ssize_t(bytes);
+        if (!ok)
+            addrIndex.clear();
+    }
+    close(fd);
+    if (ok && verbose >= 2)
+        *debug << "loaded symbol index for build-id " << buildID
+            << " (" << addrIndex.size() << " symbols)\n";
+    return ok;
+}
 
-    Sym sym;
-    std::string name;
-    auto findSym = [&] (auto &table) {
+void
+Object::saveAddrIndex() const
+{
+    auto dir = cacheDirectory();
+    auto buildID = getBuildID();
+    if (dir == "" || buildID == "")
+        return;
+    makedirs(dir);
+    auto path = stringify(dir, "/", buildID, ".symidx");
+    // write to a temporary and rename, so concurrent readers only ever see a
+    // complete index.
+    auto tmp = stringify(path, ".", getpid());
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return;
+    SymIndexHeader hdr { SYMINDEX_MAGIC, SYMINDEX_VERSION, sizeof(AddrSym), 0,
+        uint64_t(io->size()), addrIndex.size() };
+    size_t bytes = addrIndex.size() * sizeof(AddrSym);
+    bool ok = write(fd, &hdr, sizeof hdr) == ssize_t(sizeof hdr)
+        && write(fd, addrIndex.data(), bytes) == ssize_t(bytes);
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        unlink(tmp.c_str());
+}
+
+void
+Object::buildAddrIndex()
+{
+    loadSections();
+    if (loadAddrIndex()) {
+        addrIndexBuilt = true;
+        return;
+    }
+    auto add = [this] (auto &table, bool dynamic) {
         for (const auto &candidate : table) {
             if (candidate.st_shndx >= sectionHeaders.size())
                 continue;
-            if (type != STT_NOTYPE && ELF_ST_TYPE(candidate.st_info) != type)
-                continue;
-            if (candidate.st_value > addr)
-                continue;
-            if (candidate.st_size + candidate.st_value <= addr) {
-                if (candidate.st_size == 0 && candidate.st_value == addr) {
-                    sym = candidate;
-                    name = table.name(candidate);
-                    haveExactZeroSizeMatch = true;
-                }
-                continue;
-            }
             auto &sec = sectionHeaders[candidate.st_shndx];
-            if ((sec->shdr.sh_flags & SHF_ALLOC) == 0)
-                continue;
-            sym = candidate;
-            name = table.name(candidate);
-            return true;
+            addrIndex.push_back({candidate, 0, dynamic,
+                    (sec->shdr.sh_flags & SHF_ALLOC) != 0});
         }
-        sym.st_shndx = SHN_UNDEF;
-        return false;
     };
-    if (findSym(*debugSymbols()))
-        return std::make_pair( sym, name );
-    if (findSym(*dynamicSymbols()))
-        return std::make_pair( sym, name );
+    add(*debugSymbols(), false);
+    add(*dynamicSymbols(), true);
+    // stable sort, so debug-table symbols sort ahead of dynamic ones with the
+    // same address, preserving the old table preference.
+    std::stable_sort(addrIndex.begin(), addrIndex.end(),
+            [] (const AddrSym &lhs, const AddrSym &rhs) {
+                return lhs.sym.st_value < rhs.sym.st_value;
+            });
+    // Record the highest extent seen so far at each entry: a backward scan
+    // from the binary-search point can stop as soon as no earlier symbol can
+    // cover the address.
+    Addr maxEnd = 0;
+    for (auto &entry : addrIndex) {
+        maxEnd = std::max(maxEnd, Addr(entry.sym.st_value + entry.sym.st_size));
+        entry.maxEnd = maxEnd;
+    }
+    saveAddrIndex();
+    addrIndexBuilt = true;
+}
+
+/*
+ * Find the symbol that represents a particular address.
+ */
+std::optional<std::pair<Sym, string>>
+Object::findSymbolByAddress(Addr addr, int type)
+{
+    warmAddrIndex();
+
+    bool haveExactZeroSizeMatch = false;
+    Sym sym;
+    sym.st_shndx = SHN_UNDEF;
+    std::string name;
+    auto nameOf = [this] (const AddrSym &entry) {
+        return entry.dynamic ? dynamicSymbols()->name(entry.sym)
+            : debugSymbols()->name(entry.sym);
+    };
+
+    auto it = std::upper_bound(addrIndex.begin(), addrIndex.end(), addr,
+            [] (Addr lhs, const AddrSym &rhs) { return lhs < rhs.sym.st_value; });
+    while (it != addrIndex.begin()) {
+        const auto &entry = *--it;
+        bool typeOk = type == STT_NOTYPE || ELF_ST_TYPE(entry.sym.st_info) == type;
+        if (typeOk && entry.sym.st_size == 0 && entry.sym.st_value == addr
+                && !haveExactZeroSizeMatch) {
+            sym = entry.sym;
+            name = nameOf(entry);
+            haveExactZeroSizeMatch = true;
+        }
+        if (entry.maxEnd <= addr)
+            break; // nothing here or earlier can cover addr.
+        if (typeOk && entry.alloc && entry.sym.st_value + entry.sym.st_size > addr)
+            return std::make_pair(entry.sym, nameOf(entry));
+    }
     // .gnu_debugdata is a separate LZMA-compressed ELF image with just
     // a symbol table.
     if (debugData == nullptr) {
@@ -458,6 +603,7 @@ Object::findSymbolByAddress(Addr addr, int type)
 const Section &
 Object::getSection(const string &name, Word type) const
 {
+    loadSections();
     auto s = namedSection.find(name);
     if (s != namedSection.end()) {
         auto &ref = sectionHeaders[s->second];
@@ -492,6 +638,7 @@ Object::getDebugSection(const string &name, Word type) const
 const Section &
 Object::getSection(Word idx) const
 {
+    loadSections();
     if (sectionHeaders[idx]->shdr.sh_type != SHT_NULL)
         return *sectionHeaders[idx];
     return *sectionHeaders[0];
@@ -502,6 +649,7 @@ Object::getLinkedSection(const Section &from) const
 {
     if (!from)
         return from;
+    loadSections();
     if (from.elf == this) // it might come from the debug object...
         return *sectionHeaders[from.shdr.sh_link];
     auto debug = getDebug();
@@ -532,18 +680,21 @@ Object::findDynamicSymbol(const std::string &name)
     return VersionedSymbol(sym, *gnu_version, idx);
 }
 
-// XXX: if we're doing name lookups on symbols, consider caching them all in a
-// hash table, rather than doing linear scans for each symbol we haven't
-// looked-up yet.
 Sym
 Object::findDebugSymbol(const string &name)
 {
-    auto &syment = cachedSymbols[name];
-    if (syment.disposition == CachedSymbol::SYM_NEW) {
-        auto found = debugSymbols()->linearSearch(name, syment.sym);
-        syment.disposition = found ? CachedSymbol::SYM_FOUND : CachedSymbol::SYM_NOTFOUND;
+    // .symtab has no .hash/.gnu.hash coverage, so index it by name once on
+    // the first lookup - that costs one pass over the table, the same as a
+    // single linear-search miss, and makes every later lookup O(1). The
+    // index is shared with whoever else holds this object via ImageCache.
+    if (debugNames_ == nullptr) {
+        debugNames_ = std::make_unique<std::unordered_map<std::string, Sym>>();
+        auto &table = *debugSymbols();
+        for (const auto &info : table)
+            debugNames_->emplace(table.name(info), info); // keeps first occurrence.
     }
-    return syment.disposition == CachedSymbol::SYM_FOUND ? syment.sym : undef();
+    auto it = debugNames_->find(name);
+    return it != debugNames_->end() ? it->second : undef();
 }
 
 Object *
@@ -554,23 +705,10 @@ Object::getDebug() const
     debugLoaded = true;
 
     // Use the build ID to find debug data.
-    for (const auto &note : notes()) {
-        if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
-            std::ostringstream dir;
-            dir << ".build-id/";
-            size_t i;
-            auto io = note.data();
-            std::vector<unsigned char> data(io->size());
-            io->readObj(0, &data[0], io->size());
-            dir << std::hex << std::setw(2) << std::setfill('0') << int(data[0]);
-            dir << "/";
-            for (i = 1; i < size_t(io->size()); ++i)
-                dir << std::setw(2) << int(data[i]);
-            dir << ".debug" << std::dec;
-            debugObject = imageCache.getDebugImage(dir.str());
-            break;
-        }
-    }
+    auto buildID = getBuildID();
+    if (buildID.size() > 2)
+        debugObject = imageCache.getDebugImage(stringify(".build-id/",
+                 buildID.substr(0, 2), "/", buildID.substr(2), ".debug"));
 
     // If that doesn't work, maybe the gnu_debuglink is valid?
     if (!debugObject) {
@@ -583,6 +721,34 @@ Object::getDebug() const
         }
     }
 
+#ifdef WITH_DEBUGINFOD
+    // Last resort: ask any debuginfod servers named in $DEBUGINFOD_URLS for
+    // the debug data. The client library keeps a content-addressed cache
+    // under the user's cache directory, so only the first run for a given
+    // build-id pays for the download.
+    if (!debugObject && buildID != "") {
+        static debuginfod_client *client = debuginfod_begin();
+        if (client != nullptr) {
+            char *path = nullptr;
+            int fd = debuginfod_find_debuginfo(client,
+                    reinterpret_cast<const unsigned char *>(buildID.c_str()),
+                    0, &path);
+            if (fd >= 0) {
+                close(fd);
+                try {
+                    debugObject = imageCache.getImageForName(path, true);
+                }
+                catch (const std::exception &ex) {
+                    if (verbose >= 2)
+                        *debug << "debuginfod gave unusable " << path
+                            << " for " << *io << ": " << ex.what() << "\n";
+                }
+            }
+            free(path);
+        }
+    }
+#endif
+
     if (!debugObject) {
         if (verbose >= 2)
            *debug << "no debug object for " << *this->io << "\n";
@@ -743,31 +909,72 @@ ImageCache::getImageForName(const string &name, bool isDebug) {
     auto res = getImageIfLoaded(name);
     if (res != nullptr)
         return res;
-    auto item = make_shared<Object>(*this, std::make_shared<MmapReader>(name), isDebug);
+    // Build the image outside the lock - this is the expensive part, and
+    // letting it overlap is what makes concurrent attach work. If two
+    // threads race to load the same image, the first to insert wins.
+    Trace::Span span("elf", [&] { return "parse " + name; });
+    auto start = std::chrono::steady_clock::now();
+    // loadFile rather than MmapReader directly: it picks the right reader
+    // stack for pseudo-files and http:// names as well as mappable ones.
+    auto item = make_shared<Object>(*this, loadFile(name), isDebug);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
     // don't cache negative entries: assign into the cache after we've constructed:
     // a failure to load the image will throw.
-    cache[name] = item;
-    return item;
+    auto &shard = shardFor(name);
+    std::lock_guard<std::mutex> guard(shard.mtx);
+    shard.loads++;
+    shard.loadTime += elapsed;
+    auto &slot = shard.cache[name];
+    if (slot == nullptr)
+        slot = item;
+    return slot;
 }
 
-ImageCache::ImageCache() : elfHits(0), elfLookups(0) {}
+ImageCache::ImageCache() {}
 ImageCache::~ImageCache() noexcept {
     if (verbose >= 2) {
-        *debug << "ELF image cache: lookups: " << elfLookups << ", hits=" << elfHits << std::endl;
-        for (const auto &items : cache) {
-            assert(items.second);
-            *debug << "\t" << *items.second->io << std::endl;
+        dumpStats(*debug);
+        for (const auto &shard : shards) {
+            for (const auto &items : shard.cache) {
+                assert(items.second);
+                *debug << "\t" << *items.second->io << std::endl;
+            }
         }
     }
 }
 
+std::ostream &
+ImageCache::dumpStats(std::ostream &os) const
+{
+    int lookups = 0, hits = 0, loads = 0;
+    std::chrono::microseconds loadTime{0};
+    for (size_t i = 0; i < SHARDCOUNT; ++i) {
+        auto &shard = shards[i];
+        std::lock_guard<std::mutex> guard(shard.mtx);
+        if (shard.lookups != 0)
+            os << "ELF image cache shard " << i << ": lookups: " << shard.lookups
+                << ", hits=" << shard.hits << ", loads=" << shard.loads
+                << ", load time=" << shard.loadTime.count() << "us" << std::endl;
+        lookups += shard.lookups;
+        hits += shard.hits;
+        loads += shard.loads;
+        loadTime += shard.loadTime;
+    }
+    os << "ELF image cache: lookups: " << lookups << ", hits=" << hits
+        << ", loads=" << loads << ", load time=" << loadTime.count() << "us" << std::endl;
+    return os;
+}
+
 Object::sptr
 ImageCache::getImageIfLoaded(const string &name)
 {
-    elfLookups++;
-    auto it = cache.find(name);
-    if (it != cache.end()) {
-        elfHits++;
+    auto &shard = shardFor(name);
+    std::lock_guard<std::mutex> guard(shard.mtx);
+    shard.lookups++;
+    auto it = shard.cache.find(name);
+    if (it != shard.cache.end()) {
+        shard.hits++;
         return it->second;
     }
     return Object::sptr();
@@ -795,18 +1002,26 @@ ImageCache::getDebugImage(const string &name) {
 void
 ImageCache::flush(Object::sptr o)
 {
-   for (auto it = cache.begin(); it != cache.end(); ++it) {
-      if (it->second == o) {
-         cache.erase(it);
-         return;
+   for (auto &shard : shards) {
+      std::lock_guard<std::mutex> guard(shard.mtx);
+      for (auto it = shard.cache.begin(); it != shard.cache.end(); ++it) {
+         if (it->second == o) {
+            shard.cache.erase(it);
+            return;
+         }
       }
    }
 }
 
-VersionedSymbol::VersionedSymbol(const Sym &sym_, const Section &versionInfo, size_t idx)
-    : Sym(sym_)
-    , versionIdx(versionInfo ? versionInfo.io()->readObj<Half>(idx * sizeof (Half)) : -1)
-{ }
+int
+VersionedSymbol::versionIdx() const
+{
+    if (versionIdx_ == -2)
+        versionIdx_ = versionInfo != nullptr && *versionInfo
+            ? versionInfo->io()->readObj<Half>(symIdx * sizeof (Half))
+            : -1;
+    return versionIdx_;
+}
 
 namespace {
 struct Undef {
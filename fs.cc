@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <iostream>
 #include <fcntl.h>
 #include <string.h>
@@ -80,3 +81,26 @@ openfile(const std::string &name, int mode, int mask)
 }
 
 
+
+std::string
+cacheDirectory()
+{
+    const char *env = getenv("PSTACK_CACHE_DIR");
+    if (env != nullptr)
+        return env;
+    env = getenv("XDG_CACHE_HOME");
+    if (env != nullptr && *env != '\0')
+        return std::string(env) + "/pstack";
+    env = getenv("HOME");
+    if (env != nullptr && *env != '\0')
+        return std::string(env) + "/.cache/pstack";
+    return "";
+}
+
+void
+makedirs(const std::string &path)
+{
+    for (size_t i = 1; i <= path.size(); ++i)
+        if (i == path.size() || path[i] == '/')
+            (void)mkdir(path.substr(0, i).c_str(), 0755);
+}
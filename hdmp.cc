@@ -3,7 +3,10 @@
 
 #include <libpstack/proc.h>
 #include <unistd.h>
+#include <algorithm>
+#include <map>
 #include <set>
+#include <vector>
 #include "heap.h"
 
 enum printoption {
@@ -12,8 +15,28 @@ enum printoption {
 
 std::set<printoption> options;
 
-void printStack(std::ostream &os, Dwarf::ImageCache &ic, std::shared_ptr<Process> &proc, const hdbg_info &info, void **frames) {
-   for (size_t i = 0; i < info.maxframes && frames[i] != nullptr; ++i) {
+// The stacks are interned in the target: walk the hash table once and build
+// the id -> frames mapping.
+using StackTable = std::map<unsigned, std::vector<void *>>;
+
+StackTable readStacks(std::shared_ptr<Process> &proc, const hdbg_info &info) {
+   StackTable stacks;
+   for (auto bucket : info.stackbuckets) {
+      for (Elf::Addr addr = (Elf::Addr)bucket; addr != 0; ) {
+         auto node = proc->io->readObj<stacknode>(addr);
+         auto &frames = stacks[node.id];
+         frames.resize(node.nframes);
+         if (node.nframes != 0)
+            proc->io->readObj(addr + offsetof(stacknode, frames),
+                  &frames[0], node.nframes);
+         addr = (Elf::Addr)node.next;
+      }
+   }
+   return stacks;
+}
+
+void printStack(std::ostream &os, Dwarf::ImageCache &ic, std::shared_ptr<Process> &proc, void *const *frames, size_t nframes) {
+   for (size_t i = 0; i < nframes && frames[i] != nullptr; ++i) {
       uintptr_t frameip = uintptr_t(frames[i]);
       if (i != 0)
          frameip--;
@@ -44,28 +67,52 @@ void printStack(std::ostream &os, Dwarf::ImageCache &ic, std::shared_ptr<Process
    os << "\n";
 }
 
-void printBlocks(std::ostream &os, Dwarf::ImageCache &ic, std::shared_ptr<Process> proc, const hdbg_info &info, const memdesc_list &list, enum memstate state) {
+// Per-allocation-site totals, keyed by interned stack id.
+struct SiteStats {
+   size_t count = 0;
+   size_t bytes = 0;
+};
+using SiteTable = std::map<unsigned, SiteStats>;
+
+// Walk a block list accumulating per-site totals; integrity problems are
+// reported per block, but symbolization is deferred until each unique site
+// is printed once.
+void aggregateBlocks(std::ostream &os, std::shared_ptr<Process> proc, const memdesc_list &list, enum memstate state, SiteTable &sites) {
 
-   size_t sz = sizeof (struct memdesc) + info.maxframes * sizeof (void *);
-   struct memdesc *hdr = (memdesc *)malloc(sz);
+   struct memdesc hdr;
 
-   for (Elf::Addr addr = (Elf::Addr)list.tqh_first; addr; addr = (Elf::Addr)hdr->node.tqe_next) {
-      if (proc->io->read((uintptr_t)addr, sz, (char *)hdr) != sz)
+   for (Elf::Addr addr = (Elf::Addr)list.tqh_first; addr; addr = (Elf::Addr)hdr.node.tqe_next) {
+      if (proc->io->read((uintptr_t)addr, sizeof hdr, (char *)&hdr) != sizeof hdr)
          break;
-      os << "ptr=" << hdr->data + 1;
-      memstate head = proc->io->readObj<memstate>((Elf::Addr)&hdr->data->state);
-      memstate tail = proc->io->readObj<memstate>((Elf::Addr)(hdr->data + 1) + hdr->len);
-      if (head != state) {
-         std::cout << " BADHEAD";
-      }
-      if (tail != state) {
-         std::cout << " BADTAIL";
+      memstate head = proc->io->readObj<memstate>((Elf::Addr)&hdr.data->state);
+      memstate tail = proc->io->readObj<memstate>((Elf::Addr)(hdr.data + 1) + hdr.len);
+      if (head != state || tail != state) {
+         os << "ptr=" << hdr.data + 1;
+         if (head != state)
+            os << " BADHEAD";
+         if (tail != state)
+            os << " BADTAIL";
+         os << " size=" << hdr.len << "\n";
       }
-      os << " size=" << hdr->len << "\n";
-      printStack(os, ic, proc, info, hdr->stack);
+      auto &site = sites[hdr.stackid];
+      site.count++;
+      site.bytes += hdr.len;
+   }
+}
 
+// print the accumulated sites, biggest first, resolving each stack once.
+void printSites(std::ostream &os, Dwarf::ImageCache &ic, std::shared_ptr<Process> proc, const StackTable &stacks, const SiteTable &sites) {
+   std::vector<std::pair<unsigned, SiteStats>> order(sites.begin(), sites.end());
+   std::sort(order.begin(), order.end(),
+         [](const auto &l, const auto &r) { return l.second.bytes > r.second.bytes; });
+   for (const auto &[id, site] : order) {
+      os << "total=" << site.bytes << " blocks=" << site.count << "\n";
+      auto si = stacks.find(id);
+      if (si != stacks.end() && !si->second.empty())
+         printStack(os, ic, proc, &si->second[0], si->second.size());
+      else
+         os << "\t(no stack recorded)\n\n";
    }
-   free(hdr);
 }
 
 void dumpHeap(std::shared_ptr<Process> proc, std::ostream &os, Dwarf::ImageCache &ic)
@@ -84,19 +131,29 @@ void dumpHeap(std::shared_ptr<Process> proc, std::ostream &os, Dwarf::ImageCache
    << "Calls to aligned_alloc et al:  " << info.stats.aligned_alloc_calls << "\n"
    ;
 
+   auto stacks = readStacks(proc, info);
+
    os << "\nStack at termination:\n\n";
-   printStack(os, ic, proc, info, info.crashstack);
+   printStack(os, ic, proc, info.crashstack, CRASHFRAMES);
    if (options.find(heap_allocated) != options.end()) {
       os << "\nCurrently allocated memory:\n\n";
-      printBlocks(os, ic, proc, info, info.heap, mem_allocated);
+      SiteTable sites;
+      for (const auto &shard : info.shards)
+         aggregateBlocks(os, proc, shard.heap, mem_allocated, sites);
+      printSites(os, ic, proc, stacks, sites);
    }
    if (options.find(heap_recentfree) != options.end()) {
       os << "\nRecently freed memory:\n\n";
-      printBlocks(os, ic, proc, info, info.freelist, mem_free);
+      SiteTable sites;
+      for (const auto &shard : info.shards)
+         aggregateBlocks(os, proc, shard.freelist, mem_free, sites);
+      printSites(os, ic, proc, stacks, sites);
    }
    if (options.find(heap_historicbig) != options.end()) {
       os << "\nHistoric large allocations:\n\n";
-      printBlocks(os, ic, proc, info, info.freebig, mem_free);
+      SiteTable sites;
+      aggregateBlocks(os, proc, info.freebig, mem_free, sites);
+      printSites(os, ic, proc, stacks, sites);
    }
 }
 
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 // disable optimization.
 // There are a number of problems optimization can cause in here. For example,
@@ -47,9 +48,26 @@ static void buffer_free(void *unused) {
 struct hdbg_info hdbg; // not static - "hdmp" finds this symbol.
 
 static int startup = 2;
-static pthread_mutex_t heap_lock;
+static pthread_mutex_t shard_locks[HDBG_NSHARDS];
 static pthread_mutex_t descriptors_lock;
 
+// Each thread keeps a private pool of descriptors, refilled from and spilled
+// to the shared pool in batches, so the common alloc/free path doesn't touch
+// descriptors_lock at all. The initial-exec TLS model matters: the default
+// dynamic model can call malloc from __tls_get_addr and recurse into us.
+#define TLS_DESC_MAX 64
+#define TLS_DESC_BATCH 32
+static __thread struct memdesc_list tls_descs __attribute__((tls_model("initial-exec")));
+static __thread int tls_ndescs __attribute__((tls_model("initial-exec"))) = -1;
+
+static inline unsigned shard_of(const struct memdesc *desc) {
+    return ((uintptr_t)desc >> 6) % HDBG_NSHARDS;
+}
+
+// scratch buffer for capturing a trace before it is interned.
+static pthread_mutex_t stacks_lock;
+static __thread void *stack_scratch[DBGH_STACKMAX] __attribute__((tls_model("initial-exec")));
+
 static malloc_t real_malloc = buffer_malloc;
 static free_t real_free = buffer_free;
 static calloc_t real_calloc = buffer_calloc;
@@ -109,38 +127,97 @@ set_state(struct memdesc *desc, enum memstate state)
     desc->data->state = state;
 }
 
+/*
+ * Return the id for this frame vector, storing it in the hash-consed stack
+ * table if it's new. The common case - an allocation site seen before - is
+ * satisfied with a lock-free chain walk; chains only ever grow at the head,
+ * and new nodes are published with a release store.
+ */
+static unsigned intern_stack(void **frames) {
+    unsigned n;
+    uintptr_t h = 2166136261u;
+    for (n = 0; n < hdbg.maxframes && frames[n]; n++)
+        h = (h ^ (uintptr_t)frames[n]) * 16777619u;
+    unsigned bucket = h % HDBG_STACKBUCKETS;
+
+    struct stacknode *node;
+    for (node = __atomic_load_n(&hdbg.stackbuckets[bucket], __ATOMIC_ACQUIRE);
+          node != 0; node = node->next)
+        if (node->nframes == n &&
+              memcmp(node->frames, frames, n * sizeof frames[0]) == 0)
+            return node->id;
+
+    LOCK(&stacks_lock);
+    // re-check: it may have been interned while we walked without the lock.
+    struct stacknode *head = hdbg.stackbuckets[bucket];
+    for (node = head; node != 0; node = node->next) {
+        if (node->nframes == n &&
+              memcmp(node->frames, frames, n * sizeof frames[0]) == 0) {
+            UNLOCK(&stacks_lock);
+            return node->id;
+        }
+    }
+    node = real_malloc(sizeof *node + (n > 0 ? n - 1 : 0) * sizeof (void *));
+    node->nframes = n;
+    memcpy(node->frames, frames, n * sizeof frames[0]);
+    node->id = ++hdbg.stackcount;
+    node->next = head;
+    __atomic_store_n(&hdbg.stackbuckets[bucket], node, __ATOMIC_RELEASE);
+    UNLOCK(&stacks_lock);
+    return node->id;
+}
+
+// Take a descriptor from the thread's private pool, batching a refill from
+// the shared pool (or falling back to the real allocator) when it runs dry.
+static struct memdesc *desc_alloc(void) {
+    if (tls_ndescs < 0) {
+        TAILQ_INIT(&tls_descs);
+        tls_ndescs = 0;
+    }
+    if (tls_ndescs == 0) {
+        LOCK(&descriptors_lock);
+        while (tls_ndescs < TLS_DESC_BATCH && !TAILQ_EMPTY(&hdbg.descriptors)) {
+            struct memdesc *d = TAILQ_FIRST(&hdbg.descriptors);
+            TAILQ_REMOVE(&hdbg.descriptors, d, node);
+            TAILQ_INSERT_HEAD(&tls_descs, d, node);
+            tls_ndescs++;
+        }
+        UNLOCK(&descriptors_lock);
+    }
+    if (tls_ndescs == 0)
+        return real_malloc(sizeof (struct memdesc));
+    struct memdesc *desc = TAILQ_FIRST(&tls_descs);
+    TAILQ_REMOVE(&tls_descs, desc, node);
+    tls_ndescs--;
+    return desc;
+}
+
 // prepare a new allocation - guard each side with the magic for an allocated
 // block, and create a descriptor for the allocation to hold its stack trace.
 static inline void build_alloc(void *base, struct guard *guard, size_t size) {
-    struct memdesc *desc;
-    LOCK(&descriptors_lock);
-    if (TAILQ_EMPTY(&hdbg.descriptors)) {
-        UNLOCK(&descriptors_lock);
-        desc = real_malloc(sizeof (struct memdesc) +
-              sizeof (void *) * (hdbg.maxframes - 1));
-    } else {
-        desc = TAILQ_FIRST(&hdbg.descriptors);
-        TAILQ_REMOVE(&hdbg.descriptors, desc, node);
-        UNLOCK(&descriptors_lock);
-    }
+    struct memdesc *desc = desc_alloc();
     guard->desc = desc;
     desc->data = guard;
     desc->len = size;
     desc->base = base;
     set_state(desc, mem_allocated);
-    getstacktrace(desc->stack, hdbg.maxframes);
-
-    LOCK(&heap_lock);
-    desc->serial = hdbg.serial++;
-    hdbg.stats.alloc_total += size;
-    if (hdbg.stats.alloc_total > hdbg.stats.maxmem) {
-        hdbg.stats.maxmem = hdbg.stats.alloc_total;
-        if (hdbg.alloc_limit && hdbg.stats.alloc_total > hdbg.alloc_limit)
-           die("exceeded set memory limit");
-        hdbg.stats.maxmem = hdbg.stats.alloc_total;
-    }
-    TAILQ_INSERT_HEAD(&hdbg.heap, desc, node);
-    UNLOCK(&heap_lock);
+    getstacktrace(stack_scratch, hdbg.maxframes);
+    desc->stackid = intern_stack(stack_scratch);
+
+    desc->serial = __atomic_fetch_add(&hdbg.serial, 1, __ATOMIC_RELAXED);
+    size_t total = __atomic_add_fetch(&hdbg.stats.alloc_total, size, __ATOMIC_RELAXED);
+    size_t maxmem = __atomic_load_n(&hdbg.stats.maxmem, __ATOMIC_RELAXED);
+    while (total > maxmem &&
+          !__atomic_compare_exchange_n(&hdbg.stats.maxmem, &maxmem, total,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (hdbg.alloc_limit && total > hdbg.alloc_limit)
+        die("exceeded set memory limit");
+
+    unsigned si = shard_of(desc);
+    LOCK(&shard_locks[si]);
+    TAILQ_INSERT_HEAD(&hdbg.shards[si].heap, desc, node);
+    UNLOCK(&shard_locks[si]);
     fill(guard + 1, size, 0xbaadf00d);
 }
 
@@ -150,14 +227,33 @@ static inline void build_alloc(void *base, struct guard *guard, size_t size) {
 // them.
 static void free_desc(struct memdesc *desc) {
     sanity_freenode(desc);
-    LOCK(&descriptors_lock);
     if (desc->len >= hdbg.rememberbigger && hdbg.numbig < hdbg.maxbig) {
-       TAILQ_INSERT_TAIL(&hdbg.freebig, desc, node);
-       hdbg.numbig++;
-    } else {
-       TAILQ_INSERT_TAIL(&hdbg.descriptors, desc, node);
+        LOCK(&descriptors_lock);
+        if (hdbg.numbig < hdbg.maxbig) {
+            TAILQ_INSERT_TAIL(&hdbg.freebig, desc, node);
+            hdbg.numbig++;
+            UNLOCK(&descriptors_lock);
+            return;
+        }
+        UNLOCK(&descriptors_lock);
+    }
+    // back to the thread's pool; spill a batch to the shared pool if we've
+    // accumulated too many (e.g. this thread frees what others allocate).
+    if (tls_ndescs < 0) {
+        TAILQ_INIT(&tls_descs);
+        tls_ndescs = 0;
+    }
+    TAILQ_INSERT_HEAD(&tls_descs, desc, node);
+    if (++tls_ndescs > TLS_DESC_MAX) {
+        LOCK(&descriptors_lock);
+        while (tls_ndescs > TLS_DESC_MAX - TLS_DESC_BATCH) {
+            struct memdesc *d = TAILQ_FIRST(&tls_descs);
+            TAILQ_REMOVE(&tls_descs, d, node);
+            TAILQ_INSERT_TAIL(&hdbg.descriptors, d, node);
+            tls_ndescs--;
+        }
+        UNLOCK(&descriptors_lock);
     }
-    UNLOCK(&descriptors_lock);
 }
 
 // Read the state markers at the start and end of a block, and assert they are
@@ -260,21 +356,26 @@ static bool use_hdmp() {
        INTSET(hdmp_maxmem, hdbg.alloc_limit);
        INTSET(hdmp_level, hdbg.level);
     }
+    if (hdbg.maxframes > DBGH_STACKMAX)
+        hdbg.maxframes = DBGH_STACKMAX; // bounded by the interning scratch buffer
 
     // Initialize internal state.
-    TAILQ_INIT(&hdbg.heap);
-    TAILQ_INIT(&hdbg.freelist);
+    for (int i = 0; i < HDBG_NSHARDS; i++) {
+        TAILQ_INIT(&hdbg.shards[i].heap);
+        TAILQ_INIT(&hdbg.shards[i].freelist);
+        pthread_mutex_init(&shard_locks[i], 0);
+    }
     TAILQ_INIT(&hdbg.descriptors);
     TAILQ_INIT(&hdbg.freebig);
     pthread_mutex_init(&descriptors_lock, 0);
-    pthread_mutex_init(&heap_lock, 0);
+    pthread_mutex_init(&stacks_lock, 0);
 
     // Make sure we can lock/unlock mutexes without recursing on malloc (i.e.,
     // while startup != 0)
     LOCK(&descriptors_lock);
     UNLOCK(&descriptors_lock);
-    LOCK(&heap_lock);
-    UNLOCK(&heap_lock);
+    LOCK(&shard_locks[0]);
+    UNLOCK(&shard_locks[0]);
 
     // Find real implementations of heap allocation routines.
 #define SYM(func) real_##func = (func ## _t)dlsym(RTLD_NEXT, #func)
@@ -319,18 +420,20 @@ static void assertheap() {
     if (!hdbg.level || startup)
         return;
 
-    LOCK(&heap_lock);
-    struct memdesc *desc;
-    TAILQ_FOREACH(desc, &hdbg.heap, node)
-        if (get_state(desc) != mem_allocated)
-            die("allocated memory isn't");
-    int count = 0;
-    TAILQ_FOREACH(desc, &hdbg.freelist, node) {
-        sanity_freenode(desc);
-        if (count++ > 64)
-            break;
+    for (int i = 0; i < HDBG_NSHARDS; i++) {
+        LOCK(&shard_locks[i]);
+        struct memdesc *desc;
+        TAILQ_FOREACH(desc, &hdbg.shards[i].heap, node)
+            if (get_state(desc) != mem_allocated)
+                die("allocated memory isn't");
+        int count = 0;
+        TAILQ_FOREACH(desc, &hdbg.shards[i].freelist, node) {
+            sanity_freenode(desc);
+            if (count++ > 64)
+                break;
+        }
+        UNLOCK(&shard_locks[i]);
     }
-    UNLOCK(&heap_lock);
 }
 
 // simple frame-pointer based stack unwind.
@@ -411,7 +514,7 @@ void *malloc(size_t size) {
         return real_malloc(size);
     /* Space for guard at the start, memstate at the end, and size in between */
     struct guard *guard = real_malloc(sizeof *guard + size + sizeof (enum memstate));
-    hdbg.stats.malloc_calls++;
+    __atomic_fetch_add(&hdbg.stats.malloc_calls, 1, __ATOMIC_RELAXED);
     build_alloc(guard, guard, size);
     return guard + 1;
 }
@@ -419,7 +522,7 @@ void *malloc(size_t size) {
 void *aligned_alloc(size_t align, size_t size) {
     if (!use_hdmp())
         return real_aligned_alloc(align, size);
-    hdbg.stats.calloc_calls++;
+    __atomic_fetch_add(&hdbg.stats.calloc_calls, 1, __ATOMIC_RELAXED);
     /*
      * We need an aligned block with space for our guard before it. So, we need
      * to bump the size by the first multiple of align that will accomodate our
@@ -457,29 +560,33 @@ void free(void *p) {
     if (desc->data != guard)
         die("internal integrity error");
 
-    getstacktrace(desc->stack, hdbg.maxframes);
+    getstacktrace(stack_scratch, hdbg.maxframes);
+    desc->stackid = intern_stack(stack_scratch); // record the freeing stack
     fill(desc->data + 1, desc->len, 0xdeaddead);
     set_state(desc, mem_free);
 
-    LOCK(&heap_lock);
+    __atomic_fetch_add(&hdbg.stats.free_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&hdbg.stats.alloc_total, desc->len, __ATOMIC_RELAXED);
 
-    hdbg.stats.free_calls++;
-    hdbg.stats.alloc_total -= desc->len;
-    TAILQ_REMOVE(&hdbg.heap, desc, node);
+    unsigned si = shard_of(desc);
+    struct hdbg_shard *shard = &hdbg.shards[si];
+    LOCK(&shard_locks[si]);
+    TAILQ_REMOVE(&shard->heap, desc, node);
 
-    TAILQ_INSERT_HEAD(&hdbg.freelist, desc, node);
+    TAILQ_INSERT_HEAD(&shard->freelist, desc, node);
     // put this block on the freelist, and extract the oldest block if the list
     // is too big. We will actually free the oldest one now, so we have
     // maintained some hysteresis between the application calling free() and
-    // actually freeing the memory.
-    if (hdbg.freelistsize == hdbg.freelistmax) {
-        desc = TAILQ_LAST(&hdbg.freelist, memdesc_list);
-        TAILQ_REMOVE(&hdbg.freelist, desc, node);
+    // actually freeing the memory. The configured limit is spread over the
+    // shards.
+    if (shard->freelistsize >= hdbg.freelistmax / HDBG_NSHARDS + 1) {
+        desc = TAILQ_LAST(&shard->freelist, memdesc_list);
+        TAILQ_REMOVE(&shard->freelist, desc, node);
     } else {
-        hdbg.freelistsize++;
+        shard->freelistsize++;
         desc = 0;
     }
-    UNLOCK(&heap_lock);
+    UNLOCK(&shard_locks[si]);
 
     if (desc) {
         void *p = desc->base;
@@ -494,7 +601,7 @@ void *realloc(void *p, size_t size) {
     struct guard *guard;
     if (!use_hdmp())
         return real_realloc(p, size);
-    hdbg.stats.realloc_calls++;
+    __atomic_fetch_add(&hdbg.stats.realloc_calls, 1, __ATOMIC_RELAXED);
     if (p) {
         guard = (struct guard *)p - 1;
         olddesc = guard->desc;
@@ -512,7 +619,7 @@ void *realloc(void *p, size_t size) {
 void *calloc(size_t numelem, size_t size) {
     if (!use_hdmp())
        return real_calloc(numelem, size);
-    hdbg.stats.calloc_calls++;
+    __atomic_fetch_add(&hdbg.stats.calloc_calls, 1, __ATOMIC_RELAXED);
     size *= numelem;
     void *p = malloc(size);
     memset(p, 0, size);
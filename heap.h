@@ -11,6 +11,7 @@ enum memstate {
 };
 
 #define DBGH_STACKFRAMES 16
+#define DBGH_STACKMAX 64 /* hard cap on HDMP_STACKDEPTH */
 
 struct memdesc;
 
@@ -37,7 +38,21 @@ struct memdesc {
     size_t len; /* User-requested length of allocated block. */
     struct guard *data; /* Points to data for this descriptor */
     void *base;
-    void * stack[1]; // array of instruction pointers.
+    unsigned stackid; /* id of the interned call stack (see stacknode) */
+};
+
+/*
+ * Call stacks are hash-consed: each distinct frame vector is stored once in
+ * a chained hash table and allocations refer to it by id, since the same few
+ * thousand allocation sites account for millions of live blocks. The
+ * post-mortem tool walks the buckets to rebuild the id mapping.
+ */
+#define HDBG_STACKBUCKETS 4096
+struct stacknode {
+    struct stacknode *next; /* hash chain */
+    unsigned id;
+    unsigned nframes;
+    void *frames[1]; /* instruction pointers, nframes of them */
 };
 
 struct stats {
@@ -50,15 +65,26 @@ struct stats {
     unsigned aligned_alloc_calls;
 };
 
+/*
+ * The live and recently-freed blocks are spread over a fixed set of shards,
+ * each guarded by its own lock (the locks live in heap.c - the post-mortem
+ * tool doesn't need them). A block's shard is chosen from its descriptor's
+ * address, so the free path locks only the shard the allocation lives on.
+ */
+#define HDBG_NSHARDS 64
+struct hdbg_shard {
+    struct memdesc_list heap; /* Active memory */
+    struct memdesc_list freelist; /* Free memory */
+    int freelistsize;
+};
+
 /* This is the structure the post-processing tool grovels for. */
 #define CRASHFRAMES 512
 struct hdbg_info {
-    struct memdesc_list heap; /* Active memory */
-    struct memdesc_list freelist; /* Free memory */
+    struct hdbg_shard shards[HDBG_NSHARDS];
     struct memdesc_list descriptors; /* Free memdescs */
     struct memdesc_list freebig; /* memdescs for big blocks that were free'd */
     int freelistmax;
-    int freelistsize;
     struct stats stats;
     int level;
     unsigned long serial;
@@ -71,5 +97,9 @@ struct hdbg_info {
     size_t maxbig;
     size_t alloc_limit;
     void *crashstack[CRASHFRAMES];
+
+    /* interned call stacks */
+    struct stacknode *stackbuckets[HDBG_STACKBUCKETS];
+    unsigned stackcount;
 };
 #endif
@@ -0,0 +1,302 @@
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include "libpstack/reader.h"
+#include "libpstack/global.h"
+
+using std::string;
+
+size_t httpBlockSize = 64 * 1024;
+
+namespace {
+
+/*
+ * A parsed HTTP response header block: status code plus the handful of
+ * fields we care about. The body is left unread on the socket for the
+ * caller to consume - with pipelined requests there may be several
+ * responses queued behind it.
+ */
+struct Response {
+    int status = 0;
+    Reader::Off contentLength = Reader::Off(-1);
+    Reader::Off totalSize = Reader::Off(-1); // from Content-Range, if present.
+    bool close = false; // server asked to drop the connection after the body.
+};
+
+// Read exactly count bytes from the socket, throwing on EOF or error -
+// header and body lengths are known, so a short read means the server or
+// the network failed us.
+void
+recvAll(int sock, char *ptr, size_t count, const string &url)
+{
+    while (count != 0) {
+        ssize_t rc = ::recv(sock, ptr, count, 0);
+        if (rc == 0)
+            throw (Exception() << "connection to " << url << " closed mid-response");
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            throw (Exception() << "read from " << url << " failed: " << strerror(errno));
+        }
+        ptr += rc;
+        count -= rc;
+    }
+}
+
+// Read the status line and headers of one response. Received a byte at a
+// time so we never consume body bytes - headers are a few hundred bytes,
+// and the body transfer dwarfs the syscall cost.
+Response
+recvHeaders(int sock, const string &url)
+{
+    string block;
+    while (block.size() < 4 ||
+            block.compare(block.size() - 4, 4, "\r\n\r\n") != 0) {
+        char c;
+        recvAll(sock, &c, 1, url);
+        block.push_back(c);
+        if (block.size() > 65536)
+            throw (Exception() << "oversized response header from " << url);
+    }
+    Response res;
+    std::istringstream lines(block);
+    string line;
+    std::getline(lines, line); // status line: HTTP/1.x <code> <reason>
+    auto space = line.find(' ');
+    if (line.compare(0, 5, "HTTP/") != 0 || space == string::npos)
+        throw (Exception() << "malformed response from " << url << ": " << line);
+    res.status = strtol(line.c_str() + space, nullptr, 10);
+    while (std::getline(lines, line) && line != "" && line != "\r") {
+        auto colon = line.find(':');
+        if (colon == string::npos)
+            continue;
+        string field = line.substr(0, colon);
+        for (auto &c : field)
+            c = char(tolower(c));
+        auto value = line.find_first_not_of(' ', colon + 1);
+        if (field == "content-length") {
+            res.contentLength = strtoll(line.c_str() + value, nullptr, 10);
+        } else if (field == "content-range") {
+            // Content-Range: bytes <start>-<end>/<total>
+            auto slash = line.find('/', value);
+            if (slash != string::npos && line[slash + 1] != '*')
+                res.totalSize = strtoll(line.c_str() + slash + 1, nullptr, 10);
+        } else if (field == "connection") {
+            if (line.find("close", value) != string::npos)
+                res.close = true;
+        }
+    }
+    return res;
+}
+
+}
+
+HttpReader::HttpReader(const string &url_)
+    : url(url_)
+    , sock(-1)
+    , contentLength(-1)
+{
+    if (!isUrl(url))
+        throw (Exception() << "unsupported URL '" << url
+                << "': only plain http:// is spoken");
+    auto hostStart = url.find("//") + 2;
+    auto pathStart = url.find('/', hostStart);
+    string authority = url.substr(hostStart,
+            pathStart == string::npos ? string::npos : pathStart - hostStart);
+    path = pathStart == string::npos ? "/" : url.substr(pathStart);
+    auto colon = authority.find(':');
+    if (colon != string::npos) {
+        host = authority.substr(0, colon);
+        port = authority.substr(colon + 1);
+    } else {
+        host = authority;
+        port = "80";
+    }
+    if (host == "")
+        throw (Exception() << "no host in URL " << url);
+    connect(); // fail at construction time, like a FileReader that can't open.
+}
+
+HttpReader::~HttpReader()
+{
+    disconnect();
+}
+
+void
+HttpReader::connect() const
+{
+    struct addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs);
+    if (rc != 0)
+        throw (Exception() << "can't resolve " << host << ": " << gai_strerror(rc));
+    int err = 0;
+    for (auto *a = addrs; a != nullptr; a = a->ai_next) {
+        sock = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock == -1)
+            continue;
+        if (::connect(sock, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        err = errno;
+        ::close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+    if (sock == -1)
+        throw (Exception() << "can't connect to " << host << ":" << port
+                << ": " << strerror(err));
+}
+
+void
+HttpReader::disconnect() const
+{
+    if (sock != -1) {
+        ::close(sock);
+        sock = -1;
+    }
+}
+
+void
+HttpReader::sendRequest(const char *method, Off off, Off end) const
+{
+    if (sock == -1)
+        connect();
+    std::ostringstream req;
+    req << method << " " << path << " HTTP/1.1\r\n"
+        << "Host: " << host << "\r\n"
+        << "User-Agent: pstack\r\n";
+    if (off != Off(-1))
+        req << "Range: bytes=" << off << "-" << end << "\r\n";
+    req << "\r\n";
+    const string &text = req.str();
+    size_t done = 0;
+    while (done < text.size()) {
+        ssize_t rc = ::send(sock, text.data() + done, text.size() - done,
+                MSG_NOSIGNAL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            throw (Exception() << "write to " << url << " failed: " << strerror(errno));
+        }
+        done += rc;
+    }
+}
+
+/*
+ * Consume one response, copying up to count bytes of body into ptr.
+ * Expects a 206 for the range we asked for; tolerates servers that ignore
+ * Range and send a 200 with the whole file (we skim to the offset and drop
+ * the connection after taking our bytes), and treats 416 as a read past
+ * EOF. Caller holds the lock.
+ */
+size_t
+HttpReader::fetch(Off off, size_t count, char *ptr) const
+{
+    auto res = recvHeaders(sock, url);
+    if (res.totalSize != Off(-1))
+        contentLength = res.totalSize;
+    if (res.status == 416) {
+        // requested range entirely past EOF.
+        disconnect(); // any body (an error page) is of unknown shape; start afresh.
+        return 0;
+    }
+    if (res.status != 206 && res.status != 200)
+        throw (Exception() << "HTTP error " << res.status << " from " << url);
+    if (res.contentLength == Off(-1))
+        throw (Exception() << "no content length from " << url
+                << ": can't frame response"); // chunked encoding - not worth speaking.
+    Off skip = 0;
+    Off avail = res.contentLength;
+    if (res.status == 200) {
+        // Range not honoured: the body is the entire file.
+        contentLength = res.contentLength;
+        if (off >= avail) {
+            disconnect();
+            return 0;
+        }
+        skip = off;
+        avail -= off;
+    }
+    char waste[4096];
+    while (skip != 0) {
+        size_t chunk = std::min(Off(sizeof waste), skip);
+        recvAll(sock, waste, chunk, url);
+        skip -= chunk;
+    }
+    size_t got = std::min(Off(count), avail);
+    recvAll(sock, ptr, got, url);
+    if (avail > Off(got)) {
+        // body bytes we didn't want - don't drain the rest of a 50GB file
+        // just to keep the connection alive.
+        disconnect();
+    } else if (res.close) {
+        disconnect();
+    }
+    return got;
+}
+
+size_t
+HttpReader::read(Off off, size_t count, char *ptr) const
+{
+    if (count == 0)
+        return 0;
+    std::lock_guard<std::mutex> guard(mtx);
+    sendRequest("GET", off, off + Off(count) - 1);
+    return fetch(off, count, ptr);
+}
+
+void
+HttpReader::readScatter(ReadRange *ranges, size_t nranges) const
+{
+    // Pipeline the batch: send every range request before reading any
+    // response, so the server (and the network) work on the later fetches
+    // while we consume the earlier ones. Responses come back in request
+    // order. If the server drops the connection partway, fall back to
+    // issuing the remainder one at a time.
+    std::lock_guard<std::mutex> guard(mtx);
+    size_t sent = 0;
+    try {
+        for (; sent < nranges; ++sent)
+            sendRequest("GET", ranges[sent].off,
+                    ranges[sent].off + Off(ranges[sent].count) - 1);
+        for (size_t i = 0; i < nranges; ++i)
+            ranges[i].rc = fetch(ranges[i].off, ranges[i].count, ranges[i].ptr);
+        return;
+    }
+    catch (const Exception &) {
+        disconnect();
+    }
+    for (size_t i = 0; i < nranges; ++i) {
+        try {
+            sendRequest("GET", ranges[i].off, ranges[i].off + Off(ranges[i].count) - 1);
+            ranges[i].rc = fetch(ranges[i].off, ranges[i].count, ranges[i].ptr);
+        }
+        catch (const Exception &) {
+            disconnect();
+            ranges[i].rc = 0;
+        }
+    }
+}
+
+Reader::Off
+HttpReader::size() const
+{
+    std::lock_guard<std::mutex> guard(mtx);
+    if (contentLength == Off(-1)) {
+        sendRequest("HEAD", -1, -1);
+        auto res = recvHeaders(sock, url);
+        if (res.status != 200 || res.contentLength == Off(-1))
+            throw (Exception() << "can't find size of " << url
+                    << ": HTTP status " << res.status);
+        contentLength = res.contentLength;
+        if (res.close)
+            disconnect();
+    }
+    return contentLength;
+}
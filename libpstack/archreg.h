@@ -5,6 +5,7 @@
 #ifdef __i386__
 #define IPREG 8
 #define CFA_RESTORE_REGNO 4
+#define FPREG 5
 REGMAP(0, eax)
 REGMAP(1, ecx)
 REGMAP(2, edx)
@@ -25,6 +26,7 @@ REGMAP(14, xfs)
 #ifdef __amd64__
 #define CFA_RESTORE_REGNO 7
 #define IPREG 16
+#define FPREG 6
 REGMAP(0, rax)
 REGMAP(1, rdx)
 REGMAP(2, rcx)
@@ -91,6 +93,7 @@ REGMAP(59, gs_base)
 #if ELF_BITS == 32
 #define IPREG 15
 #define CFA_RESTORE_REGNO 13
+#define FPREG 11
 
 REGMAP(0, regs[0])
 REGMAP(1, regs[1])
@@ -113,6 +116,7 @@ REGMAP(17, regs[17])
 #else
 #define IPREG 32
 #define CFA_RESTORE_REGNO 31
+#define FPREG 29
 REGMAP(0, regs[0])
 REGMAP(1, regs[1])
 REGMAP(2, regs[2])
@@ -0,0 +1,43 @@
+#ifndef pstack_budget_h
+#define pstack_budget_h
+#include <cstddef>
+#include <list>
+
+/*
+ * A process-wide memory budget over the re-creatable caches: decoded DWARF
+ * units and reader page caches. Clients register on construction and account
+ * the bytes they hold with charge()/release(); once the total passes "limit"
+ * (0, the default, disables the whole mechanism), the least-recently-charged
+ * clients are asked to shed() until the total fits again. Shed data is
+ * re-decoded on demand - an occasional re-decode beats the OOM killer when a
+ * target carries hundreds of debug-rich objects.
+ *
+ * shed() runs with the registry lock held, so implementations must not
+ * block (try_lock their own structures, returning 0 if they lose the race)
+ * and must not call charge()/release() - the registry adjusts the accounting
+ * from the returned byte count. Clients whose data is only ever touched on
+ * the serialized symbolization path register with concurrent=false: they
+ * are only shed by charges made from that same path, and so need no locking
+ * of their own.
+ */
+namespace Budget {
+
+extern size_t limit; // bytes. Set before loading a process.
+
+class Client {
+    mutable size_t held = 0;
+    const bool concurrent;
+    std::list<Client *>::iterator lruHook;
+protected:
+    explicit Client(bool concurrent_);
+    virtual ~Client();
+    void charge(size_t) const;
+    void release(size_t) const;
+public:
+    void touch() const; // mark recently-used without changing the accounting.
+    virtual size_t shed() = 0;
+};
+
+} // Budget namespace
+
+#endif
@@ -1,13 +1,16 @@
 #ifndef DWARF_H
 #define DWARF_H
 
+#include "libpstack/budget.h"
 #include "libpstack/elf.h"
 #include <limits>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <iterator>
@@ -108,6 +111,18 @@ struct Abbreviation {
     using AttrNameMap = std::vector<AttrNameEnt>;
     int nextSibIdx;
     mutable AttrNameMap attrName2Idx; // mutable so we can sort on demand
+    // Precomputed layout: if every form's size is determined by the
+    // abbreviation and the unit's address/offset widths alone (no LEBs,
+    // inline strings or blocks), DIEs using this abbreviation span exactly
+    // totalSize bytes, so their extent - and hence the tree structure - is
+    // known without decoding any attribute data.
+    bool fixedSize = false;
+    size_t totalSize = 0;
+    // Size of each form's encoding, -1 where it depends on the data (LEBs,
+    // inline strings, blocks). Lets us skip over attributes without decoding
+    // them.
+    std::vector<int> formSizes;
+    void computeLayout(uint16_t version, size_t dwarfLen, size_t addrlen);
     Abbreviation(DWARFReader &);
     Abbreviation() {}
 };
@@ -129,6 +144,21 @@ struct PubnameUnit {
     PubnameUnit(DWARFReader &r);
 };
 
+// A parsed name-lookup accelerator section (.debug_names or .gdb_index).
+// Lookups probe the section's own hash table, so resolving a name to the
+// entries defining it needs no unit decode at all. Results carry the unit's
+// debug_info offset, and the DIE's offset within it where the format provides
+// one (.gdb_index only identifies the unit).
+class NameIndex {
+public:
+    struct Result {
+        Elf::Off unitOffset; // offset of the defining unit in .debug_info.
+        Elf::Off dieOffset; // debug_info-relative DIE offset, or 0 for the unit root.
+    };
+    virtual std::vector<Result> lookup(const std::string &name) const = 0;
+    virtual ~NameIndex() = default;
+};
+
 // Data stored in a BLOCK form attribute.
 struct Block {
    Elf::Off offset;
@@ -137,6 +167,24 @@ struct Block {
 
 enum class ContainsAddr { YES, NO, UNKNOWN };
 
+// Bump-pointer arena owning a unit's raw DIE storage. Raw DIEs, their
+// attribute values and block data are placement-allocated from here, so a
+// unit decode is a handful of chunk allocations rather than millions of
+// small ones, and the lot is freed wholesale when the unit is purged (once
+// any outstanding DIE references drop away) or destroyed. Everything stored
+// here must be trivially destructible - nothing runs destructors on the
+// contents.
+class Arena {
+    static constexpr size_t chunkSize = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t used = chunkSize; // bytes consumed in the most recent chunk.
+public:
+    void *allocate(size_t size, size_t align);
+    // approximate footprint, for the memory budget. (Oversized allocations
+    // get their own chunk, and are under-counted - they're rare.)
+    size_t size() const { return chunks.size() * chunkSize; }
+};
+
 
 // Ranges represents a sequence of addresses. The main use is to check if a text
 // address exists in the range, and is therefore associated with some information,
@@ -144,6 +192,10 @@ enum class ContainsAddr { YES, NO, UNKNOWN };
 class Ranges : public std::vector<std::pair<uintmax_t, uintmax_t>> {
    public:
       Ranges(const DIE &, uintmax_t base);
+      // Is addr covered by any of the ranges? Entries are sorted by start
+      // address at construction, so this is a binary search rather than a
+      // scan - rnglist-heavy DWARF5 functions can carry hundreds of entries.
+      bool contains(uintmax_t addr) const;
 };
 
 // An abstract "DIE" -
@@ -177,6 +229,12 @@ class DIE {
     // section for a particular unit.
     static std::shared_ptr<Raw> decode(Unit *unit, const DIE &parent, Elf::Off offset);
 
+    // Skip over the sibling list starting at 'offset' (and over each
+    // sibling's subtree) with a raw cursor, returning the offset just past
+    // its null terminator. Nothing is decoded or cached - used to find a
+    // DIE's next sibling without materializing its descendants.
+    static Elf::Off skipTree(Unit *unit, Elf::Off offset);
+
     // Return the first child of this DIE (used by iterator implementation)
     DIE firstChild() const;
 
@@ -255,6 +313,10 @@ public:
     Attribute attribute(AttrName name, bool local = false) const;
 
     std::string name() const;
+    // As name(), but a view pinned to the string section (or to `backing`
+    // when the section isn't memory-mapped) - no allocation on the common,
+    // mmap-backed path.
+    std::string_view name(std::string &backing) const;
     Attributes attributes() const { return Attributes(*this); }
 
     // Get the DIE's type tag.
@@ -300,9 +362,12 @@ public:
     FileEntry() = default;
     FileEntry(const FileEntry &) = default;
     std::string name;
-    unsigned dirindex;
-    unsigned lastMod;
-    unsigned length;
+    // DWARF5 file tables populate these from the content descriptors that
+    // are actually present, so anything omitted must default to zero rather
+    // than garbage.
+    unsigned dirindex = 0;
+    unsigned lastMod = 0;
+    unsigned length = 0;
     FileEntry(std::string name_, unsigned dirindex, unsigned lastMod_, unsigned length_);
     FileEntry(DWARFReader &r);
 };
@@ -310,7 +375,7 @@ public:
 class LineState {
     LineState() = delete;
 public:
-    FileEntry *file;
+    unsigned file; // index into the LineInfo's files.
     uintmax_t addr;
     unsigned line;
     unsigned column;
@@ -333,7 +398,22 @@ public:
     std::vector<int> opcode_lengths;
     std::vector<std::string> directories;
     std::vector<FileEntry> files;
-    std::vector<LineState> matrix;
+
+    // One row of the compiled line table. The state machine is replayed once
+    // at build time and only what lookups need is kept - a 16-byte record
+    // rather than a full LineState. Rows are sorted by address so queries
+    // binary search. A file of endSequence marks the first address past a
+    // sequence, i.e., a gap in coverage.
+    struct LineRow {
+        uintmax_t addr;
+        uint32_t file; // index into files.
+        uint32_t line;
+    };
+    static constexpr uint32_t endSequence = std::numeric_limits<uint32_t>::max();
+    std::vector<LineRow> rows;
+
+    // Find the row covering addr, or null if no sequence covers it.
+    const LineRow *rowForAddress(uintmax_t addr) const;
     void build(DWARFReader &, Unit &);
 };
 
@@ -344,6 +424,24 @@ class Macros {
     bool visit4(Unit &, MacroVisitor *) const;
     void readD5(const Info &dwarf, intmax_t offset);
     void readD4(const Info &dwarf, intmax_t offset);
+    // One decoded entry of a version-5 macro contribution. The opcode stream
+    // is decoded once per contribution - strings resolved, file tables looked
+    // up - and traversals after the first replay this vector instead.
+    // Imported contributions (GCC emits boost-style transparent includes as
+    // shared DW_MACRO_import targets) are indexed by offset in the owning
+    // Info, so each is decoded once per file, not once per importer per
+    // traversal.
+    struct Entry {
+        enum class Kind : uint8_t { define, undef, startFile, endFile, import };
+        Kind kind;
+        int line = 0;
+        std::string text;          // define/undef
+        std::string directory;     // startFile
+        FileEntry file;            // startFile
+        uintmax_t importOffset = 0; // import
+    };
+    mutable std::unique_ptr<std::vector<Entry>> entries;
+    void decode5(Unit &) const;
     int dwarflen;
     Reader::csptr io;
 public:
@@ -355,7 +453,7 @@ public:
 };
 
 // A (partial-) compilation unit.
-class Unit : public std::enable_shared_from_this<Unit> {
+class Unit : public std::enable_shared_from_this<Unit>, public Budget::Client {
 
     using Abbreviations = std::unordered_map<size_t, Abbreviation>;
 
@@ -380,12 +478,38 @@ class Unit : public std::enable_shared_from_this<Unit> {
     Elf::Off rootOffset;
     Elf::Off abbrevOffset;
     std::unique_ptr<LineInfo> lines;
-    std::unique_ptr<Macros> macros;
+    // Owned by the Info's offset-indexed block cache, so a contribution
+    // shared between units is only decoded once.
+    const Macros *macros = nullptr;
 
     // Previously decoded ranges at a given offset in .debug_ranges / .debug_rnglists
     using RangesForOffset = std::map<Elf::Addr, std::unique_ptr<Ranges>>;
     RangesForOffset rangesForOffset;
 
+    // Interval index over the subprogram and inlined-subroutine DIEs in this
+    // unit, sorted by start address. maxHigh is the largest end address of
+    // this and all preceding entries, bounding how far a containment search
+    // needs to scan left of its binary-search hit.
+    struct FuncRange {
+        Elf::Addr low;
+        Elf::Addr high;
+        Elf::Addr maxHigh;
+        Elf::Off die;
+    };
+    std::unique_ptr<std::vector<FuncRange>> funcRanges;
+    void indexFunctions(const DIE &die);
+
+    // Storage for the raw DIEs in allEntries. DIEs handed out to API
+    // consumers share ownership of the arena, so purging the unit can't
+    // pull the storage out from under them.
+    friend class DIE;
+    std::shared_ptr<Arena> arena = std::make_shared<Arena>();
+
+    // Bytes charged to the memory budget for the decoded DIEs; tracks the
+    // arena footprint, and goes back to zero when the unit is purged.
+    size_t budgeted = 0;
+    size_t dropDecoded(); // purge, returning the bytes that were budgeted.
+
 public:
 
     using sptr = std::shared_ptr<Unit>;
@@ -410,6 +534,7 @@ public:
     ~Unit() noexcept = default;
 
     void purge(); // Remove all "raw" DIEs from allEntries, potentially freeing memory.
+    size_t shed() override; // purge on behalf of the memory budget.
 
     // Is a given DIE the root for this unit?
     bool isRoot(const DIE &die) { return die.getOffset() == rootOffset; }
@@ -433,6 +558,21 @@ public:
     // For _strx forms, indirect through debugStrOffsets to get a string for a
     // specific index.
     std::string strx(size_t idx);
+    std::string_view strx(size_t idx, std::string &backing);
+
+private:
+    // The unit's slice of .debug_str_offsets, located once on first use: the
+    // DW_AT_str_offsets_base attribute decode and section lookup are hoisted
+    // out of the per-access path, and where the section is mmapped the
+    // resolved slice is indexed directly - one bounds-checked load per strx.
+    // (clang's DWARF5 output makes strx the most common string form by far.)
+    bool strxLocated = false;
+    const char *strxSlice = nullptr; // contiguous slice, or null.
+    uintmax_t strxBase = 0;
+    size_t strxCount = 0; // entries between base and section end.
+    void locateStrx();
+
+public:
 
     // addrx forms are similar - indirect through table in .debug_addr.
     uintmax_t addrx(size_t idx);
@@ -440,6 +580,11 @@ public:
     // rnglistx again similar, but more convoluted.
     uintmax_t rnglistx(size_t idx);
 
+    // All subprogram and inlined-subroutine DIEs covering the given address,
+    // in nesting order, outermost first - i.e., the function for a PC
+    // followed by its inline call chain. The first call walks the unit's
+    // tree once to build an interval index; later calls are a binary search.
+    std::vector<DIE> functionsForAddress(Elf::Addr addr);
 };
 
 // A frame-descriptor-entry describes the details of how to unwind the stack
@@ -451,7 +596,7 @@ struct FDE {
     Elf::Off end;
     Elf::Off cieOff;
     std::vector<unsigned char> augmentation;
-    FDE(CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
+    FDE(const CFI *, DWARFReader &, Elf::Off cieOff_, Elf::Off endOff_);
 };
 
 enum RegisterType {
@@ -489,6 +634,30 @@ struct CallFrame {
     // default copy constructor is valid.
 };
 
+// A bounded LRU cache of CallFrames, keyed by the object-relative PC range
+// the unwind row covers. Stack walks repeatedly land in the same functions,
+// so re-executing the CFA instructions per distinct PC wastes most of the
+// unwinder's time; any PC within a cached row is a map lookup instead.
+class CallFrameCache {
+    static constexpr size_t maxEntries = 4096;
+    struct Entry {
+        Elf::Addr start;
+        Elf::Addr end;
+        std::shared_ptr<const CallFrame> frame;
+    };
+    // Unwinds for separate threads may run concurrently; frames are handed
+    // out as shared pointers so an entry evicted by one thread stays alive
+    // for any other still using it.
+    mutable std::mutex lock;
+    std::list<Entry> entries; // most recently used first.
+    std::map<Elf::Addr, std::list<Entry>::iterator> byAddr; // keyed by start.
+public:
+    // Find the cached frame whose row covers addr, or null.
+    std::shared_ptr<const CallFrame> find(Elf::Addr addr);
+    // Cache (and return) the frame for rows covering [start, end).
+    std::shared_ptr<const CallFrame> add(Elf::Addr start, Elf::Addr end, CallFrame frame);
+};
+
 // A CIE is a Common Information Entry, describing attributes of code and some
 // initial location instructions potentially shared by multiple FDEs
 struct CIE {
@@ -508,7 +677,12 @@ struct CIE {
     std::string augmentation;
     CIE(const CFI *, DWARFReader &, Elf::Off);
     CIE() {}
-    CallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr) const;
+    // Execute location instructions from addr up to wantAddr. If rowStart /
+    // rowEnd are given, they receive the PC range over which the result is
+    // valid (rowEnd is "unbounded" if the program ran out of instructions -
+    // the caller should clamp it to the FDE's extent).
+    CallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr,
+            uintmax_t *rowStart = nullptr, uintmax_t *rowEnd = nullptr) const;
 };
 
 /*
@@ -519,15 +693,98 @@ struct CFI {
     Elf::Addr sectionAddr; // virtual address of this section  (may need to be offset by load address)
     Reader::csptr io;
     FIType type;
-    std::map<Elf::Addr, CIE> cies;
-    std::list<FDE> fdeList;
-    CFI(const Info *, Elf::Addr addr, Reader::csptr io, FIType);
+    mutable std::map<Elf::Addr, CIE> cies;
+    // FDEs, sorted by start address so findFDE can binary search. When
+    // .eh_frame_hdr drives lookups this stays empty until decodeAll().
+    mutable std::vector<FDE> fdeList;
+    // When constructed with an .eh_frame_hdr, lookups binary search the
+    // header's pre-sorted table and decode single FDEs on demand rather than
+    // eagerly scanning the whole section.
+    CFI(const Info *, Elf::Addr addr, Reader::csptr io, FIType,
+            Elf::Addr hdrAddr = 0, Reader::csptr hdrIo = nullptr);
     CFI() = delete;
     CFI(const CFI &) = delete;
-    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff); // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
+    Elf::Addr decodeCIEFDEHdr(DWARFReader &, FIType, Elf::Off *cieOff) const; // cieOFF set to -1 if this is CIE, set to offset of associated CIE for an FDE
     const FDE *findFDE(Elf::Addr) const;
-    bool isCIE(Elf::Addr);
+    const CIE *getCIE(Elf::Off) const;
+    bool isCIE(Elf::Addr) const;
     intmax_t decodeAddress(DWARFReader &, int encoding) const;
+    // Decode every CIE and FDE in the section - lookups only need this when
+    // there's no .eh_frame_hdr, but dumping wants the lot.
+    void decodeAll() const;
+private:
+    // Unwinds for separate threads may decode CIEs and FDEs concurrently.
+    mutable std::mutex lock;
+    void decodeAllLocked() const;
+    // Decode the CIE at the given offset into cies, if not already there.
+    // Caller must hold the lock.
+    void addCIE(Elf::Off offset) const;
+    // Geometry of the .eh_frame_hdr search table, when present and usable.
+    Reader::csptr hdrIo;
+    Elf::Addr hdrAddr = 0;
+    Elf::Off searchTable = 0; // offset of the table in .eh_frame_hdr.
+    size_t searchEntries = 0;
+    uint8_t searchEnc = 0;
+    size_t searchEntrySize = 0;
+    mutable std::map<Elf::Off, FDE> fdesByOffset; // FDEs decoded on demand.
+    mutable bool allDecoded = false;
+};
+
+/*
+ * An ORC-style compact unwind table, compiled offline from an object's CFI
+ * (see pstack's --compile-unwind). Each row covers a PC range where the CFA
+ * is a register plus a fixed offset and the return address is saved at a
+ * fixed offset from the CFA - which covers nearly all compiler-generated
+ * code. Rows that can't be expressed that way carry ROW_FULL_CFI, telling
+ * the unwinder to fall back to executing the frame instructions.
+ */
+class CompactUnwind {
+public:
+    struct Row {
+        Elf::Addr pc;      // first (object-relative) address the row covers.
+        int32_t cfaOffset; // CFA = register(cfaReg) + cfaOffset.
+        int32_t raOffset;  // the return address is saved at CFA + raOffset.
+        int32_t fpOffset;  // with ROW_FP_AT, the caller's frame pointer is
+                           // saved at CFA + fpOffset.
+        int16_t cfaReg;
+        uint16_t flags;
+    };
+    static constexpr uint16_t ROW_FULL_CFI = 1;
+    // The caller's frame pointer must be restored from CFA + fpOffset. Rows
+    // without this flag leave the frame pointer untouched. Restoring it
+    // matters beyond this frame: the next frame's CFA rule may well be
+    // frame-pointer based.
+    static constexpr uint16_t ROW_FP_AT = 2;
+    std::vector<Row> rows; // sorted by pc; each row extends to the next.
+    // Find the row covering addr: null if there is none, or if the covering
+    // row needs full CFI treatment.
+    const Row *find(Elf::Addr addr) const;
+    // Build a table covering every FDE in the given call frame information.
+    static CompactUnwind compile(const CFI &);
+};
+
+#define DWARF_OP(op, value, args) op = value,
+enum ExpressionOp {
+#include <libpstack/dwarf/ops.h>
+    LASTOP = 0x100
+};
+#undef DWARF_OP
+
+/*
+ * A DWARF expression pre-decoded into fixed-size (operation, operand) pairs.
+ * LEB128 and fixed-width operands are decoded once when the expression is
+ * first seen, so repeated evaluation is a tight switch over the array with no
+ * Reader involvement. For DW_OP_entry_value, the operand is the count of
+ * immediately-following instructions that form the nested expression.
+ */
+struct CompiledExpression {
+    struct Insn {
+        ExpressionOp op;
+        intmax_t operand;
+    };
+    std::vector<Insn> insns;
+    CompiledExpression() = default;
+    explicit CompiledExpression(DWARFReader &);
 };
 
 class ImageCache;
@@ -585,6 +842,13 @@ public:
 
     const std::list<PubnameUnit> &pubnames() const;
 
+    // Look up DIEs by name through an accelerator table (.debug_names,
+    // .gdb_index, or a hashed index over .debug_pubnames, in that order of
+    // preference). Returns an empty vector if the name isn't present, or if
+    // the image carries none of those sections - callers can then fall back
+    // to a unit walk.
+    std::vector<DIE> namedEntries(const std::string &name) const;
+
     // get a unit, given an offset.
     Unit::sptr getUnit(Elf::Off offset) const;
 
@@ -603,13 +867,21 @@ public:
     // address.
     std::vector<std::pair<std::string, int>> sourceFromAddr(uintmax_t addr) const;
 
+    // Return the pre-decoded form of the DWARF expression at [start, end) in
+    // the given reader, compiling and caching it on first use. Frame-base and
+    // CFA expressions for hot functions are evaluated once per frame, so this
+    // saves re-decoding the operand stream each time.
+    const CompiledExpression &expressionAt(const Reader::csptr &io,
+            Elf::Off start, Elf::Off end) const;
+
     LineInfo *linesAt(intmax_t, Unit &) const;
+    const Macros *macrosAt(intmax_t offset, int version) const;
 
     // The ELF object this DWARF data is associated with
     const Elf::Object::sptr elf;
 
-    // Cached call frames for specific return addresses.
-    std::map<Elf::Addr, CallFrame> callFrameForAddr;
+    // Cached unwind rows for return addresses seen during stack walks.
+    CallFrameCache callFrames;
 
 
     // Get decoded call frame information from .debug_frame section
@@ -620,6 +892,15 @@ public:
     // Get best of above.
     CFI *getCFI() const;
 
+    // The compact unwind table for this image, if one was previously built
+    // with compileCompactUnwind(); null otherwise.
+    const CompactUnwind *compactUnwind() const;
+
+    // Compile this image's CFI into a compact unwind table, stored in the
+    // user's cache directory keyed by build-id. Returns false if the image
+    // has no CFI or build-id, or caching is disabled.
+    bool compileCompactUnwind() const;
+
     // direct access to various DWARF sections.
     const Elf::Section & debugInfo;
     const Elf::Section & debugStrings;
@@ -636,19 +917,54 @@ private:
     // These are mutable so we can lazy-eval them when getters are called, and
     // maintain logical constness.
     mutable std::unique_ptr<std::list<PubnameUnit>> pubnameUnits { nullptr };
+    mutable std::unique_ptr<NameIndex> nameIndex;
+    mutable bool nameIndexLoaded { false };
     mutable std::map<Elf::Off, Unit::sptr> units;
+    // Memoized sourceFromAddr results; misses are cached as empty vectors.
+    mutable std::unordered_map<uintmax_t,
+        std::vector<std::pair<std::string, int>>> sourceForAddr;
+    // Compiled DWARF expressions, keyed by the reader and offset they were
+    // decoded from.
+    mutable std::map<std::pair<const Reader *, Elf::Off>,
+        CompiledExpression> expressions;
     mutable Info::sptr altDwarf;
     mutable std::unique_ptr<ARanges> aranges; // maps starting address to length + unit offset.
     mutable std::unique_ptr<Macros> macros;
+    // Macro contributions indexed by (section offset, version) - shared
+    // between the units whose DW_AT_macros point at them and between
+    // DW_MACRO_import sites, so each block is parsed at most once.
+    mutable std::map<std::pair<Elf::Off, int>, std::unique_ptr<Macros>> macroBlocks;
     mutable std::unique_ptr<CFI> debugFrame;
     mutable std::unique_ptr<CFI> ehFrame;
+    mutable std::unique_ptr<CompactUnwind> orcTable;
+    mutable bool orcLoaded { false };
+    // Guards the lazily-constructed state above. Batch dumps share Info
+    // objects for common DSOs across worker threads, so the symbolize-side
+    // caches (units, aranges, the sourceFromAddr memo, pubnames) need
+    // guarding just like the unwind-side ones (CFI construction, the compact
+    // unwind table, compiled expressions). Recursive because the lazy
+    // builders nest: lookupUnit synthesizes aranges via getUnits and
+    // getUnit.
+    mutable std::recursive_mutex lazyLock;
 
     mutable bool altImageLoaded { false };
     mutable bool unitRangesCached { false };
+    mutable bool allUnitsDecoded { false };
     mutable bool debugFrameLoaded { false };
     mutable bool ehFrameLoaded = { false };
 
     void decodeARangeSet(DWARFReader &) const;
+    // Populate the unit cache for the entire .debug_info section, decoding
+    // the units' abbreviations and root DIEs on multiple threads when the
+    // debug data is memory-backed. Used by getUnits() so full sweeps don't
+    // serialize on the decode.
+    void decodeAllUnits() const;
+    // When .debug_aranges is absent, build the equivalent index from each
+    // unit's root DIE (in parallel where the debug data is memory-backed),
+    // and persist it keyed by build-id so later runs skip the unit sweep.
+    void synthesizeARanges() const;
+    bool loadARangesIndex() const;
+    void saveARangesIndex() const;
     std::string getAltImageName() const;
 };
 
@@ -659,11 +975,13 @@ private:
 class ImageCache : public Elf::ImageCache {
     int dwarfHits;
     int dwarfLookups;
+    std::mutex mtx;
     std::map<Elf::Object::sptr, Info::sptr> dwarfCache;
 public:
     Info::sptr getDwarf(const std::string &);
     Info::sptr getDwarf(Elf::Object::sptr);
     void flush(Elf::Object::sptr);
+    std::ostream &dumpStats(std::ostream &) const override;
     ImageCache();
     ~ImageCache() noexcept;
 };
@@ -676,7 +994,7 @@ class DIE::Attribute {
     friend class DIE::Raw;
     // A generic value.
     union Value {
-        Value(DWARFReader &, const FormEntry &form, Unit *);
+        Value(DWARFReader &, const FormEntry &form, Unit *, Arena &);
         uintmax_t addr;
         uintmax_t signature;
         uintmax_t udata;
@@ -694,6 +1012,10 @@ public:
 
     bool valid() const { return formp != nullptr; }
     explicit operator std::string() const;
+    // Zero-copy access for string forms: a view into the string section when
+    // it is contiguous in memory, materialized into `backing` otherwise.
+    // Materialize (via the std::string conversion) only at output boundaries.
+    std::string_view stringView(std::string &backing) const;
     explicit operator intmax_t() const;
     explicit operator uintmax_t() const;
     explicit operator bool() const { return valid() && value().flag; }
@@ -777,13 +1099,6 @@ inline
 Info::Units::iterator::iterator(const Info *info_, Elf::Off offset)
     : info(info_), currentUnit(info->getUnit(offset)) {}
 
-#define DWARF_OP(op, value, args) op = value,
-enum ExpressionOp {
-#include <libpstack/dwarf/ops.h>
-    LASTOP = 0x100
-};
-#undef DWARF_OP
-
 #define DWARF_EH_PE(op, value) op = value,
 enum ExceptionHandlingEncoding {
 #include "libpstack/dwarf/ehpe.h"
@@ -12,43 +12,80 @@ namespace Dwarf {
 class DWARFReader {
     Elf::Off off;
     Elf::Off end;
+    // Sequential decode is the common case, so rather than paying a virtual
+    // read on the underlying reader for every byte, halfword, and LEB we
+    // decode, pin a zero-copy pointer when the backing store is contiguous in
+    // memory, and otherwise stage data through a small refillable buffer.
+    static constexpr size_t BUFSIZE = 128;
+    const unsigned char *flat;
+    unsigned char buffer[BUFSIZE];
+    Elf::Off bufStart = 0;
+    size_t bufLen = 0;
+    // Return a pointer to `count` bytes of content at the current offset, or
+    // nullptr if the caller must fall back to the virtual read interface.
+    const unsigned char *cursor(size_t count) {
+        if (off + count > end)
+            return nullptr;
+        if (flat != nullptr)
+            return flat + off;
+        if (count > BUFSIZE)
+            return nullptr;
+        if (off < bufStart || off + count > bufStart + bufLen) {
+            size_t want = size_t(std::min(Elf::Off(BUFSIZE), end - off));
+            try {
+                bufLen = io->read(off, want, (char *)buffer);
+            }
+            catch (const Exception &) {
+                bufLen = 0;
+            }
+            bufStart = off;
+            if (bufLen < count)
+                return nullptr;
+        }
+        return buffer + (off - bufStart);
+    }
 public:
     ::Reader::csptr io;
     unsigned addrLen;
     DWARFReader(Reader::csptr io_, Elf::Off off_ = 0, size_t end_ = std::numeric_limits<size_t>::max())
         : off(off_)
         , end(end_ == std::numeric_limits<size_t>::max() ? io_->size() : end_)
+        , flat((const unsigned char *)io_->contiguous(0, end))
         , io(std::move(io_))
         , addrLen(ELF_BITS / 8)
         {
         }
     void getBytes(size_t size, unsigned char *to) {
-       io->readObj(off, to, size);
+       auto p = cursor(size);
+       if (p != nullptr)
+          memcpy(to, p, size);
+       else
+          io->readObj(off, to, size);
        off += size;
     }
     uint32_t getu32() {
         unsigned char q[4];
-        io->readObj(off, q, 4);
-        off += sizeof q;
+        getBytes(sizeof q, q);
         return q[0] | q[1] << 8 | q[2] << 16 | uint32_t(q[3] << 24);
     }
     uint16_t getu16() {
         unsigned char q[2];
-        io->readObj(off, q, 2);
-        off += sizeof q;
+        getBytes(sizeof q, q);
         return q[0] | q[1] << 8;
     }
     uint8_t getu8() {
+        auto p = cursor(1);
+        if (p != nullptr) {
+            off++;
+            return *p;
+        }
         unsigned char q;
         io->readObj(off, &q, 1);
         off++;
         return q;
     }
     int8_t gets8() {
-        int8_t q;
-        io->readObj(off, &q, 1);
-        off += 1;
-        return q;
+        return int8_t(getu8());
     }
     uintmax_t getuint(int len) {
         uintmax_t rc = 0;
@@ -56,8 +93,7 @@ public:
         uint8_t bytes[16];
         if (len > 16)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getBytes(len, bytes);
         uint8_t *p = bytes + len;
         for (i = 1; i <= len; i++)
             rc = rc << 8 | p[-i];
@@ -69,8 +105,7 @@ public:
         uint8_t bytes[16];
         if (len > 16 || len < 1)
             throw Exception() << "can't deal with ints of size " << len;
-        io->readObj(off, bytes, len);
-        off += len;
+        getBytes(len, bytes);
         uint8_t *p = bytes + len;
         rc = (p[-1] & 0x80) ? -1 : 0;
         for (i = 1; i <= len; i++)
@@ -79,11 +114,26 @@ public:
     }
 
     uintmax_t getuleb128() {
+        // a LEB for a 64-bit value is at most 10 bytes - decode from local
+        // memory when we can get that much, and fall back to the reader when
+        // close to the end of the section.
+        auto p = cursor(10);
+        if (p != nullptr) {
+            auto v = readleb128_swar<uintmax_t>(p);
+            off += v.second;
+            return v.first;
+        }
         auto v = io->readULEB128(off);
         skip(v.second);
         return v.first;
     }
     intmax_t getsleb128() {
+        auto p = cursor(10);
+        if (p != nullptr) {
+            auto v = readleb128_swar<intmax_t>(p);
+            off += v.second;
+            return v.first;
+        }
         auto v = io->readSLEB128(off);
         skip(v.second);
         return v.first;
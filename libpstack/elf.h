@@ -41,6 +41,10 @@
 #include <list>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <array>
+#include <chrono>
+#include <mutex>
 #include <memory>
 #include <limits>
 #include <optional>
@@ -214,11 +218,18 @@ const Sym &undef();
 // an index into the version table. This is essentially an augmentation of the
 // Elf{32_64}_Sym - store it alongside here for ease of use.
 struct VersionedSymbol : public Sym {
-   int versionIdx;
-   VersionedSymbol() : Sym(undef()), versionIdx(-1) {}
-   VersionedSymbol(const Sym &sym_, const Section &versionInfo, size_t idx);
-   bool isHidden() const { return versionIdx != -1 && ((versionIdx & 0x8000) != 0 || versionIdx == 0); }
-   bool isVersioned() const { return (versionIdx & 0x7fff) > 1; }
+   VersionedSymbol() : Sym(undef()), versionInfo(nullptr), symIdx(0) {}
+   VersionedSymbol(const Sym &sym_, const Section &versionInfo_, size_t idx)
+      : Sym(sym_), versionInfo(&versionInfo_), symIdx(idx) {}
+   // Index into the version table, fetched from the adjunct section on first
+   // use: most consumers (address indexing, name lookups) never ask for it.
+   int versionIdx() const;
+   bool isHidden() const { return versionIdx() != -1 && ((versionIdx() & 0x8000) != 0 || versionIdx() == 0); }
+   bool isVersioned() const { return (versionIdx() & 0x7fff) > 1; }
+private:
+   const Section *versionInfo;
+   size_t symIdx;
+   mutable int versionIdx_ = -2; // -2: not fetched yet.
 };
 
 /*
@@ -278,13 +289,23 @@ public:
     // object, or the associated debug ELF object.
     const Section &getDebugSection(const std::string &name, Word type) const;
 
-    std::map<int, std::vector<Dyn>> dynamic;
+    mutable std::map<int, std::vector<Dyn>> dynamic;
 
     // Accessing segments.
     const ProgramHeaders &getSegments(Word type) const;
     const std::map<Elf::Word, ProgramHeaders> &getAllSegments() const;
 
     std::optional<std::pair<Sym, std::string>> findSymbolByAddress(Addr addr, int type);
+    // Build (and persist, when the image has a build-id) the sorted symbol
+    // address index without performing a lookup - used by --warm to prestage
+    // the cache from a deploy pipeline. The --warm workers (and batch
+    // dumps) share Objects for common DSOs, so the check-then-build is
+    // locked; once built the index is immutable.
+    void warmAddrIndex() {
+        std::lock_guard<std::mutex> guard(addrIndexLock);
+        if (!addrIndexBuilt)
+            buildAddrIndex();
+    }
     VersionedSymbol findDynamicSymbol(const std::string &name);
     Sym findDebugSymbol(const std::string &name);
 
@@ -292,6 +313,9 @@ public:
 
     // Misc operations
     std::string getInterpreter() const;
+    // The GNU build-id note content as a lowercase hex string, or "" if the
+    // image carries no such note.
+    std::string getBuildID() const;
     const Ehdr &getHeader() const { return elfHeader; }
     const Phdr *getSegmentForAddress(Off) const;
     Notes notes() const { return Notes(this); }
@@ -304,15 +328,21 @@ public:
     SymbolSection<Sym> *debugSymbols();
     SymbolSection<VersionedSymbol> * dynamicSymbols();
     const SymbolVersioning *symbolVersions() const;
-    const Section *gnu_version;
+    mutable const Section *gnu_version;
+    // All section headers, parsing them if needed.
+    const SectionHeaders &getSections() const { loadSections(); return sectionHeaders; }
 private:
     mutable std::unique_ptr<SymbolVersioning> symbolVersions_;
     // Elf header, section headers, program headers.
     mutable Object::sptr debugData;
     Ehdr elfHeader;
     ImageCache &imageCache;
-    SectionHeaders sectionHeaders;
-    std::map<std::string, size_t> namedSection;
+    // Section headers and their derivatives are parsed on first use - see
+    // loadSections().
+    mutable bool sectionsLoaded = false;
+    mutable SectionHeaders sectionHeaders;
+    mutable std::map<std::string, size_t> namedSection;
+    void loadSections() const;
     std::map<Word, ProgramHeaders> programHeaders;
 
     std::unique_ptr<SymbolSection<Sym>> debugSymbols_;
@@ -347,12 +377,27 @@ private:
 
     Object *getDebug() const; // Gets linked debug object. Note that getSection indirects through this.
     friend std::ostream &::operator<< (std::ostream &, const JSON<Elf::Object> &);
-    struct CachedSymbol {
-        enum { SYM_FOUND, SYM_NOTFOUND, SYM_NEW } disposition;
+    // name index over debugSymbols(), built on first lookup by name.
+    std::unique_ptr<std::unordered_map<std::string, Sym>> debugNames_;
+
+    // Sorted address index over the debug and dynamic symbol tables, built
+    // on the first findSymbolByAddress query, so each query is a binary
+    // search rather than a walk over the tables.
+    struct AddrSym {
         Sym sym;
-        CachedSymbol() : disposition { SYM_NEW } {}
+        Addr maxEnd; // highest (st_value + st_size) at or before this entry.
+        bool dynamic; // which table the symbol came from, for naming it.
+        bool alloc; // the symbol's section is SHF_ALLOC.
     };
-    std::map<std::string, CachedSymbol> cachedSymbols;
+    std::vector<AddrSym> addrIndex;
+    bool addrIndexBuilt = false;
+    std::mutex addrIndexLock; // guards the lazy build of addrIndex.
+    void buildAddrIndex();
+    // Persistent copy of addrIndex, keyed by build-id under the user's cache
+    // directory. Both fail soft: a damaged or missing cache just means we
+    // build the index from the symbol tables as usual.
+    bool loadAddrIndex();
+    void saveAddrIndex() const;
     mutable const Phdr *lastSegmentForAddress; // cache of last segment returned for a specific address.
 };
 
@@ -444,14 +489,32 @@ extern std::vector<std::string> globalDebugDirectories;
  * links, hard links, or canonicalization of filenames. (XXX: do this with stat
  * & st_ino + st_dev)
  */
+/*
+ * Caches named ELF images. The cache is sharded by a hash of the image path,
+ * with a lock per shard, so concurrent loads only contend when their paths
+ * hash together; images themselves are built outside the locks. Each shard
+ * keeps its own lookup/hit counts and cumulative image-load time, visible
+ * via dumpStats().
+ */
 class ImageCache {
-    std::map<std::string, Object::sptr> cache;
-    int elfHits;
-    int elfLookups;
+    static constexpr size_t SHARDCOUNT = 16;
+    struct Shard {
+        std::mutex mtx;
+        std::map<std::string, Object::sptr> cache;
+        int hits = 0;
+        int lookups = 0;
+        int loads = 0;
+        std::chrono::microseconds loadTime{0};
+    };
+    mutable std::array<Shard, SHARDCOUNT> shards;
+    Shard &shardFor(const std::string &name) const {
+        return shards[std::hash<std::string>()(name) % SHARDCOUNT];
+    }
 public:
     ImageCache();
     virtual ~ImageCache() noexcept;
     virtual void flush(Object::sptr);
+    virtual std::ostream &dumpStats(std::ostream &) const;
     Object::sptr getImageForName(const std::string &name, bool isDebug = false);
     Object::sptr getImageIfLoaded(const std::string &name);
     Object::sptr getDebugImage(const std::string &name);
@@ -1,24 +1,35 @@
 #include <exception>
+#include <memory>
 #include <sstream>
 
+// The message text is assembled lazily: no stream exists until the first
+// item is inserted into the exception, and the formatted string is only
+// materialized when what() is called. Code that throws and catches these for
+// control flow without ever rendering the message doesn't pay for an
+// ostringstream.
 class Exception : public std::exception {
-    mutable std::ostringstream str;
+    mutable std::unique_ptr<std::ostringstream> str;
     mutable std::string intermediate;
 public:
     Exception() throw() {
     }
 
     Exception(const Exception &rhs) throw() {
-        str << rhs.str.str();
+        if (rhs.str != nullptr)
+            getStream() << rhs.str->str();
     }
 
     ~Exception() throw () = default;
 
     const char *what() const throw() {
-        intermediate = str.str();
+        intermediate = str != nullptr ? str->str() : "";
         return intermediate.c_str();
     }
-    std::ostream &getStream() const { return str; }
+    std::ostream &getStream() const {
+        if (str == nullptr)
+            str.reset(new std::ostringstream());
+        return *str;
+    }
     typedef void IsStreamable;
     template <typename T>
     const Exception &operator << (const T& o) const {
@@ -11,6 +11,11 @@ std::string dirname(const std::string &);
 std::string basename(const std::string &);
 std::string linkResolve(std::string name);
 int openfile(const std::string &filename, int mode = O_RDONLY, int umask = 0777);
+// Directory for pstack's persistent index caches: $PSTACK_CACHE_DIR if set
+// (empty disables caching), else the XDG cache location. makedirs creates a
+// directory and any missing parents, best-effort.
+std::string cacheDirectory();
+void makedirs(const std::string &path);
 
 extern std::vector<std::pair<std::string, std::string>> pathReplacements;
 #endif // LIBPSTACK_UTIL_H
@@ -6,6 +6,8 @@
 #include <type_traits>
 #include <cstdint>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <typeinfo>
 #include <map>
 #include <iomanip>
@@ -73,9 +75,41 @@ operator << (std::ostream &os, const JSON<unsigned char, C>&json) {
    return os << int(json.object);
 }
 
+/*
+ * Integral values bypass the locale-aware num_put machinery: dumps are
+ * integer-dense, and producing the digits into a stack buffer and appending
+ * them with a single write is far cheaper than a facet call per token.
+ */
 template <typename T, typename C>
 typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, unsigned char>::value, std::ostream>::type &
-operator << (std::ostream &os, const JSON<T, C>&json) { return os << json.object; }
+operator << (std::ostream &os, const JSON<T, C>&json) {
+   char buf[24]; // fits a sign plus the digits of 2^64
+   char *end = buf + sizeof buf;
+   char *p = end;
+   typename std::make_unsigned<T>::type uv = json.object;
+   if constexpr (std::is_signed<T>::value)
+      if (json.object < 0)
+         uv = ~uv + 1; // negate in the unsigned domain: T's minimum is fine.
+   do {
+      *--p = char('0' + uv % 10);
+      uv /= 10;
+   } while (uv != 0);
+   if constexpr (std::is_signed<T>::value)
+      if (json.object < 0)
+         *--p = '-';
+   os.write(p, end - p);
+   return os;
+}
+
+/*
+ * A printer for JSON floating point values.
+ */
+template <typename T, typename C>
+typename std::enable_if<std::is_floating_point<T>::value, std::ostream>::type &
+operator << (std::ostream &os, const JSON<T, C> &json) {
+   char buf[32];
+   return os.write(buf, snprintf(buf, sizeof buf, "%g", double(json.object)));
+}
 
 /*
  * A printer for JSON boolean types: print "true" or "false"
@@ -184,12 +218,54 @@ struct JSONEncodingError : public std::exception {
    JSONEncodingError(std::string &&rhs) : msg(std::move(rhs)) {}
 };
 
+/*
+ * True if any byte in the word needs escaping: a control character, '"',
+ * '\\', or a high bit set (the start of a multibyte sequence). Portable
+ * word-at-a-time byte tests - the strings we print are almost always plain
+ * symbol names, so whole words pass this at once.
+ */
+inline bool
+escapeNeeded(uint64_t w)
+{
+    constexpr uint64_t ones = 0x0101010101010101ULL;
+    constexpr uint64_t highs = 0x8080808080808080ULL;
+    auto hasZeroByte = [](uint64_t v) { return ((v - ones) & ~v & highs) != 0; };
+    return (w & highs) != 0
+        || ((w - ones * 0x20) & ~w & highs) != 0 // any byte < 0x20
+        || hasZeroByte(w ^ ones * '"')
+        || hasZeroByte(w ^ ones * '\\');
+}
+
 inline std::ostream & operator << (std::ostream &o, const Escape &escape)
 {
     auto flags(o.flags());
-    for (auto i = escape.value.begin(); i != escape.value.end();) {
+    const char *p = escape.value.data();
+    size_t len = escape.value.size();
+    for (size_t i = 0; i < len;) {
+        // Find the longest run needing no escapes - a word at a time, then
+        // byte by byte into the word that stopped us - and emit it with a
+        // single write.
+        size_t run = i;
+        uint64_t w;
+        while (run + sizeof w <= len) {
+            memcpy(&w, p + run, sizeof w);
+            if (escapeNeeded(w))
+                break;
+            run += sizeof w;
+        }
+        while (run < len) {
+            auto uc = (unsigned char)p[run];
+            if (uc < 0x20 || uc >= 0x80 || uc == '"' || uc == '\\')
+                break;
+            ++run;
+        }
+        if (run != i) {
+            o.write(p + i, run - i);
+            i = run;
+            continue;
+        }
         int c;
-        switch (c = (unsigned char)*i++) {
+        switch (c = (unsigned char)p[i++]) {
             case '\b': o << "\\b"; break;
             case '\f': o << "\\f"; break;
             case '\n': o << "\\n"; break;
@@ -211,7 +287,9 @@ inline std::ostream & operator << (std::ostream &o, const Escape &escape)
                         v &= ~mask;
                     }
                     while (--count) {
-                        c = (unsigned char)*i++;
+                        if (i == len)
+                            throw JSONEncodingError("truncated multibyte sequence");
+                        c = (unsigned char)p[i++];
                         if ((c & 0xc0) != 0x80)
                             throw JSONEncodingError("illegal character in multibyte sequence");
                         v = (v << 6) | (c & 0x3f);
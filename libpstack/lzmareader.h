@@ -9,6 +9,11 @@
 /*
  * Provides an LZMA-decoded view of downstream. LZMA API allows random-access
  * to the data, and we cache each decompressed block as we decode it.
+ *
+ * For streams up to a size threshold, the first access decompresses the
+ * entire stream once into an anonymous mapping, and all further reads (and
+ * contiguous() requests) are served zero-copy from that; larger streams stay
+ * on the block-at-a-time path.
  */
 class LzmaReader : public Reader {
     LzmaReader(const LzmaReader &) = delete;
@@ -18,10 +23,15 @@ class LzmaReader : public Reader {
     size_t pos = 0;
     Reader::csptr upstream;
     mutable std::map<Off, std::vector<unsigned char>> lzBlocks;
+    mutable char *whole = nullptr;
+    const char *flatten() const;
+    void decodeBlock(Off compressedOff, size_t compressedSize, char *out, size_t outSize) const;
+    size_t readBlockwise(Off, size_t, char *) const;
 public:
     LzmaReader(Reader::csptr upstream_);
     ~LzmaReader();
     size_t read(Off, size_t, char *) const override;
+    const char *contiguous(Off off, Off length) const override;
     void describe(std::ostream &) const override;
     Off size() const override;
     std::string filename() const override { return upstream->filename(); }
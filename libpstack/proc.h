@@ -7,7 +7,9 @@ extern "C" {
 #include <thread_db.h>
 }
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <functional>
@@ -32,7 +34,11 @@ public:
     ExpressionStack(): isReg(false) {}
     Elf::Addr poptop() { Elf::Addr tos = top(); pop(); return tos; }
     Elf::Addr eval(const Process &, DWARFReader &r, const StackFrame*, Elf::Addr);
+    Elf::Addr eval(const Process &, const CompiledExpression &, const StackFrame*, Elf::Addr);
     Elf::Addr eval(const Process &, const DIE::Attribute &, const StackFrame*, Elf::Addr);
+private:
+    Elf::Addr evalInsns(const Process &, const CompiledExpression &,
+          size_t begin, size_t end, const StackFrame *, Elf::Addr);
 };
 
 // this works for i386 and x86_64 - might need to change for other archs.
@@ -51,6 +57,11 @@ enum class UnwindMechanism {
    // frame pointer register in previous frame.
    FRAMEPOINTER,
 
+   // walked directly along the frame-pointer chain without consulting CFI,
+   // each hop validated against the address-space map. Only used when fast
+   // frame-pointer unwinding is requested.
+   FP_CHAIN,
+
    // attempt was made to recover stack state by assuming the previous frame
    // was target of a call to a bad address
    BAD_IP_RECOVERY,
@@ -64,6 +75,10 @@ enum class UnwindMechanism {
    // The stack frame was built up by scanning a log file.
    LOGFILE,
 
+   // No unwind info existed for the address (PLT stub, JIT-generated code,
+   // asm leaf); a cached per-region heuristic rule was applied instead.
+   HEURISTIC,
+
    INVALID,
 };
 
@@ -75,7 +90,10 @@ struct CodeLocation {
     Info::sptr dwarf_;
     const Elf::Phdr *phdr_;
     mutable const CIE *cie_;
-    mutable const FDE *fde_;
+    // atomic: a CodeLocation is shared by every frame at the same PC, and
+    // those frames may be unwound concurrently. The resolution is
+    // idempotent, so a benign race just computes it twice.
+    mutable std::atomic<const FDE *> fde_;
     mutable const CFI *cfi_;
     CallFrame frame_;
     mutable Dwarf::DIE die_;
@@ -120,12 +138,15 @@ class StackFrame {
 public:
     Elf::Addr rawIP() const;
     Dwarf::ProcessLocation scopeIP(const Process &) const;
-    Elf::CoreRegisters regs;
+    // The register set lives in the owning ThreadStack's frame arena
+    // (ThreadStack::addFrame allocates it), so the frame itself is a few
+    // words and trivially copyable: growing the frame vector moves
+    // pointers, not register sets.
+    Elf::CoreRegisters *regs;
     Elf::Addr cfa;
     UnwindMechanism mechanism;
     bool isSignalTrampoline;
-    StackFrame(UnwindMechanism mechanism, const Elf::CoreRegisters &regs);
-    StackFrame &operator = (const StackFrame &) = delete;
+    StackFrame(UnwindMechanism mechanism, Elf::CoreRegisters *regs);
     std::optional<Elf::CoreRegisters> unwind(Process &);
     void setCoreRegs(const Elf::CoreRegisters &);
     void getCoreRegs(Elf::CoreRegisters &) const;
@@ -134,13 +155,22 @@ public:
 
 }
 
+struct PstackOptions;
+
 struct ThreadStack {
     td_thrinfo_t info;
+    // Bump-allocated backing store for the frames' register sets. getStacks
+    // shares one arena between all the stacks a worker unwinds, so a whole
+    // dump makes a handful of chunk allocations where each frame used to
+    // carry (and copy) its own register block.
+    std::shared_ptr<Dwarf::Arena> frameArena;
     std::vector<Dwarf::StackFrame> stack;
     ThreadStack() {
         memset(&info, 0, sizeof info);
     }
-    void unwind(Process &, Elf::CoreRegisters &regs, unsigned maxFrames);
+    // Copy regs into the frame arena and append a frame referring to them.
+    Dwarf::StackFrame &addFrame(Dwarf::UnwindMechanism, const Elf::CoreRegisters &);
+    void unwind(Process &, Elf::CoreRegisters &regs, const PstackOptions &, unsigned maxFrames);
 };
 
 struct PstackOptions {
@@ -148,6 +178,17 @@ struct PstackOptions {
    bool doargs = false;
    bool dolocals = false;
    bool nothreaddb = false;
+   // Demangle C++ symbol names when printing frames.
+   bool demangle = false;
+   // Walk the frame-pointer chain directly rather than executing CFI for
+   // each frame, falling back to DWARF per-frame when the chain looks
+   // inconsistent. Much cheaper for -fno-omit-frame-pointer builds.
+   bool fpunwind = false;
+   // Copy each thread's registers and the top of its stack while stopped,
+   // then resume the target and unwind against the snapshot. Keeps the pause
+   // proportional to the memcpy, not to DWARF complexity; reads outside the
+   // captured stacks fall through to the (now running) process.
+   bool snapshot = false;
    int maxdepth = std::numeric_limits<int>::max();
    std::ostream *output = &std::cout;
 };
@@ -182,7 +223,17 @@ class Process : public ps_prochandle {
     Elf::Addr entry;
     Elf::Addr interpBase;
     void loadSharedObjects(Elf::Addr);
+    // Where we found r_debug, and the load addresses seen on the last
+    // link-map walk - used by rescanSharedObjects to detect dlopen/dlclose
+    // between samples without reloading anything.
+    Elf::Addr rdebugAddr = 0;
+    std::vector<Elf::Addr> linkMapSignature;
 public:
+    // Cheap steady-state check for repeated sampling (pstack -b): walk the
+    // link-map chain reading only the link_map nodes, and reload the shared
+    // objects only if the chain changed since the last scan. All Elf/Dwarf
+    // state is reused otherwise, so a sample costs just stop + unwind.
+    void rescanSharedObjects();
     Elf::Addr vdsoBase;
     virtual Elf::Addr findRDebugAddr();
 
@@ -201,6 +252,44 @@ public:
     std::map<pid_t, Lwp> lwps;
     Dwarf::ImageCache &imageCache;
     std::map<Elf::Addr, Elf::Object::sptr> objects;
+    // Flat, sorted table of the loaded objects' PT_LOAD extents, rebuilt as
+    // objects are added. Unwinding classifies nearly every address through
+    // findSegment, so a binary search over one contiguous array (plus a
+    // last-hit cache - consecutive lookups are strongly local) replaces
+    // walking the object map and then each object's program headers.
+    struct MappedSegment {
+        Elf::Addr start;
+        Elf::Addr end;
+        Elf::Addr reloc;
+        Elf::Object::sptr obj;
+        const Elf::Phdr *phdr;
+    };
+    std::vector<MappedSegment> segments;
+    mutable std::atomic<size_t> lastSegment{0};
+    mutable std::map<std::pair<const Dwarf::Info *, Elf::Addr>,
+        std::shared_ptr<Dwarf::CodeLocation>> codeLocations;
+    mutable std::mutex codeLocationsLock;
+    // Memoized ps_pglobal_lookup results, misses included: thread_db asks
+    // for the same dozen nptl symbols on every attach and every sample
+    // iteration, and each lookup otherwise walks every loaded object's
+    // symbol tables. Cleared when the link map is rescanned. thread_db
+    // callbacks are serialized, so no lock is needed.
+    mutable std::map<std::pair<std::string, std::string>,
+        std::optional<Elf::Addr>> psLookupCache;
+    // How to unwind frames whose address has no CFI: PLT stubs, JIT pages,
+    // asm leaves. The verdict is derived once per code page and cached
+    // (guarded by codeLocationsLock) - repeated samples of the same JIT
+    // region otherwise re-fail the FDE lookup and re-derive the answer for
+    // every frame.
+    enum class HeuristicRule { FramePointer, ReturnOnStack, None };
+    HeuristicRule unwindHeuristic(Elf::Addr ip, const Elf::CoreRegisters &) const;
+    // True if addr looks like the return address of a call: it leads to
+    // plausible code and the preceding bytes decode as a call instruction.
+    bool looksLikeReturnAddress(Elf::Addr) const;
+    // Scan the stack upward from sp for the first value that looks like a
+    // return address; returns (address found, stack pointer just above it).
+    std::optional<std::pair<Elf::Addr, Elf::Addr>> scanForReturnAddress(Elf::Addr sp) const;
+    mutable std::map<Elf::Addr, HeuristicRule> heuristicRules;
     virtual Reader::csptr getAUXV() const = 0;
     void processAUXV(const Reader &);
     Reader::sptr io;
@@ -210,6 +299,12 @@ public:
     // Find the the object (and its load address) and segment containing a given address
     std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *> findSegment(Elf::Addr addr) const;
     Dwarf::Info::sptr getDwarf(Elf::Object::sptr) const;
+    // Get the (shared, lazily-resolved) CodeLocation for an object-relative
+    // address. Thread pools routinely contain thousands of frames over a
+    // handful of distinct PCs; sharing the CodeLocation means each unique PC
+    // is symbolized at most once, however many frames refer to it.
+    std::shared_ptr<Dwarf::CodeLocation> getCodeLocation(
+          Dwarf::Info::sptr, const Elf::Phdr *, Elf::Addr objaddr) const;
     Process(Elf::Object::sptr exec, Reader::sptr memory, const PstackOptions &prl, Dwarf::ImageCache &cache);
     virtual void stop(pid_t lwpid) = 0;
     virtual void stopProcess() = 0;
@@ -217,8 +312,19 @@ public:
     virtual void resume(pid_t lwpid) = 0;
     std::ostream &dumpStackText(std::ostream &, const ThreadStack &, const PstackOptions &) const;
     std::ostream &dumpFrameText(std::ostream &, const PrintableFrame &, const Dwarf::StackFrame &) const;
+    // Fold each thread's stack into one semicolon-separated line (outermost
+    // frame first - collapsed flamegraph format) and bump its count. Used by
+    // the sampling profiler mode.
+    void foldStacks(const std::list<ThreadStack> &, const PstackOptions &,
+          std::map<std::string, size_t> &counts) const;
     std::ostream &dumpStackJSON(std::ostream &, const ThreadStack &) const;
     template <typename T> void listThreads(const T &);
+    // Fast-path thread enumeration: fill in (pthread descriptor address,
+    // lwp id) pairs read straight from the C library's thread list. Returns
+    // false when unsupported; the caller then falls back to thread_db.
+    virtual bool enumerateThreadsFast(std::vector<std::pair<Elf::Addr, lwpid_t>> &) {
+        return false;
+    }
 
 
     // find address of named symbol in the process.
@@ -231,7 +337,17 @@ public:
     resolveSymbolDetail(const char *name, bool includeDebug,
                         std::function<bool(Elf::Addr, const Elf::Object::sptr&)> match =
                            [](Elf::Addr, const Elf::Object::sptr &) { return true; }) const;
-    virtual std::list<ThreadStack> getStacks(const PstackOptions &, unsigned maxFrames);
+    // Unwind every thread. If `streamed` is provided it is invoked with each
+    // thread's stack, in thread order, as soon as that stack (and all before
+    // it) finish unwinding - so the first stack can be shown while later
+    // threads are still being walked.
+    virtual std::list<ThreadStack> getStacks(const PstackOptions &, unsigned maxFrames,
+          const std::function<void(const ThreadStack &)> &streamed = {});
+    // Write a minimal ET_CORE image capturing everything needed to symbolize
+    // the process later, offline: thread registers, the top of each stack,
+    // the link map, and the mapped-file table. Replayed via CoreProcess like
+    // any other core. See snapshot.cc.
+    void recordSnapshot(std::ostream &);
     virtual ~Process();
     void load();
     virtual pid_t getPID() const = 0;
@@ -257,12 +373,50 @@ public:
     LiveReader(pid_t, const std::string &);
 };
 
+// Reads target memory with process_vm_readv, servicing a whole scatter-read
+// batch in one syscall; link-map and python walks issue thousands of tiny
+// reads, so the batching matters. Falls back to /proc/<pid>/mem if the
+// syscall is unavailable (no CAP_SYS_PTRACE relationship, seccomp, etc).
+class LiveMemReader final : public LiveReader {
+    pid_t pid;
+    mutable bool vmReadBroken = false; // process_vm_readv doesn't work; use pread.
+public:
+    LiveMemReader(pid_t pid_) : LiveReader(pid_, "mem"), pid(pid_) {}
+    size_t read(Off off, size_t count, char *ptr) const override;
+    void readScatter(ReadRange *ranges, size_t nranges) const override;
+};
+
+// Routes reads landing in non-writable, file-backed segments (as classified
+// by Process::findSegment) to the mapped ELF object's own reader instead of
+// the target's address space: text and rodata are immutable, and the backing
+// files are already open, so those fetches skip the round trip through the
+// target entirely. Anything else - writable data, or addresses outside the
+// segment table - falls through to the wrapped reader.
+class ObjectOverlayReader final : public Reader {
+    const Process &proc;
+    Reader::sptr upstream;
+public:
+    ObjectOverlayReader(const Process &proc_, Reader::sptr upstream_)
+        : proc(proc_), upstream(std::move(upstream_)) {}
+    size_t read(Off off, size_t count, char *ptr) const override;
+    void describe(std::ostream &os) const override { os << *upstream; }
+    std::string filename() const override { return upstream->filename(); }
+    Off size() const override { return upstream->size(); }
+    void advise(Off start, Off end, Advice advice) const override {
+        upstream->advise(start, end, advice);
+    }
+};
+
 // Name of the file /proc/<pid>/name, after symlink dereferencing
 std::string procname(pid_t pid, const std::string &);
 
 struct LiveThreadList;
 class LiveProcess final : public Process {
     pid_t pid;
+    // The cache over live target memory. io starts out pointing at this, but
+    // gets wrapped (ObjectOverlayReader, and snapshot mode's overlay), so
+    // keep a direct reference for flushing when the target resumes.
+    std::shared_ptr<CacheReader> liveMemory;
 public:
     // attach to existing process.
     LiveProcess(Elf::Object::sptr &, pid_t, const PstackOptions &, Dwarf::ImageCache &, bool alreadyStopped=false);
@@ -275,6 +429,7 @@ public:
     virtual Reader::csptr getAUXV() const override;
     void findLWPs();
     virtual pid_t getPID() const override;
+    bool enumerateThreadsFast(std::vector<std::pair<Elf::Addr, lwpid_t>> &) override;
 protected:
     bool loadSharedObjectsFromFileNote() override;
     std::vector<AddressRange> addressSpace() const override;
@@ -329,6 +484,14 @@ public:
 protected:
     bool loadSharedObjectsFromFileNote() override;
     std::vector<AddressRange> addressSpace() const override;
+private:
+    // One-pass index over the core's notes, built on first use. Large cores
+    // carry a prstatus note per thread, so repeatedly walking the note
+    // segments for register fetches gets expensive; with the index, each
+    // lookup touches only notes of the wanted type.
+    const std::vector<Elf::NoteDesc> &notesOfType(int type) const;
+    mutable std::map<int, std::vector<Elf::NoteDesc>> noteIndex;
+    mutable bool notesIndexed = false;
 };
 
 // RAII to stop a process.
@@ -367,7 +530,8 @@ public:
    std::vector<AddressRange> addressSpace() const;
    pid_t getPID() const;
    bool loadSharedObjectsFromFileNote();
-   virtual std::list<ThreadStack> getStacks(const PstackOptions &, unsigned maxFrames);
+   virtual std::list<ThreadStack> getStacks(const PstackOptions &, unsigned maxFrames,
+         const std::function<void(const ThreadStack &)> &streamed = {}) override;
 };
 
 struct WaitStatus {
@@ -378,6 +542,24 @@ struct WaitStatus {
 std::ostream &operator << (std::ostream &os, WaitStatus ws);
 std::ostream &operator << (std::ostream &os, const JSON<Dwarf::StackFrame, const Process *> &jt);
 std::ostream & operator << (std::ostream &os, const JSON<ThreadStack, const Process *> &jt);
+
+/*
+ * Renders thread stacks in the compact binary form behind pstack's
+ * --format=binary. Symbol, function and file names are interned in a string
+ * table shared by every thread in the stream, so each distinct name crosses
+ * the wire once. The record layout is described with the implementation in
+ * process.cc.
+ */
+class BinaryStackWriter {
+    std::ostream &os;
+    const Process &proc;
+    std::map<std::string, uint32_t> strings;
+    uint32_t stringId(const std::string &);
+    template <typename T> void put(T value);
+public:
+    BinaryStackWriter(std::ostream &, const Process &);
+    void dump(const ThreadStack &);
+};
 void gregset2core(Elf::CoreRegisters &core, const gregset_t greg);
 
 #endif
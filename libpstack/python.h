@@ -79,6 +79,28 @@ struct PythonPrinter {
     Elf::Addr printThread(Elf::Addr);
     Elf::Addr printInterp(Elf::Addr, bool withModules);
 
+    // Object images fetched ahead of the walk: while decoding one frame we
+    // batch the read of the next frame down the chain with the frame's code
+    // object, so the image is already local by the time print() reaches it.
+    static constexpr size_t objPrefetchSize = 256;
+    struct Prefetched {
+        size_t len;
+        char data[objPrefetchSize];
+    };
+    mutable std::map<Elf::Addr, Prefetched> prefetchedObjs;
+
+    // Decoded code-object metadata, keyed by target address. Thread pools
+    // run identical code, so without this the same names and line table are
+    // fetched once per frame referencing the code object. The printer is
+    // constructed per sample, so the cache cannot go stale across samples.
+    struct CodeMeta {
+        std::string name;
+        std::string file;
+        int firstlineno;
+        std::vector<unsigned char> lnotab;
+    };
+    mutable std::map<Elf::Addr, CodeMeta> codeMeta;
+
     Process &proc;
     std::ostream &os;
     mutable std::set<Elf::Addr> visited;
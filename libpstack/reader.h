@@ -4,12 +4,17 @@
 #include <stdint.h>
 #include <climits>
 #include <stdlib.h>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <limits>
 #include <list>
+#include <string_view>
+#include <vector>
 #include <cassert>
+#include "libpstack/budget.h"
 #include "libpstack/exception.h"
 
 // Reader provides the basic random-access IO to a range of bytes.  The most
@@ -56,6 +61,32 @@ template <typename T, typename Iter> static inline std::pair<T, size_t> readleb1
 }
 
 
+// Decode a LEB128 from a raw pointer that has at least 8 readable bytes of
+// headroom. Instead of the data-dependent byte loop above, load the bytes as
+// a single word and locate the terminator (high bit clear) with one bit-scan;
+// the 7-bit groups are then extracted from the register. Encodings longer
+// than 8 bytes (only possible for values over 56 bits) take the generic path.
+template <typename T> static inline std::pair<T, size_t> readleb128_swar(const unsigned char *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   uint64_t word;
+   memcpy(&word, p, sizeof word);
+   uint64_t stops = ~word & 0x8080808080808080ULL;
+   if (stops != 0) {
+      size_t nbytes = size_t(__builtin_ctzll(stops)) / 8 + 1;
+      uint64_t result = 0;
+      for (size_t i = nbytes; i-- > 0;)
+         result = result << 7 | ((word >> (i * 8)) & 0x7f);
+      if constexpr (std::is_signed_v<T>) {
+         unsigned shift = nbytes * 7;
+         if (shift < sizeof(T) * CHAR_BIT && ((word >> ((nbytes - 1) * 8)) & 0x40) != 0)
+            result |= ~uint64_t(0) << shift;
+      }
+      return { T(result), nbytes };
+   }
+#endif
+   return readleb128<T>(p);
+}
+
 class Reader : public std::enable_shared_from_this<Reader> {
     Reader(const Reader &);
 public:
@@ -75,6 +106,38 @@ public:
     virtual std::pair<uintmax_t, size_t> readULEB128(Off off) const;
     virtual std::pair<intmax_t, size_t> readSLEB128(Off off) const;
 
+    // One request in a scatter read: count bytes at off, read into ptr. rc
+    // receives the number of bytes actually read.
+    struct ReadRange {
+        Off off;
+        size_t count;
+        char *ptr;
+        size_t rc;
+    };
+
+    // Read a batch of discontiguous ranges in one call. The base
+    // implementation just loops over read(), but process- and memory-backed
+    // readers can service the whole batch with far fewer syscalls. A failed
+    // range reports rc == 0 rather than throwing, so one bad address doesn't
+    // abort the rest of the batch.
+    virtual void readScatter(ReadRange *ranges, size_t nranges) const {
+        for (size_t i = 0; i < nranges; ++i) {
+            auto &r = ranges[i];
+            try {
+                r.rc = read(r.off, r.count, r.ptr);
+            }
+            catch (const Exception &) {
+                r.rc = 0;
+            }
+        }
+    }
+
+    // Expected access patterns a caller can advise for a range of content,
+    // before starting a sweep or a burst of random probes. These are hints
+    // only: readers with no useful way to act on them ignore them.
+    enum class Advice { Sequential, Random, WillNeed };
+    virtual void advise(Off, Off, Advice) const { }
+
     // describe this reader.
     virtual void describe(std::ostream &os) const = 0;
 
@@ -85,6 +148,23 @@ public:
     virtual std::string readString(Off offset) const;
 
     virtual Off size() const = 0;
+
+    // Zero-copy variant of readString: a view pinned to the reader's backing
+    // store when that store is contiguous in memory (an mmapped section),
+    // falling back to materializing into `backing` otherwise. The view is
+    // valid as long as the reader and `backing` are. Saves an allocation per
+    // access on hot paths like DIE name lookups.
+    std::string_view readStringView(Off offset, std::string &backing) const;
+
+    // If the backing store for the given range is contiguous in memory (an
+    // mmaped file, or a MemReader over a decompressed image, say), return a
+    // pointer to it, so callers can walk the bytes in-place with no virtual
+    // dispatch and no copying. Returns nullptr if the range must be accessed
+    // via read() instead. (This would return a std::span if we had C++20.)
+    virtual const char *contiguous(Off off, Off length) const {
+        (void)off; (void)length;
+        return nullptr;
+    }
     typedef std::shared_ptr<Reader> sptr;
     typedef std::shared_ptr<const Reader> csptr;
     virtual csptr view(const std::string &name, Off start, Off length=std::numeric_limits<Off>::max()) const;
@@ -119,10 +199,12 @@ Reader::readObj(Off offset) const
 // Reader implementations
 class FileReader : public Reader {
     std::string name;
+protected:
     int file;
     mutable Off fileSize;
 public:
     virtual size_t read(Off off, size_t count, char *ptr) const override ;
+    void advise(Off off, Off length, Advice advice) const override;
     FileReader(std::string name_);
     FileReader(std::string name_, Off minsize);
     ~FileReader();
@@ -131,9 +213,62 @@ public:
     Off size() const override;
 };
 
+// A FileReader that learns where the holes in a sparse file are (via
+// SEEK_HOLE/SEEK_DATA at open) and synthesizes zeros for them without any
+// IO. Used for core files that can't be mmaped: most of a sparse heap core
+// is hole, and scanning workloads otherwise pay physical reads for it.
+class SparseFileReader final : public FileReader {
+    struct Extent { Off start; Off end; };
+    std::vector<Extent> extents; // data extents, sorted, non-overlapping.
+public:
+    SparseFileReader(const std::string &name);
+    size_t read(Off off, size_t count, char *ptr) const override;
+};
+
+// Serves reads of a remote file via HTTP/1.1 range requests, so cores
+// archived in object storage can be symbolized in place - a dump touches
+// well under 1% of a large core, and fetching just those ranges beats
+// downloading the whole file. Only plain http is spoken (no TLS); point it
+// at the store directly or through a local proxy. A single keep-alive
+// connection is reused across requests, and readScatter pipelines a batch
+// of ranges on it so queued fetches overlap with the server's work.
+// Usable anywhere a FileReader is; stack a CacheReader on top for
+// block-granular fetching and a local cache (loadFile does this).
+class HttpReader final : public Reader {
+    std::string url;
+    std::string host;  // for connect() and the Host: header.
+    std::string port;
+    std::string path;
+    mutable int sock;
+    mutable Off contentLength;
+    // One connection, so one request in flight at a time (readScatter
+    // excepted) - and readers are shared between unwinding threads.
+    mutable std::mutex mtx;
+    void connect() const;
+    void disconnect() const;
+    void sendRequest(const char *method, Off off, Off end) const;
+    size_t fetch(Off off, size_t count, char *ptr) const;
+public:
+    static bool isUrl(const std::string &name) {
+        return name.compare(0, 7, "http://") == 0;
+    }
+    HttpReader(const std::string &url_);
+    ~HttpReader();
+    size_t read(Off off, size_t count, char *ptr) const override;
+    void readScatter(ReadRange *ranges, size_t nranges) const override;
+    void describe(std::ostream &os) const override { os << url; }
+    std::string filename() const override { return url; }
+    Off size() const override;
+};
+
+// Fetch granularity for the CacheReader stacked over an HttpReader -
+// settable from the command line to trade round trips against bytes
+// transferred.
+extern size_t httpBlockSize;
+
 // Reader implementations
 
-class CacheReader final : public Reader {
+class CacheReader final : public Reader, public Budget::Client {
     struct CacheEnt {
         std::string value;
         bool isNew;
@@ -141,29 +276,44 @@ class CacheReader final : public Reader {
     };
     Reader::csptr upstream;
     mutable std::unordered_map<Off, CacheEnt> stringCache;
-    static const size_t PAGESIZE = 256;
-    static const size_t MAXPAGES = 16;
+    size_t pagesize;
+    size_t maxpages;
     class Page {
         Page(const Page &) = delete;
     public:
         Off offset;
         size_t len;
-        char data[PAGESIZE];
-        Page() {};
-        void load(const Reader &r, Off offset_);
+        std::unique_ptr<char[]> data;
+        Page(size_t pagesize) : data(new char[pagesize]) {};
+        void load(const Reader &r, Off offset_, size_t pagesize);
     };
+    // Pages in LRU order, most-recently-used first, plus an index by page
+    // offset so lookup is O(1) - promoting a page to the front is just a
+    // splice, and doesn't invalidate the iterators held in the index.
     mutable std::list<Page *> pages;
-    Page *getPage(Off pageoff) const;
+    mutable std::unordered_map<Off, std::list<Page *>::iterator> pageIndex;
+    // The page and string caches mutate on read, and reads may come from
+    // several unwinding threads at once.
+    mutable std::mutex lock;
+    Page *getPage(Off pageoff) const; // caller must hold the lock.
 public:
     void flush();
     virtual size_t read(Off off, size_t count, char *ptr) const override;
+    // Ranges fully covered by cached pages are served locally; the misses
+    // are forwarded to the upstream reader as a single batch, which a
+    // process-backed reader can satisfy in one syscall.
+    void readScatter(ReadRange *ranges, size_t nranges) const override;
     virtual void describe(std::ostream &os) const override {
         // this must be the same as the underlying stream: we sometimes rely on the
         // FileReader's filename
         os << *upstream;
     }
-    CacheReader(Reader::csptr upstream_);
+    CacheReader(Reader::csptr upstream_, size_t pagesize_ = 256, size_t maxpages_ = 16);
+    void advise(Off off, Off length, Advice advice) const override {
+        upstream->advise(off, length, advice);
+    }
     std::string readString(Off off) const override;
+    size_t shed() override; // drop the pages for the budget manager.
     ~CacheReader();
     Off size() const override { return upstream->size(); }
     std::string filename() const override { return upstream->filename(); }
@@ -181,15 +331,33 @@ public:
     Off size() const override { return len; }
     std::string filename() const override { return "in-memory"; }
     std::string readString(Off offset) const override;
+    const char *contiguous(Off off, Off length) const override {
+        if (off > Off(len) || length > Off(len) - off)
+            return nullptr;
+        return (const char *)data + off;
+    }
     virtual csptr view(const std::string &name, Off start, Off length=std::numeric_limits<Off>::max()) const override;
     virtual std::pair<uintmax_t, size_t> readULEB128(Off off) const override;
     virtual std::pair<intmax_t, size_t> readSLEB128(Off off) const override;
 };
 
+// A MemReader over a buffer it owns - for images copied out of a target
+// (e.g. the vdso) that must outlive the reader they were copied from.
+class BufferReader final : public MemReader {
+    std::vector<char> buffer;
+public:
+    BufferReader(const std::string &name, std::vector<char> &&buf)
+        : MemReader(name, 0, nullptr), buffer(std::move(buf)) {
+        len = buffer.size();
+        data = buffer.data();
+    }
+};
+
 class MmapReader final : public MemReader {
 public:
     MmapReader(const std::string &name_);
     ~MmapReader();
+    void advise(Off off, Off length, Advice advice) const override;
     std::string filename() const override { return descr; }
 };
 
@@ -215,7 +383,16 @@ public:
         return upstream->readString(absoff + offset);
     }
     virtual size_t read(Off off, size_t count, char *ptr) const override;
+    const char *contiguous(Off off, Off len) const override {
+        if (off > length || len > length - off)
+            return nullptr;
+        return upstream->contiguous(off + offset, len);
+    }
+    void advise(Off off, Off len, Advice advice) const override {
+        upstream->advise(off + offset, std::min(len, length - std::min(off, length)), advice);
+    }
     OffsetReader(const std::string &name, Reader::csptr upstream_, Off offset_, Off length_ = std::numeric_limits<Off>::max());
+    csptr view(const std::string &name, Off start, Off length=std::numeric_limits<Off>::max()) const override;
     void describe(std::ostream &os) const override {
         os << name << "( range " << "[" << offset << "," << offset + length << "]" << " of " << *upstream << " )";
     }
@@ -235,13 +412,19 @@ template <typename T>
 struct ReaderArray {
    class iterator {
       const Reader *reader;
+      // Non-null if the reader's backing store is contiguous in memory - we
+      // can then fetch each item directly rather than via a virtual read.
+      const char *flat;
       T datum;
        void getitem();
    public:
       Reader::Off offset;
       T &operator *();
-      iterator(const Reader *reader_) : reader(reader_),offset(reader->size()) { }
-      iterator(const Reader *reader_, Reader::Off offset_) : reader(reader_),offset(offset_) {
+      iterator(const Reader *reader_) : reader(reader_),flat(nullptr),offset(reader->size()) { }
+      iterator(const Reader *reader_, Reader::Off offset_) : reader(reader_),flat(nullptr),offset(offset_) {
+          auto limit = reader->size();
+          if (limit != std::numeric_limits<Reader::Off>::max())
+              flat = reader->contiguous(0, limit);
           getitem();
       }
       bool operator == (const iterator &rhs) { return offset == rhs.offset && reader == rhs.reader; }
@@ -260,8 +443,20 @@ struct ReaderArray {
 };
 
 template <typename T> void ReaderArray<T>::iterator::getitem() {
+    if (flat != nullptr) {
+        if (offset + sizeof (T) > reader->size()) {
+            offset = reader->size();
+            return;
+        }
+        memcpy(&datum, flat + offset, sizeof (T));
+        return;
+    }
     try {
-        reader->readObj(offset, &datum);
+        // use read() rather than readObj() - a short read at the end of the
+        // reader is expected when we iterate to the end, and shouldn't cost
+        // an exception per array traversal.
+        if (reader->read(offset, sizeof datum, (char *)&datum) != sizeof datum)
+            offset = reader->size();
     }
     catch (const Exception &ex) {
         // if we hit an error, just set our size to the reader size. We'll now
@@ -0,0 +1,81 @@
+#ifndef pstack_stats_h
+#define pstack_stats_h
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+/*
+ * A registry of lightweight counters for the internal caches and hot phases,
+ * so a deployment can be tuned from what pstack actually did rather than
+ * guesswork. Counters are relaxed atomics bumped unconditionally - an
+ * increment on a cache path is noise next to the lookup it measures - but the
+ * phase timers make clock calls, so they only run once "enabled" is set (by
+ * --stats). Instances register themselves during static initialization;
+ * dumpText and dumpJSON walk the registry at exit.
+ */
+namespace Stats {
+
+extern bool enabled; // set by --stats: gates the phase timers only.
+
+struct Cache {
+    const char *name;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> bytes{0}; // payload loaded on misses, where meaningful.
+    explicit Cache(const char *name_);
+    void hit() {
+        hits.fetch_add(1, std::memory_order_relaxed);
+    }
+    void miss(uint64_t loaded = 0) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        if (loaded != 0)
+            bytes.fetch_add(loaded, std::memory_order_relaxed);
+    }
+};
+
+struct Phase {
+    const char *name;
+    std::atomic<uint64_t> ns{0};
+    std::atomic<uint64_t> calls{0};
+    explicit Phase(const char *name_);
+};
+
+// Times the enclosing scope into a Phase. A no-op (two branches, no clock
+// reads) unless stats are enabled.
+class Timed {
+    Phase &phase;
+    std::chrono::steady_clock::time_point start;
+public:
+    explicit Timed(Phase &phase_) : phase(phase_) {
+        if (enabled)
+            start = std::chrono::steady_clock::now();
+    }
+    ~Timed() {
+        if (!enabled)
+            return;
+        auto took = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start);
+        phase.ns.fetch_add(took.count(), std::memory_order_relaxed);
+        phase.calls.fetch_add(1, std::memory_order_relaxed);
+    }
+    Timed(const Timed &) = delete;
+    Timed &operator =(const Timed &) = delete;
+};
+
+std::ostream &dumpText(std::ostream &);
+std::ostream &dumpJSON(std::ostream &);
+
+// The caches and phases we instrument. (The ELF image cache keeps its own
+// sharded counters - see Elf::ImageCache::dumpStats.)
+extern Cache readerPages;  // CacheReader's page cache.
+extern Cache dwarfUnits;   // Dwarf::Info's offset-to-Unit map.
+extern Cache sourceLines;  // Info::sourceFromAddr memoization.
+extern Cache callFrames;   // CFI's decoded-FDE cache (.eh_frame_hdr path).
+extern Phase attach;       // process load: attach, link map, images.
+extern Phase unwind;       // getStacks: register capture and unwinding.
+extern Phase symbolize;    // rendering frames to names and source (within unwind).
+
+} // Stats namespace
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef pstack_trace_h
+#define pstack_trace_h
+#include <chrono>
+#include <string>
+
+/*
+ * Opt-in tracing of the major phases of a run, written as chrome://tracing
+ * JSON so a single slow incident can be opened as a flame view. Each Span is
+ * a complete ("ph":"X") event covering its enclosing scope, tagged with the
+ * thread that ran it, so the worker-pool phases show their parallelism.
+ *
+ * When tracing is off a Span is a single branch on "active" - the name is
+ * produced by a callable, so nothing is even formatted. Events are buffered
+ * in memory and only serialized by finish(): recording is a vector append
+ * under a lock, not I/O on the unwind path.
+ */
+namespace Trace {
+
+extern bool active; // set by start(); checked inline by every Span.
+
+void start(const std::string &path); // start recording; finish() writes to path.
+void finish();                       // serialize the trace and stop recording.
+void record(const char *cat, std::string &&name,
+        std::chrono::steady_clock::time_point begin,
+        std::chrono::steady_clock::time_point end);
+
+class Span {
+    const char *cat = nullptr;
+    std::string name;
+    std::chrono::steady_clock::time_point begin;
+public:
+    template <typename Namer>
+    Span(const char *cat_, Namer &&namer) {
+        if (!active)
+            return;
+        cat = cat_;
+        name = namer();
+        begin = std::chrono::steady_clock::now();
+    }
+    ~Span() {
+        if (cat != nullptr)
+            record(cat, std::move(name), begin, std::chrono::steady_clock::now());
+    }
+    Span(const Span &) = delete;
+    Span &operator =(const Span &) = delete;
+};
+
+} // Trace namespace
+
+#endif
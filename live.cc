@@ -6,6 +6,7 @@
 
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <dirent.h>
 #include <err.h>
@@ -27,14 +28,89 @@ procname(pid_t pid, const std::string &base)
 LiveReader::LiveReader(pid_t pid, const std::string &base)
    : FileReader(procname(pid, base), std::numeric_limits<Reader::Off>::max()) {}
 
+size_t
+LiveMemReader::read(Off off, size_t count, char *ptr) const
+{
+    if (!vmReadBroken) {
+        iovec local { ptr, count };
+        iovec remote { (void *)(uintptr_t)off, count };
+        ssize_t rc = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (rc > 0)
+            return rc;
+        if (rc == 0 || errno == ENOSYS || errno == EPERM)
+            // the syscall isn't going to work for this process - stick to
+            // pread on /proc/<pid>/mem from here on.
+            vmReadBroken = true;
+        else
+            throw (Exception()
+                << "read " << count
+                << " at " << (void *)off
+                << " on " << *this
+                << " failed: " << strerror(errno));
+    }
+    return FileReader::read(off, count, ptr);
+}
+
+void
+LiveMemReader::readScatter(ReadRange *ranges, size_t nranges) const
+{
+    size_t i = 0;
+    // Batch up to IOV_MAX requests into each syscall. When the kernel stops
+    // at a fault it reports the bytes transferred so far, which attributes
+    // the damage to one range; everything after it is retried in the next
+    // batch.
+    while (i < nranges && !vmReadBroken) {
+        size_t n = std::min(nranges - i, size_t(IOV_MAX));
+        std::vector<iovec> local(n), remote(n);
+        for (size_t j = 0; j < n; ++j) {
+            local[j] = { ranges[i + j].ptr, ranges[i + j].count };
+            remote[j] = { (void *)(uintptr_t)ranges[i + j].off, ranges[i + j].count };
+        }
+        ssize_t rc = process_vm_readv(pid, local.data(), n, remote.data(), n, 0);
+        if (rc < 0) {
+            if (errno == ENOSYS || errno == EPERM) {
+                vmReadBroken = true;
+                break;
+            }
+            // the first range faulted outright; fail it and move on.
+            ranges[i].rc = 0;
+            ++i;
+            continue;
+        }
+        size_t got = rc, j = 0;
+        for (; j < n; ++j) {
+            auto &r = ranges[i + j];
+            if (got < r.count)
+                break;
+            r.rc = r.count;
+            got -= r.count;
+        }
+        if (j == n) {
+            i += n;
+            continue;
+        }
+        // range j faulted mid-way (or at the start); record what it got and
+        // resume with the ranges the kernel didn't attempt.
+        ranges[i + j].rc = got;
+        i += j + 1;
+    }
+    if (i < nranges)
+        Reader::readScatter(ranges + i, nranges - i);
+}
+
 LiveProcess::LiveProcess(Elf::Object::sptr &ex, pid_t pid_,
             const PstackOptions &options, Dwarf::ImageCache &imageCache, bool alreadyStopped)
     : Process(
             ex ? ex : imageCache.getImageForName(procname(pid_, "exe")),
-            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "mem")),
+            std::make_shared<CacheReader>(std::make_shared<LiveMemReader>(pid_)),
             options, imageCache)
     , pid(pid_)
 {
+    liveMemory = std::dynamic_pointer_cast<CacheReader>(io);
+    // Serve text and rodata reads from the mapped ELF images rather than the
+    // live process; the segment table is empty until load(), so early reads
+    // just fall through to the cached ptrace reader underneath.
+    io = std::make_shared<ObjectOverlayReader>(*this, io);
     (void)ps_getpid(this);
     if (alreadyStopped)
        lwps[pid].stopCount = 1;
@@ -77,7 +153,12 @@ LiveProcess::resume(lwpid_t pid)
         return;
     if (ptrace(PT_DETACH, pid, caddr_t(1), 0) != 0)
         std::clog << "failed to detach from process " << pid << ": " << strerror(errno) << "\n";
-    dynamic_cast<CacheReader&>(*io).flush();
+    // The target is running again, so anything cached from its memory is
+    // stale. Flush through our direct reference - io itself is wrapped in
+    // overlay readers (and possibly a stack snapshot), so it never is the
+    // cache.
+    if (liveMemory)
+        liveMemory->flush();
     if (verbose >= 1) {
         timeval tv;
         gettimeofday(&tv, nullptr);
@@ -112,12 +193,120 @@ LiveProcess::getPID() const
     return pid;
 }
 
+/*
+ * Enumerate glibc's thread list directly instead of via td_ta_thr_iter. The
+ * nptl_db helper descriptors (_thread_db_*) that libc publishes for
+ * thread_db's benefit give us the field offsets we need, after which each
+ * thread costs a couple of reads - thread_db performs many small ps_pdread
+ * calls per thread, which dominates attach time on heavily threaded targets.
+ * Returns false (and the caller falls back to thread_db) whenever anything
+ * doesn't look exactly as expected.
+ */
+bool
+LiveProcess::enumerateThreadsFast(std::vector<std::pair<Elf::Addr, lwpid_t>> &threads)
+{
+    try {
+        // descriptors are { size-in-bits, element count, offset }.
+        auto field = [this](const char *desc) {
+            uint32_t d[3];
+            io->readObj(resolveSymbol(desc, true), &d[0], 3);
+            return Elf::Addr(d[2]);
+        };
+        Elf::Addr tidOff = field("_thread_db_pthread_tid");
+        Elf::Addr listOff = field("_thread_db_pthread_list");
+
+        // The list heads live in _rtld_global on current glibc; older
+        // versions exported them as plain variables from libpthread.
+        std::vector<Elf::Addr> heads;
+        try {
+            Elf::Addr rtld = resolveSymbol("_rtld_global", true);
+            heads.push_back(rtld + field("_thread_db_rtld_global__dl_stack_used"));
+            heads.push_back(rtld + field("_thread_db_rtld_global__dl_stack_user"));
+        } catch (const Exception &) {
+            heads.push_back(resolveSymbol("stack_used", true));
+            heads.push_back(resolveSymbol("__stack_user", true));
+        }
+
+        for (auto head : heads) {
+            Elf::Addr node;
+            io->readObj(head, &node); // list_t.next is the first member.
+            for (size_t i = 0; node != head; ++i) {
+                // Bail on an implausible chain - corrupt, or racing a
+                // thread's birth - rather than looping forever.
+                if (node == 0 || i > lwps.size() + 1024)
+                    return false;
+                Elf::Addr descriptor = node - listOff;
+                uint32_t tid;
+                io->readObj(descriptor + tidOff, &tid);
+                threads.emplace_back(descriptor, lwpid_t(tid));
+                io->readObj(node, &node);
+            }
+        }
+    }
+    catch (const Exception &) {
+        return false;
+    }
+    // Cross-check against the kernel's view from /proc/<pid>/task: if the
+    // two disagree (exotic libc, thread mid-exit), let thread_db arbitrate.
+    if (threads.size() != lwps.size())
+        return false;
+    for (auto &thread : threads)
+        if (lwps.find(thread.second) == lwps.end())
+            return false;
+    return true;
+}
+
 void
 LiveProcess::stopProcess()
 {
-    stop(pid); // suspend the main process itself first.
+#ifdef __linux__
+    /*
+     * Seize and interrupt every LWP before collecting any of the stop
+     * notifications: the kernel delivers the stops concurrently, so the
+     * process freezes at roughly one instant and total stop time no longer
+     * scales with the thread count - attaching and waiting one LWP at a
+     * time let later threads keep running (and mutating state) while the
+     * earlier ones reported in. Re-scan /proc until no new LWPs appear, in
+     * case a stopping thread was mid-clone.
+     */
+    for (;;) {
+        findLWPs();
+        std::vector<lwpid_t> interrupted;
+        for (auto &lwp : lwps) {
+            auto &tcb = lwp.second;
+            if (tcb.stopCount++ != 0)
+                continue;
+            gettimeofday(&tcb.stoppedAt, nullptr);
+            if (ptrace(PTRACE_SEIZE, lwp.first, 0, 0) != 0) {
+                *debug << "failed to seize LWP " << lwp.first << ": "
+                       << strerror(errno) << "\n";
+                continue;
+            }
+            if (ptrace(PTRACE_INTERRUPT, lwp.first, 0, 0) != 0)
+                *debug << "failed to interrupt LWP " << lwp.first << ": "
+                       << strerror(errno) << "\n";
+            else
+                interrupted.push_back(lwp.first);
+        }
+        if (interrupted.empty())
+            break;
+        for (auto lwp : interrupted) {
+            int status;
+            if (waitpid(lwp, &status, __WALL) == -1)
+                *debug << "failed to stop LWP " << lwp << ": wait failed: "
+                       << strerror(errno) << "\n";
+            else if (verbose >= 1)
+                *debug << "suspend LWP " << lwp << std::endl;
+        }
+    }
+#else
     findLWPs();
 
+    // Stop all LWPs, one attach-and-wait at a time.
+    for (auto &lwp : lwps)
+        stop(lwp.first);
+#endif
+
     /*
      * suspend any threads that the thread-db knows about.
      * XXX: This doesn't actually work under linux: If we fail, just stop the LWP
@@ -125,7 +314,8 @@ LiveProcess::stopProcess()
     listThreads([this] (const td_thrhandle_t *thr) {
         td_thrinfo_t info;
         td_thr_get_info(thr, &info);
-        (void)lwps[info.ti_lid]; // make sure we have the LWP
+        if (lwps.find(info.ti_lid) == lwps.end())
+            stop(info.ti_lid); // missed by the LWP scan somehow.
         if (td_thr_dbsuspend(thr) == TD_NOCAPAB) {
             if (verbose >= 3)
                 *debug << "can't suspend thread "  << thr
@@ -133,12 +323,6 @@ LiveProcess::stopProcess()
         }
     });
 
-    // Stop all LWPS.
-    int i = 0;
-    for (auto &lwp : lwps) {
-        stop(lwp.first);
-        i++;
-    }
     if (verbose >= 2)
         *debug << "stopped process " << pid << "\n";
 }
@@ -156,8 +340,6 @@ LiveProcess::resumeProcess()
 
     for (auto &lwp : lwps)
         resume(lwp.first);
-
-    resume(pid);
 }
 
 void
@@ -58,7 +58,11 @@ LogProcess::addressSpace() const {
 }
 
 std::list<ThreadStack>
-LogProcess::getStacks(const PstackOptions &, unsigned) {
+LogProcess::getStacks(const PstackOptions &, unsigned,
+      const std::function<void(const ThreadStack &)> &streamed) {
+   if (streamed)
+      for (auto &stack : stacks)
+         streamed(stack);
    return stacks;
 }
 
@@ -139,10 +143,11 @@ LogProcess::loadSharedObjectsFromFileNote() {
         // Add the stack of virtual addresses to the core.
         stacks.push_back(ThreadStack());
         auto &procstack = stacks.back();
+        procstack.frameArena = std::make_shared<Dwarf::Arena>();
         for (auto addr : ipStack) {
-           Elf::CoreRegisters core;
+           Elf::CoreRegisters core {};
            Elf::setReg(core, IPREG, addr);
-           procstack.stack.emplace_back(Dwarf::UnwindMechanism::LOGFILE, core);
+           procstack.addFrame(Dwarf::UnwindMechanism::LOGFILE, core);
         }
     }
     return true;
@@ -3,6 +3,11 @@
 
 #include <lzma.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 static auto allocator() {
    static lzma_allocator alloc {
@@ -44,8 +49,140 @@ LzmaReader::size() const
     return lzma_index_uncompressed_size(index);
 }
 
+// Streams up to this uncompressed size are decompressed in one shot into an
+// anonymous mapping on first access; beyond it, we stay block-at-a-time.
+// (Spilling oversize streams to a temp file was considered, but an anonymous
+// mapping already pages out under pressure, and .gnu_debugdata images are
+// typically a few MB.)
+static constexpr size_t FLATTEN_MAX = size_t(256) << 20;
+
+// decode one xz block into its final location.
+void
+LzmaReader::decodeBlock(Off compressedOff, size_t compressedSize, char *out, size_t outSize) const
+{
+    std::vector<unsigned char> compressed(compressedSize);
+    upstream->readObj(compressedOff, &compressed[0], compressed.size());
+    lzma_block block{};
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(compressed[0]);
+    int rc = lzma_block_header_decode(&block, allocator(), &compressed[0]);
+    if (rc != LZMA_OK)
+        throw (Exception() << "can't decode block header: " << rc);
+    size_t compressed_pos = block.header_size;
+    size_t uncompressed_pos = 0;
+    rc = lzma_block_buffer_decode(&block, allocator(),
+            &compressed[0], &compressed_pos, compressed.size(),
+            (uint8_t *)out, &uncompressed_pos, outSize);
+    for (auto i = 0;  block.filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        allocator()->free(allocator(), block.filters[i].options);
+    if (rc != LZMA_OK)
+        throw (Exception() << "can't decode block buffer: " << rc);
+}
+
+const char *
+LzmaReader::flatten() const
+{
+    if (whole == nullptr) {
+        size_t len = size();
+        if (len == 0 || len > FLATTEN_MAX)
+            return nullptr;
+        void *p = mmap(nullptr, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+
+        // gather all the blocks in the stream from the index.
+        struct Job {
+            Off compressedOff;
+            size_t compressedSize;
+            Off uncompressedOff;
+            size_t uncompressedSize;
+        };
+        std::vector<Job> jobs;
+        lzma_index_iter iter{};
+        lzma_index_iter_init(&iter, index);
+        while (!bool(lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)))
+            jobs.push_back({Off(iter.block.compressed_file_offset),
+                    size_t(iter.block.total_size),
+                    Off(iter.block.uncompressed_stream_offset),
+                    size_t(iter.block.uncompressed_size)});
+
+        try {
+            // Blocks are independent, so multi-block streams can decode
+            // concurrently - but only when the upstream is memory-backed, as
+            // buffered readers aren't safe to share across threads.
+            size_t nthreads = std::min(jobs.size(),
+                    size_t(std::thread::hardware_concurrency()));
+            if (nthreads > 1 && upstream->contiguous(0, upstream->size()) != nullptr) {
+                std::atomic<size_t> nextJob(0);
+                std::mutex failLock;
+                std::exception_ptr failure;
+                std::vector<std::thread> workers;
+                for (size_t i = 0; i < nthreads; ++i)
+                    workers.emplace_back([&] {
+                        for (;;) {
+                            size_t j = nextJob++;
+                            if (j >= jobs.size())
+                                return;
+                            try {
+                                decodeBlock(jobs[j].compressedOff, jobs[j].compressedSize,
+                                        (char *)p + jobs[j].uncompressedOff, jobs[j].uncompressedSize);
+                            }
+                            catch (...) {
+                                std::lock_guard<std::mutex> guard(failLock);
+                                if (!failure)
+                                    failure = std::current_exception();
+                            }
+                        }
+                    });
+                for (auto &w : workers)
+                    w.join();
+                if (failure)
+                    std::rethrow_exception(failure);
+            } else {
+                for (auto &job : jobs)
+                    decodeBlock(job.compressedOff, job.compressedSize,
+                            (char *)p + job.uncompressedOff, job.uncompressedSize);
+            }
+        }
+        catch (...) {
+            munmap(p, len);
+            throw;
+        }
+        whole = (char *)p;
+        lzBlocks.clear(); // block cache is now redundant.
+        if (verbose >= 2)
+            *debug << "lzma flatten: " << *this << ", " << len << " bytes, "
+                << jobs.size() << " blocks\n";
+    }
+    return whole;
+}
+
+const char *
+LzmaReader::contiguous(Off off, Off length) const
+{
+    auto p = flatten();
+    if (p == nullptr || off > size() || length > size() - off)
+        return nullptr;
+    return p + off;
+}
+
 size_t
 LzmaReader::read(Off offset, size_t size, char *data) const
+{
+    auto p = flatten();
+    if (p != nullptr) {
+        if (offset > this->size())
+            throw (Exception() << "read past end of " << *this);
+        size_t rc = std::min(size, size_t(this->size() - offset));
+        memcpy(data, p + offset, rc);
+        return rc;
+    }
+    return readBlockwise(offset, size, data);
+}
+
+size_t
+LzmaReader::readBlockwise(Off offset, size_t size, char *data) const
 {
     size_t startSize = size;
     while (size != 0) {
@@ -55,25 +192,9 @@ LzmaReader::read(Off offset, size_t size, char *data) const
             throw (Exception() << "can't locate offset " << offset << " in index");
         auto &uncompressed = lzBlocks[iter.block.uncompressed_stream_offset];
         if (uncompressed.empty()) {
-            std::vector<unsigned char>compressed(iter.block.total_size);
-            upstream->readObj(iter.block.compressed_file_offset, &compressed[0], compressed.size());
-            lzma_block block{};
-            lzma_filter filters[LZMA_FILTERS_MAX + 1];
-            block.filters = filters;
-            block.header_size = lzma_block_header_size_decode(compressed[0]);
-            int rc = lzma_block_header_decode(&block, allocator(), &compressed[0]);
-            if (rc != LZMA_OK)
-                throw (Exception() << "can't decode block header: " << rc);
             uncompressed.resize(iter.block.uncompressed_size);
-            size_t compressed_pos = block.header_size;
-            size_t uncompressed_pos = 0;
-            rc = lzma_block_buffer_decode(&block, allocator(),
-                    &compressed[0], &compressed_pos, compressed.size(),
-                    &uncompressed[0], &uncompressed_pos, uncompressed.size());
-            for (auto i = 0;  block.filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-                allocator()->free(allocator(), block.filters[i].options);
-            if ( rc != LZMA_OK)
-                throw (Exception() << "can't decode block buffer: " << rc);
+            decodeBlock(iter.block.compressed_file_offset, iter.block.total_size,
+                    (char *)&uncompressed[0], uncompressed.size());
         }
         size_t blockOff = offset - iter.block.uncompressed_stream_offset;
         auto amount = std::min(uncompressed.size() - blockOff, size);
@@ -93,5 +214,7 @@ LzmaReader::describe(std::ostream &os) const
 
 LzmaReader::~LzmaReader()
 {
+    if (whole != nullptr)
+        munmap(whole, size());
     lzma_index_end(index, allocator());
 }
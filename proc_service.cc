@@ -44,18 +44,26 @@ ps_pglobal_lookup(struct ps_prochandle *ph, const char *ld_object_name,
                   const char *ld_symbol_name, psaddr_t *ld_symbol_addr)
 {
     auto p = static_cast<const Process *>(ph);
-    try {
-        *ld_symbol_addr = psaddr_t(intptr_t(p->resolveSymbol(ld_symbol_name, true,
-            [ld_object_name](const Elf::Addr, const Elf::Object::sptr &o) {
-                auto bn = basename(o->io->filename());
-                return bn == ld_object_name || bn == "libc.so.6";
-            }
-            )));
-        return PS_OK;
+    // thread_db requests the same symbols on every attach and every sample;
+    // resolve each (object, symbol) pair once, remembering failures too.
+    auto [it, isnew] = p->psLookupCache.emplace(
+            std::make_pair(std::string(ld_object_name), std::string(ld_symbol_name)),
+            std::nullopt);
+    if (isnew) {
+        try {
+            it->second = p->resolveSymbol(ld_symbol_name, true,
+                [ld_object_name](const Elf::Addr, const Elf::Object::sptr &o) {
+                    auto bn = basename(o->io->filename());
+                    return bn == ld_object_name || bn == "libc.so.6";
+                });
+        }
+        catch (...) {
+        }
     }
-    catch (...) {
+    if (!it->second)
         return PS_ERR;
-    }
+    *ld_symbol_addr = psaddr_t(intptr_t(*it->second));
+    return PS_OK;
 }
 
 void
@@ -7,14 +7,22 @@
 #include "libpstack/global.h"
 #include "libpstack/stringify.h"
 #include "libpstack/ioflag.h"
+#include "libpstack/stats.h"
+#include "libpstack/trace.h"
 
+#include <cxxabi.h>
 #include <link.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
+#include <thread>
 
 #include <iomanip>
+#include <unordered_map>
 #include <iostream>
 #include <limits>
 #include <set>
@@ -31,6 +39,7 @@
 #define SP(regs) regs.esp
 #define IP(regs) (regs.eip)
 #elif defined(__aarch64__)
+#define SP(regs) (regs.sp)
 #define IP(regs) (regs.pc)
 #endif
 
@@ -116,10 +125,12 @@ Process::load()
         Elf::Addr r_debug_addr = findRDebugAddr();
         bool isStatic = r_debug_addr == 0 || r_debug_addr == Elf::Addr(-1);
 
-        if (isStatic)
+        if (isStatic) {
             addElfObject(execImage, 0);
-        else
+        } else {
+            rdebugAddr = r_debug_addr;
             loadSharedObjects(r_debug_addr);
+        }
     }
     catch (const Exception &) {
         // We were unable to read the link map.
@@ -148,6 +159,18 @@ Process::getDwarf(Elf::Object::sptr elf) const
     return imageCache.getDwarf(elf);
 }
 
+std::shared_ptr<Dwarf::CodeLocation>
+Process::getCodeLocation(Dwarf::Info::sptr info, const Elf::Phdr *phdr, Elf::Addr objaddr) const
+{
+    std::lock_guard<std::mutex> guard(codeLocationsLock);
+    auto key = std::make_pair(info.get(), objaddr);
+    auto it = codeLocations.find(key);
+    if (it == codeLocations.end())
+        it = codeLocations.emplace(key,
+              std::make_shared<Dwarf::CodeLocation>(info, phdr, objaddr)).first;
+    return it->second;
+}
+
 
 const char *
 auxtype2str(int auxtype) {
@@ -160,15 +183,25 @@ auxtype2str(int auxtype) {
 void
 Process::processAUXV(const Reader &auxio)
 {
-    for (size_t i = 0;; i++) {
-        Elf::auxv_t aux;
+    // Slurp the whole vector in a few bulk reads rather than one syscall
+    // per entry; it's at most a page or two.
+    std::vector<Elf::auxv_t> auxen;
+    for (size_t off = 0;;) {
+        Elf::auxv_t chunk[64];
+        size_t rc;
         try {
-            auxio.readObj(i * sizeof aux, &aux);
+            rc = auxio.read(off, sizeof chunk, (char *)chunk);
         }
         catch (const Exception &ex) {
             break;
         }
+        auxen.insert(auxen.end(), chunk, chunk + rc / sizeof chunk[0]);
+        if (rc < sizeof chunk)
+            break;
+        off += rc;
+    }
 
+    for (const auto &aux : auxen) {
         Elf::Addr hdr = aux.a_un.a_val;
         switch (aux.a_type) {
             case AT_ENTRY: {
@@ -187,7 +220,14 @@ Process::processAUXV(const Reader &auxio)
             }
             case AT_SYSINFO_EHDR: {
                 try {
-                    auto elf = std::make_shared<Elf::Object>(imageCache, io->view("(vdso image)", hdr, 65536));
+                    // Copy the vdso out of the target once. It's only a few
+                    // pages, and a view over target memory would re-read the
+                    // kernel-mapped pages on every sample when the cache is
+                    // flushed at resume.
+                    std::vector<char> img(65536);
+                    img.resize(io->read(hdr, img.size(), img.data()));
+                    auto elf = std::make_shared<Elf::Object>(imageCache,
+                            std::make_shared<BufferReader>("(vdso image)", std::move(img)));
                     vdsoBase = hdr;
                     addElfObject(elf, hdr);
                     vdsoImage = elf;
@@ -272,7 +312,8 @@ dieName(std::ostream &os, const Dwarf::DIE &die, bool first=true) {
             tag == Dwarf::DW_TAG_namespace ) {
         if (printedParent)
             os << "::";
-       os << die.name();
+       std::string backing;
+       os << die.name(backing);
        return true;
     }
     return printedParent;
@@ -321,12 +362,15 @@ PrintableFrame::PrintableFrame(const Process &proc, const Dwarf::StackFrame &fra
                 // below in the ELF fallback code.
             }
         }
-        while (function) {
-            auto inl = function.findEntryForAddr(objIp, Dwarf::DW_TAG_inlined_subroutine);
-            if (!inl)
-                break;
-            inlined.push_back(inl);
-            function = std::move(inl);
+        // The unit's interval index gives us every function and inlined
+        // subroutine covering the address in nesting order; the inline call
+        // chain is the entries below our function.
+        for (auto &die : function.getUnit()->functionsForAddress(objIp)) {
+            if (die.getOffset() <= function.getOffset())
+                continue;
+            if (die.tag() != Dwarf::DW_TAG_inlined_subroutine)
+                break; // a nested subprogram ends the chain.
+            inlined.push_back(die);
         }
     }
     if (functionOffset == std::numeric_limits<Elf::Addr>::max()) {
@@ -408,6 +452,101 @@ operator << (std::ostream &os, const JSON<ThreadStack, const Process *> &ts)
         .field("ti_stack", ts.object.stack, ts.context);
 }
 
+/*
+ * Binary stack output, for consumers that find JSON itself the bottleneck.
+ *
+ * The stream opens with the 8-byte header "pstack01", then a sequence of
+ * records, each introduced by a one-byte tag:
+ *
+ *   's': u32 id, u32 length, then that many bytes - defines a string table
+ *        entry. Ids are assigned sequentially from 1; 0 means "no string".
+ *        Every string is defined before the first record that refers to it.
+ *
+ *   't': u64 tid, i32 lwpid, i32 type, i32 priority, u32 frame count, then
+ *        per frame: u64 ip, u64 function offset, u64 load address, u64
+ *        symbol value, u8 signal-trampoline flag, u32 function name, u32
+ *        symbol name, u32 source count, and u32 file + u32 line per source
+ *        entry. Names and files are string-table ids.
+ *
+ * Integers are in the byte order of the host that produced the stream.
+ */
+BinaryStackWriter::BinaryStackWriter(std::ostream &os_, const Process &proc_)
+    : os(os_), proc(proc_)
+{
+    os.write("pstack01", 8);
+}
+
+template <typename T> void
+BinaryStackWriter::put(T value)
+{
+    os.write(reinterpret_cast<const char *>(&value), sizeof value);
+}
+
+uint32_t
+BinaryStackWriter::stringId(const std::string &s)
+{
+    auto [it, isnew] = strings.emplace(s, uint32_t(strings.size() + 1));
+    if (isnew) {
+        put(uint8_t('s'));
+        put(it->second);
+        put(uint32_t(s.size()));
+        os.write(s.data(), s.size());
+    }
+    return it->second;
+}
+
+void
+BinaryStackWriter::dump(const ThreadStack &ts)
+{
+    // Flatten the frames (interning strings, which may emit table entries)
+    // before the thread record starts, so the record itself is contiguous.
+    struct Frame {
+        Elf::Addr ip, offset, loadaddr, symvalue;
+        bool trampoline;
+        uint32_t die, symbol;
+        std::vector<std::pair<uint32_t, uint32_t>> source;
+    };
+    std::vector<Frame> frames;
+    frames.reserve(ts.stack.size());
+    PstackOptions options;
+    for (const auto &frame : ts.stack) {
+        Dwarf::ProcessLocation location = frame.scopeIP(proc);
+        PrintableFrame pframe(proc, frame, 0, options);
+        Frame out;
+        out.ip = frame.rawIP();
+        out.offset = pframe.functionOffset;
+        out.loadaddr = location.elfReloc;
+        out.trampoline = frame.isSignalTrampoline;
+        out.die = pframe.dieName.empty() ? 0 : stringId(pframe.dieName);
+        const auto &sym = location.symbol();
+        out.symbol = sym ? stringId(sym->second) : 0;
+        out.symvalue = sym ? sym->first.st_value : 0;
+        for (const auto &[file, line] : location.source())
+            out.source.emplace_back(stringId(file), uint32_t(line));
+        frames.push_back(std::move(out));
+    }
+    put(uint8_t('t'));
+    put(uint64_t(ts.info.ti_tid));
+    put(int32_t(ts.info.ti_lid));
+    put(int32_t(ts.info.ti_type));
+    put(int32_t(ts.info.ti_pri));
+    put(uint32_t(frames.size()));
+    for (const auto &f : frames) {
+        put(uint64_t(f.ip));
+        put(uint64_t(f.offset));
+        put(uint64_t(f.loadaddr));
+        put(uint64_t(f.symvalue));
+        put(uint8_t(f.trampoline));
+        put(f.die);
+        put(f.symbol);
+        put(uint32_t(f.source.size()));
+        for (const auto &[file, line] : f.source) {
+            put(file);
+            put(line);
+        }
+    }
+}
+
 struct ArgPrint {
     const Process &p;
     const PrintableFrame &pframe;
@@ -446,7 +585,8 @@ operator << (std::ostream &os, const ProcPtr &pp) {
         base = DIE(base.attribute(DW_AT_type))) 
         ;
 
-    if (base && base.name() == "char") {
+    std::string backing;
+    if (base && base.name(backing) == "char") {
        std::string s = pp.proc.io->readString(pp.addr);
        os << "\"" << s << "\"";
     } else {
@@ -587,7 +727,8 @@ operator << (std::ostream &os, const ArgPrint &ap)
     for (auto child : location.die().children()) {
         switch (child.tag()) {
             case DW_TAG_formal_parameter: {
-                auto name = child.name();
+                std::string backing;
+                auto name = child.name(backing);
                 auto type = DIE(child.attribute(DW_AT_type));
                 Elf::Addr addr = 0;
                 os << sep << name;
@@ -629,9 +770,11 @@ std::ostream &operator << (std::ostream &os, Dwarf::UnwindMechanism mech) {
       case Dwarf::UnwindMechanism::MACHINEREGS: return os << "machine registers";
       case Dwarf::UnwindMechanism::DWARF: return os << "DWARF";
       case Dwarf::UnwindMechanism::FRAMEPOINTER: return os << "frame pointer";
+      case Dwarf::UnwindMechanism::FP_CHAIN: return os << "frame pointer chain";
       case Dwarf::UnwindMechanism::BAD_IP_RECOVERY: return os << "popped faulting IP";
       case Dwarf::UnwindMechanism::TRAMPOLINE: return os << "signal trampoline";
       case Dwarf::UnwindMechanism::LOGFILE: return os << "log file";
+      case Dwarf::UnwindMechanism::HEURISTIC: return os << "heuristic";
       case Dwarf::UnwindMechanism::INVALID: return os << "invalid";
    }
    abort();
@@ -650,10 +793,66 @@ Process::dumpStackText(std::ostream &os, const ThreadStack &thread,
     return os;
 }
 
+/*
+ * Demangle a symbol name (for -C), memoized: a dump resolves the same few
+ * hundred symbols over and over across threads, and __cxa_demangle is
+ * expensive, so each unique name is demangled once per run. Names that
+ * don't demangle map to themselves. Batch-mode workers print concurrently,
+ * so the cache is locked; node references stay stable across rehashes, so
+ * the returned reference is safe to use after the lock drops.
+ */
+static const std::string &
+demangle(const std::string &mangled)
+{
+    static std::unordered_map<std::string, std::string> cache;
+    static std::mutex cacheLock;
+    std::lock_guard<std::mutex> guard(cacheLock);
+    auto [it, isnew] = cache.emplace(mangled, "");
+    if (isnew) {
+        int status;
+        char *raw = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+        if (status == 0 && raw != nullptr) {
+            it->second = raw;
+            free(raw);
+        } else {
+            it->second = mangled;
+        }
+    }
+    return it->second;
+}
+
+void
+Process::foldStacks(const std::list<ThreadStack> &threads,
+        const PstackOptions &options, std::map<std::string, size_t> &counts) const
+{
+    for (auto &thread : threads) {
+        std::string line;
+        for (auto it = thread.stack.rbegin(); it != thread.stack.rend(); ++it) {
+            PrintableFrame pframe(*this, *it, 0, options);
+            std::string name = pframe.dieName;
+            if (name == "") {
+                auto location = it->scopeIP(*this);
+                if (location.valid()) {
+                    auto sym = location.symbol();
+                    if (sym)
+                        name = options.demangle ? demangle(sym->second) : sym->second;
+                }
+            }
+            if (name == "")
+                name = "[unknown]";
+            if (!line.empty())
+                line += ";";
+            line += name;
+        }
+        if (!line.empty())
+            ++counts[line];
+    }
+}
+
 std::ostream &
 Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe, const Dwarf::StackFrame &frame) const
 {
-
+    Stats::Timed timed(Stats::symbolize);
     IOFlagSave _(os);
 
     Dwarf::ProcessLocation location = pframe.frame.scopeIP(pframe.proc);
@@ -698,7 +897,7 @@ Process::dumpFrameText(std::ostream &os, const PrintableFrame &pframe, const Dwa
         if (pframe.dieName != "") {
             name = pframe.dieName;
         } else if (sym) {
-            name = sym->second;
+            name = pframe.options.demangle ? demangle(sym->second) : sym->second;
             flags += location.die() ? "%" : "!";
         } else {
             name = "<unknown>";
@@ -728,6 +927,18 @@ void
 Process::addElfObject(Elf::Object::sptr obj, Elf::Addr load)
 {
     objects[load] = obj;
+    // Rebuild the extent table. Quadratic over loads, but the object count is
+    // small, and loading finishes before any unwinding starts.
+    segments.clear();
+    for (const auto &loaded : objects)
+        for (const auto &hdr : loaded.second->getSegments(PT_LOAD))
+            if (hdr.p_memsz != 0)
+                segments.push_back({loaded.first + hdr.p_vaddr,
+                        loaded.first + hdr.p_vaddr + hdr.p_memsz,
+                        loaded.first, loaded.second, &hdr});
+    std::sort(segments.begin(), segments.end(),
+            [](const MappedSegment &l, const MappedSegment &r) { return l.end < r.end; });
+    lastSegment = 0;
     if (verbose >= 2) {
         IOFlagSave _(*debug);
         *debug << "object " << *obj->io << " loaded at address "
@@ -745,10 +956,20 @@ Process::loadSharedObjects(Elf::Addr rdebugAddr)
     struct r_debug rDebug;
     io->readObj(rdebugAddr, &rDebug);
 
+    struct PendingObject {
+        std::string path;
+        Elf::Addr mapAddr;
+        Elf::Addr loadAddr;
+    };
+    std::vector<PendingObject> pending;
+
     /* Iterate over the r_debug structure's entries, loading libraries */
+    linkMapSignature.clear();
+    psLookupCache.clear(); // the objects backing cached lookups may change.
     struct link_map map;
     for (auto mapAddr = Elf::Addr(rDebug.r_map); mapAddr != 0; mapAddr = Elf::Addr(map.l_next)) {
         io->readObj(mapAddr, &map);
+        linkMapSignature.push_back(Elf::Addr(map.l_addr));
 
         // If we see the executable, just add it in and avoid going through the path
         // replacement work
@@ -773,17 +994,84 @@ Process::loadSharedObjects(Elf::Addr rdebugAddr)
         std::string path = io->readString(Elf::Off(map.l_name));
         if (path == "")
             continue;
+        pending.push_back({path, mapAddr, Elf::Addr(map.l_addr)});
+    }
+
+    // Opening and parsing the images is the expensive part, and each is
+    // independent - load them concurrently, then register the results in
+    // link-map order. The link-map traversal above stays serial, as it
+    // walks pointers through target memory.
+    size_t nthreads = std::min(pending.size(), size_t(std::thread::hardware_concurrency()));
+    if (nthreads > 1) {
+        std::atomic<size_t> nextJob(0);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < nthreads; ++i)
+            workers.emplace_back([&] {
+                for (;;) {
+                    size_t j = nextJob++;
+                    if (j >= pending.size())
+                        return;
+                    try {
+                        imageCache.getImageForName(pending[j].path);
+                    }
+                    catch (const std::exception &e) {
+                        // failures reported when we register below.
+                    }
+                }
+            });
+        for (auto &w : workers)
+            w.join();
+    }
+
+    for (auto &obj : pending) {
         try {
-            addElfObject(imageCache.getImageForName(path), Elf::Addr(map.l_addr));
+            addElfObject(imageCache.getImageForName(obj.path), obj.loadAddr);
         }
         catch (const std::exception &e) {
-            std::clog << "warning: can't load text for '" << path << "' at " <<
-            (void *)mapAddr << "/" << (void *)map.l_addr << ": " << e.what() << "\n";
+            std::clog << "warning: can't load text for '" << obj.path << "' at " <<
+            (void *)obj.mapAddr << "/" << (void *)obj.loadAddr << ": " << e.what() << "\n";
             continue;
         }
     }
 }
 
+/*
+ * glibc's public r_debug carries no generation counter, so "did anything
+ * change" is answered by re-walking the link_map chain and comparing the
+ * load addresses against the last scan. That's a handful of word-sized
+ * reads; opening and parsing images is the expensive part, and we only do
+ * it when the chain actually changed. Objects that were dlclosed stay
+ * registered - symbolizing a stale address is no worse than it ever was.
+ */
+void
+Process::rescanSharedObjects()
+{
+    if (rdebugAddr == 0)
+        return;
+    try {
+        struct r_debug rDebug;
+        io->readObj(rdebugAddr, &rDebug);
+        if (rDebug.r_state != r_debug::RT_CONSISTENT)
+            return; // mid dlopen/dlclose - pick it up on the next sample.
+        std::vector<Elf::Addr> sig;
+        struct link_map map;
+        for (auto mapAddr = Elf::Addr(rDebug.r_map); mapAddr != 0;
+                mapAddr = Elf::Addr(map.l_next)) {
+            io->readObj(mapAddr, &map);
+            sig.push_back(Elf::Addr(map.l_addr));
+        }
+        if (sig != linkMapSignature) {
+            if (verbose >= 1)
+                *debug << "link map changed: rescanning shared objects\n";
+            loadSharedObjects(rdebugAddr);
+        }
+    }
+    catch (const Exception &) {
+        // Transient read failure (e.g., the target is exiting). Keep the
+        // state we have.
+    }
+}
+
 Elf::Addr
 Process::findRDebugAddr()
 {
@@ -823,26 +1111,172 @@ Process::findRDebugAddr()
     return 0;
 }
 
-namespace std {
+std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *>
+Process::findSegment(Elf::Addr addr) const
+{
+    // Adjacent frames overwhelmingly land in the same mapping, so try the
+    // last hit first. The index is atomic only so concurrent unwinders can
+    // race on it harmlessly; the table itself is immutable by then.
+    size_t cached = lastSegment.load(std::memory_order_relaxed);
+    if (cached < segments.size()) {
+        const auto &seg = segments[cached];
+        if (seg.start <= addr && addr < seg.end)
+            return std::make_tuple(seg.reloc, seg.obj, seg.phdr);
+    }
+    auto it = std::upper_bound(segments.begin(), segments.end(), addr,
+            [](Elf::Addr a, const MappedSegment &seg) { return a < seg.end; });
+    if (it != segments.end() && it->start <= addr) {
+        lastSegment.store(it - segments.begin(), std::memory_order_relaxed);
+        return std::make_tuple(it->reloc, it->obj, it->phdr);
+    }
+    return std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *>();
+}
+
+/*
+ * Decide how to unwind a frame whose address has no CFI. PLT stubs get the
+ * return-address-on-stack rule outright: the stub runs before any callee
+ * prologue, so the caller's return address is still on top of the stack
+ * (following the frame-pointer chain there would silently skip the calling
+ * function). For anything else - JIT pages, asm leaves - prefer an
+ * established-looking frame-pointer chain, falling back to top-of-stack.
+ * The verdict is derived from one sample frame and cached per code page, so
+ * heavily sampled JIT regions pay for the analysis once, not per frame.
+ */
+Process::HeuristicRule
+Process::unwindHeuristic(Elf::Addr ip, const Elf::CoreRegisters &regs) const
+{
+    auto page = ip & ~Elf::Addr(0xfff);
+    {
+        std::lock_guard<std::mutex> guard(codeLocationsLock);
+        auto it = heuristicRules.find(page);
+        if (it != heuristicRules.end())
+            return it->second;
+    }
+    auto rule = HeuristicRule::None;
+
+    auto [reloc, obj, phdr] = findSegment(ip);
+    (void)phdr;
+    if (obj != nullptr) {
+        for (const char *pltname : { ".plt", ".plt.sec", ".plt.got" }) {
+            const auto &sec = obj->getSection(pltname, SHT_PROGBITS);
+            if (sec && ip - reloc >= sec.shdr.sh_addr
+                    && ip - reloc < sec.shdr.sh_addr + sec.shdr.sh_size) {
+                rule = HeuristicRule::ReturnOnStack;
+                break;
+            }
+        }
+    }
+
+#if defined(__i386__) || defined(__amd64__)
+    if (rule == HeuristicRule::None) {
+        try {
+            Elf::Addr bp = BP(regs), sp = SP(regs);
+            Elf::Addr chain[2]; // saved BP, then return address.
+            if (bp > sp && io->read(bp, sizeof chain, (char *)chain) == sizeof chain
+                  && chain[0] > bp && looksLikeReturnAddress(chain[1]))
+                rule = HeuristicRule::FramePointer;
+            else if (scanForReturnAddress(sp))
+                rule = HeuristicRule::ReturnOnStack;
+        }
+        catch (const Exception &) {
+            // unreadable stack: no heuristic applies.
+        }
+    }
+#else
+    (void)regs;
+#endif
+
+    if (verbose >= 2)
+        *debug << "heuristic unwind rule for page " << (void *)page << ": "
+               << int(rule) << "\n";
+    std::lock_guard<std::mutex> guard(codeLocationsLock);
+    heuristicRules.emplace(page, rule);
+    return rule;
+}
+
 bool
-operator < (const std::pair<Elf::Addr, Elf::Object::sptr> &entry, Elf::Addr addr) {
-   return entry.first < addr;
+Process::looksLikeReturnAddress(Elf::Addr addr) const
+{
+    if (addr < 4096)
+        return false;
+    // The target must be executable code, or a region we know nothing about
+    // (JIT allocations aren't in the segment table).
+    auto [reloc, obj, phdr] = findSegment(addr);
+    (void)reloc;
+    if (obj != nullptr && (phdr->p_flags & PF_X) == 0)
+        return false;
+#if defined(__i386__) || defined(__amd64__)
+    // The bytes just before a genuine return address decode as a call:
+    // E8 rel32, or FF /2 / FF /3 in one of its addressing forms. This is
+    // what separates return addresses from stale code pointers spilled on
+    // the stack.
+    unsigned char insn[7];
+    try {
+        if (io->read(addr - sizeof insn, sizeof insn, (char *)insn) != sizeof insn)
+            return false;
+    }
+    catch (const Exception &) {
+        return false;
+    }
+    if (insn[sizeof insn - 5] == 0xE8)
+        return true;
+    for (size_t len : { 2, 3, 4, 6, 7 }) {
+        auto op = insn + sizeof insn - len;
+        if (op[0] == 0xFF && ((op[1] >> 3) & 7) >= 2 && ((op[1] >> 3) & 7) <= 3)
+            return true;
+    }
+    return false;
+#else
+    return true;
+#endif
 }
+
+std::optional<std::pair<Elf::Addr, Elf::Addr>>
+Process::scanForReturnAddress(Elf::Addr sp) const
+{
+    // A frameless function's return address is rarely more than a few
+    // spill slots above the stack pointer; a small window keeps the false
+    // positive exposure down.
+    Elf::Addr words[32];
+    size_t rc;
+    try {
+        rc = io->read(sp, sizeof words, (char *)words) / sizeof words[0];
+    }
+    catch (const Exception &) {
+        return std::nullopt;
+    }
+    for (size_t i = 0; i < rc; ++i)
+        if (looksLikeReturnAddress(words[i]))
+            return std::make_pair(words[i], sp + (i + 1) * sizeof words[0]);
+    return std::nullopt;
 }
 
-std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *>
-Process::findSegment(Elf::Addr addr) const
+size_t
+ObjectOverlayReader::read(Off off, size_t count, char *ptr) const
 {
-    auto it = std::lower_bound(objects.begin(), objects.end(), addr);
-    if (it != objects.begin()) {
-       --it;
-       if (it->first  + it->second->endVA() >= addr) {
-           auto segment = it->second->getSegmentForAddress(addr - it->first);
-           if (segment)
-               return std::make_tuple(it->first, it->second, segment);
-       }
+    auto [reloc, obj, phdr] = proc.findSegment(off);
+    // Only serve segments mapped read-only: writable mappings (data, bss,
+    // and anything RELRO - the phdr still has PF_W) may have diverged from
+    // the file, so those must come from the target.
+    if (obj != nullptr && (phdr->p_flags & PF_W) == 0) {
+        Off segOff = off - reloc - phdr->p_vaddr;
+        if (segOff < phdr->p_filesz) {
+            auto fromFile = std::min(Off(count), Off(phdr->p_filesz) - segOff);
+            auto rc = obj->io->read(phdr->p_offset + segOff, fromFile, ptr);
+            if (rc < count) {
+                // The read crossed out of the segment (or came up short);
+                // satisfy the remainder from the target.
+                try {
+                    rc += upstream->read(off + rc, count - rc, ptr + rc);
+                }
+                catch (const Exception &) {
+                    // the partial read stands on its own.
+                }
+            }
+            return rc;
+        }
     }
-    return std::tuple<Elf::Addr, Elf::Object::sptr, const Elf::Phdr *>();
+    return upstream->read(off, count, ptr);
 }
 
 std::tuple<Elf::Object::sptr, Elf::Addr, Elf::Sym>
@@ -881,9 +1315,20 @@ Process::~Process()
     td_ta_delete(agent);
 }
 
+Dwarf::StackFrame &
+ThreadStack::addFrame(Dwarf::UnwindMechanism mechanism, const Elf::CoreRegisters &regs)
+{
+    auto pooled = new (frameArena->allocate(sizeof (Elf::CoreRegisters),
+                alignof (Elf::CoreRegisters))) Elf::CoreRegisters(regs);
+    stack.emplace_back(mechanism, pooled);
+    return stack.back();
+}
+
 void
-ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
+ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, const PstackOptions &options, unsigned maxFrames)
 {
+    if (frameArena == nullptr) // getStacks normally installs a shared one.
+        frameArena = std::make_shared<Dwarf::Arena>();
     stack.clear();
     stack.reserve(20);
 
@@ -895,7 +1340,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
 #endif
 
     try {
-        stack.emplace_back(Dwarf::UnwindMechanism::MACHINEREGS, regs);
+        addFrame(Dwarf::UnwindMechanism::MACHINEREGS, regs);
 
         // Set up the first frame using the machine context registers
         stack.front().setCoreRegs(regs);
@@ -903,12 +1348,43 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
         for (size_t frameCount = 0; frameCount < maxFrames; frameCount++) {
             auto &prev = stack.back();
 
+#if defined(__i386__) || defined(__amd64__)
+            // Fast mode for frame-pointer builds: follow the saved
+            // BP/return-address pair directly instead of executing CFI. Each
+            // hop is validated - the new BP must be above the old one, and
+            // the return address must land in an executable segment - and any
+            // inconsistency falls through to full DWARF unwinding for this
+            // frame. We don't trust the chain for the topmost frame (the IP
+            // may be in a prologue before BP is established) or just above a
+            // signal trampoline.
+            if (options.fpunwind && frameCount > 0 && !prev.isSignalTrampoline
+                  && prev.rawIP() != 0) {
+                Elf::Addr oldBp = BP((*prev.regs));
+                if (oldBp == 0)
+                    break; // null base pointer terminates the chain.
+                Elf::Addr chain[2]; // saved BP, then return address.
+                if (p.io->read(oldBp, sizeof chain, (char *)chain) == sizeof chain) {
+                    Dwarf::ProcessLocation retLoc = { p, chain[1] };
+                    if (chain[0] > oldBp && retLoc.valid()
+                          && (retLoc.codeloc->phdr_->p_flags & PF_X) != 0) {
+                        Elf::CoreRegisters newRegs = *prev.regs;
+                        SP(newRegs) = oldBp + ELF_BYTES * 2;
+                        BP(newRegs) = chain[0];
+                        IP(newRegs) = chain[1];
+                        prev.cfa = oldBp + ELF_BYTES * 2;
+                        addFrame(Dwarf::UnwindMechanism::FP_CHAIN, newRegs);
+                        continue;
+                    }
+                }
+            }
+#endif
+
             try {
                 auto maybeNewRegs = prev.unwind(p);
                 if (!maybeNewRegs)
                     break;
                 auto &newRegs = *maybeNewRegs;
-                stack.emplace_back(Dwarf::UnwindMechanism::DWARF, newRegs);
+                addFrame(Dwarf::UnwindMechanism::DWARF, newRegs);
 #ifdef __aarch64__
                 auto &cur = stack.back();
                 if (newRegs.pc == trampoline)
@@ -945,25 +1421,25 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
 
 
                 if (stack.size() == 1 || stack[stack.size() - 2].isSignalTrampoline) {
-                    Dwarf::ProcessLocation badip = { p, IP(prev.regs) };
+                    Dwarf::ProcessLocation badip = { p, IP((*prev.regs)) };
                     if (!badip.valid() || (badip.codeloc->phdr_->p_flags & PF_X) == 0) {
 
-                        auto newRegs = prev.regs; // start with a copy of prev frames regs.
+                        auto newRegs = *prev.regs; // start with a copy of prev frames regs.
 #if defined(__amd64__) || defined(__i386__)
                         // get stack pointer in the current frame, and read content of TOS
-                        auto sp = SP(prev.regs);
+                        auto sp = SP((*prev.regs));
                         Elf::Addr ip;
                         auto in = p.io->read(sp, sizeof ip, (char *)&ip);
                         if (in == sizeof ip) {
                             SP(newRegs) = sp + sizeof ip;
                             IP(newRegs) = ip;             // .. insn pointer.
-                            stack.emplace_back(Dwarf::UnwindMechanism::BAD_IP_RECOVERY, newRegs);
+                            addFrame(Dwarf::UnwindMechanism::BAD_IP_RECOVERY, newRegs);
                             continue;
                         }
 
 #elif defined(__aarch64__)
-                        newRegs.pc = prev.regs.regs[30]; // Copy old link register into new instruction pointer.
-                        stack.emplace_back(Dwarf::UnwindMechanism::BAD_IP_RECOVERY, newRegs);
+                        newRegs.pc = prev.regs->regs[30]; // Copy old link register into new instruction pointer.
+                        addFrame(Dwarf::UnwindMechanism::BAD_IP_RECOVERY, newRegs);
                         continue;
 #endif
 
@@ -979,13 +1455,13 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
                        siginfo_t si;
                        ucontext_t uc;
                     };
-                    auto sigframe = p.io->readObj<rt_sigframe>(prev.regs.sp);
+                    auto sigframe = p.io->readObj<rt_sigframe>(prev.regs->sp);
                     Elf::CoreRegisters newRegs;
                     for (int i = 0; i < 31; ++i)
                        newRegs.regs[i] = sigframe.uc.uc_mcontext.regs[i];
                     newRegs.sp = sigframe.uc.uc_mcontext.sp;
                     newRegs.pc = sigframe.uc.uc_mcontext.pc;
-                    stack.emplace_back(Dwarf::UnwindMechanism::TRAMPOLINE, newRegs);
+                    addFrame(Dwarf::UnwindMechanism::TRAMPOLINE, newRegs);
                     continue;
                 }
 
@@ -1002,11 +1478,11 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
                     // whether this is realtime or "classic" frame
                     auto restoreSym = obj->findDebugSymbol("__restore");
                     if (restoreSym.st_shndx != SHN_UNDEF && objip == restoreSym.st_value)
-                        sigContextAddr = SP(prev.regs) + 4;
+                        sigContextAddr = SP((*prev.regs)) + 4;
                     else {
                         auto restoreRtSym = obj->findDebugSymbol("__restore_rt");
                         if (restoreRtSym.st_shndx != SHN_UNDEF && objip == restoreRtSym.st_value)
-                            sigContextAddr = p.io->readObj<Elf::Addr>(SP(prev.regs) + 8) + 20;
+                            sigContextAddr = p.io->readObj<Elf::Addr>(SP((*prev.regs)) + 8) + 20;
                     }
                     if (sigContextAddr != 0) {
                        // This mapping is based on DWARF regnos, and ucontext.h
@@ -1014,13 +1490,30 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
                        p.io->readObj(sigContextAddr, &regs);
                        Elf::CoreRegisters core;
                        gregset2core(core, regs);
-                       stack.emplace_back(Dwarf::UnwindMechanism::TRAMPOLINE, core);
+                       addFrame(Dwarf::UnwindMechanism::TRAMPOLINE, core);
                        continue;
                     }
                 }
 #endif
 
 #if defined(__i386__) || defined(__amd64__)
+                // No usable CFI is the common reason we land here: consult
+                // the cached per-region heuristic. PLT stubs and frameless
+                // JIT/asm code leave the return address on top of the
+                // stack; a frame-pointer verdict falls through to the chain
+                // walk below.
+                if (p.unwindHeuristic(prev.rawIP(), *prev.regs)
+                        == Process::HeuristicRule::ReturnOnStack) {
+                    auto hit = p.scanForReturnAddress(SP((*prev.regs)));
+                    if (hit) {
+                        Elf::CoreRegisters newRegs = *prev.regs;
+                        IP(newRegs) = hit->first;
+                        SP(newRegs) = hit->second;
+                        addFrame(Dwarf::UnwindMechanism::HEURISTIC, newRegs);
+                        continue;
+                    }
+                }
+
                 // frame-pointer unwinding.
                 // Use ebp/rbp to find return address and saved BP.
                 // Restore those, and the stack pointer itself.
@@ -1031,7 +1524,7 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
                 // unwinding is finished.
                 if (prev.rawIP() != 0) {
                    Elf::Addr newBp, newIp, oldBp;
-                   oldBp = BP(prev.regs);
+                   oldBp = BP((*prev.regs));
                    if (oldBp == 0) {
                       // null base pointer means we're done.
                       break;
@@ -1039,12 +1532,11 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
                    p.io->readObj(oldBp + ELF_BYTES, &newIp);
                    p.io->readObj(oldBp, &newBp);
                    if (newBp > oldBp && newIp > 4096) {
-                       Elf::CoreRegisters newRegs = prev.regs;
+                       Elf::CoreRegisters newRegs = *prev.regs;
                        SP(newRegs) = oldBp + ELF_BYTES * 2;
                        BP(newRegs) = newBp;
                        IP(newRegs) = newIp;
-                       stack.emplace_back(Dwarf::UnwindMechanism::FRAMEPOINTER, newRegs);
-                       stack.back().cfa = newBp;
+                       addFrame(Dwarf::UnwindMechanism::FRAMEPOINTER, newRegs).cfa = newBp;
                        continue;
                    }
                 }
@@ -1061,6 +1553,8 @@ ThreadStack::unwind(Process &p, Elf::CoreRegisters &regs, unsigned maxFrames)
 
 std::shared_ptr<Process>
 Process::load(Elf::Object::sptr exec, std::string id, const PstackOptions &options, Dwarf::ImageCache &imageCache) {
+    Stats::Timed timed(Stats::attach);
+    Trace::Span span("process", [&] { return "load " + id; });
     pid_t pid;
     std::istringstream(id) >> pid;
     std::shared_ptr<Process> proc;
@@ -1070,10 +1564,32 @@ Process::load(Elf::Object::sptr exec, std::string id, const PstackOptions &optio
        else
           throw Exception() << "process " << pid << ": " << strerror(errno);
     } else {
-       // don't use imagecache for cores. We don't want to mmap them (they can
-       // be enormous, esp. from a leaky process), use loadFile and a caching
-       // reader on the underlying file instead.
-       auto core = std::make_shared<Elf::Object>(imageCache, loadFile(id));
+       // don't use imagecache for cores, but do map them: the mapping only
+       // faults in the pages we touch, the kernel can discard them under
+       // pressure (they're clean, file-backed), and repeated reads within a
+       // segment become plain memory accesses instead of syscalls. Cores on
+       // filesystems that can't be mapped fall back to a sparse-aware pread
+       // reader - holes (most of a sparse heap core) cost no IO - behind a
+       // page cache sized for scanning rather than the small default.
+       Reader::csptr coreIO;
+       if (HttpReader::isUrl(id)) {
+          // a core archived in object storage: symbolize it in place over
+          // HTTP range requests (loadFile stacks the block cache).
+          coreIO = loadFile(id);
+       }
+       struct stat s {};
+       if (stat(id.c_str(), &s) == 0 && S_ISREG(s.st_mode) && s.st_size > 0) {
+          try {
+             coreIO = std::make_shared<MmapReader>(id);
+          }
+          catch (const Exception &) {
+             // fall through to pread-based access.
+          }
+       }
+       if (!coreIO)
+          coreIO = std::make_shared<CacheReader>(
+                std::make_shared<SparseFileReader>(id), 64 * 1024, 64);
+       auto core = std::make_shared<Elf::Object>(imageCache, coreIO);
        if (core->getHeader().e_type != ET_CORE)
           return nullptr; // image is ELF, but not a core - just return null
        proc = std::make_shared<CoreProcess>(exec, core, options, imageCache);
@@ -1082,8 +1598,73 @@ Process::load(Elf::Object::sptr exec, std::string id, const PstackOptions &optio
     return proc;
 }
 
+namespace {
+
+// How much of each thread's stack --snapshot captures.
+constexpr size_t stackSnapshotSize = 64 * 1024;
+
+/*
+ * Serves reads from stack ranges captured while the target was stopped,
+ * falling back to the live process for anything else. Installed as the
+ * process reader in snapshot mode, so unwinding and argument printing work
+ * against a consistent copy of the stacks after the target is resumed.
+ */
+class StackSnapshotReader final : public Reader {
+    struct Range {
+        Elf::Addr start;
+        std::vector<char> data;
+    };
+    std::vector<Range> ranges; // sorted by start.
+public:
+    Reader::sptr live;
+    StackSnapshotReader(Reader::sptr live_) : live(std::move(live_)) {}
+    void capture(Elf::Addr addr, size_t len) {
+        Range r { addr, std::vector<char>(len) };
+        try {
+            r.data.resize(live->read(addr, len, r.data.data()));
+        }
+        catch (const std::exception &) {
+            return; // can't read this stack; reads will go to the live image.
+        }
+        if (!r.data.empty())
+            ranges.push_back(std::move(r));
+    }
+    void seal() {
+        std::sort(ranges.begin(), ranges.end(),
+                [](const Range &l, const Range &r) { return l.start < r.start; });
+    }
+    size_t read(Off off, size_t count, char *ptr) const override {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), Elf::Addr(off),
+                [](Elf::Addr a, const Range &r) { return a < r.start; });
+        if (it != ranges.begin()) {
+            --it;
+            if (Elf::Addr(off) < it->start + it->data.size()) {
+                size_t at = off - it->start;
+                size_t chunk = std::min(count, it->data.size() - at);
+                memcpy(ptr, it->data.data() + at, chunk);
+                return chunk;
+            }
+        }
+        return live->read(off, count, ptr);
+    }
+    void describe(std::ostream &os) const override {
+        os << "stack snapshot of ";
+        live->describe(os);
+    }
+    Off size() const override { return live->size(); }
+    std::string filename() const override { return live->filename(); }
+};
+
+}
+
 std::list<ThreadStack>
-Process::getStacks(const PstackOptions &options, unsigned maxFrames) {
+Process::getStacks(const PstackOptions &options, unsigned maxFrames,
+        const std::function<void(const ThreadStack &)> &streamed) {
+    Stats::Timed timed(Stats::unwind);
+    // If an earlier snapshot pass replaced the reader (looping with -b),
+    // revert to the live one before stopping the process again.
+    if (auto prior = std::dynamic_pointer_cast<StackSnapshotReader>(io))
+        io = prior->live;
     std::list<ThreadStack> threadStacks;
     std::set<pid_t> tracedLwps;
     StopProcess processSuspender(this);
@@ -1095,22 +1676,50 @@ Process::getStacks(const PstackOptions &options, unsigned maxFrames) {
      * threading systems where there is not a 1:1 correspondence between
      * userland pthreads and kernel LWPs
      */
-    listThreads([this, &threadStacks, &tracedLwps, maxFrames] (
-                       const td_thrhandle_t *thr) {
-        Elf::CoreRegisters regs;
-        td_err_e the;
+    // Phase one: snapshot the register state for every thread while the
+    // thread_db agent walks them. The unwinds themselves are deferred -
+    // they're independent of each other once the registers are captured, so
+    // they can run in parallel below.
+    std::vector<std::pair<ThreadStack *, Elf::CoreRegisters>> toUnwind;
+
+    // Prefer the direct walk of the C library's thread list when available -
+    // it needs a couple of reads per thread where thread_db makes dozens.
+    // The fallthrough LWP loop below covers anything it misses.
+    std::vector<std::pair<Elf::Addr, lwpid_t>> fastThreads;
+    if (enumerateThreadsFast(fastThreads)) {
+        if (verbose >= 2)
+            *debug << "enumerated " << fastThreads.size()
+                   << " threads from the C library's thread list\n";
+        for (auto &fast : fastThreads) {
+            Elf::CoreRegisters regs;
+            if (getRegs(fast.second, &regs)) {
+                threadStacks.push_back(ThreadStack());
+                auto &info = threadStacks.back().info;
+                info.ti_tid = thread_t(fast.first);
+                info.ti_lid = fast.second;
+                info.ti_type = TD_THR_USER;
+                toUnwind.emplace_back(&threadStacks.back(), regs);
+                tracedLwps.insert(fast.second);
+            }
+        }
+    } else {
+        listThreads([this, &threadStacks, &tracedLwps, &toUnwind] (
+                           const td_thrhandle_t *thr) {
+            Elf::CoreRegisters regs;
+            td_err_e the;
 #ifdef __linux__
-        the = td_thr_getgregs(thr, (elf_greg_t *) &regs);
+            the = td_thr_getgregs(thr, (elf_greg_t *) &regs);
 #else
-        the = td_thr_getgregs(thr, &regs);
+            the = td_thr_getgregs(thr, &regs);
 #endif
-        if (the == TD_OK) {
-            threadStacks.push_back(ThreadStack());
-            td_thr_get_info(thr, &threadStacks.back().info);
-            threadStacks.back().unwind(*this, regs, maxFrames);
-            tracedLwps.insert(threadStacks.back().info.ti_lid);
-        }
-    });
+            if (the == TD_OK) {
+                threadStacks.push_back(ThreadStack());
+                td_thr_get_info(thr, &threadStacks.back().info);
+                toUnwind.emplace_back(&threadStacks.back(), regs);
+                tracedLwps.insert(threadStacks.back().info.ti_lid);
+            }
+        });
+    }
 
      /*
       * Now find LWPs, the kernel scheduled entities.  If we saw a thread above
@@ -1129,10 +1738,78 @@ Process::getStacks(const PstackOptions &options, unsigned maxFrames) {
             threadStacks.back().info.ti_lid = lwp.first;
             Elf::CoreRegisters regs;
             getRegs(lwp.first,  &regs);
-            threadStacks.back().unwind(*this, regs, maxFrames);
+            toUnwind.emplace_back(&threadStacks.back(), regs);
         }
     }
 
+#ifdef SP
+    if (options.snapshot) {
+        // Capture the top of every stack while still stopped, let the target
+        // run again, and then install the snapshot as the process reader:
+        // everything from here on reads the copy where possible. The link
+        // map and images were loaded at attach, so nothing else is needed
+        // from the stopped process.
+        auto snap = std::make_shared<StackSnapshotReader>(io);
+        for (auto &job : toUnwind)
+            snap->capture(SP(job.second), stackSnapshotSize);
+        snap->seal();
+        processSuspender.clear();
+        io = snap;
+    }
+#endif
+
+    // Phase two: unwind. The walks only read memory (or the snapshot), so
+    // fan them out over a worker pool - wall-clock stop time then scales
+    // with cores rather than thread count. The DWARF, CFI and reader caches
+    // involved are all safe to share between unwinders.
+    // Stream finished stacks in thread order as the pool completes them:
+    // the first stack can be printed while later threads are still being
+    // walked, instead of waiting for the slowest one.
+    std::mutex streamLock;
+    size_t streamCursor = 0;
+    std::vector<bool> unwound(toUnwind.size(), false);
+    auto complete = [&](size_t i) {
+        if (!streamed)
+            return;
+        std::lock_guard<std::mutex> guard(streamLock);
+        unwound[i] = true;
+        while (streamCursor < toUnwind.size() && unwound[streamCursor])
+            streamed(*toUnwind[streamCursor++].first);
+    };
+
+    // Each worker shares one register arena between all the stacks it
+    // unwinds - a whole dump is then a handful of chunk allocations, not one
+    // register block per frame. Per-worker arenas keep the bump allocator
+    // lock-free; the stacks hold shared references, so lifetime is
+    // unaffected by which worker unwound what.
+    auto unwindOne = [this, &toUnwind, &options, maxFrames, &complete](
+            size_t i, const std::shared_ptr<Dwarf::Arena> &arena) {
+        Trace::Span span("unwind", [&] {
+                return "thread " + std::to_string(toUnwind[i].first->info.ti_lid); });
+        toUnwind[i].first->frameArena = arena;
+        toUnwind[i].first->unwind(*this, toUnwind[i].second, options, maxFrames);
+        complete(i);
+    };
+    size_t nworkers = std::min(toUnwind.size(),
+            size_t(std::thread::hardware_concurrency()));
+    if (nworkers > 1) {
+        std::atomic<size_t> nextJob(0);
+        std::vector<std::thread> workers;
+        workers.reserve(nworkers);
+        for (size_t t = 0; t < nworkers; ++t)
+            workers.emplace_back([&toUnwind, &nextJob, &unwindOne]() {
+                auto arena = std::make_shared<Dwarf::Arena>();
+                for (size_t i; (i = nextJob++) < toUnwind.size();)
+                    unwindOne(i, arena);
+            });
+        for (auto &w : workers)
+            w.join();
+    } else {
+        auto arena = std::make_shared<Dwarf::Arena>();
+        for (size_t i = 0; i < toUnwind.size(); ++i)
+            unwindOne(i, arena);
+    }
+
     /*
      * if we don't need to print arguments to functions, we now have the full
      * backtrace and don't need to read anything more from the process.
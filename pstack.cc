@@ -4,6 +4,9 @@
 #include "libpstack/proc.h"
 #include "libpstack/fs.h"
 #include "libpstack/ps_callback.h"
+#include "libpstack/stats.h"
+#include "libpstack/budget.h"
+#include "libpstack/trace.h"
 #if defined(WITH_PYTHON2) || defined(WITH_PYTHON3)
 #define WITH_PYTHON
 #include "libpstack/python.h"
@@ -11,6 +14,9 @@
 
 #include <sys/types.h>
 #include <sys/signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <sysexits.h>
@@ -18,31 +24,221 @@
 
 #include <csignal>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <set>
+#include <sstream>
+#include <thread>
 
 #define XSTR(a) #a
 #define STR(a) XSTR(a)
 
 namespace {
-bool doJson = false;
+enum class OutputFormat { text, json, binary };
+OutputFormat outputFormat = OutputFormat::text;
 volatile bool interrupted = false;
 
+// Per-thread hashes of the previous sample's raw IP vectors when looping
+// with -b. Most threads of a wedged process are parked in the same
+// poll/condwait stack every sample; a thread whose IPs haven't moved is
+// emitted as a one-line marker instead of being symbolized and printed
+// again, which is where nearly all the per-sample cost goes.
+struct DiffState {
+    std::map<lwpid_t, size_t> previous;
+};
+
 void
-pstack(Process &proc, const PstackOptions &options, int maxFrames)
+pstack(Process &proc, const PstackOptions &options, int maxFrames, DiffState *diff = nullptr)
 {
-    const auto &threadStacks = proc.getStacks(options, maxFrames);
     auto &os = *options.output;
-    if (doJson) {
+    switch (outputFormat) {
+    case OutputFormat::json: {
+        const auto &threadStacks = proc.getStacks(options, maxFrames);
         os << json(threadStacks, const_cast<const Process*>(&proc));
-    } else {
+        break;
+    }
+    case OutputFormat::binary: {
+        // the writer streams each stack as it completes, like the text path.
+        BinaryStackWriter writer(os, proc);
+        proc.getStacks(options, maxFrames, [&] (const ThreadStack &s) {
+            writer.dump(s);
+        });
+        break;
+    }
+    case OutputFormat::text: {
+        // Stream each stack as its unwind completes - the first one appears
+        // while the remaining threads are still being walked.
         os << "process: " << *proc.io << "\n";
-        for (auto &s : threadStacks) {
+        std::map<lwpid_t, size_t> current;
+        proc.getStacks(options, maxFrames, [&] (const ThreadStack &s) {
+            if (diff != nullptr) {
+                size_t hash = 1099511628211ULL;
+                for (const auto &frame : s.stack)
+                    hash = (hash ^ frame.rawIP()) * 1099511628211ULL;
+                current[s.info.ti_lid] = hash;
+                auto prev = diff->previous.find(s.info.ti_lid);
+                if (prev != diff->previous.end() && prev->second == hash) {
+                    os << "thread: " << (void *)s.info.ti_tid << ", lwp: "
+                        << s.info.ti_lid << ", type: " << s.info.ti_type
+                        << " (unchanged)\n" << std::endl;
+                    return;
+                }
+            }
             proc.dumpStackText(os, s, options);
             os << std::endl;
+        });
+        if (diff != nullptr)
+            diff->previous = std::move(current);
+        break;
+    }
+    }
+}
+
+const char *
+formatName()
+{
+    switch (outputFormat) {
+    case OutputFormat::json: return "json";
+    case OutputFormat::binary: return "binary";
+    default: return "text";
+    }
+}
+
+// Minimal buffered streambuf over a connected socket, so the daemon can
+// drive the regular printing paths at a remote client.
+class FdStreamBuf : public std::streambuf {
+    int fd;
+    char buf[8192];
+public:
+    FdStreamBuf(int fd_) : fd(fd_) { setp(buf, buf + sizeof buf); }
+    ~FdStreamBuf() { sync(); }
+    int_type overflow(int_type c) override {
+        if (sync() == -1)
+            return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = char(c);
+            pbump(1);
         }
+        return c;
     }
+    int sync() override {
+        for (char *p = pbase(); p != pptr();) {
+            auto rc = ::write(fd, p, pptr() - p);
+            if (rc <= 0)
+                return -1;
+            p += rc;
+        }
+        setp(buf, buf + sizeof buf);
+        return 0;
+    }
+};
+
+/*
+ * Daemon mode: hold the image caches hot in a long-lived process, and serve
+ * dump requests over a unix socket. A request is a single line,
+ * "<format> <pid-or-core>"; the response is the dump output, streamed until
+ * close. Repeat dumps of processes built from already-seen binaries then
+ * cost only the ptrace stop and the unwind - all the ELF and DWARF parsing
+ * is amortized into the cache (and bounded by --memory-budget, if given).
+ */
+int
+runDaemon(const std::string &path, const PstackOptions &options,
+        Dwarf::ImageCache &imageCache, int maxFrames)
+{
+    // a dying client must not take the daemon with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        std::cerr << "socket path too long: " << path << "\n";
+        return EX_USAGE;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+    unlink(path.c_str());
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1
+            || bind(sock, (sockaddr *)&addr, sizeof addr) != 0
+            || listen(sock, 16) != 0) {
+        std::cerr << "can't listen on " << path << ": " << strerror(errno) << "\n";
+        return EX_OSERR;
+    }
+    if (verbose)
+        *debug << "pstackd listening on " << path << "\n";
+    for (;;) {
+        int conn = accept(sock, nullptr, nullptr);
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        std::string request;
+        for (char c; read(conn, &c, 1) == 1 && c != '\n';)
+            request += c;
+        auto sep = request.find(' ');
+        auto format = request.substr(0, sep);
+        auto target = sep == std::string::npos ? "" : request.substr(sep + 1);
+
+        FdStreamBuf streambuf(conn);
+        std::ostream os(&streambuf);
+        auto prevFormat = outputFormat;
+        outputFormat = format == "json" ? OutputFormat::json
+            : format == "binary" ? OutputFormat::binary : OutputFormat::text;
+        PstackOptions reqOptions = options;
+        reqOptions.output = &os;
+        if (verbose)
+            *debug << "pstackd: dump " << target << " as " << format << "\n";
+        try {
+            auto process = Process::load(nullptr, target, reqOptions, imageCache);
+            if (process != nullptr)
+                pstack(*process, reqOptions, maxFrames);
+            else
+                os << "error: no such process: " << target << "\n";
+        } catch (const std::exception &ex) {
+            os << "error: " << ex.what() << "\n";
+        }
+        outputFormat = prevFormat;
+        os.flush();
+        close(conn);
+    }
+    close(sock);
+    return 0;
+}
+
+// Forward one target to a daemon and relay its response.
+int
+remoteStack(const std::string &path, const std::string &target, const PstackOptions &options)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        std::cerr << "socket path too long: " << path << "\n";
+        return EX_USAGE;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof addr) != 0) {
+        std::cerr << "can't reach pstackd on " << path << ": "
+            << strerror(errno) << "\n";
+        return EX_UNAVAILABLE;
+    }
+    std::string request = std::string(formatName()) + " " + target + "\n";
+    for (size_t off = 0; off < request.size();) {
+        auto rc = write(fd, request.data() + off, request.size() - off);
+        if (rc <= 0) {
+            std::cerr << "can't send request: " << strerror(errno) << "\n";
+            close(fd);
+            return EX_IOERR;
+        }
+        off += rc;
+    }
+    char buf[8192];
+    for (ssize_t rc; (rc = read(fd, buf, sizeof buf)) > 0;)
+        options.output->write(buf, rc);
+    close(fd);
+    return 0;
 }
 
 // This is mostly for testing. We start the process, and run pstack when we see
@@ -187,6 +383,33 @@ bool pystack(Process &proc, const PstackOptions &options, bool showModules) {
 }
 #endif
 
+// Pre-build the persistent cache artifacts for one image - symbol address
+// index, synthesized unit ranges, compact unwind table - reporting how long
+// each took. Run from a deploy pipeline, this makes the first incident-time
+// pstack against a new release as fast as the hundredth. Artifacts that are
+// already cached just load, and report correspondingly small times.
+void
+warmImage(Dwarf::ImageCache &imageCache, const Elf::Object::sptr &obj, std::ostream &os)
+{
+    auto time = [](auto &&fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count() / 1000.0;
+    };
+    auto symbols = time([&] { obj->warmAddrIndex(); });
+    auto di = imageCache.getDwarf(obj);
+    // a lookup that misses .debug_aranges synthesizes (and persists) the
+    // unit range index for images that lack the section.
+    auto aranges = time([&] {
+            di->lookupUnit(std::numeric_limits<Elf::Addr>::max()); });
+    auto unwind = time([&] { di->compileCompactUnwind(); });
+    os << obj->io->filename()
+        << ": symbol index " << symbols
+        << "ms, unit ranges " << aranges
+        << "ms, compact unwind " << unwind << "ms\n";
+}
+
 int
 usage(std::ostream &os, const char *name, const Flags &options)
 {
@@ -205,6 +428,7 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
 {
     int maxFrames = 1024;
     double sleepTime = 0.0;
+    double profileDuration = 0.0;
     PstackOptions options;
     std::ofstream out;
 
@@ -215,6 +439,11 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
     std::vector<std::string> btLogs;
     std::string execName;
     bool printAllStacks = false;
+    bool dumpStats = false;
+    std::string daemonSocket;
+    std::string recordFile;
+    bool warmCaches = false;
+    std::string remoteSocket;
     int exitCode = -1; // used for options that exit immediately to signal exit.
     std::string subprocessCmd;
 
@@ -243,6 +472,14 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
             "repeat pstack, with `delay` seconds between each iteration (can be non-integer)",
             Flags::set(sleepTime))
 
+    .add("profile",
+            'P',
+            "duration",
+            "sample stacks repeatedly for `duration` seconds, then print aggregated\n"
+            "stack counts in collapsed (flamegraph) format. -b sets the sample\n"
+            "interval (default 0.01s)",
+            Flags::set(profileDuration))
+
     .add("elf-dump",
             'd',
             "ELF file",
@@ -261,6 +498,16 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
                 *options.output << json(*di);
                 exitCode = 0; })
 
+    .add("compile-unwind",
+            'u',
+            "ELF file",
+            "compile the image's call frame information into a compact unwind "
+            "table in the cache directory, speeding up later stack walks, and exit",
+            [&](const char *arg) {
+                auto obj = std::make_shared<Elf::Object>(imageCache, loadFile(arg));
+                auto di = std::make_shared<Dwarf::Info>(obj, imageCache);
+                exitCode = di->compileCompactUnwind() ? 0 : 1; })
+
     .add("depth",
             'r',
             "depth",
@@ -283,10 +530,32 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
             "attempt to show the value of arguments to functions",
             Flags::setf(options.doargs))
 
+    .add("demangle",
+            'C',
+            "demangle C++ symbol names (each unique name is demangled once,\n"
+            "so this beats piping through c++filt)",
+            Flags::setf(options.demangle))
+
     .add("json",
             'j',
             "use JSON output rather than plaintext",
-            Flags::setf(doJson))
+            [&]() { outputFormat = OutputFormat::json; })
+
+    .add("format",
+            'c',
+            "format",
+            "output format: \"text\" (default), \"json\" (as -j), or \"binary\",\n"
+            "a length-prefixed record stream with interned symbol/file names,\n"
+            "for machine consumers",
+            [&](const char *arg) {
+                if (strcmp(arg, "text") == 0)
+                    outputFormat = OutputFormat::text;
+                else if (strcmp(arg, "json") == 0)
+                    outputFormat = OutputFormat::json;
+                else if (strcmp(arg, "binary") == 0)
+                    outputFormat = OutputFormat::binary;
+                else
+                    usage(std::cerr, argv[0], flags); })
 
     .add("no-src",
             's',
@@ -298,6 +567,45 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
             "more debugging data. Can be repeated",
             [&]() { ++verbose; })
 
+    .add("snapshot",
+            'z',
+            "snapshot each thread's registers and the top of its stack, then "
+            "resume the process before unwinding, minimising the pause time "
+            "for latency-sensitive targets",
+            Flags::setf(options.snapshot))
+
+    .add("record",
+            'R',
+            "file",
+            "record a compact snapshot of the target into `file` instead of\n"
+            "printing stacks: registers, stack tops, link map and mapped-file\n"
+            "table, but no symbol data. Symbolize later (on any host with the\n"
+            "binaries and debug info) by running pstack on the snapshot file",
+            Flags::set(recordFile))
+
+    .add("warm",
+            'W',
+            "pre-build cache artifacts (symbol indexes, synthesized unit\n"
+            "ranges, compact unwind tables) for the given binaries, cores or\n"
+            "PIDs without dumping anything, and report per-artifact build\n"
+            "times. Run it from a deploy pipeline so the first pstack against\n"
+            "a new release pays no index-building cost",
+            Flags::setf(warmCaches))
+
+    .add("http-block-size",
+            'H',
+            "bytes",
+            "fetch granularity for http:// targets - larger blocks mean fewer\n"
+            "round trips, smaller ones fewer bytes transferred (default 65536)",
+            Flags::set(httpBlockSize))
+
+    .add("fp-unwind",
+            'f',
+            "walk the frame-pointer chain where it looks sane, rather than "
+            "using unwind info for every frame (fast, but requires the "
+            "target be built with frame pointers)",
+            Flags::setf(options.fpunwind))
+
     .add("no-threaddb",
             't',
             "don't use the thread_db functions to enumerate pthreads (just uses LWPs)",
@@ -320,6 +628,40 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
                std::clog << STR(VERSION) << "\n";
                exitCode = 0; })
 
+    .add("daemon",
+            'Q',
+            "socket",
+            "run as a persistent symbol-server daemon, serving dump requests "
+            "on the given unix socket",
+            Flags::set<std::string>(daemonSocket))
+
+    .add("remote",
+            'q',
+            "socket",
+            "forward the dump request to a pstackd daemon on `socket`",
+            Flags::set<std::string>(remoteSocket))
+
+    .add("memory-budget",
+            'B',
+            "megabytes",
+            "bound pstack's own cache memory: past this, least-recently-used "
+            "DWARF and reader caches are dropped and re-decoded on demand",
+            [&](const char *arg) {
+                Budget::limit = strtoul(arg, nullptr, 0) * 1024 * 1024; })
+
+    .add("trace",
+            'T',
+            "file",
+            "record a chrome://tracing profile of the run to `file`",
+            [&](const char *arg) { Trace::start(arg); })
+
+    .add("stats",
+            'S',
+            "dump cache and phase-timing statistics before exiting (as JSON with -j)",
+            [&]() {
+               dumpStats = true;
+               Stats::enabled = true; })
+
 #ifdef WITH_PYTHON
     .add("python-modules",
             'm',
@@ -375,10 +717,103 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
         return 0;
     }
 
+    if (daemonSocket != "")
+        return runDaemon(daemonSocket, options, imageCache, maxFrames);
+
     if (optind == argc && btLogs.empty())
         return usage(std::cerr, argv[0], flags);
 
-    auto doStack = [=, &options] (Process &proc) {
+    if (remoteSocket != "") {
+        int rc = 0;
+        for (int i = optind; i < argc; i++)
+            rc = std::max(rc, remoteStack(remoteSocket, argv[i], options));
+        return rc;
+    }
+
+    if (warmCaches) {
+        // Pre-stage cache artifacts for each target instead of dumping
+        // stacks. Targets warm concurrently; the shared image cache parses
+        // DSOs common to several targets once.
+        std::vector<std::string> targets(argv + optind, argv + argc);
+        std::vector<std::ostringstream> bufs(targets.size());
+        std::vector<std::string> errors(targets.size());
+        std::atomic<size_t> nextJob(0);
+        auto worker = [&] {
+            for (;;) {
+                size_t j = nextJob++;
+                if (j >= targets.size())
+                    return;
+                try {
+                    // PIDs and cores warm every mapped object; anything else
+                    // is treated as a single ELF image.
+                    auto process = Process::load(exec, targets[j], options,
+                            imageCache);
+                    if (process != nullptr)
+                        for (const auto &[addr, obj] : process->objects)
+                            warmImage(imageCache, obj, bufs[j]);
+                    else
+                        warmImage(imageCache,
+                                imageCache.getImageForName(targets[j]), bufs[j]);
+                } catch (const std::exception &e) {
+                    errors[j] = e.what();
+                }
+            }
+        };
+        size_t nworkers = std::min(targets.size(),
+                size_t(std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        workers.reserve(nworkers);
+        for (size_t t = 0; t < nworkers; ++t)
+            workers.emplace_back(worker);
+        for (auto &w : workers)
+            w.join();
+        int rc = 0;
+        for (size_t j = 0; j < targets.size(); ++j) {
+            if (errors[j] != "") {
+                std::cerr << "warming " << targets[j] << " failed: "
+                    << errors[j] << "\n";
+                rc = EX_SOFTWARE;
+            } else {
+                *options.output << bufs[j].str();
+            }
+        }
+        return rc;
+    }
+
+    auto doStack = [=] (Process &proc, const PstackOptions &options) {
+        if (recordFile != "") {
+            std::ofstream snap(recordFile, std::ios::binary | std::ios::trunc);
+            if (!snap)
+                throw (Exception() << "can't open " << recordFile << " for writing");
+            proc.recordSnapshot(snap);
+            return;
+        }
+        if (profileDuration != 0.0) {
+            // Aggregating profiler: sample every thread at the -b interval
+            // for the requested duration, counting identical stacks, and
+            // emit one "outer;...;leaf count" line per distinct stack.
+            double interval = sleepTime != 0.0 ? sleepTime : 0.01;
+            std::map<std::string, size_t> counts;
+            timeval start, now;
+            gettimeofday(&start, nullptr);
+            for (;;) {
+                proc.foldStacks(proc.getStacks(options, maxFrames), options, counts);
+                gettimeofday(&now, nullptr);
+                double elapsed = now.tv_sec - start.tv_sec
+                    + (now.tv_usec - start.tv_usec) / 1e6;
+                if (interrupted || elapsed >= profileDuration)
+                    break;
+                usleep(interval * 1000000);
+                proc.rescanSharedObjects();
+            }
+            for (auto &c : counts)
+                *options.output << c.first << " " << c.second << "\n";
+            return;
+        }
+        // When sampling repeatedly, carry the per-thread stack hashes from
+        // sample to sample so unchanged threads print as one line.
+        DiffState diff;
+        DiffState *diffp = sleepTime != 0.0 ? &diff : nullptr;
         while (!interrupted) {
 #if defined(WITH_PYTHON)
             if (doPython || printAllStacks) {
@@ -390,18 +825,84 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
             if (!doPython)
 #endif
             {
-                pstack(proc, options, maxFrames);
+                pstack(proc, options, maxFrames, diffp);
             }
-            if (sleepTime != 0.0)
+            if (sleepTime != 0.0) {
                 usleep(sleepTime * 1000000);
-            else
+                // Pick up anything dlopened since the last sample; a no-op
+                // walk of the link map when nothing changed.
+                proc.rescanSharedObjects();
+            } else {
                 break;
+            }
         }
     };
     if (!btLogs.empty()) {
        LogProcess lp{exec, btLogs, options, imageCache};
        lp.load();
-       doStack(lp);
+       doStack(lp, options);
+    } else if (argc - optind > 1 && sleepTime == 0.0 && profileDuration == 0.0) {
+        // Multiple one-shot targets: dump them concurrently. The image cache
+        // is shared, so common DSOs (libc, libstdc++, ...) are parsed once
+        // for the whole batch. Because an argument naming a plain executable
+        // applies to the targets after it, work out the (exec, target)
+        // pairing sequentially first. Each worker thread owns its targets
+        // end-to-end - ptrace tracership is per-thread, so the thread that
+        // attaches must be the one that reads registers and detaches.
+        struct Target { std::string id; Elf::Object::sptr exec; };
+        std::vector<Target> targets;
+        for (int i = optind; i < argc; i++) {
+            pid_t pid = 0;
+            std::istringstream(argv[i]) >> pid;
+            if (pid == 0) {
+                try {
+                    Elf::Object probe(imageCache, loadFile(argv[i]));
+                    if (probe.getHeader().e_type != ET_CORE) {
+                        exec = imageCache.getImageForName(argv[i]);
+                        continue;
+                    }
+                } catch (const std::exception &) {
+                    // not ELF at all - queue it so the worker reports the
+                    // failure in order with everything else.
+                }
+            }
+            targets.push_back({argv[i], exec});
+        }
+        std::vector<std::ostringstream> bufs(targets.size());
+        std::vector<std::string> errors(targets.size());
+        std::atomic<size_t> nextJob(0);
+        size_t nworkers = std::min(targets.size(),
+                size_t(std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+        workers.reserve(nworkers);
+        for (size_t t = 0; t < nworkers; ++t)
+            workers.emplace_back([&] {
+                for (;;) {
+                    size_t j = nextJob++;
+                    if (j >= targets.size())
+                        return;
+                    PstackOptions topts = options;
+                    topts.output = &bufs[j];
+                    try {
+                        auto process = Process::load(targets[j].exec,
+                                targets[j].id, topts, imageCache);
+                        if (process != nullptr)
+                            doStack(*process, topts);
+                    } catch (const std::exception &e) {
+                        errors[j] = e.what();
+                    }
+                }
+            });
+        for (auto &w : workers)
+            w.join();
+        // print in argument order, whatever order the dumps finished in.
+        for (size_t j = 0; j < targets.size(); ++j) {
+            if (errors[j] != "")
+                std::cerr << "trace of " << targets[j].id << " failed: "
+                    << errors[j] << "\n";
+            else
+                *options.output << bufs[j].str();
+        }
     } else {
         for (int i = optind; i < argc; i++) {
             try {
@@ -409,12 +910,21 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
                 if (process == nullptr)
                     exec = imageCache.getImageForName(argv[i]);
                 else
-                    doStack(*process);
+                    doStack(*process, options);
             } catch (const std::exception &e) {
                 std::cerr << "trace of " << argv[i] << " failed: " << e.what() << "\n";
             }
         }
     }
+    Trace::finish();
+    if (dumpStats) {
+        if (outputFormat == OutputFormat::json) {
+            Stats::dumpJSON(std::clog) << std::endl;
+        } else {
+            imageCache.dumpStats(std::clog);
+            Stats::dumpText(std::clog);
+        }
+    }
     return 0;
 }
 }
@@ -422,6 +932,12 @@ emain(int argc, char **argv, Dwarf::ImageCache &imageCache)
 int
 main(int argc, char **argv)
 {
+    // Give stdout a large buffer and cut it loose from stdio: dump output
+    // (especially -j) is token-dense, and flushing in megabyte blocks rather
+    // than per line keeps the formatting off the syscall path.
+    static char outputBuffer[1024 * 1024];
+    std::ios_base::sync_with_stdio(false);
+    std::cout.rdbuf()->pubsetbuf(outputBuffer, sizeof outputBuffer);
     try {
         Dwarf::ImageCache imageCache;
         struct sigaction sa;
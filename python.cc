@@ -2,6 +2,7 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <regex.h>
+#include <algorithm>
 #include "libpstack/global.h"
 #include "libpstack/proc.h"
 #include "libpstack/stringify.h"
@@ -46,6 +47,74 @@ getPyInterpInfo(const Process &proc) {
         V2HEX(major, minor)};
 }
 
+/*
+ * When the interpreter is statically linked into a stripped binary, none of
+ * the symbol-based approaches can work. As a last resort, scan the writable
+ * data of the loaded objects for something shaped like the interpreter list
+ * head. pstack already depends on PyInterpreterState starting with its
+ * "next" and "tstate_head" pointers (see printInterp), and a genuine thread
+ * state carries a back-pointer to its owning interpreter in its first few
+ * words, so a candidate costs only a couple of follow-up reads to vet.
+ */
+static std::tuple<Elf::Object::sptr, Elf::Addr, Elf::Addr>
+scanInterpHead(const Process &proc)
+{
+    auto mapped = [&proc](Elf::Addr addr) {
+        return addr != 0 && std::get<1>(proc.findSegment(addr)) != nullptr;
+    };
+
+    auto validInterp = [&](Elf::Addr interp) {
+        if (interp % sizeof (Elf::Addr) != 0 || !mapped(interp))
+            return false;
+        Elf::Addr state[2]; // next, tstate_head
+        try {
+            if (proc.io->read(interp, sizeof state, (char *)state) != sizeof state)
+                return false;
+            if (!mapped(state[1]) || (state[0] != 0 && !mapped(state[0])))
+                return false;
+            // The thread state's leading words hold list linkage and the
+            // back-pointer to the interpreter; its exact slot moved between
+            // versions, so accept it anywhere in the first four words.
+            Elf::Addr ts[4];
+            if (proc.io->read(state[1], sizeof ts, (char *)ts) != sizeof ts)
+                return false;
+            for (auto w : ts)
+                if (w == interp)
+                    return true;
+        }
+        catch (const std::exception &) {
+        }
+        return false;
+    };
+
+    constexpr size_t chunkSize = 65536;
+    std::vector<Elf::Addr> words(chunkSize / sizeof (Elf::Addr));
+    for (const auto &seg : proc.segments) {
+        if (seg.obj == nullptr || (seg.phdr->p_flags & PF_W) == 0)
+            continue;
+        for (Elf::Addr base = seg.start; base < seg.end; base += chunkSize) {
+            size_t count = std::min(Elf::Addr(chunkSize), seg.end - base);
+            size_t rc;
+            try {
+                rc = proc.io->read(base, count, (char *)words.data());
+            }
+            catch (const std::exception &) {
+                continue;
+            }
+            for (size_t i = 0; i < rc / sizeof (Elf::Addr); ++i) {
+                Elf::Addr headp = base + i * sizeof (Elf::Addr);
+                if (words[i] == 0 || words[i] == headp || !validInterp(words[i]))
+                    continue;
+                if (verbose)
+                    *debug << "found plausible interp_head at " << std::hex << headp
+                        << std::dec << " in " << *seg.obj->io << std::endl;
+                return std::make_tuple(seg.obj, seg.reloc, headp);
+            }
+        }
+    }
+    return std::make_tuple(nullptr, 0, 0);
+}
+
 std::tuple<Elf::Object::sptr, Elf::Addr, Elf::Addr>
 getInterpHead(const Process &proc) {
     // As a local python2 hack, we have a global variable pointing at interp_head
@@ -90,6 +159,13 @@ getInterpHead(const Process &proc) {
     }
 #endif
 
+    auto scanned = scanInterpHead(proc);
+    if (std::get<0>(scanned) != nullptr) {
+        if (verbose)
+            std::clog << "found python interpreter by scanning writable data" << std::endl;
+        return scanned;
+    }
+
     if (verbose)
         std::clog << "Couldn't find a python interpreter" << std::endl;
 
@@ -3,23 +3,109 @@
 #include <algorithm>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "libpstack/dwarf.h"
 #include "libpstack/python.h"
 
-// This reimplements PyCode_Addr2Line
-template<int PyV> int
-getLine(const Reader &proc, const PyCodeObject *code, const PyFrameObject *frame)
+/*
+ * Each inclusion of this file is compiled against one interpreter's headers,
+ * so anywhere the layout changed between interpreter versions we specialize
+ * at compile time on PY_VERSION_HEX rather than branching at runtime: the
+ * decode paths for the version the build targets carry no version tests.
+ */
+
+#if PY_VERSION_HEX >= 0x030b0000
+/*
+ * 3.11 moved the frame stack and interpreter bookkeeping into core-only
+ * structures whose headers cannot be included from C++. The offsets we need
+ * are exported by the C-only translation unit, pythonc.c.
+ */
+extern "C" {
+size_t pyInterpNextOff(void);
+size_t pyInterpThreadsHeadOff(void);
+size_t pyInterpModulesOff(void);
+size_t pyFrameCodeOff(void);
+size_t pyFramePrevOff(void);
+size_t pyFrameInstrOff(void);
+size_t pyFrameOwnerOff(void);
+size_t pyCodeAdaptiveOff(void);
+int pyFrameOwnedByCStack(void);
+}
+
+/*
+ * Decode the PEP-657 location table (co_linetable): each entry starts with a
+ * flagged byte carrying a 4-bit form code and a code-unit count, with line
+ * deltas encoded as 6-bit varints. Returns the line covering instruction
+ * offset "lasti" (in code units).
+ */
+static int
+getLocation(const std::vector<unsigned char> &table, int firstline, int lasti)
 {
-    auto lnotab = readPyObj<PyV, PyVarObject>(proc, Elf::Addr(code->co_lnotab));
+    int line = firstline;
+    int addr = 0;
+    size_t i = 0;
+    auto varint = [&]() {
+        unsigned v = 0;
+        int shift = 0;
+        unsigned char b;
+        do {
+            if (i == table.size())
+                return v;
+            b = table[i++];
+            v |= unsigned(b & 0x3f) << shift;
+            shift += 6;
+        } while ((b & 0x40) != 0);
+        return v;
+    };
+    auto svarint = [&]() {
+        unsigned v = varint();
+        return (v & 1) != 0 ? -int(v >> 1) : int(v >> 1);
+    };
+    while (i < table.size()) {
+        unsigned char first = table[i++];
+        int code = (first >> 3) & 15;
+        int units = (first & 7) + 1;
+        switch (code) {
+            case 15: // no location.
+                break;
+            case 14: // long form: line delta, then end line and columns.
+                line += svarint();
+                varint();
+                varint();
+                varint();
+                break;
+            case 13: // no column.
+                line += svarint();
+                break;
+            case 12: case 11: case 10: // one-line forms with columns.
+                line += code - 10;
+                // start and end column, one raw byte each: these forms are
+                // only emitted when both fit in a byte; only the long form
+                // carries varint columns.
+                i += 2;
+                break;
+            default: // short forms: same line, one column byte.
+                i += 1;
+                break;
+        }
+        addr += units;
+        if (addr > lasti)
+            break;
+    }
+    return line;
+}
+
+#else
 
-    unsigned char linedata[lnotab.ob_size];
-    proc.readObj(Elf::Addr(code->co_lnotab) + offsetof(PyBytesObject, ob_sval),
-            &linedata[0], lnotab.ob_size);
-    int line = code->co_firstlineno;
+// This reimplements PyCode_Addr2Line, over the cached line table.
+template<int PyV> int
+getLine(const typename PythonPrinter<PyV>::CodeMeta &meta, const PyFrameObject *frame)
+{
+    int line = meta.firstlineno;
     int addr = 0;
-    unsigned char *p = linedata;
-    unsigned char *e = linedata + lnotab.ob_size;
+    auto p = meta.lnotab.begin();
+    auto e = meta.lnotab.end();
     while (p < e) {
         addr += *p++;
         if (addr > frame->f_lasti) {
@@ -33,15 +119,18 @@ getLine(const Reader &proc, const PyCodeObject *code, const PyFrameObject *frame
     }
     return line;
 }
+#endif
 
 template <int PyV> class HeapPrinter final : public PythonTypePrinter<PyV> {
-    Elf::Addr print(const PythonPrinter<PyV> *pc, const PyObject *, const PyTypeObject *pto, Elf::Addr remote) const override {
+    Elf::Addr print(const PythonPrinter<PyV> *pc, const PyObject *pyo, const PyTypeObject *pto, Elf::Addr) const override {
         pc->os << pc->proc.io->readString(Elf::Addr(pto->tp_name));
         if (pto->tp_dictoffset > 0) {
             pc->os << "\n";
             pc->depth++;
-            PyObject *dictAddr;
-            pc->proc.io->readObj(remote + pto->tp_dictoffset, &dictAddr);
+            // the instance dict pointer lives inside the object body we
+            // already fetched - decode it locally rather than issuing
+            // another target read.
+            PyObject *dictAddr = *(PyObject * const *)((const char *)pyo + pto->tp_dictoffset);
             pc->print(Elf::Addr(dictAddr));
             pc->depth--;
             pc->os << "\n";
@@ -121,12 +210,22 @@ template <int PyV> class TypePrinter final : public PythonTypePrinter<PyV> {
 template <int PyV> class LongPrinter final : public PythonTypePrinter<PyV> {
     Elf::Addr print(const PythonPrinter<PyV> *pc, const PyObject *pyo, const PyTypeObject *, Elf::Addr) const override {
         auto plo = (PyLongObject *)pyo;
-        auto size = ((PyVarObject *)plo)->ob_size;
         intmax_t value = 0;
+#if PY_VERSION_HEX >= 0x030c0000
+        // 3.12 packs the digit count and sign into lv_tag.
+        const auto &lv = ((const _longobject *)plo)->long_value;
+        size_t ndigits = lv.lv_tag >> 3;
+        for (size_t i = 0; i < ndigits; ++i) {
+            value += intmax_t(lv.ob_digit[i]) << (PyLong_SHIFT * i);
+        }
+        if ((lv.lv_tag & 3) == 2) value *= -1;
+#else
+        auto size = ((PyVarObject *)plo)->ob_size;
         for (int i = 0; i < abs(size); ++i) {
             value += intmax_t(plo->ob_digit[i]) << (PyLong_SHIFT * i) ;
         }
         if (size < 0) value *= -1;
+#endif
         pc->os << value;
         return 0;
     }
@@ -163,6 +262,13 @@ template <int PyV> class TuplePrinter final : public PythonTypePrinter<PyV> {
     bool dupdetect() const override {return true;}
 };
 
+/*
+ * Heap-allocated PyFrameObjects (and the public layout this code needs)
+ * disappeared in 3.11: the stack walk goes through _PyInterpreterFrame
+ * records instead, in printThread below.
+ */
+#if PY_VERSION_HEX < 0x030b0000
+
 template <int PyV>
 int
 printTupleVars(const PythonPrinter<PyV> *pc, Elf::Addr namesAddr, Elf::Addr valuesAddr, const char *type, Py_ssize_t maxvals = 1000000)
@@ -197,17 +303,45 @@ template <int PyV> class FramePrinter final : public PythonTypePrinter<PyV> {
     Elf::Addr print(const PythonPrinter<PyV> *pc, const PyObject *pyo, const PyTypeObject *, Elf::Addr remoteAddr) const override {
         auto pfo = (const PyFrameObject *)pyo;
         if (pfo->f_code != 0) {
-            const auto &code = readPyObj<PyV, PyCodeObject>(*pc->proc.io, Elf::Addr(pfo->f_code));
-            auto lineNo = getLine<PyV>(*pc->proc.io, &code, pfo);
-            auto func = readString<PyV>(*pc->proc.io, Elf::Addr(code.co_name));
-            auto file = readString<PyV>(*pc->proc.io, Elf::Addr(code.co_filename));
+            /*
+             * Batch the code object fetch with the prefetch of the next
+             * frame down the chain: the back pointer is already decoded, so
+             * descending a frame costs one scatter read rather than two
+             * dependent round trips to the target.
+             */
+            PyCodeObject code;
+            typename PythonPrinter<PyV>::Prefetched next;
+            Reader::ReadRange ranges[2] = {
+                { Elf::Addr(pfo->f_code), sizeof code, (char *)&code, 0 },
+                { Elf::Addr(pfo->f_back), sizeof next.data, next.data, 0 },
+            };
+            pc->proc.io->readScatter(ranges, pfo->f_back != 0 ? 2 : 1);
+            if (ranges[0].rc != sizeof code)
+                throw Exception() << "short read of code object at " << std::hex << Elf::Addr(pfo->f_code);
+            if (pfo->f_back != 0 && ranges[1].rc >= sizeof (PyVarObject)) {
+                next.len = ranges[1].rc;
+                pc->prefetchedObjs[Elf::Addr(pfo->f_back)] = next;
+            }
+            auto mi = pc->codeMeta.find(Elf::Addr(pfo->f_code));
+            if (mi == pc->codeMeta.end()) {
+                typename PythonPrinter<PyV>::CodeMeta meta;
+                meta.name = readString<PyV>(*pc->proc.io, Elf::Addr(code.co_name));
+                meta.file = readString<PyV>(*pc->proc.io, Elf::Addr(code.co_filename));
+                meta.firstlineno = code.co_firstlineno;
+                auto lnotab = readPyObj<PyV, PyVarObject>(*pc->proc.io, Elf::Addr(code.co_lnotab));
+                meta.lnotab.resize(lnotab.ob_size);
+                pc->proc.io->readObj(Elf::Addr(code.co_lnotab) + offsetof(PyBytesObject, ob_sval),
+                        meta.lnotab.data(), lnotab.ob_size);
+                mi = pc->codeMeta.emplace(Elf::Addr(pfo->f_code), std::move(meta)).first;
+            }
+            auto lineNo = getLine<PyV>(mi->second, pfo);
 
-            pc->os << pc->prefix() << func;
+            pc->os << pc->prefix() << mi->second.name;
 
             if (pc->options.doargs)
                 printArguments<PyV>(pc, pyo, remoteAddr);
 
-            pc->os << " in " << file << ":" << lineNo << std::endl;
+            pc->os << " in " << mi->second.file << ":" << lineNo << std::endl;
 
             if (pc->options.dolocals) {
 
@@ -240,6 +374,8 @@ template <int PyV> class FramePrinter final : public PythonTypePrinter<PyV> {
     bool dupdetect() const override { return true; }
 };
 
+#endif // PY_VERSION_HEX < 0x030b0000
+
 
 template <int PyV>
 const char *
@@ -308,7 +444,9 @@ PythonPrinter<PyV>::PythonPrinter(Process &proc_, std::ostream &os_, const Pstac
     static ListPrinter<PyV> listPrinter;
     static TypePrinter<PyV> typePrinter;
     static LongPrinter<PyV> longPrinter;
+#if PY_VERSION_HEX < 0x030b0000
     static FramePrinter<PyV> framePrinter;
+#endif
     static TuplePrinter<PyV> tuplePrinter;
 
     for (auto ps : PythonTypePrinter<PyV>::all) {
@@ -331,7 +469,26 @@ PythonPrinter<PyV>::print(Elf::Addr remoteAddr) const {
     depth++;
     try {
         while (remoteAddr) {
-            auto baseObj = readPyObj<PyV, PyVarObject>(*proc.io, remoteAddr);
+            /*
+             * Fetch the object header and the leading part of the body in a
+             * single read: the header tells us the type and full size, and
+             * for the vast majority of objects the same read already covers
+             * everything, so we only return to the target for oversized
+             * objects rather than once for the header and again for the body.
+             */
+            char inbuf[objPrefetchSize];
+            size_t prefetched;
+            auto pf = prefetchedObjs.find(remoteAddr);
+            if (pf != prefetchedObjs.end()) {
+                prefetched = pf->second.len;
+                memcpy(inbuf, pf->second.data, prefetched);
+                prefetchedObjs.erase(pf);
+            } else {
+                prefetched = proc.io->read(remoteAddr, sizeof inbuf, inbuf);
+            }
+            if (prefetched < sizeof (PyVarObject))
+                throw Exception() << "short read of object header at " << std::hex << remoteAddr;
+            const auto &baseObj = *(const PyVarObject *)inbuf;
             if (pyRefcnt<const PyVarObject, PyV>(&baseObj) == 0) {
                 os << "(dead object)";
             }
@@ -385,7 +542,12 @@ PythonPrinter<PyV>::print(Elf::Addr remoteAddr) const {
                 fullSize = size;
             }
             char buf[fullSize];
-            proc.io->readObj(remoteAddr, buf, fullSize);
+            if (size_t(fullSize) <= prefetched) {
+                memcpy(buf, inbuf, fullSize);
+            } else {
+                memcpy(buf, inbuf, prefetched);
+                proc.io->readObj(remoteAddr + prefetched, buf + prefetched, fullSize - prefetched);
+            }
             remoteAddr = printer->print(this, (const PyObject *)buf, pto.get(), remoteAddr);
         }
     }
@@ -417,7 +579,57 @@ PythonPrinter<PyV>::printThread(Elf::Addr ptr)
         os << "anonymous thread";
     }
     os << "\n";
+#if PY_VERSION_HEX >= 0x030b0000
+    /*
+     * Since 3.11 the frame stack lives in internal _PyInterpreterFrame
+     * records rather than heap PyFrameObjects, so walk and print them here:
+     * they are not python objects, and the generic printer can't dispatch
+     * on them.
+     */
+#if PY_VERSION_HEX >= 0x030d0000
+    Elf::Addr frame = Elf::Addr(thread.current_frame);
+#else
+    Elf::Addr frame = 0;
+    if (thread.cframe != nullptr)
+        proc.io->readObj(Elf::Addr(thread.cframe) + offsetof(_PyCFrame, current_frame), &frame);
+#endif
+    depth++;
+    try {
+        while (frame != 0) {
+            Elf::Addr codeAddr = 0, instr = 0;
+            char owner = 0;
+            proc.io->readObj(frame + pyFrameCodeOff(), &codeAddr);
+            proc.io->readObj(frame + pyFrameInstrOff(), &instr);
+            proc.io->readObj(frame + pyFrameOwnerOff(), &owner);
+            // C-stack shim frames carry no code object worth reporting.
+            if (owner != pyFrameOwnedByCStack() && codeAddr != 0) {
+                auto mi = codeMeta.find(codeAddr);
+                if (mi == codeMeta.end()) {
+                    auto code = readPyObj<PyV, PyCodeObject>(*proc.io, codeAddr);
+                    CodeMeta meta;
+                    meta.name = readString<PyV>(*proc.io, Elf::Addr(code.co_name));
+                    meta.file = readString<PyV>(*proc.io, Elf::Addr(code.co_filename));
+                    meta.firstlineno = code.co_firstlineno;
+                    auto linetable = readPyObj<PyV, PyVarObject>(*proc.io, Elf::Addr(code.co_linetable));
+                    meta.lnotab.resize(linetable.ob_size);
+                    proc.io->readObj(Elf::Addr(code.co_linetable) + offsetof(PyBytesObject, ob_sval),
+                            meta.lnotab.data(), linetable.ob_size);
+                    mi = codeMeta.emplace(codeAddr, std::move(meta)).first;
+                }
+                int lasti = int((instr - (codeAddr + pyCodeAdaptiveOff())) / 2);
+                os << prefix() << mi->second.name << " in " << mi->second.file
+                    << ":" << getLocation(mi->second.lnotab, mi->second.firstlineno, lasti) << "\n";
+            }
+            proc.io->readObj(frame + pyFramePrevOff(), &frame);
+        }
+    }
+    catch (const std::exception &ex) {
+        os << "(frame walk failed:" << ex.what() << ")\n";
+    }
+    depth--;
+#else
     print(Elf::Addr(thread.frame));
+#endif
     return Elf::Addr(thread.next);
 }
 
@@ -429,14 +641,23 @@ template <int PyV>
 Elf::Addr
 PythonPrinter<PyV>::printInterp(Elf::Addr ptr, bool showModules)
 {
-    // these are the first two fields in PyInterpreterState - next and tstate_head.
     struct State {
         Elf::Addr next;
         Elf::Addr head;
         Elf::Addr modules;
     };
     State state;
+#if PY_VERSION_HEX >= 0x030b0000
+    // the interpreter state became core-only in 3.11; its offsets come from
+    // the C translation unit that can see the internal headers.
+    proc.io->readObj(ptr + pyInterpNextOff(), &state.next);
+    proc.io->readObj(ptr + pyInterpThreadsHeadOff(), &state.head);
+    proc.io->readObj(ptr + pyInterpModulesOff(), &state.modules);
+#else
+    // these are the first three fields in PyInterpreterState - next,
+    // tstate_head and modules.
     proc.io->readObj(ptr, &state);
+#endif
     os << "---- interpreter @" << std::hex << ptr << std::dec << " -----" << std::endl ;
     for (Elf::Addr tsp = state.head; tsp; ) {
         tsp = printThread(tsp);
@@ -449,6 +670,7 @@ PythonPrinter<PyV>::printInterp(Elf::Addr ptr, bool showModules)
     return state.next;
 }
 
+#if PY_VERSION_HEX < 0x030b0000
 template <int PyV>
 void printArguments(const PythonPrinter<PyV> *pc, const PyObject *pyo, Elf::Addr remoteAddr) {
     const PyFrameObject* pfo = (PyFrameObject *)pyo;
@@ -524,3 +746,4 @@ void printArguments(const PythonPrinter<PyV> *pc, const PyObject *pyo, Elf::Addr
     }
     pc->os << ")";
 }
+#endif // PY_VERSION_HEX < 0x030b0000
@@ -1,14 +1,17 @@
 #include <Python.h>
 #include <frameobject.h>
 #include <dictobject.h>
+#if PY_VERSION_HEX < 0x030b0000
 #include <Objects/dict-common.h>
 #include <longintrepr.h>
 #include <longintrepr.h>
+#endif
 #include <unicodeobject.h>
 #include <methodobject.h>
 #include "libpstack/python.h"
 #include "libpstack/global.h"
 
+#if PY_VERSION_HEX < 0x030b0000
 #define DK_SIZE(dk) ((dk)->dk_size)
 #define DK_IXSIZE(dk)                \
     (  DK_SIZE(dk) <= 0xff       ? 1 \
@@ -17,6 +20,7 @@
                                  : sizeof(int64_t))
 #define DK_ENTRIES(dk) \
     ((PyDictKeyEntry *)(&((int8_t *)((dk)->dk_indices))[DK_SIZE(dk) * DK_IXSIZE(dk)]))
+#endif
 
 template<> std::set<const PythonTypePrinter<3> *> PythonTypePrinter<3>::all = std::set<const PythonTypePrinter<3> *>();
 template <>
@@ -33,7 +37,12 @@ template <> std::string readString<3>(const Reader &r, const Elf::Addr addr) {
     PyASCIIObject baseObj = r.readObj<PyASCIIObject>(addr);
     int ascii = baseObj.state.ascii;
     int compact = baseObj.state.compact;
+#if PY_VERSION_HEX >= 0x030c0000
+    // 3.12 dropped the "ready" state; compact strings are always ready.
+    int ready = 1;
+#else
     int ready = baseObj.state.ready;
+#endif
 
     if (compact && ascii && ready) {
         return r.readString(addr + sizeof(PyASCIIObject));
@@ -46,6 +55,10 @@ template <> std::string readString<3>(const Reader &r, const Elf::Addr addr) {
 
 namespace {
 
+// The dict internals moved to core-only headers in 3.11 and the key table
+// changed shape; until that layout is mirrored here, dicts print through
+// the generic path on newer interpreters.
+#if PY_VERSION_HEX < 0x030b0000
 // Reads indexSize bytes at address as a signed int
 int64_t readIndex(const Reader &r, const Elf::Addr addr, size_t indexSize) {
     char buf[8];
@@ -102,11 +115,16 @@ class DictPrinter final : public PythonTypePrinter<3> {
     bool dupdetect() const override { return true; }
 };
 static DictPrinter dictPrinter;
+#endif
 
 class BoolPrinter final : public PythonTypePrinter<3> {
     Elf::Addr print(const PythonPrinter<3> *pc, const PyObject *pyo, const PyTypeObject *, Elf::Addr) const override {
         auto pio = (const _longobject *)pyo;
+#if PY_VERSION_HEX >= 0x030c0000
+        pc->os << (pio->long_value.ob_digit[0] ? "True" : "False");
+#else
         pc->os << (pio->ob_digit[0] ? "True" : "False");
+#endif
         return 0;
     }
     const char *type() const override { return "PyBool_Type"; }
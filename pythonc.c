@@ -9,6 +9,67 @@
 #error "no support for this version of python"
 #endif
 
+#if PY_VERSION_HEX >= 0x030b0000
+#include <internal/pycore_frame.h>
+#include <internal/pycore_interp.h>
+#endif
+
 size_t pyInterpOffset() {
    return offsetof(_PyRuntimeState, interpreters) + offsetof(struct pyinterpreters, head);
 }
+
+#if PY_VERSION_HEX >= 0x030b0000
+/*
+ * 3.11 moved the frame stack and the interpreter/thread bookkeeping into
+ * core-only structures, and their headers are as C++-hostile as the ones
+ * above. Export the offsets the C++ printer needs, in the same style as
+ * pyInterpOffset.
+ */
+size_t pyInterpNextOff(void) {
+   return offsetof(PyInterpreterState, next);
+}
+
+size_t pyInterpThreadsHeadOff(void) {
+   return offsetof(PyInterpreterState, threads) + offsetof(struct pythreads, head);
+}
+
+size_t pyInterpModulesOff(void) {
+#if PY_VERSION_HEX >= 0x030c0000
+   return offsetof(PyInterpreterState, imports.modules);
+#else
+   return offsetof(PyInterpreterState, modules);
+#endif
+}
+
+size_t pyFrameCodeOff(void) {
+#if PY_VERSION_HEX >= 0x030d0000
+   return offsetof(struct _PyInterpreterFrame, f_executable);
+#else
+   return offsetof(struct _PyInterpreterFrame, f_code);
+#endif
+}
+
+size_t pyFramePrevOff(void) {
+   return offsetof(struct _PyInterpreterFrame, previous);
+}
+
+size_t pyFrameInstrOff(void) {
+#if PY_VERSION_HEX >= 0x030d0000
+   return offsetof(struct _PyInterpreterFrame, instr_ptr);
+#else
+   return offsetof(struct _PyInterpreterFrame, prev_instr);
+#endif
+}
+
+size_t pyFrameOwnerOff(void) {
+   return offsetof(struct _PyInterpreterFrame, owner);
+}
+
+size_t pyCodeAdaptiveOff(void) {
+   return offsetof(PyCodeObject, co_code_adaptive);
+}
+
+int pyFrameOwnedByCStack(void) {
+   return FRAME_OWNED_BY_CSTACK;
+}
+#endif
@@ -2,13 +2,70 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <mutex>
 #include "libpstack/reader.h"
 #include "libpstack/fs.h"
 #include "libpstack/global.h"
+#include "libpstack/stats.h"
 
 using std::string;
+
+namespace {
+
+/*
+ * Views are created and dropped constantly on the decode paths - one per
+ * unit, abbreviation table, note descriptor, and so on - and each is a
+ * small allocation of the same size: the reader combined with its
+ * shared_ptr control block by allocate_shared. Recycle those blocks on a
+ * freelist instead of round-tripping each through the heap. The list is
+ * capped so a burst of views doesn't pin memory forever; each distinct
+ * node type gets its own list, so every hit is an exact size match.
+ */
+template <typename T> struct ViewAllocator {
+    using value_type = T;
+    static inline std::mutex lock;
+    static inline void *freelist = nullptr;
+    static inline size_t avail = 0;
+    static constexpr size_t maxAvail = 1024;
+
+    ViewAllocator() noexcept = default;
+    template <typename U> ViewAllocator(const ViewAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n) {
+        if (n == 1) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (freelist != nullptr) {
+                void *p = freelist;
+                freelist = *static_cast<void **>(p);
+                --avail;
+                return static_cast<T *>(p);
+            }
+        }
+        return static_cast<T *>(::operator new(n * sizeof (T)));
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+        if (n == 1) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (avail < maxAvail) {
+                *reinterpret_cast<void **>(p) = freelist;
+                freelist = p;
+                ++avail;
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+    template <typename U> bool operator==(const ViewAllocator<U> &) const noexcept { return true; }
+    template <typename U> bool operator!=(const ViewAllocator<U> &) const noexcept { return false; }
+};
+
+}
+
 Reader::Off
 FileReader::size() const
 {
@@ -62,30 +119,58 @@ MemReader::describe(std::ostream &os) const
 
 string
 MemReader::readString(Off offset) const {
-   return string((char *)data + offset);
+   if (offset >= Off(len))
+      return "";
+   // bound the scan by the end of our data, in case the terminator is absent.
+   auto p = (const char *)data + offset;
+   auto q = (const char *)memchr(p, 0, len - offset);
+   return q != nullptr ? string(p, q - p) : string(p, len - offset);
 }
 
 
+std::string_view
+Reader::readStringView(Off offset, string &backing) const
+{
+    // ask for a zero-length range: we don't know the string's extent until
+    // we've scanned for the terminator, which we can only do cheaply if the
+    // store is contiguous anyway.
+    const char *p = contiguous(offset, 0);
+    if (p != nullptr) {
+        size_t bound = size() - offset;
+        auto q = (const char *)memchr(p, 0, bound);
+        return { p, q != nullptr ? size_t(q - p) : bound };
+    }
+    backing = readString(offset);
+    return backing;
+}
+
 string
 Reader::readString(Off offset) const
 {
     if (offset == 0)
         return "(null)";
+    // scan a chunk at a time, rather than paying a virtual read per byte.
+    char chunk[64];
     string res;
-    for (Off s = size(); offset < s; ++offset) {
-        char c;
-        if (read(offset, 1, &c) != 1)
+    for (Off s = size(); offset < s;) {
+        size_t rc = read(offset, std::min(sizeof chunk, size_t(s - offset)), chunk);
+        if (rc == 0)
             break;
-        if (c == 0)
+        auto q = (const char *)memchr(chunk, 0, rc);
+        if (q != nullptr) {
+            res.append(chunk, q - chunk);
             break;
-        res += c;
+        }
+        res.append(chunk, rc);
+        offset += rc;
     }
     return res;
 }
 
 Reader::csptr
 Reader::view(const std::string &name, Off offset, Off size) const {
-   return std::make_shared<OffsetReader>(name, shared_from_this(), offset, size);
+   return std::allocate_shared<OffsetReader>(ViewAllocator<OffsetReader>(),
+         name, shared_from_this(), offset, size);
 }
 
 size_t
@@ -108,24 +193,81 @@ FileReader::read(Off off, size_t count, char *ptr) const
 }
 
 void
-CacheReader::Page::load(const Reader &r, Off offset_)
+FileReader::advise(Off off, Off length, Advice advice) const
+{
+    int native;
+    switch (advice) {
+        case Advice::Sequential: native = POSIX_FADV_SEQUENTIAL; break;
+        case Advice::Random: native = POSIX_FADV_RANDOM; break;
+        case Advice::WillNeed: native = POSIX_FADV_WILLNEED; break;
+        default: return;
+    }
+    // purely advisory - ignore any failure.
+    (void)posix_fadvise(file, off, length, native);
+}
+
+void
+MmapReader::advise(Off off, Off length, Advice advice) const
+{
+    int native;
+    switch (advice) {
+        case Advice::Sequential: native = MADV_SEQUENTIAL; break;
+        case Advice::Random: native = MADV_RANDOM; break;
+        case Advice::WillNeed: native = MADV_WILLNEED; break;
+        default: return;
+    }
+    if (off > Off(len))
+        return;
+    length = std::min(length, Off(len) - off);
+    // madvise needs a page-aligned base address.
+    static const size_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+    auto base = (uintptr_t)data + off;
+    auto aligned = base & ~uintptr_t(pagemask);
+    (void)madvise((void *)aligned, length + (base - aligned), native);
+}
+
+void
+CacheReader::Page::load(const Reader &r, Off offset_, size_t pagesize)
 {
-    assert(offset_ % PAGESIZE == 0);
-    len = r.read(offset_, PAGESIZE, data);
+    assert(offset_ % pagesize == 0);
+    len = r.read(offset_, pagesize, data.get());
     offset = offset_;
 }
 
-CacheReader::CacheReader(Reader::csptr upstream_)
-    : upstream(move(upstream_))
+CacheReader::CacheReader(Reader::csptr upstream_, size_t pagesize_, size_t maxpages_)
+    : Budget::Client(true) // reads come from several threads.
+    , upstream(move(upstream_))
+    , pagesize(pagesize_)
+    , maxpages(maxpages_)
 {
 }
 
 void
 CacheReader::flush() {
+    std::lock_guard<std::mutex> guard(lock);
     std::list<Page *> clearpages;
     std::swap(pages, clearpages);
+    pageIndex.clear();
     for (auto &i : clearpages)
         delete i;
+    release(clearpages.size() * pagesize);
+}
+
+size_t
+CacheReader::shed() {
+    // The budget manager may call this while another thread is mid-read; if
+    // the lock is contended the cache is hot anyway, so report nothing freed
+    // and let the registry pick another victim.
+    std::unique_lock<std::mutex> guard(lock, std::try_to_lock);
+    if (!guard)
+        return 0;
+    size_t freed = pages.size() * pagesize;
+    for (auto &p : pages)
+        delete p;
+    pages.clear();
+    pageIndex.clear();
+    stringCache.clear();
+    return freed;
 }
 
 CacheReader::~CacheReader()
@@ -137,33 +279,34 @@ CacheReader::Page *
 CacheReader::getPage(Off pageoff) const
 {
     Page *p;
-    bool first = true;
-    for (auto i = pages.begin(); i != pages.end(); ++i) {
-        p = *i;
-        if (p->offset == pageoff) {
-            // move page to front.
-            if (!first) {
-                pages.erase(i);
-                pages.push_front(p);
-            }
-            return p;
-        }
-        first = false;
+    auto it = pageIndex.find(pageoff);
+    if (it != pageIndex.end()) {
+        // cache hit: promote page to the front of the LRU list.
+        Stats::readerPages.hit();
+        p = *it->second;
+        if (it->second != pages.begin())
+            pages.splice(pages.begin(), pages, it->second);
+        return p;
     }
-    if (pages.size() == MAXPAGES) {
+    Stats::readerPages.miss(pagesize);
+    if (pages.size() == maxpages) {
         p = pages.back();
+        pageIndex.erase(p->offset);
         pages.pop_back();
     } else {
-        p = new Page();
+        p = new Page(pagesize);
+        charge(pagesize);
     }
     try {
-        p->load(*upstream, pageoff);
+        p->load(*upstream, pageoff, pagesize);
         pages.push_front(p);
+        pageIndex[pageoff] = pages.begin();
         return p;
     }
     catch (...) {
         // failed to load page - delete it, and continue with error.
         delete p;
+        release(pagesize);
         throw;
     }
 
@@ -172,42 +315,182 @@ CacheReader::getPage(Off pageoff) const
 size_t
 CacheReader::read(Off off, size_t count, char *ptr) const
 {
-    if (count >= PAGESIZE)
+    if (count >= pagesize)
         return upstream->read(off, count, ptr);
+    std::lock_guard<std::mutex> guard(lock);
     Off startoff = off;
     for (;;) {
         if (count == 0)
             break;
-        size_t offsetOfDataInPage = off % PAGESIZE;
+        size_t offsetOfDataInPage = off % pagesize;
         Off offsetOfPageInFile = off - offsetOfDataInPage;
-        Page *page = getPage(offsetOfPageInFile);
+        Page *page;
+        try {
+            page = getPage(offsetOfPageInFile);
+        }
+        catch (...) {
+            // A read can legitimately run off the end of the mapped data (eg,
+            // scanning for a string terminator near the top of the stack). If
+            // we already have some of it, return the short count; only fail
+            // reads that get nothing at all.
+            if (off != startoff)
+                break;
+            throw;
+        }
         if (page == nullptr)
             break;
         size_t chunk = std::min(page->len - offsetOfDataInPage, count);
-        memcpy(ptr, page->data + offsetOfDataInPage, chunk);
+        memcpy(ptr, page->data.get() + offsetOfDataInPage, chunk);
         off += chunk;
         count -= chunk;
         ptr += chunk;
-        if (page->len != PAGESIZE)
+        if (page->len != pagesize)
             break;
     }
     return off - startoff;
 }
 
+void
+CacheReader::readScatter(ReadRange *ranges, size_t nranges) const
+{
+    std::vector<ReadRange *> misses;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < nranges; ++i) {
+            auto &r = ranges[i];
+            // serve from pages already resident - don't fault anything in.
+            size_t got = 0;
+            while (got < r.count) {
+                Off off = r.off + Off(got);
+                size_t inPage = off % pagesize;
+                auto it = pageIndex.find(off - inPage);
+                if (it == pageIndex.end())
+                    break;
+                Page *p = *it->second;
+                if (inPage >= p->len)
+                    break;
+                size_t chunk = std::min(r.count - got, p->len - inPage);
+                memcpy(r.ptr + got, p->data.get() + inPage, chunk);
+                got += chunk;
+                if (p->len != pagesize)
+                    break;
+            }
+            if (got == r.count)
+                r.rc = got;
+            else
+                misses.push_back(&r);
+        }
+    }
+    if (misses.empty())
+        return;
+    // forward the misses as one batch; these bypass the page cache, which
+    // is fine - scatter reads are one-shot gathers, not hot loops.
+    std::vector<ReadRange> batch;
+    batch.reserve(misses.size());
+    for (auto *m : misses)
+        batch.push_back(*m);
+    upstream->readScatter(batch.data(), batch.size());
+    for (size_t i = 0; i < misses.size(); ++i)
+        misses[i]->rc = batch[i].rc;
+}
+
 string
 CacheReader::readString(Off off) const
 {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = stringCache.find(off);
+        if (it != stringCache.end() && !it->second.isNew)
+            return it->second.value;
+    }
+    // drop the lock to fetch: Reader::readString comes back through read(),
+    // which takes it again.
+    auto value = Reader::readString(off);
+    std::lock_guard<std::mutex> guard(lock);
     auto &entry = stringCache[off];
-    if (entry.isNew) {
-        entry.value = Reader::readString(off);
-        entry.isNew = false;
+    entry.value = value;
+    entry.isNew = false;
+    return value;
+}
+
+SparseFileReader::SparseFileReader(const string &name_)
+    : FileReader(name_)
+{
+    // Map the data extents up front; pread never has to find them again.
+    // ENXIO from SEEK_DATA means nothing but hole to EOF. A filesystem
+    // without hole support gets one extent covering the whole file.
+    for (Off pos = 0;;) {
+        off_t dataOff = lseek(file, pos, SEEK_DATA);
+        if (dataOff == -1) {
+            if (errno != ENXIO) {
+                extents.clear();
+                extents.push_back({0, size()});
+            }
+            break;
+        }
+        off_t holeOff = lseek(file, dataOff, SEEK_HOLE);
+        if (holeOff == -1)
+            holeOff = size();
+        extents.push_back({Off(dataOff), Off(holeOff)});
+        pos = holeOff;
+    }
+}
+
+size_t
+SparseFileReader::read(Off off, size_t count, char *ptr) const
+{
+    Off limit = size();
+    if (off >= limit)
+        return 0;
+    count = std::min(Off(count), limit - off);
+    size_t done = 0;
+    while (done < count) {
+        Off at = off + Off(done);
+        // first data extent ending beyond `at`.
+        auto it = std::upper_bound(extents.begin(), extents.end(), at,
+                [](Off a, const Extent &e) { return a < e.end; });
+        if (it == extents.end()) {
+            // hole from here to EOF.
+            memset(ptr + done, 0, count - done);
+            done = count;
+        } else if (at < it->start) {
+            size_t zeros = std::min(Off(count - done), it->start - at);
+            memset(ptr + done, 0, zeros);
+            done += zeros;
+        } else {
+            size_t chunk = std::min(Off(count - done), it->end - at);
+            size_t rc = FileReader::read(at, chunk, ptr + done);
+            done += rc;
+            if (rc < chunk)
+                break;
+        }
     }
-    return entry.value;
+    return done;
 }
 
 Reader::csptr
 loadFile(const string &path)
 {
+    // Remote files are fetched over HTTP range requests, a block at a time,
+    // behind a cache sized like the core-scanning one - most accesses after
+    // the first to a region are then local.
+    if (HttpReader::isUrl(path))
+        return std::make_shared<CacheReader>(
+            std::make_shared<HttpReader>(path), httpBlockSize, 64);
+    // For regular files, prefer to mmap the entire image - the MemReader
+    // access path avoids a pread syscall per access, and needs no cache
+    // stacked on top of it. Fall back to a buffered FileReader for
+    // pseudo-files (/proc entries report zero size) and anything mmap can't
+    // handle.
+    struct stat buf{};
+    if (stat(path.c_str(), &buf) == 0 && S_ISREG(buf.st_mode) && buf.st_size > 0) {
+        try {
+            return std::make_shared<MmapReader>(path);
+        }
+        catch (const Exception &) {
+            // fall through to pread-based access.
+        }
+    }
     return std::make_shared<CacheReader>(
         std::make_shared<FileReader>(path));
 }
@@ -249,7 +532,8 @@ public:
 
 MemReader::csptr
 MemReader::view(const std::string &name, Off offset, Off size) const {
-   return std::make_shared<MemOffsetReader>(name, this, offset, size);
+   return std::allocate_shared<MemOffsetReader>(ViewAllocator<MemOffsetReader>(),
+         name, this, offset, size);
 }
 
 
@@ -273,6 +557,18 @@ OffsetReader::OffsetReader(const std::string& name, Reader::csptr upstream_, Off
     length = length_ == std::numeric_limits<Off>::max() ? upstream->size() - offset : length_;
 }
 
+Reader::csptr
+OffsetReader::view(const std::string &name_, Off start, Off length_) const {
+    // A view of a view is just a view on the ultimate upstream with the
+    // offsets summed - delegate to the upstream's view() with our offset
+    // applied, so chains of OffsetReaders collapse as they are built, and
+    // views over memory-backed readers get the upstream's zero-copy view
+    // rather than another layer of forwarding.
+    if (length_ == std::numeric_limits<Off>::max())
+        length_ = length - std::min(start, length);
+    return upstream->view(name_, offset + start, length_);
+}
+
 size_t
 OffsetReader::read(Off off, size_t count, char *ptr) const {
     if (off > length)
@@ -300,14 +596,18 @@ Reader::readSLEB128(Off off) const
 std::pair<uintmax_t, size_t>
 MemReader::readULEB128(Off off) const
 {
-    auto p = reinterpret_cast<const char *>(data) + off;
+    auto p = reinterpret_cast<const unsigned char *>(data) + off;
+    if (len - size_t(off) >= 8)
+        return readleb128_swar<uintmax_t>(p);
     return readleb128<uintmax_t>(p);
 }
 
 std::pair<intmax_t, size_t>
 MemReader::readSLEB128(Off off) const
 {
-    auto p = reinterpret_cast<const char *>(data) + off;
+    auto p = reinterpret_cast<const unsigned char *>(data) + off;
+    if (len - size_t(off) >= 8)
+        return readleb128_swar<intmax_t>(p);
     return readleb128<intmax_t>(p);
 }
 
@@ -4,6 +4,7 @@
 #include "libpstack/global.h"
 #include "libpstack/fs.h"
 
+#include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
 
@@ -20,9 +21,37 @@
 #include <ucontext.h>
 #include <dlfcn.h>
 
+namespace {
+/*
+ * Reads our own address space directly. Unwinding can chase a bogus pointer
+ * (eg, a garbage frame pointer below _start), and a plain memcpy from an
+ * unmapped address is fatal, so check each page with msync first - a bad
+ * address becomes a short read or exception, as it would be for any other
+ * process type.
+ */
+class SelfMemReader final : public MemReader {
+public:
+    SelfMemReader()
+        : MemReader("me", std::numeric_limits<size_t>::max(), nullptr) {}
+    size_t read(Off off, size_t count, char *ptr) const override {
+        static const Off page = sysconf(_SC_PAGESIZE);
+        if (off + count < off)
+            throw (Exception() << "read of " << count << " at " << (void *)off << " wraps");
+        for (Off p = off & ~(page - 1); p < off + count; p += page) {
+            if (msync((void *)p, page, MS_ASYNC) == 0)
+                continue;
+            if (p <= off)
+                throw (Exception() << (void *)off << " is not mapped");
+            return p - off;
+        }
+        return MemReader::read(off, count, ptr);
+    }
+};
+}
+
 SelfProcess::SelfProcess(const Elf::Object::sptr &ex, const PstackOptions &options, Dwarf::ImageCache &imageCache)
     : Process( ex ? ex : imageCache.getImageForName("/proc/self/exe"),
-            std::make_shared<MemReader>("me", std::numeric_limits<size_t>::max(), reinterpret_cast<void *>(0)), // the entire of our own address space.
+            std::make_shared<SelfMemReader>(), // the entire of our own address space.
             options, imageCache)
 {
 }
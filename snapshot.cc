@@ -0,0 +1,251 @@
+#include "libpstack/archreg.h"
+#include "libpstack/dwarf.h"
+#include "libpstack/proc.h"
+#include "libpstack/global.h"
+
+#include <link.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+/*
+ * Snapshot recording: write a minimal ET_CORE image of a (briefly) stopped
+ * process, containing just what offline symbolizing needs - the registers
+ * and top-of-stack for each thread, the memory the link-map walk touches,
+ * the vdso, and an NT_FILE note naming the mapped objects. The result is a
+ * few megabytes where a real core is gigabytes, and CoreProcess replays it
+ * like any other core, so the expensive part (opening images, reading DWARF)
+ * can happen later, on a host that actually has the debug info.
+ */
+
+namespace {
+
+// How much of each thread's stack the snapshot captures. Matches what
+// --snapshot copies for live unwinding; enough for any plausible stack.
+constexpr size_t stackSnapshotSize = 64 * 1024;
+
+// A chunk of target memory destined for a PT_LOAD segment in the image.
+struct Range {
+    Elf::Addr start;
+    std::vector<char> data;
+};
+
+// Append one note to the PT_NOTE blob: header, "CORE" name, descriptor,
+// each padded to 4 bytes as the gABI requires.
+void
+appendNote(std::vector<char> &notes, int type, const void *desc, size_t len)
+{
+    static const char noteName[] = "CORE";
+    Elf::Note hdr {};
+    hdr.n_namesz = sizeof noteName;
+    hdr.n_descsz = len;
+    hdr.n_type = type;
+    auto put = [&notes](const void *p, size_t n) {
+        notes.insert(notes.end(), (const char *)p, (const char *)p + n);
+        while (notes.size() % 4 != 0)
+            notes.push_back(0);
+    };
+    put(&hdr, sizeof hdr);
+    put(noteName, sizeof noteName);
+    put(desc, len);
+}
+
+// Layout of the NT_FILE descriptor (dead.cc reads the same shapes back).
+struct FileNoteHeader {
+    Elf::Off count;
+    Elf::Off pageSize;
+};
+struct FileNoteEntry {
+    Elf::Off start;
+    Elf::Off end;
+    Elf::Off fileOff;
+};
+
+}
+
+void
+Process::recordSnapshot(std::ostream &os)
+{
+    StopProcess here(this);
+
+    std::vector<Range> ranges;
+    // Capture up to len bytes of target memory; short reads (the range runs
+    // off the end of a mapping) and failures just shrink or skip the range.
+    auto capture = [&](Elf::Addr addr, size_t len) {
+        if (addr == 0 || len == 0)
+            return;
+        Range r { addr, std::vector<char>(len) };
+        try {
+            r.data.resize(io->read(addr, len, r.data.data()));
+        }
+        catch (const std::exception &) {
+            return;
+        }
+        if (!r.data.empty())
+            ranges.push_back(std::move(r));
+    };
+
+    // Registers and the top of the stack for every LWP (stopProcess found
+    // them all).
+    std::vector<char> notes;
+    for (auto &lwp : lwps) {
+        Elf::CoreRegisters regs;
+        if (!getRegs(lwp.first, &regs))
+            continue;
+        prstatus_t status {};
+        status.pr_pid = lwp.first;
+        memcpy(&status.pr_reg, &regs, sizeof regs);
+        appendNote(notes, NT_PRSTATUS, &status, sizeof status);
+        capture(Elf::getReg(regs, CFA_RESTORE_REGNO), stackSnapshotSize);
+    }
+
+    // The auxiliary vector, plus the string AT_EXECFN points at, so the
+    // replay can locate the executable by name.
+    auto auxio = getAUXV();
+    if (auxio) {
+        std::vector<Elf::auxv_t> auxen(512);
+        size_t rc = 0;
+        try {
+            rc = auxio->read(0, auxen.size() * sizeof auxen[0], (char *)auxen.data());
+        }
+        catch (const Exception &) {
+        }
+        if (rc != 0) {
+            appendNote(notes, NT_AUXV, auxen.data(), rc);
+            auxen.resize(rc / sizeof auxen[0]);
+#ifdef AT_EXECFN
+            for (const auto &aux : auxen)
+                if (aux.a_type == AT_EXECFN)
+                    capture(aux.a_un.a_val, PATH_MAX);
+#endif
+        }
+    }
+
+    // The memory the replay walks to rebuild the link map exactly as we see
+    // it: the executable's PT_DYNAMIC (for DT_DEBUG), r_debug itself, and
+    // each link_map node with its name string.
+    Elf::Addr loadAddr = entry - execImage->getHeader().e_entry;
+    for (auto &seg : execImage->getSegments(PT_DYNAMIC))
+        capture(seg.p_vaddr + loadAddr, seg.p_filesz);
+    if (rdebugAddr != 0 && rdebugAddr != Elf::Addr(-1)) {
+        capture(rdebugAddr, sizeof (struct r_debug));
+        try {
+            struct r_debug rDebug;
+            io->readObj(rdebugAddr, &rDebug);
+            struct link_map map;
+            for (auto mapAddr = Elf::Addr(rDebug.r_map); mapAddr != 0;
+                    mapAddr = Elf::Addr(map.l_next)) {
+                io->readObj(mapAddr, &map);
+                capture(mapAddr, sizeof map);
+                if (map.l_name != 0)
+                    capture(Elf::Addr(map.l_name),
+                            io->readString(Elf::Off(map.l_name)).size() + 1);
+            }
+        }
+        catch (const Exception &) {
+            // Partial chain; the NT_FILE note below still allows replay.
+        }
+    }
+
+    // The vdso: only a couple of pages, has no backing file on the replay
+    // host, and routinely appears at the top of stacks.
+    if (vdsoBase != 0)
+        capture(vdsoBase, 65536);
+
+    // NT_FILE: name the mapped objects and their load addresses, both for
+    // human consumption and as the fallback the replay uses if the link-map
+    // walk above came up short.
+    {
+        std::vector<FileNoteEntry> entries;
+        std::string names;
+        for (auto &loaded : objects) {
+            if (loaded.second == vdsoImage)
+                continue;
+            auto path = loaded.second->io->filename();
+            if (path.empty() || path[0] != '/')
+                continue;
+            Elf::Addr end = loaded.first;
+            for (auto &phdr : loaded.second->getSegments(PT_LOAD))
+                end = std::max(end, loaded.first + phdr.p_vaddr + phdr.p_memsz);
+            entries.push_back({loaded.first, end, 0});
+            names += path;
+            names += '\0';
+        }
+        std::vector<char> desc(sizeof (FileNoteHeader)
+                + entries.size() * sizeof (FileNoteEntry) + names.size());
+        FileNoteHeader header { Elf::Off(entries.size()), Elf::Off(getpagesize()) };
+        memcpy(desc.data(), &header, sizeof header);
+        memcpy(desc.data() + sizeof header, entries.data(),
+                entries.size() * sizeof (FileNoteEntry));
+        memcpy(desc.data() + sizeof header + entries.size() * sizeof (FileNoteEntry),
+                names.data(), names.size());
+        appendNote(notes, NT_FILE, desc.data(), desc.size());
+    }
+
+    // Coalesce overlapping captures (a thread's stack can cover strings
+    // captured separately, for instance) so the PT_LOADs are disjoint.
+    std::sort(ranges.begin(), ranges.end(),
+            [](const Range &l, const Range &r) { return l.start < r.start; });
+    std::vector<Range> merged;
+    for (auto &r : ranges) {
+        if (!merged.empty()) {
+            auto &prev = merged.back();
+            Elf::Addr prevEnd = prev.start + prev.data.size();
+            if (r.start <= prevEnd) {
+                Elf::Addr rEnd = r.start + r.data.size();
+                if (rEnd > prevEnd)
+                    prev.data.insert(prev.data.end(),
+                            r.data.begin() + (prevEnd - r.start), r.data.end());
+                continue;
+            }
+        }
+        merged.push_back(std::move(r));
+    }
+
+    // Lay the image out: header, program headers, the note blob, then the
+    // memory ranges, all contiguous.
+    Elf::Ehdr ehdr {};
+    const auto &exe = execImage->getHeader();
+    memcpy(ehdr.e_ident, exe.e_ident, sizeof ehdr.e_ident);
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = exe.e_machine;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof ehdr;
+    ehdr.e_ehsize = sizeof ehdr;
+    ehdr.e_phentsize = sizeof (Elf::Phdr);
+    ehdr.e_phnum = merged.size() + 1;
+
+    std::vector<Elf::Phdr> phdrs;
+    Elf::Off dataOff = sizeof ehdr + (merged.size() + 1) * sizeof (Elf::Phdr);
+    Elf::Phdr note {};
+    note.p_type = PT_NOTE;
+    note.p_offset = dataOff;
+    note.p_filesz = notes.size();
+    phdrs.push_back(note);
+    dataOff += notes.size();
+    for (auto &r : merged) {
+        Elf::Phdr load {};
+        load.p_type = PT_LOAD;
+        load.p_offset = dataOff;
+        load.p_vaddr = r.start;
+        load.p_filesz = load.p_memsz = r.data.size();
+        load.p_flags = PF_R | PF_W;
+        load.p_align = 1;
+        phdrs.push_back(load);
+        dataOff += r.data.size();
+    }
+
+    os.write((const char *)&ehdr, sizeof ehdr);
+    os.write((const char *)phdrs.data(), phdrs.size() * sizeof (Elf::Phdr));
+    os.write(notes.data(), notes.size());
+    for (auto &r : merged)
+        os.write(r.data.data(), r.data.size());
+    if (!os)
+        throw (Exception() << "failed to write snapshot");
+    if (verbose)
+        *debug << "snapshot: " << lwps.size() << " threads, " << merged.size()
+               << " memory ranges, " << dataOff << " bytes\n";
+}
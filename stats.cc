@@ -0,0 +1,102 @@
+#include "libpstack/stats.h"
+#include "libpstack/json.h"
+
+#include <iostream>
+#include <vector>
+
+namespace Stats {
+
+bool enabled;
+
+namespace {
+// Function-local statics, so registration is safe whatever order the
+// translation units initialize in.
+std::vector<Cache *> &
+cacheRegistry()
+{
+    static std::vector<Cache *> registry;
+    return registry;
+}
+
+std::vector<Phase *> &
+phaseRegistry()
+{
+    static std::vector<Phase *> registry;
+    return registry;
+}
+
+std::ostream &
+operator << (std::ostream &os, const JSON<Cache> &j)
+{
+    return JObject(os)
+        .field("hits", j.object.hits.load())
+        .field("misses", j.object.misses.load())
+        .field("bytes", j.object.bytes.load());
+}
+
+std::ostream &
+operator << (std::ostream &os, const JSON<Phase> &j)
+{
+    return JObject(os)
+        .field("calls", j.object.calls.load())
+        .field("usec", j.object.ns.load() / 1000);
+}
+}
+
+Cache::Cache(const char *name_) : name(name_)
+{
+    cacheRegistry().push_back(this);
+}
+
+Phase::Phase(const char *name_) : name(name_)
+{
+    phaseRegistry().push_back(this);
+}
+
+std::ostream &
+dumpText(std::ostream &os)
+{
+    for (const auto *c : cacheRegistry()) {
+        auto hits = c->hits.load();
+        auto lookups = hits + c->misses.load();
+        os << c->name << ": lookups: " << lookups << ", hits=" << hits;
+        if (lookups != 0)
+            os << " (" << hits * 100 / lookups << "%)";
+        auto bytes = c->bytes.load();
+        if (bytes != 0)
+            os << ", bytes loaded=" << bytes;
+        os << std::endl;
+    }
+    for (const auto *p : phaseRegistry())
+        os << p->name << ": " << p->ns.load() / 1000 << "us over "
+            << p->calls.load() << " calls" << std::endl;
+    return os;
+}
+
+std::ostream &
+dumpJSON(std::ostream &os)
+{
+    os << "{ \"caches\": { ";
+    const char *sep = "";
+    for (const auto *c : cacheRegistry()) {
+        os << sep << "\"" << Escape(c->name) << "\": " << json(*c);
+        sep = ", ";
+    }
+    os << " }, \"phases\": { ";
+    sep = "";
+    for (const auto *p : phaseRegistry()) {
+        os << sep << "\"" << Escape(p->name) << "\": " << json(*p);
+        sep = ", ";
+    }
+    return os << " } }";
+}
+
+Cache readerPages("page cache");
+Cache dwarfUnits("DWARF unit cache");
+Cache sourceLines("source line cache");
+Cache callFrames("call frame cache");
+Phase attach("attach");
+Phase unwind("unwind");
+Phase symbolize("symbolize");
+
+} // Stats namespace
@@ -0,0 +1,100 @@
+// Attach-latency benchmark: spawns attach-target with a given thread and
+// DSO count, attaches the way pstack does, and reports where the time goes
+// as a JSON object - one line per run, for trend tracking. The interesting
+// phases for the dump-latency SLO are:
+//
+//   load_ms        attach, and read the link map and images
+//   stop_ms        stop every LWP
+//   first_ms       until the first thread's stack is unwound
+//   unwind_ms      until every thread's stack is unwound
+//
+// usage: attach-bench [nthreads [ndsos [dsopath]]]
+#include <libpstack/proc.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+extern int verbose;
+
+namespace {
+using clk = std::chrono::steady_clock;
+
+double
+ms(clk::time_point from, clk::time_point to)
+{
+   return std::chrono::duration<double, std::milli>(to - from).count();
+}
+}
+
+int
+main(int argc, char **argv)
+{
+   verbose = 0;
+   const char *nthreads = argc > 1 ? argv[1] : "10";
+   const char *ndsos = argc > 2 ? argv[2] : "0";
+
+   int fds[2];
+   if (pipe(fds) != 0)
+      abort();
+   pid_t pid = fork();
+   if (pid == 0) {
+      dup2(fds[1], 1);
+      close(fds[0]);
+      close(fds[1]);
+      if (argc > 3)
+         execl("./attach-target", "attach-target", nthreads, ndsos, argv[3], nullptr);
+      else
+         execl("./attach-target", "attach-target", nthreads, nullptr);
+      perror("exec attach-target");
+      _exit(1);
+   }
+   close(fds[1]);
+   char buf[16];
+   if (read(fds[0], buf, sizeof buf) <= 0) { // wait for "ready"
+      fprintf(stderr, "target did not start\n");
+      return 1;
+   }
+
+   PstackOptions options;
+   Dwarf::ImageCache cache;
+
+   auto start = clk::now();
+   auto proc = Process::load(nullptr, std::to_string(pid), options, cache);
+   auto loaded = clk::now();
+
+   clk::time_point stopped, first;
+   size_t threads = 0, frames = 0;
+   {
+      StopProcess here(proc.get());
+      stopped = clk::now();
+      proc->getStacks(options, 1000, [&] (const ThreadStack &s) {
+         if (threads++ == 0)
+            first = clk::now();
+         frames += s.stack.size();
+      });
+   }
+   auto done = clk::now();
+
+   JObject(std::cout)
+      .field("threads", threads)
+      .field("frames", frames)
+      .field("load_ms", ms(start, loaded))
+      .field("stop_ms", ms(loaded, stopped))
+      .field("first_ms", ms(stopped, first))
+      .field("unwind_ms", ms(stopped, done));
+   (std::cout << std::endl).flush();
+
+   kill(pid, SIGKILL);
+   waitpid(pid, nullptr, 0);
+   for (int i = atoi(ndsos); i-- > 0;) {
+      std::string copy = "/tmp/attach-dso." + std::to_string(pid)
+         + "." + std::to_string(i) + ".so";
+      unlink(copy.c_str());
+   }
+   return 0;
+}
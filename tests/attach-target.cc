@@ -0,0 +1,72 @@
+// Target process for the attach-latency benchmark (attach-bench.cc). A
+// generalization of thread.cc: the thread count is a parameter, and it can
+// inflate its link map by loading copies of a small DSO, so the benchmark
+// can model processes of different shapes. Prints "ready" once everything
+// is up, then parks forever.
+//
+// usage: attach-target <nthreads> [ndsos dsopath]
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+void *
+entry(void *barrier)
+{
+   pthread_barrier_wait((pthread_barrier_t *)barrier);
+   pause();
+   return nullptr;
+}
+}
+
+// dlopen de-duplicates by path, so each extra DSO needs to be a distinct
+// file: copy the prototype and load the copy.
+static void
+loadCopies(const char *proto, int count)
+{
+   for (int i = 0; i < count; ++i) {
+      std::string copy = "/tmp/attach-dso." + std::to_string(getpid())
+         + "." + std::to_string(i) + ".so";
+      int in = open(proto, O_RDONLY);
+      int out = open(copy.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0755);
+      assert(in >= 0 && out >= 0);
+      char buf[65536];
+      for (ssize_t rc; (rc = read(in, buf, sizeof buf)) > 0;)
+         assert(write(out, buf, rc) == rc);
+      close(in);
+      close(out);
+      void *h = dlopen(copy.c_str(), RTLD_NOW);
+      if (h == nullptr) {
+         fprintf(stderr, "dlopen %s: %s\n", copy.c_str(), dlerror());
+         exit(1);
+      }
+      // the copies stay on disk so the attaching process can read their
+      // text; the benchmark removes them once it has its dump.
+   }
+}
+
+int
+main(int argc, char **argv)
+{
+   int nthreads = argc > 1 ? atoi(argv[1]) : 10;
+   if (argc > 3)
+      loadCopies(argv[3], atoi(argv[2]));
+
+   pthread_barrier_t barrier;
+   pthread_barrier_init(&barrier, nullptr, nthreads + 1);
+   for (int i = 0; i < nthreads; i++) {
+      pthread_t tid;
+      int rc = pthread_create(&tid, nullptr, entry, &barrier);
+      assert(rc == 0);
+   }
+   pthread_barrier_wait(&barrier);
+   printf("ready\n");
+   fflush(stdout);
+   pause();
+}
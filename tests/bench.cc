@@ -0,0 +1,105 @@
+// Self-contained microbenchmarks for the library's hot paths - run via
+// "make bench". The tree carries no external benchmark dependency, so the
+// harness is a timed loop with a warmup pass; each benchmark prints wall
+// time per iteration. The numbers are for comparing builds on the same
+// machine, not across machines.
+#include <libpstack/proc.h>
+#include <libpstack/archreg.h>
+#include <libpstack/dwarf.h>
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <functional>
+
+extern int verbose;
+
+namespace {
+
+volatile uintmax_t sink; // keep benchmark bodies from being optimized away.
+
+void
+bench(const char *name, size_t iters, const std::function<void()> &fn)
+{
+    using namespace std::chrono;
+    fn(); // warm caches and lazily-built state.
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < iters; ++i)
+        fn();
+    auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    printf("%-28s %10zu iters %14.1f ns/iter\n", name, iters, double(elapsed) / iters);
+}
+
+}
+
+int
+main()
+{
+    verbose = 0;
+    // Unwinding ourselves always ends at a frame with no backing object,
+    // which warns on clog; that's expected here, so drop the noise.
+    std::clog.rdbuf(nullptr);
+    PstackOptions options;
+    Dwarf::ImageCache cache;
+
+    auto self = std::make_shared<SelfProcess>(nullptr, options, cache);
+    self->load();
+
+    auto exe = self->execImage;
+    auto di = cache.getDwarf(exe);
+
+    // Addresses inside our own main(), object-relative, to drive the
+    // address-based lookups.
+    auto [ lib, reloc, sym ] = self->resolveSymbolDetail("main", true);
+    Elf::Addr objIp = sym.st_value;
+    size_t range = sym.st_size ? sym.st_size : 1;
+
+    bench("findSymbolByAddress", 100000, [&, &lib=lib, objIp, range] {
+        auto found = lib->findSymbolByAddress(objIp + sink % range, STT_FUNC);
+        sink += found ? found->first.st_value : 0;
+    });
+
+    auto *cfi = di->getEhFrame();
+    if (cfi != nullptr)
+        bench("CFI::findFDE", 100000, [&] {
+            sink += uintmax_t(cfi->findFDE(objIp + sink % range));
+        });
+
+    bench("Info::getUnits", 20, [&] {
+        // a fresh Info each time, so the units are re-decoded rather than
+        // served from this Info's cache.
+        auto fresh = std::make_shared<Dwarf::Info>(exe, cache);
+        for (const auto &u : fresh->getUnits())
+            sink += u->offset;
+    });
+
+    bench("sourceFromAddr", 10000, [&] {
+        // walk the addresses of main() so line lookups don't all hit the
+        // same memoized entry.
+        auto src = di->sourceFromAddr(objIp + sink % range);
+        sink += src.size();
+    });
+
+    {
+        auto file = std::make_shared<FileReader>("/proc/self/exe");
+        auto cached = std::make_shared<CacheReader>(file);
+        auto size = file->size();
+        bench("CacheReader::read", 100000, [&] {
+            char buf[64];
+            sink = sink * 2654435761U + 1;
+            sink += cached->read(sink % (size - sizeof buf), sizeof buf, buf);
+        });
+    }
+
+    // A full unwind of the calling thread. SelfProcess can only read the
+    // registers of the thread doing the asking, so this is one thread's
+    // worth of the work a sample of the multi-threaded test program does.
+    bench("getStacks", 100, [&] {
+        auto stacks = self->getStacks(options, 100);
+        for (const auto &s : stacks)
+            sink += s.stack.size();
+    });
+    return 0;
+}
@@ -0,0 +1,101 @@
+#!/usr/bin/python3
+
+# Performance regression harness over a corpus of recorded cores. The corpus
+# itself (production cores are big, and often private) is not checked in:
+# point PSTACK_CORPUS at a directory containing <name>.core files, each with
+# a matching <name> executable beside it, and a baseline.json recording the
+# expected wall time and RSS per core. Each core is traced PSTACK_CORPUS_RUNS
+# times (default 3); the best wall time and the largest RSS are compared
+# against the baseline with a multiplicative tolerance
+# (PSTACK_CORPUS_TOLERANCE, default 1.25).
+#
+# Set PSTACK_CORPUS_RECORD=1 to (re)write baseline.json from the current run
+# instead of comparing - do this on the reference machine, and check the
+# result in alongside the corpus.
+#
+# Without PSTACK_CORPUS we fall back to ./corpus if it exists - that's where
+# "make corpus" puts a synthetic one (see tests/mkcorpus.py) - and otherwise
+# exit 77, which ctest reports as "skipped".
+
+import glob
+import json
+import os
+import subprocess
+import sys
+import time
+
+CORPUS = os.environ.get("PSTACK_CORPUS")
+if not CORPUS and os.path.isdir("corpus"):
+    CORPUS = "corpus"
+PSTACK_BIN = os.environ.get("PSTACK_BIN", "pstack")
+TOLERANCE = float(os.environ.get("PSTACK_CORPUS_TOLERANCE", "1.25"))
+RECORD = os.environ.get("PSTACK_CORPUS_RECORD")
+RUNS = int(os.environ.get("PSTACK_CORPUS_RUNS", "3"))
+
+if not CORPUS:
+    print("PSTACK_CORPUS is not set; nothing to compare against")
+    sys.exit(77)
+
+
+def measure(args):
+    """Best-of-RUNS wall time (seconds) and largest max-RSS (kb) for args."""
+    best, rss = None, 0
+    for _ in range(RUNS):
+        start = time.monotonic()
+        proc = subprocess.Popen(args, stdout=subprocess.DEVNULL,
+                                stderr=subprocess.DEVNULL)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        if status != 0:
+            raise Exception("%s failed with status %d" % (args, status))
+        best = wall if best is None else min(best, wall)
+        rss = max(rss, usage.ru_maxrss)
+    return best, rss
+
+
+baselinePath = os.path.join(CORPUS, "baseline.json")
+baseline = {}
+if os.path.exists(baselinePath):
+    with open(baselinePath) as f:
+        baseline = json.load(f)
+
+results = {}
+failures = []
+cores = sorted(glob.glob(os.path.join(CORPUS, "*.core")))
+if not cores:
+    print("no cores found in %s" % CORPUS)
+    sys.exit(77)
+
+for core in cores:
+    name = os.path.basename(core)[:-len(".core")]
+    args = ["./%s" % PSTACK_BIN, "-a"]
+    exe = os.path.join(CORPUS, name)
+    if os.path.exists(exe):
+        args += ["-e", exe]
+    args.append(core)
+
+    wall, rss = measure(args)
+    results[name] = {"wall_s": round(wall, 4), "rss_kb": rss}
+
+    old = baseline.get(name)
+    if old is None:
+        status = "no baseline"
+    else:
+        status = "ok"
+        if wall > old["wall_s"] * TOLERANCE:
+            status = "wall time regressed (baseline %.3fs)" % old["wall_s"]
+            failures.append(name)
+        elif rss > old["rss_kb"] * TOLERANCE:
+            status = "RSS regressed (baseline %dkb)" % old["rss_kb"]
+            failures.append(name)
+    print("%-40s %8.3fs %10dkb  %s" % (name, wall, rss, status))
+
+if RECORD:
+    with open(baselinePath, "w") as f:
+        json.dump(results, f, indent=1, sort_keys=True)
+    print("recorded baseline for %d cores in %s" % (len(results), baselinePath))
+    sys.exit(0)
+
+if failures:
+    print("regressed: %s" % ", ".join(failures))
+    sys.exit(1)
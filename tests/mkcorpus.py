@@ -0,0 +1,119 @@
+#!/usr/bin/python3
+
+# Fabricate synthetic ELF/DWARF images and matching cores for scale testing.
+# The checked-in test programs are tiny, so pathological inputs - huge
+# symtabs, hundreds of thousands of FDEs, bloated line programs, deep inline
+# chains - can't be reproduced in CI without shipping production cores. This
+# generates them instead: it emits a C translation unit at a parameterized
+# scale, compiles it with debug info, runs it until it dumps core, and drops
+# the executable and core into a directory laid out the way corpus-test.py
+# expects (<name> beside <name>.core).
+#
+# The knobs and what they inflate:
+#   --funcs N         N distinct functions: symtab entries, FDEs, and
+#                     (with --lines) line program size all scale with this.
+#   --globals N       N data symbols, for symtab size without compile cost.
+#   --lines N         statements (each on its own line) per function body.
+#   --inline-depth N  an always_inline chain N deep at the point of the crash.
+#   --frames N        real (non-inlined) stack frames in the dumped core.
+#
+# Defaults are sized so "make corpus" finishes in seconds; crank them up to
+# make an effect show. Compile time, not generation, is the practical limit
+# on --funcs.
+#
+# Record a baseline for the generated corpus with:
+#   PSTACK_CORPUS=<dir> PSTACK_CORPUS_RECORD=1 tests/corpus-test.py
+
+import argparse
+import os
+import subprocess
+import sys
+
+from coremonitor import CoreMonitor
+
+
+def generate(f, args):
+    w = lambda s="": print(s, file=f)
+    w("/* generated by mkcorpus.py - do not edit. */")
+    w("#include <stdlib.h>")
+    w("#include <sys/resource.h>")
+    w()
+    for i in range(args.globals_):
+        w("int global_%d = %d;" % (i, i))
+    w()
+    # Each function gets a body of --lines single-line statements, so the
+    # line program grows as funcs * lines.
+    for i in range(args.funcs):
+        w("int func_%d(int x) {" % i)
+        for j in range(args.lines):
+            w("    x += %d;" % (j + 1))
+        w("    return x;")
+        w("}")
+    w()
+    # The inline chain: inline_<depth-1> down to inline_0, which aborts.
+    # All of it lands in the top stack frame of the core as a chain of
+    # DW_TAG_inlined_subroutine DIEs.
+    w("static inline __attribute__((always_inline)) int inline_0(int x) {")
+    w("    abort();")
+    w("}")
+    for d in range(1, args.inline_depth):
+        w("static inline __attribute__((always_inline)) int inline_%d(int x) {" % d)
+        w("    return inline_%d(x + 1);" % (d - 1))
+        w("}")
+    w()
+    w("int recurse(int n) {")
+    w("    if (n <= 0)")
+    w("        return inline_%d(n);" % (args.inline_depth - 1))
+    w("    return recurse(n - 1) + 1;")
+    w("}")
+    w()
+    w("int main(int argc, char *argv[]) {")
+    w("    struct rlimit rl = { RLIM_INFINITY, RLIM_INFINITY };")
+    w("    setrlimit(RLIMIT_CORE, &rl);")
+    # Call through a volatile pointer so no amount of optimization can
+    # discard the function bodies the corpus exists to provide.
+    w("    int (* volatile fp)(int) = func_%d;" % (args.funcs - 1))
+    w("    return recurse(%d) + fp(argc);" % args.frames)
+    w("}")
+
+
+def main():
+    ap = argparse.ArgumentParser(
+            description="generate a synthetic executable and core")
+    ap.add_argument("--output", default="corpus",
+            help="directory to generate into (default: corpus)")
+    ap.add_argument("--name", default="synthetic",
+            help="basename for the executable and core")
+    ap.add_argument("--cc", default=os.environ.get("CC", "cc"))
+    ap.add_argument("--funcs", type=int, default=5000)
+    ap.add_argument("--globals", type=int, default=5000, dest="globals_")
+    ap.add_argument("--lines", type=int, default=20)
+    ap.add_argument("--inline-depth", type=int, default=60)
+    ap.add_argument("--frames", type=int, default=500)
+    args = ap.parse_args()
+
+    os.makedirs(args.output, exist_ok=True)
+    src = os.path.join(args.output, args.name + ".c")
+    exe = os.path.join(args.output, args.name)
+    with open(src, "w") as f:
+        generate(f, args)
+    subprocess.check_call([args.cc, "-g", "-O0", "-o", exe, src])
+
+    # Run it where it was built so a relative core_pattern drops the core
+    # beside the executable; CoreMonitor works out the core's name from the
+    # pattern, same as the crash tests do.
+    os.chdir(args.output)
+    # Run by absolute path, so the core's AT_EXECFN finds the executable no
+    # matter where it's traced from.
+    cm = CoreMonitor([os.path.abspath(args.name)])
+    core = cm.core()
+    if core is None:
+        print("no core was produced - check kernel.core_pattern")
+        return 1
+    os.rename(core, args.name + ".core")
+    print("generated %s and %s.core in %s" % (args.name, args.name, args.output))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,85 @@
+#include "libpstack/trace.h"
+#include "libpstack/json.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace Trace {
+
+bool active;
+
+namespace {
+struct Event {
+    const char *cat;
+    std::string name;
+    uint64_t ts;  // microseconds since the trace epoch.
+    uint64_t dur;
+    long tid;
+};
+
+std::mutex lock;
+std::vector<Event> events;
+std::string output;
+std::chrono::steady_clock::time_point epoch;
+
+uint64_t
+usec(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+}
+
+void
+start(const std::string &path)
+{
+    output = path;
+    epoch = std::chrono::steady_clock::now();
+    active = true;
+}
+
+void
+record(const char *cat, std::string &&name,
+        std::chrono::steady_clock::time_point begin,
+        std::chrono::steady_clock::time_point end)
+{
+    Event ev { cat, std::move(name), usec(begin - epoch), usec(end - begin),
+        long(syscall(SYS_gettid)) };
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back(std::move(ev));
+}
+
+void
+finish()
+{
+    if (!active)
+        return;
+    active = false;
+    std::ofstream os(output, std::ios::trunc);
+    if (!os) {
+        std::clog << "warning: can't write trace to " << output << "\n";
+        return;
+    }
+    os << "[";
+    const char *sep = "\n";
+    for (const auto &ev : events) {
+        os << sep;
+        JObject(os)
+            .field("name", ev.name)
+            .field("cat", ev.cat)
+            .field("ph", "X")
+            .field("pid", getpid())
+            .field("tid", ev.tid)
+            .field("ts", ev.ts)
+            .field("dur", ev.dur);
+        sep = ",\n";
+    }
+    os << "\n]\n";
+    events.clear();
+}
+
+} // Trace namespace